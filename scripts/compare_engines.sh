@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+#
+# Time / memory / Jacobian comparison of the deformable engines.
+#
+# Runs one rigid registration, then deformable_register with each engine
+# from the same rigid transform, and tabulates wall time, peak RSS, folded
+# voxels, the Jacobian range and the centroid deviation from T0.
+#
+# Usage: scripts/compare_engines.sh <build_dir> <fixed.nii> <moving.nii> [engines...]
+#   e.g. scripts/compare_engines.sh build T0_norm.nii.gz T1_norm.nii.gz bspline demons syn
+#
+# Extra deformable_register options can be passed through ENGINE_OPTIONS.
+# Needs GNU time (/usr/bin/time) for peak memory.
+
+set -euo pipefail
+
+if [ $# -lt 3 ]; then
+    sed -n '3,13p' "$0"
+    exit 1
+fi
+
+build_dir=$1
+fixed=$2
+moving=$3
+shift 3
+engines=("$@")
+if [ ${#engines[@]} -eq 0 ]; then
+    engines=(bspline demons syn)
+fi
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+"$build_dir/rigid_register" --transform "$work_dir/rigid.tfm" "$fixed" "$moving" > /dev/null
+
+json_field() {
+    grep -o "\"$2\":[^,}]*" "$1" | head -1 | cut -d: -f2
+}
+
+printf "%-8s %-8s %-10s %-14s %-10s %-10s %s\n" \
+    "engine" "time_s" "peak_MB" "folded_voxels" "jac_min" "jac_max" "centroid_mm"
+
+for engine in "${engines[@]}"; do
+    output="$work_dir/${engine}.nii.gz"
+    report="$work_dir/${engine}.json"
+    /usr/bin/time -f "%e %M" -o "$work_dir/${engine}.time" \
+        "$build_dir/deformable_register" ${ENGINE_OPTIONS:-} --engine "$engine" \
+        --initial-transform "$work_dir/rigid.tfm" --jacobian-report "$report" \
+        "$fixed" "$moving" "$output" > /dev/null
+    read -r seconds peak_kb < "$work_dir/${engine}.time"
+    centroid=$("$build_dir/check_centroid_alignment" "$fixed" "$output" | awk '/Distance/ { print $NF }')
+    printf "%-8s %-8s %-10s %-14s %-10s %-10s %s\n" "$engine" "$seconds" "$(( peak_kb / 1024 ))" \
+        "$(json_field "$report" folded_voxels)" "$(json_field "$report" min)" \
+        "$(json_field "$report" max)" "$centroid"
+done
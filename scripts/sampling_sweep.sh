@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+#
+# Accuracy / time trade-off of metric sampling for rigid_register.
+#
+# Runs rigid registration once with full sampling as the reference, then
+# with RANDOM (or REGULAR) sampling at each percentage, and reports wall time
+# and the centroid distance between each result and the reference.
+#
+# Usage: scripts/sampling_sweep.sh <build_dir> <fixed.nii> <moving.nii> [strategy] [percentages...]
+#   e.g. scripts/sampling_sweep.sh build T0_norm.nii.gz T1_norm.nii.gz random 0.05 0.1 0.2 0.5
+#
+# Extra rigid_register options (e.g. --fixed-mask brain.nii.gz) can be passed
+# through the RIGID_OPTIONS environment variable.
+
+set -euo pipefail
+
+if [ $# -lt 3 ]; then
+    sed -n '3,14p' "$0"
+    exit 1
+fi
+
+build_dir=$1
+fixed=$2
+moving=$3
+strategy=${4:-random}
+shift $(( $# < 4 ? $# : 4 ))
+percentages=("$@")
+if [ ${#percentages[@]} -eq 0 ]; then
+    percentages=(0.02 0.05 0.1 0.2 0.5)
+fi
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+run() {
+    local output=$1
+    shift
+    local start end
+    start=$(date +%s.%N)
+    "$build_dir/rigid_register" ${RIGID_OPTIONS:-} "$@" "$fixed" "$moving" "$output" > /dev/null
+    end=$(date +%s.%N)
+    echo "$end - $start" | bc
+}
+
+reference="$work_dir/reference.nii.gz"
+reference_time=$(run "$reference" --sampling none)
+
+printf "%-10s %-12s %-10s %s\n" "strategy" "percentage" "time_s" "centroid_delta_mm"
+printf "%-10s %-12s %-10.2f %s\n" "none" "1.0" "$reference_time" "0"
+
+for percentage in "${percentages[@]}"; do
+    output="$work_dir/sampled_${percentage}.nii.gz"
+    time_s=$(run "$output" --sampling "$strategy" --sampling-percentage "$percentage")
+    delta=$("$build_dir/check_centroid_alignment" "$reference" "$output" \
+            | awk '/Distance/ { print $NF }')
+    printf "%-10s %-12s %-10.2f %s\n" "$strategy" "$percentage" "$time_s" "$delta"
+done
@@ -0,0 +1,338 @@
+//
+// Background I/O for cohort runs
+//
+
+#include "case_io.h"
+
+#include <algorithm>
+#include <exception>
+
+#include <itkImageIOFactory.h>
+#include <itksys/SystemTools.hxx>
+
+#include "stages.h"
+#include "volume_cache.h"
+
+namespace tt
+{
+
+namespace
+{
+
+// Memory ReadStoredImage will take for fileName, from its header; 0 when
+// the header cannot be read (the read then fails on the case's thread).
+size_t StoredImageBytes(const std::string & fileName)
+{
+    if (IsRawVolumeFile(fileName))
+    {
+        return static_cast<size_t>(itksys::SystemTools::FileLength(fileName));
+    }
+
+    itk::ImageIOBase::Pointer io =
+        itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::IOFileModeEnum::ReadMode);
+    if (!io)
+    {
+        return 0;
+    }
+    try
+    {
+        io->SetFileName(fileName);
+        io->ReadImageInformation();
+    }
+    catch (itk::ExceptionObject &)
+    {
+        return 0;
+    }
+
+    switch (io->GetComponentType())
+    {
+        case itk::IOComponentEnum::SHORT:
+        case itk::IOComponentEnum::USHORT:
+        case itk::IOComponentEnum::CHAR:
+        case itk::IOComponentEnum::UCHAR:
+            if (io->GetNumberOfComponents() == 1)
+            {
+                return static_cast<size_t>(io->GetImageSizeInBytes());
+            }
+            break;
+        default:
+            break;
+    }
+    return static_cast<size_t>(io->GetImageSizeInPixels()) * sizeof(ImageType::PixelType);
+}
+
+} // namespace
+
+// =====================================================
+// InputPrefetcher
+// =====================================================
+
+InputPrefetcher::InputPrefetcher(const std::vector<std::vector<std::string>> & inputs, unsigned int lookahead,
+                                 size_t memoryLimit)
+    : m_Lookahead(lookahead), m_MemoryLimit(memoryLimit)
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        for (const auto & fileName : inputs[i])
+        {
+            if (m_Index.count(fileName))
+            {
+                continue;
+            }
+            m_Index[fileName] = m_Entries.size();
+            Entry entry;
+            entry.fileName  = fileName;
+            entry.caseIndex = i;
+            m_Entries.push_back(entry);
+        }
+    }
+    m_Thread = std::thread(&InputPrefetcher::Run, this);
+}
+
+InputPrefetcher::~InputPrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_Changed.notify_all();
+    m_Thread.join();
+}
+
+void InputPrefetcher::Begin(size_t caseIndex)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_NextCase = std::max(m_NextCase, caseIndex + 1);
+    }
+    m_Changed.notify_all();
+}
+
+void InputPrefetcher::Finish(size_t caseIndex)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        for (Entry & entry : m_Entries)
+        {
+            if (entry.caseIndex != caseIndex)
+            {
+                continue;
+            }
+            if (entry.state == State::Reading)
+            {
+                entry.dropped = true;
+            }
+            else
+            {
+                this->Release(entry);
+            }
+        }
+    }
+    m_Changed.notify_all();
+}
+
+itk::ImageBase<3>::Pointer InputPrefetcher::Take(const std::string & fileName)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    auto                         it = m_Index.find(fileName);
+    if (it == m_Index.end())
+    {
+        ++m_Statistics.misses;
+        return nullptr;
+    }
+
+    // Only a read in progress is waited for; one still queued (or waiting
+    // for memory) is cheaper to read here than to wait for.
+    Entry & entry = m_Entries[it->second];
+    m_Changed.wait(lock, [&entry]() { return entry.state != State::Reading; });
+
+    itk::ImageBase<3>::Pointer image = entry.image;
+    if (image)
+    {
+        ++m_Statistics.hits;
+    }
+    else
+    {
+        ++m_Statistics.misses;
+    }
+    this->Release(entry);
+    lock.unlock();
+    m_Changed.notify_all();
+    return image;
+}
+
+InputPrefetcher::Statistics InputPrefetcher::GetStatistics() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Statistics;
+}
+
+void InputPrefetcher::Release(Entry & entry)
+{
+    m_HeldBytes -= entry.bytes;
+    entry.bytes = 0;
+    entry.image = nullptr;
+    entry.state = State::Skipped;
+}
+
+void InputPrefetcher::Run()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (Entry & entry : m_Entries)
+    {
+        m_Changed.wait(lock,
+                       [this, &entry]()
+                       {
+                           return m_Stopping || entry.state != State::Queued ||
+                                  entry.caseIndex < m_NextCase + m_Lookahead;
+                       });
+        if (m_Stopping)
+        {
+            return;
+        }
+        if (entry.state != State::Queued)
+        {
+            continue;
+        }
+
+        lock.unlock();
+        const size_t bytes = StoredImageBytes(entry.fileName);
+        lock.lock();
+        if (bytes > m_MemoryLimit)
+        {
+            this->Release(entry);
+            continue;
+        }
+        m_Changed.wait(lock,
+                       [this, &entry, bytes]()
+                       { return m_Stopping || entry.state != State::Queued || m_HeldBytes + bytes <= m_MemoryLimit; });
+        if (m_Stopping)
+        {
+            return;
+        }
+        if (entry.state != State::Queued)
+        {
+            continue;
+        }
+
+        entry.state = State::Reading;
+        entry.bytes = bytes;
+        m_HeldBytes += bytes;
+        m_Statistics.peakBytes = std::max(m_Statistics.peakBytes, m_HeldBytes);
+        lock.unlock();
+
+        itk::ImageBase<3>::Pointer image;
+        try
+        {
+            image = ReadStoredImage(entry.fileName);
+        }
+        catch (std::exception &)
+        {
+            // Read again, and reported, by the case
+        }
+
+        lock.lock();
+        entry.image = image;
+        entry.state = State::Ready;
+        if (!image || entry.dropped)
+        {
+            this->Release(entry);
+        }
+        m_Changed.notify_all();
+    }
+}
+
+// =====================================================
+// OutputWriter
+// =====================================================
+
+OutputWriter::OutputWriter(unsigned int numberOfThreads, size_t maximumPendingBytes)
+    : m_MaximumPendingBytes(maximumPendingBytes)
+{
+    for (unsigned int i = 0; i < std::max(1u, numberOfThreads); ++i)
+    {
+        m_Threads.emplace_back(&OutputWriter::Run, this);
+    }
+}
+
+OutputWriter::~OutputWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_Changed.notify_all();
+    for (auto & thread : m_Threads)
+    {
+        thread.join();
+    }
+}
+
+void OutputWriter::Submit(size_t caseIndex, size_t bytes, Job job)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_Changed.wait(lock,
+                       [this, bytes]()
+                       { return m_PendingBytes == 0 || m_PendingBytes + bytes <= m_MaximumPendingBytes; });
+
+        Pending pending;
+        pending.caseIndex = caseIndex;
+        pending.bytes     = bytes;
+        pending.job       = std::move(job);
+        m_Queue.push_back(std::move(pending));
+        m_PendingBytes += bytes;
+        ++m_Cases[caseIndex].outstanding;
+    }
+    m_Changed.notify_all();
+}
+
+std::string OutputWriter::Wait(size_t caseIndex)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Changed.wait(lock, [this, caseIndex]() { return m_Cases[caseIndex].outstanding == 0; });
+
+    const std::string error = m_Cases[caseIndex].error;
+    m_Cases.erase(caseIndex);
+    return error;
+}
+
+void OutputWriter::Run()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;)
+    {
+        m_Changed.wait(lock, [this]() { return m_Stopping || !m_Queue.empty(); });
+        if (m_Queue.empty())
+        {
+            return; // stopping, and everything queued is written
+        }
+
+        Pending pending = std::move(m_Queue.front());
+        m_Queue.pop_front();
+        lock.unlock();
+
+        std::string error;
+        try
+        {
+            pending.job();
+        }
+        catch (std::exception & err)
+        {
+            error = err.what();
+        }
+        pending.job = nullptr; // what it kept alive goes before the count does
+
+        lock.lock();
+        m_PendingBytes -= pending.bytes;
+        CaseState & state = m_Cases[pending.caseIndex];
+        --state.outstanding;
+        if (state.error.empty())
+        {
+            state.error = error;
+        }
+        m_Changed.notify_all();
+    }
+}
+
+} // namespace tt
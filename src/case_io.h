@@ -0,0 +1,161 @@
+//
+// Background I/O for cohort runs (TumourTracker batch)
+//
+// Decoding a .nii.gz is single-threaded CPU work and registration leaves the
+// disk idle, so the two are overlapped. InputPrefetcher decodes the
+// timepoints of the next few cases on its own thread while earlier cases
+// register, keeping every volume in its stored pixel type
+// (ReadStoredImage) under a memory cap. OutputWriter takes the artefacts
+// of a case and compresses / writes them on writer threads while the next
+// case computes.
+//
+
+#ifndef TUMOURTRACKER_CASE_IO_H
+#define TUMOURTRACKER_CASE_IO_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+class InputPrefetcher
+{
+public:
+    struct Statistics
+    {
+        size_t hits      = 0; // taken already decoded
+        size_t misses    = 0; // read by the case itself
+        size_t peakBytes = 0; // decoded and not yet taken
+    };
+
+    // inputs[i] are the files of case i in the order they are used. Files
+    // are decoded in case order, at most lookahead cases past the last one
+    // begun and while the decoded volumes waiting to be taken fit in
+    // memoryLimit bytes. A file listed again by a later case is decoded
+    // only once; a volume larger than the whole limit is left to the case.
+    InputPrefetcher(const std::vector<std::vector<std::string>> & inputs, unsigned int lookahead,
+                    size_t memoryLimit);
+    ~InputPrefetcher();
+
+    InputPrefetcher(const InputPrefetcher &) = delete;
+    InputPrefetcher & operator=(const InputPrefetcher &) = delete;
+
+    // Case i is starting: the window of prefetched cases moves forward.
+    void Begin(size_t caseIndex);
+
+    // Case i is done: whatever it did not take (cache hits, a failure) is
+    // dropped.
+    void Finish(size_t caseIndex);
+
+    // The decoded fileName, waiting while it is being read; null when it
+    // was not prefetched or failed to read (the caller then reads it and
+    // reports the error). Each volume is handed out once.
+    itk::ImageBase<3>::Pointer Take(const std::string & fileName);
+
+    Statistics GetStatistics() const;
+
+private:
+    enum class State
+    {
+        Queued,
+        Reading,
+        Ready,
+        Skipped // taken, dropped, failed or over the limit
+    };
+
+    struct Entry
+    {
+        std::string                fileName;
+        size_t                     caseIndex = 0;
+        State                      state     = State::Queued;
+        bool                       dropped   = false; // its case finished during the read
+        size_t                     bytes     = 0;
+        itk::ImageBase<3>::Pointer image;
+    };
+
+    void Run();
+    void Release(Entry & entry); // with the lock held
+
+    std::vector<Entry>            m_Entries; // decode order
+    std::map<std::string, size_t> m_Index;   // file -> entry
+    unsigned int                  m_Lookahead;
+    size_t                        m_MemoryLimit;
+    size_t                        m_NextCase  = 0; // first case not yet begun
+    size_t                        m_HeldBytes = 0;
+    bool                          m_Stopping  = false;
+    Statistics                    m_Statistics;
+
+    mutable std::mutex      m_Mutex;
+    std::condition_variable m_Changed;
+    std::thread             m_Thread;
+};
+
+class OutputWriter
+{
+public:
+    using Job = std::function<void()>;
+
+    // Jobs run on numberOfThreads writer threads, so several files compress
+    // at once; Submit waits while more than maximumPendingBytes are queued.
+    OutputWriter(unsigned int numberOfThreads, size_t maximumPendingBytes);
+    ~OutputWriter(); // runs what is queued, then joins
+
+    OutputWriter(const OutputWriter &) = delete;
+    OutputWriter & operator=(const OutputWriter &) = delete;
+
+    // job keeps what it writes alive (smart pointers); bytes is its size
+    // for the pending limit.
+    void Submit(size_t caseIndex, size_t bytes, Job job);
+
+    // Waits for every job of a case; the first error, empty when all of
+    // them were written.
+    std::string Wait(size_t caseIndex);
+
+private:
+    struct Pending
+    {
+        size_t caseIndex = 0;
+        size_t bytes     = 0;
+        Job    job;
+    };
+
+    struct CaseState
+    {
+        unsigned int outstanding = 0;
+        std::string  error;
+    };
+
+    void Run();
+
+    std::deque<Pending>         m_Queue;
+    std::map<size_t, CaseState> m_Cases;
+    size_t                      m_MaximumPendingBytes;
+    size_t                      m_PendingBytes = 0;
+    bool                        m_Stopping     = false;
+
+    std::mutex               m_Mutex;
+    std::condition_variable  m_Changed;
+    std::vector<std::thread> m_Threads;
+};
+
+// Background I/O of a case; a null member reads / writes in place.
+struct CaseIO
+{
+    InputPrefetcher * inputs    = nullptr; // not owned
+    OutputWriter *    outputs   = nullptr; // not owned
+    size_t            caseIndex = 0;
+};
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_CASE_IO_H
@@ -2,16 +2,9 @@
 // Foreground centroid comparison for registration sanity check
 //
 
-#include <itkImage.h>
-#include <itkImageFileReader.h>
-#include <itkBinaryThresholdImageFilter.h>
-#include <itkImageMomentsCalculator.h>
 #include <iostream>
 
-using ImageType = itk::Image<float, 3>;
-using ReaderType = itk::ImageFileReader<ImageType>;
-using MomentsType = itk::ImageMomentsCalculator<ImageType>;
-using PointType = itk::Point<double, 3>;
+#include "stages.h"
 
 int main(int argc, char* argv[])
 {
@@ -22,52 +15,29 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    auto fixedReader = ReaderType::New();
-    auto regReader   = ReaderType::New();
+    auto fixedImage = tt::ReadImage(argv[1]);
+    auto regImage   = tt::ReadImage(argv[2]);
 
-    fixedReader->SetFileName(argv[1]);
-    regReader->SetFileName(argv[2]);
-
-    fixedReader->Update();
-    regReader->Update();
-
-    //Threshold to remove background (simple & robust)
-    using ThreshType =
-        itk::BinaryThresholdImageFilter<ImageType, ImageType>;
-
-    auto threshFixed = ThreshType::New();
-    threshFixed->SetInput(fixedReader->GetOutput());
-    threshFixed->SetLowerThreshold(1.0);
-    threshFixed->SetUpperThreshold(1e9);
-    threshFixed->SetInsideValue(1.0);
-    threshFixed->SetOutsideValue(0.0);
-    threshFixed->Update();
-
-    auto threshReg = ThreshType::New();
-    threshReg->SetInput(regReader->GetOutput());
-    threshReg->SetLowerThreshold(1.0);
-    threshReg->SetUpperThreshold(1e9);
-    threshReg->SetInsideValue(1.0);
-    threshReg->SetOutsideValue(0.0);
-    threshReg->Update();
-
-    // Compute moments
-    auto fixedMoments = MomentsType::New();
-    fixedMoments->SetImage(threshFixed->GetOutput());
-    fixedMoments->Compute();
-
-    auto regMoments = MomentsType::New();
-    regMoments->SetImage(threshReg->GetOutput());
-    regMoments->Compute();
-
-    PointType c1 = fixedMoments->GetCenterOfGravity();
-    PointType c2 = regMoments->GetCenterOfGravity();
+    tt::CentroidResult result;
+    try
+    {
+        result = tt::CentroidCheck(fixedImage, regImage);
+    }
+    catch (itk::ExceptionObject &err)
+    {
+        std::cerr << "Centroid check failed:\n" << err << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    std::cout << "Fixed centroid:      " << c1 << std::endl;
-    std::cout << "Registered centroid: " << c2 << std::endl;
+    std::cout << "Fixed centroid:      " << result.fixed << std::endl;
+    std::cout << "Registered centroid: " << result.registered << std::endl;
     std::cout << "Distance (mm): "
-              << c1.EuclideanDistanceTo(c2)
+              << result.distance
               << std::endl;
+    std::cout << "Foreground volume (mm^3): "
+              << result.fixedForeground.volume << " -> " << result.registeredForeground.volume
+              << " (delta " << result.volumeDelta << ")" << std::endl;
+    std::cout << "Bounding-box overlap (IoU): " << result.boundingBoxOverlap << std::endl;
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
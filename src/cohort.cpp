@@ -0,0 +1,420 @@
+//
+// Cohort batch mode (TumourTracker batch)
+//
+
+#include "cohort.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <itkMultiThreaderBase.h>
+#include <itkThreadPool.h>
+
+#include "case_io.h"
+#include "command_line.h"
+#include "stage_options.h"
+
+namespace tt
+{
+
+namespace
+{
+
+std::string Trim(const std::string & value)
+{
+    const auto first = value.find_first_not_of(" \t\r");
+    if (first == std::string::npos)
+    {
+        return std::string();
+    }
+    const auto last = value.find_last_not_of(" \t\r");
+    return value.substr(first, last - first + 1);
+}
+
+// A case that has run, waiting for its artefacts to be written before its
+// reports are and it is counted.
+struct FinishedCase
+{
+    size_t                       index   = 0;
+    std::string                  error;          // from the case itself
+    double                       seconds = 0.0;
+    std::unique_ptr<CaseReport>  report;         // null when the case failed
+    std::unique_ptr<StageProbes> probes;
+};
+
+void WriteCaseReports(const CaseSpec & spec, const CaseReport & report, const StageProbes & probes)
+{
+    std::ofstream reportFile(spec.outputDirectory + "/report.txt");
+    PrintCaseReport(report, reportFile);
+    reportFile << "\nPer-stage wall time and memory:" << std::endl;
+    probes.Report(reportFile);
+
+    std::ofstream jsonReport(spec.outputDirectory + "/report.json");
+    WriteCaseReportJson(report, jsonReport);
+}
+
+} // namespace
+
+void ConfigureThreadPool(unsigned int numberOfThreads)
+{
+    itk::MultiThreaderBase::SetGlobalDefaultThreader(itk::MultiThreaderBase::ThreaderEnum::Pool);
+    if (itk::MultiThreaderBase::GetGlobalMaximumNumberOfThreads() < numberOfThreads)
+    {
+        itk::MultiThreaderBase::SetGlobalMaximumNumberOfThreads(numberOfThreads);
+    }
+    itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(numberOfThreads);
+
+    auto pool = itk::ThreadPool::GetInstance();
+    if (pool->GetMaximumNumberOfThreads() < numberOfThreads)
+    {
+        pool->AddThreads(numberOfThreads - pool->GetMaximumNumberOfThreads());
+    }
+}
+
+std::vector<std::string> SplitManifestLine(const std::string & line)
+{
+    std::vector<std::string> fields;
+    std::istringstream       stream(Trim(line));
+    std::string              field;
+    while (std::getline(stream, field, ','))
+    {
+        fields.push_back(Trim(field));
+    }
+    return fields;
+}
+
+CaseSpec MakeCaseSpec(const std::vector<std::string> & fields)
+{
+    if (fields.size() < 4)
+    {
+        throw std::invalid_argument("expected patient,T0,T1[,...],output_dir");
+    }
+    CaseSpec spec;
+    spec.patient         = fields.front();
+    spec.outputDirectory = fields.back();
+    spec.timepoints.assign(fields.begin() + 1, fields.end() - 1);
+    return spec;
+}
+
+std::vector<CaseSpec> ReadCohortManifest(const std::string & fileName)
+{
+    std::ifstream in(fileName);
+    if (!in)
+    {
+        throw std::runtime_error("cannot open manifest " + fileName);
+    }
+
+    std::vector<CaseSpec> cases;
+    std::string           line;
+    unsigned int          lineNumber = 0;
+    while (std::getline(in, line))
+    {
+        ++lineNumber;
+        line = Trim(line);
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        const std::vector<std::string> fields = SplitManifestLine(line);
+        if (cases.empty() && !fields.empty() && fields[0] == "patient")
+        {
+            continue; // header
+        }
+        try
+        {
+            cases.push_back(MakeCaseSpec(fields));
+        }
+        catch (std::invalid_argument & err)
+        {
+            throw std::runtime_error(fileName + ":" + std::to_string(lineNumber) + ": " + err.what());
+        }
+    }
+    return cases;
+}
+
+CohortSummary RunCohort(const std::vector<CaseSpec> & cases,
+                        const PipelineOptions & options,
+                        const SchedulerOptions & scheduler,
+                        std::ostream & log)
+{
+    CohortSummary summary;
+    if (cases.empty())
+    {
+        return summary;
+    }
+
+    const unsigned int numberOfThreads =
+        scheduler.numberOfThreads > 0 ? scheduler.numberOfThreads
+                                      : itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+    unsigned int numberOfJobs =
+        scheduler.numberOfJobs > 0 ? scheduler.numberOfJobs : std::max(1u, numberOfThreads / 4);
+    numberOfJobs = std::min<unsigned int>(numberOfJobs, static_cast<unsigned int>(cases.size()));
+
+    summary.numberOfJobs  = numberOfJobs;
+    summary.threadsPerJob = std::max(1u, numberOfThreads / numberOfJobs);
+
+    ConfigureThreadPool(numberOfThreads);
+
+    PipelineOptions jobOptions   = options;
+    jobOptions.numberOfWorkUnits = summary.threadsPerJob;
+
+    log << "Cohort: " << cases.size() << " cases, " << numberOfJobs << " concurrent jobs x "
+        << summary.threadsPerJob << " threads" << std::endl;
+
+    // One image cache per patient, kept alive until that patient's last case
+    // has finished; cases of a patient with the same T0 preprocess it once.
+    std::vector<std::shared_ptr<ImageCache>> caseCaches(cases.size());
+    {
+        std::map<std::string, std::shared_ptr<ImageCache>> patientCaches;
+        for (size_t i = 0; i < cases.size(); ++i)
+        {
+            auto & cache = patientCaches[cases[i].patient];
+            if (!cache)
+            {
+                cache = std::make_shared<ImageCache>();
+            }
+            caseCaches[i] = cache;
+        }
+    }
+
+    // Inputs are decoded in manifest order, the order the workers take the
+    // cases in; outputs are written behind them.
+    std::unique_ptr<InputPrefetcher> prefetcher;
+    std::unique_ptr<OutputWriter>    writer;
+    if (scheduler.prefetchCases > 0)
+    {
+        std::vector<std::vector<std::string>> inputs;
+        for (const CaseSpec & spec : cases)
+        {
+            inputs.push_back(spec.timepoints);
+        }
+        prefetcher = std::make_unique<InputPrefetcher>(inputs, scheduler.prefetchCases,
+                                                       size_t(scheduler.prefetchMemory) << 20);
+    }
+    if (scheduler.writeThreads > 0)
+    {
+        writer = std::make_unique<OutputWriter>(scheduler.writeThreads, size_t(scheduler.writeMemory) << 20);
+    }
+
+    std::atomic<size_t> nextCase{ 0 };
+    std::mutex          logMutex;
+    Telemetry           telemetry; // shared by all cases; events carry the patient
+    const auto          start = std::chrono::steady_clock::now();
+
+    auto elapsedSeconds = [start]()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // A case is counted, and its reports written, once its outputs are
+    // written. With a writer its worker runs the next case until then, so
+    // the writes overlap that case's compute.
+    auto complete = [&](FinishedCase finished)
+    {
+        const size_t i     = finished.index;
+        std::string  error = finished.error;
+        if (writer)
+        {
+            const std::string written = writer->Wait(i);
+            if (error.empty())
+            {
+                error = written;
+            }
+            if (finished.report)
+            {
+                finished.report->writeError = written;
+            }
+        }
+        if (finished.report)
+        {
+            WriteCaseReports(cases[i], *finished.report, *finished.probes);
+        }
+
+        std::lock_guard<std::mutex> lock(logMutex);
+        if (error.empty())
+        {
+            ++summary.succeeded;
+        }
+        else
+        {
+            ++summary.failed;
+        }
+        const size_t done = summary.succeeded + summary.failed;
+        log << "[" << done << "/" << cases.size() << "] " << cases[i].patient << " "
+            << (error.empty() ? "done" : "FAILED") << " in " << finished.seconds << " s"
+            << " (" << summary.succeeded * 3600.0 / elapsedSeconds() << " cases/hour)";
+        if (!error.empty())
+        {
+            log << "\n  " << error;
+        }
+        log << std::endl;
+    };
+
+    auto worker = [&]()
+    {
+        std::unique_ptr<FinishedCase> pending;
+        for (size_t i = nextCase++; i < cases.size(); i = nextCase++)
+        {
+            const CaseSpec & spec      = cases[i];
+            const auto       caseStart = std::chrono::steady_clock::now();
+            if (prefetcher)
+            {
+                prefetcher->Begin(i);
+            }
+
+            CaseIO io;
+            io.inputs    = prefetcher.get();
+            io.outputs   = writer.get();
+            io.caseIndex = i;
+
+            FinishedCase finished;
+            finished.index  = i;
+            finished.probes = std::make_unique<StageProbes>();
+            if (!jobOptions.telemetryFile.empty())
+            {
+                finished.probes->telemetry = &telemetry;
+            }
+            try
+            {
+                finished.report = std::make_unique<CaseReport>(
+                    RunCase(spec, jobOptions, *finished.probes, caseCaches[i].get(), io));
+            }
+            catch (std::exception & err)
+            {
+                finished.error = err.what();
+            }
+            if (prefetcher)
+            {
+                prefetcher->Finish(i);
+            }
+
+            finished.seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - caseStart).count();
+            {
+                std::lock_guard<std::mutex> lock(logMutex);
+                if (caseCaches[i].use_count() == 1)
+                {
+                    const ImageCache::Statistics cacheStatistics = caseCaches[i]->GetStatistics();
+                    summary.cacheHits += cacheStatistics.hits;
+                    summary.cacheMisses += cacheStatistics.misses;
+                }
+                caseCaches[i].reset();
+            }
+
+            if (!writer)
+            {
+                complete(std::move(finished));
+                continue;
+            }
+            if (pending)
+            {
+                complete(std::move(*pending));
+            }
+            pending = std::make_unique<FinishedCase>(std::move(finished));
+        }
+        if (pending)
+        {
+            complete(std::move(*pending));
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int j = 0; j < numberOfJobs; ++j)
+    {
+        workers.emplace_back(worker);
+    }
+    for (auto & thread : workers)
+    {
+        thread.join();
+    }
+
+    if (!options.telemetryFile.empty())
+    {
+        try
+        {
+            telemetry.Write(options.telemetryFile);
+        }
+        catch (itk::ExceptionObject & err)
+        {
+            log << "Telemetry not written: " << err.GetDescription() << std::endl;
+        }
+    }
+
+    if (prefetcher)
+    {
+        const InputPrefetcher::Statistics statistics = prefetcher->GetStatistics();
+        summary.prefetchHits   = statistics.hits;
+        summary.prefetchMisses = statistics.misses;
+        summary.prefetchPeak   = statistics.peakBytes;
+    }
+
+    summary.wallSeconds  = elapsedSeconds();
+    summary.casesPerHour = summary.succeeded * 3600.0 / summary.wallSeconds;
+    return summary;
+}
+
+int RunBatchCommand(int argc, char * argv[])
+{
+    std::vector<CaseSpec> cases;
+    PipelineOptions       options;
+    SchedulerOptions      scheduler;
+
+    try
+    {
+        CommandLine cmd(argc, argv, 1, PipelineSwitches());
+        if (cmd.Positional().size() != 1)
+        {
+            std::cerr << "Usage: TumourTracker batch [options] <manifest.csv>\n"
+                      << "  manifest lines: patient,T0,T1[,T2...],output_dir\n";
+            PrintOption(std::cerr, "", "threads <n>", "total thread budget (default: all cores)");
+            PrintOption(std::cerr, "", "jobs <n>", "concurrent cases (default: threads / 4)");
+            PrintOption(std::cerr, "", "prefetch <n>", "cases whose inputs are decoded ahead (default 2, 0 = off)");
+            PrintOption(std::cerr, "", "prefetch-memory <MB>", "cap on decoded inputs waiting (default 2048)");
+            PrintOption(std::cerr, "", "write-threads <n>", "background output writers (default 2, 0 = in place)");
+            PrintOption(std::cerr, "", "write-memory <MB>", "cap on outputs queued for writing (default 2048)");
+            PrintPipelineOptionsUsage(std::cerr);
+            return EXIT_FAILURE;
+        }
+
+        options                   = ParsePipelineOptions(cmd);
+        scheduler.numberOfThreads = cmd.GetUnsigned("threads", scheduler.numberOfThreads);
+        scheduler.numberOfJobs    = cmd.GetUnsigned("jobs", scheduler.numberOfJobs);
+        scheduler.prefetchCases   = cmd.GetUnsigned("prefetch", scheduler.prefetchCases);
+        scheduler.prefetchMemory  = cmd.GetUnsigned("prefetch-memory", scheduler.prefetchMemory);
+        scheduler.writeThreads    = cmd.GetUnsigned("write-threads", scheduler.writeThreads);
+        scheduler.writeMemory     = cmd.GetUnsigned("write-memory", scheduler.writeMemory);
+        cases                     = ReadCohortManifest(cmd.Positional()[0]);
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    CohortSummary summary = RunCohort(cases, options, scheduler, std::cout);
+
+    std::cout << "\nCohort finished: " << summary.succeeded << " succeeded, "
+              << summary.failed << " failed in " << summary.wallSeconds << " s" << std::endl;
+    std::cout << "Throughput: " << summary.casesPerHour << " cases/hour" << std::endl;
+    std::cout << "T0 image cache: " << summary.cacheHits << " hits, " << summary.cacheMisses
+              << " misses" << std::endl;
+    if (scheduler.prefetchCases > 0)
+    {
+        std::cout << "Input prefetch: " << summary.prefetchHits << " decoded ahead, " << summary.prefetchMisses
+                  << " read in place, peak " << (summary.prefetchPeak >> 20) << " MB" << std::endl;
+    }
+
+    return summary.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // namespace tt
@@ -0,0 +1,70 @@
+//
+// Cohort batch mode (TumourTracker batch)
+//
+// Runs many cases of a manifest concurrently. Inter-case workers and the
+// ITK filters inside each case share one bounded pool of threads: every
+// job gets numberOfThreads / numberOfJobs ITK work units. Inputs of the
+// next cases are decoded and outputs written on separate I/O threads
+// (case_io.h), so reading, computing and writing overlap.
+//
+
+#ifndef TUMOURTRACKER_COHORT_H
+#define TUMOURTRACKER_COHORT_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+namespace tt
+{
+
+// One case per line: patient,T0,T1[,T2...],output_dir
+// Blank lines, '#' comments and a leading "patient,..." header are ignored.
+std::vector<CaseSpec> ReadCohortManifest(const std::string & fileName);
+
+// One manifest line split at commas, fields trimmed; MakeCaseSpec throws
+// std::invalid_argument for fewer than four fields.
+std::vector<std::string> SplitManifestLine(const std::string & line);
+CaseSpec                 MakeCaseSpec(const std::vector<std::string> & fields);
+
+// Make the ITK pool the only source of worker threads, sized to the budget.
+void ConfigureThreadPool(unsigned int numberOfThreads);
+
+struct SchedulerOptions
+{
+    unsigned int numberOfThreads = 0;    // total thread budget (0 = ITK global default)
+    unsigned int numberOfJobs    = 0;    // concurrent cases (0 = one per 4 threads)
+    unsigned int prefetchCases   = 2;    // decoded ahead of the last case begun (0 = read in place)
+    unsigned int prefetchMemory  = 2048; // MB of decoded inputs waiting to be taken
+    unsigned int writeThreads    = 2;    // background writers (0 = write in place)
+    unsigned int writeMemory     = 2048; // MB of outputs queued
+};
+
+struct CohortSummary
+{
+    size_t       succeeded      = 0;
+    size_t       failed         = 0;
+    unsigned int numberOfJobs   = 0;
+    unsigned int threadsPerJob  = 0;
+    double       wallSeconds    = 0.0;
+    double       casesPerHour   = 0.0;
+    size_t       cacheHits      = 0; // per-patient T0 image / pyramid lookups
+    size_t       cacheMisses    = 0;
+    size_t       prefetchHits   = 0; // timepoints taken already decoded
+    size_t       prefetchMisses = 0;
+    size_t       prefetchPeak   = 0; // bytes of decoded inputs held at once
+};
+
+CohortSummary RunCohort(const std::vector<CaseSpec> & cases,
+                        const PipelineOptions & options,
+                        const SchedulerOptions & scheduler,
+                        std::ostream & log);
+
+// Entry point for "TumourTracker batch ..." (argv[0] is "batch").
+int RunBatchCommand(int argc, char * argv[]);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_COHORT_H
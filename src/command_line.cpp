@@ -0,0 +1,340 @@
+//
+// Minimal "--name value" / "--switch" command-line parsing for the tools
+//
+
+#include "command_line.h"
+
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+namespace tt
+{
+
+namespace
+{
+
+// Just enough JSON for option profiles: objects, arrays of scalars, strings
+// (simple escapes), numbers and literals, flattened to option name -> text.
+class ProfileParser
+{
+public:
+    ProfileParser(const std::string & text, const std::string & fileName)
+        : m_Text(text), m_FileName(fileName)
+    {
+    }
+
+    std::map<std::string, std::string> Parse()
+    {
+        std::map<std::string, std::string> options;
+        this->Object("", options);
+        this->SkipSpace();
+        if (m_Position != m_Text.size())
+        {
+            this->Fail("trailing characters");
+        }
+        return options;
+    }
+
+private:
+    [[noreturn]] void Fail(const std::string & what) const
+    {
+        throw std::invalid_argument("profile " + m_FileName + ": " + what + " at offset " +
+                                    std::to_string(m_Position));
+    }
+
+    void SkipSpace()
+    {
+        while (m_Position < m_Text.size() && std::isspace(static_cast<unsigned char>(m_Text[m_Position])))
+        {
+            ++m_Position;
+        }
+    }
+
+    bool Accept(char c)
+    {
+        this->SkipSpace();
+        if (m_Position < m_Text.size() && m_Text[m_Position] == c)
+        {
+            ++m_Position;
+            return true;
+        }
+        return false;
+    }
+
+    void Expect(char c)
+    {
+        if (!this->Accept(c))
+        {
+            this->Fail(std::string("expected '") + c + "'");
+        }
+    }
+
+    std::string String()
+    {
+        this->Expect('"');
+        std::string value;
+        while (m_Position < m_Text.size() && m_Text[m_Position] != '"')
+        {
+            char c = m_Text[m_Position++];
+            if (c == '\\' && m_Position < m_Text.size())
+            {
+                c = m_Text[m_Position++];
+                switch (c)
+                {
+                    case 'n':
+                        c = '\n';
+                        break;
+                    case 't':
+                        c = '\t';
+                        break;
+                    case '"':
+                    case '\\':
+                    case '/':
+                        break;
+                    default:
+                        this->Fail("unsupported escape");
+                }
+            }
+            value += c;
+        }
+        this->Expect('"');
+        return value;
+    }
+
+    // Number or literal, as written; empty for false and null.
+    std::string Scalar()
+    {
+        this->SkipSpace();
+        if (m_Position < m_Text.size() && m_Text[m_Position] == '"')
+        {
+            return this->String();
+        }
+        const std::string::size_type start = m_Position;
+        while (m_Position < m_Text.size() &&
+               (std::isalnum(static_cast<unsigned char>(m_Text[m_Position])) || m_Text[m_Position] == '-' ||
+                m_Text[m_Position] == '+' || m_Text[m_Position] == '.'))
+        {
+            ++m_Position;
+        }
+        const std::string token = m_Text.substr(start, m_Position - start);
+        if (token.empty())
+        {
+            this->Fail("expected a value");
+        }
+        if (token == "true")
+        {
+            return "1";
+        }
+        if (token == "false" || token == "null")
+        {
+            return "";
+        }
+        if (!std::isdigit(static_cast<unsigned char>(token.back())) && token.back() != '.')
+        {
+            this->Fail("unknown literal '" + token + "'");
+        }
+        return token;
+    }
+
+    void Object(const std::string & prefix, std::map<std::string, std::string> & options)
+    {
+        this->Expect('{');
+        if (this->Accept('}'))
+        {
+            return;
+        }
+        do
+        {
+            const std::string name = prefix + this->String();
+            this->Expect(':');
+            this->SkipSpace();
+            if (m_Position < m_Text.size() && m_Text[m_Position] == '{')
+            {
+                this->Object(name + "-", options);
+                continue;
+            }
+
+            std::string value;
+            if (this->Accept('['))
+            {
+                if (!this->Accept(']'))
+                {
+                    do
+                    {
+                        value += (value.empty() ? "" : ",") + this->Scalar();
+                    } while (this->Accept(','));
+                    this->Expect(']');
+                }
+            }
+            else
+            {
+                value = this->Scalar();
+            }
+            if (!value.empty())
+            {
+                options[name] = value;
+            }
+        } while (this->Accept(','));
+        this->Expect('}');
+    }
+
+    const std::string &    m_Text;
+    const std::string &    m_FileName;
+    std::string::size_type m_Position = 0;
+};
+
+} // namespace
+
+CommandLine::CommandLine(int argc, char * argv[], int first,
+                         const std::set<std::string> & switches)
+{
+    for (int i = first; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.size() < 3 || arg.compare(0, 2, "--") != 0)
+        {
+            m_Positional.push_back(arg);
+            continue;
+        }
+
+        std::string name = arg.substr(2);
+        const std::string::size_type eq = name.find('=');
+        if (eq != std::string::npos)
+        {
+            m_Options[name.substr(0, eq)] = name.substr(eq + 1);
+        }
+        else if (switches.count(name))
+        {
+            m_Options[name] = "1";
+        }
+        else if (i + 1 < argc)
+        {
+            m_Options[name] = argv[++i];
+        }
+        else
+        {
+            throw std::invalid_argument("missing value for --" + name);
+        }
+    }
+
+    if (this->Has("profile"))
+    {
+        this->ReadProfile(m_Options["profile"]);
+    }
+}
+
+void CommandLine::ReadProfile(const std::string & fileName)
+{
+    std::ifstream file(fileName);
+    if (!file)
+    {
+        throw std::invalid_argument("cannot read profile " + fileName);
+    }
+    const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // insert() keeps the command-line value of an option given twice
+    const auto profile = ProfileParser(text, fileName).Parse();
+    m_Options.insert(profile.begin(), profile.end());
+}
+
+bool CommandLine::Has(const std::string & name) const
+{
+    return m_Options.count(name) != 0;
+}
+
+std::string CommandLine::Signature(const std::set<std::string> & names,
+                                   const std::vector<std::string> & prefixes) const
+{
+    std::string signature;
+    for (const auto & option : m_Options)
+    {
+        bool selected = names.count(option.first) != 0;
+        for (const auto & prefix : prefixes)
+        {
+            selected = selected || option.first.compare(0, prefix.size(), prefix) == 0;
+        }
+        if (selected)
+        {
+            signature += option.first + "=" + option.second + ";";
+        }
+    }
+    return signature;
+}
+
+std::string CommandLine::GetString(const std::string & name, const std::string & defaultValue) const
+{
+    auto it = m_Options.find(name);
+    return it == m_Options.end() ? defaultValue : it->second;
+}
+
+double CommandLine::GetDouble(const std::string & name, double defaultValue) const
+{
+    auto it = m_Options.find(name);
+    return it == m_Options.end() ? defaultValue : std::stod(it->second);
+}
+
+unsigned int CommandLine::GetUnsigned(const std::string & name, unsigned int defaultValue) const
+{
+    auto it = m_Options.find(name);
+    return it == m_Options.end() ? defaultValue
+                                 : static_cast<unsigned int>(std::stoul(it->second));
+}
+
+std::vector<std::string> CommandLine::GetList(const std::string & name,
+                                              const std::vector<std::string> & defaultValue) const
+{
+    auto it = m_Options.find(name);
+    if (it == m_Options.end())
+    {
+        return defaultValue;
+    }
+
+    std::vector<std::string> values;
+    std::istringstream       stream(it->second);
+    std::string              item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty())
+        {
+            values.push_back(item);
+        }
+    }
+    return values;
+}
+
+std::vector<unsigned int> CommandLine::GetUnsignedList(const std::string & name,
+                                                       const std::vector<unsigned int> & defaultValue) const
+{
+    if (!this->Has(name))
+    {
+        return defaultValue;
+    }
+
+    std::vector<unsigned int> values;
+    for (const auto & item : this->GetList(name, {}))
+    {
+        values.push_back(static_cast<unsigned int>(std::stoul(item)));
+    }
+    return values;
+}
+
+std::vector<double> CommandLine::GetDoubleList(const std::string & name,
+                                               const std::vector<double> & defaultValue) const
+{
+    if (!this->Has(name))
+    {
+        return defaultValue;
+    }
+
+    std::vector<double> values;
+    for (const auto & item : this->GetList(name, {}))
+    {
+        values.push_back(std::stod(item));
+    }
+    return values;
+}
+
+} // namespace tt
@@ -0,0 +1,60 @@
+//
+// Minimal "--name value" / "--switch" command-line parsing for the tools
+//
+
+#ifndef TUMOURTRACKER_COMMAND_LINE_H
+#define TUMOURTRACKER_COMMAND_LINE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace tt
+{
+
+class CommandLine
+{
+public:
+    // Arguments from argv[first] on. Names listed in switches take no value;
+    // every other "--name" consumes the next argument (or "--name=value").
+    //
+    // "--profile <file.json>" adds the options of a JSON object, e.g.
+    // {"shrink-factors": [4, 2, 1], "schedule": "auto", "deadline": 600}.
+    // Arrays become comma lists, true a switch (false and null are skipped)
+    // and nested objects prefix their members ({"rigid": {"iterations": 50}}
+    // is --rigid-iterations). Options given on the command line win.
+    CommandLine(int argc, char * argv[], int first = 1,
+                const std::set<std::string> & switches = {});
+
+    const std::vector<std::string> & Positional() const { return m_Positional; }
+
+    bool Has(const std::string & name) const;
+
+    std::string  GetString(const std::string & name, const std::string & defaultValue) const;
+    double       GetDouble(const std::string & name, double defaultValue) const;
+    unsigned int GetUnsigned(const std::string & name, unsigned int defaultValue) const;
+
+    // Comma-separated list, e.g. "--write rigid,deformed".
+    std::vector<std::string> GetList(const std::string & name,
+                                     const std::vector<std::string> & defaultValue) const;
+    std::vector<unsigned int> GetUnsignedList(const std::string & name,
+                                              const std::vector<unsigned int> & defaultValue) const;
+    std::vector<double>       GetDoubleList(const std::string & name,
+                                            const std::vector<double> & defaultValue) const;
+
+    // "name=value;..." of the options given (value 1 for switches) whose
+    // name is listed or starts with one of prefixes, in name order; e.g.
+    // the settings a stored result was produced with.
+    std::string Signature(const std::set<std::string> & names, const std::vector<std::string> & prefixes) const;
+
+private:
+    void ReadProfile(const std::string & fileName);
+
+    std::vector<std::string>           m_Positional;
+    std::map<std::string, std::string> m_Options;
+};
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_COMMAND_LINE_H
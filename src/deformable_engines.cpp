@@ -0,0 +1,343 @@
+//
+// Alternative deformable engines: diffeomorphic demons and SyN
+//
+
+#include "deformable_engines.h"
+
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+
+#include <itkDiffeomorphicDemonsRegistrationFilter.h>
+#include <itkDisplacementFieldTransformParametersAdaptor.h>
+#include <itkMattesMutualInformationImageToImageMetricv4.h>
+#include <itkResampleImageFilter.h>
+#include <itkShrinkImageFilter.h>
+#include <itkSyNImageRegistrationMethod.h>
+#include <itkVectorLinearInterpolateImageFunction.h>
+
+namespace tt
+{
+
+DeformableEngine ParseDeformableEngine(const std::string & name)
+{
+    if (name == "bspline")
+    {
+        return DeformableEngine::BSpline;
+    }
+    if (name == "demons")
+    {
+        return DeformableEngine::Demons;
+    }
+    if (name == "syn")
+    {
+        return DeformableEngine::SyN;
+    }
+    throw std::invalid_argument("unknown engine '" + name + "' (bspline, demons or syn)");
+}
+
+const char * DeformableEngineName(DeformableEngine engine)
+{
+    switch (engine)
+    {
+        case DeformableEngine::Demons:
+            return "demons";
+        case DeformableEngine::SyN:
+            return "syn";
+        default:
+            return "bspline";
+    }
+}
+
+namespace
+{
+
+// sigma (mm) in voxels of image along each axis.
+itk::FixedArray<double, 3> VoxelSigmas(double sigma, const itk::ImageBase<3> * image)
+{
+    itk::FixedArray<double, 3> sigmas;
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        sigmas[d] = sigma / image->GetSpacing()[d];
+    }
+    return sigmas;
+}
+
+double VoxelVolume(const itk::ImageBase<3> * image)
+{
+    const auto spacing = image->GetSpacing();
+    return spacing[0] * spacing[1] * spacing[2];
+}
+
+// Field resampled (linearly, zero outside) onto the grid of reference.
+DisplacementFieldType::Pointer ResampleField(const DisplacementFieldType * field,
+                                             const itk::ImageBase<3> * reference,
+                                             unsigned int numberOfWorkUnits)
+{
+    using FieldResampleType = itk::ResampleImageFilter<DisplacementFieldType, DisplacementFieldType, double>;
+
+    DisplacementFieldType::PixelType zero;
+    zero.Fill(0.0);
+
+    auto resampler = FieldResampleType::New();
+    resampler->SetInput(field);
+    resampler->SetReferenceImage(reference);
+    resampler->UseReferenceImageOn();
+    resampler->SetInterpolator(itk::VectorLinearInterpolateImageFunction<DisplacementFieldType, double>::New());
+    resampler->SetDefaultPixelValue(zero);
+    if (numberOfWorkUnits > 0)
+    {
+        resampler->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    resampler->Update();
+
+    DisplacementFieldType::Pointer output = resampler->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+} // namespace
+
+// =====================================================
+// Diffeomorphic demons
+// =====================================================
+
+DisplacementFieldTransformType::Pointer RegisterDemons(ImagePyramid & fixedPyramid,
+                                                       ImagePyramid & movingPyramid,
+                                                       const DemonsParameters & parameters)
+{
+    using DemonsFilterType =
+        itk::DiffeomorphicDemonsRegistrationFilter<ImageType, ImageType, DisplacementFieldType>;
+
+    const ImageType *       fixed    = fixedPyramid.GetImage();
+    const PyramidSchedule & schedule = parameters.pyramid;
+
+    // Demons compares intensities voxel by voxel on the fixed grid, so the
+    // rigid part is applied up front; the final output still resamples the
+    // original image once through rigid o field.
+    ImagePyramid * moving = &movingPyramid;
+    std::unique_ptr<ImagePyramid> alignedPyramid;
+    if (parameters.initialTransform)
+    {
+        ImageType::Pointer aligned = ResampleToReference(movingPyramid.GetImage(), parameters.initialTransform,
+                                                         fixed, parameters.numberOfWorkUnits);
+        alignedPyramid = std::make_unique<ImagePyramid>(aligned, parameters.numberOfWorkUnits);
+        moving         = alignedPyramid.get();
+    }
+
+    DisplacementFieldType::Pointer field;
+    for (unsigned int level = 0; level < schedule.GetNumberOfLevels(); ++level)
+    {
+        const unsigned int shrink = schedule.shrinkFactors[level];
+        const double       sigma  = schedule.smoothingSigmas[level];
+
+        ImageType::ConstPointer fixedLevel = fixedPyramid.GetLevel(shrink, sigma);
+
+        auto demons = DemonsFilterType::New();
+        demons->SetFixedImage(fixedLevel);
+        demons->SetMovingImage(moving->GetLevel(shrink, sigma));
+        if (field)
+        {
+            demons->SetInitialDisplacementField(ResampleField(field, fixedLevel, parameters.numberOfWorkUnits));
+        }
+        demons->SetNumberOfIterations(parameters.numberOfIterations);
+        demons->SetMaximumUpdateStepLength(parameters.maximumUpdateStepLength);
+        demons->SetUseGradientType(parameters.symmetricForces
+                                       ? itk::ESMDemonsRegistrationFunctionEnums::Gradient::Symmetric
+                                       : itk::ESMDemonsRegistrationFunctionEnums::Gradient::Fixed);
+        // The filter smooths in voxels of the level; the sigmas are in mm.
+        demons->SetSmoothDisplacementField(parameters.fieldSmoothingSigma > 0.0);
+        demons->SetStandardDeviations(VoxelSigmas(parameters.fieldSmoothingSigma, fixedLevel));
+        demons->SetSmoothUpdateField(parameters.updateFieldSmoothingSigma > 0.0);
+        demons->SetUpdateFieldStandardDeviations(VoxelSigmas(parameters.updateFieldSmoothingSigma, fixedLevel));
+        if (parameters.numberOfWorkUnits > 0)
+        {
+            demons->SetNumberOfWorkUnits(parameters.numberOfWorkUnits);
+        }
+        if (parameters.iterations != nullptr)
+        {
+            // The filter has no multi-resolution events; the levels are ours.
+            // Every voxel of the field is a parameter (three components).
+            DemonsFilterType *  filter     = demons;
+            IterationRecorder * iterations = parameters.iterations;
+            iterations->BeginLevel(level, 3 * fixedLevel->GetLargestPossibleRegion().GetNumberOfPixels());
+            demons->AddObserver(itk::IterationEvent(),
+                                [=](const itk::EventObject &) { iterations->Iteration(filter->GetMetric()); });
+        }
+        demons->Update();
+
+        field = demons->GetOutput();
+        field->DisconnectPipeline();
+    }
+
+    // Coarse last level: bring the field to the full fixed grid.
+    if (field->GetLargestPossibleRegion() != fixed->GetLargestPossibleRegion() ||
+        field->GetSpacing() != fixed->GetSpacing())
+    {
+        field = ResampleField(field, fixed, parameters.numberOfWorkUnits);
+    }
+    return MakeDisplacementFieldTransform(field);
+}
+
+// =====================================================
+// SyN
+// =====================================================
+
+DisplacementFieldTransformType::Pointer RegisterSyN(ImagePyramid & fixedPyramid,
+                                                    ImagePyramid & movingPyramid,
+                                                    const SyNParameters & parameters)
+{
+    using MetricType       = itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType>;
+    using RegistrationType =
+        itk::SyNImageRegistrationMethod<ImageType, ImageType, DisplacementFieldTransformType>;
+    using AdaptorType = itk::DisplacementFieldTransformParametersAdaptor<DisplacementFieldTransformType>;
+
+    const ImageType *       fixed          = fixedPyramid.GetImage();
+    const PyramidSchedule & schedule       = parameters.pyramid;
+    const unsigned int      numberOfLevels = schedule.GetNumberOfLevels();
+
+    if (parameters.iterationsPerLevel.size() != numberOfLevels)
+    {
+        itkGenericExceptionMacro(<< "SyN needs one iteration count per pyramid level ("
+                                 << parameters.iterationsPerLevel.size() << " given for "
+                                 << numberOfLevels << " levels)");
+    }
+
+    // Zero field on the full fixed grid; the adaptors resize it per level.
+    DisplacementFieldType::PixelType zero;
+    zero.Fill(0.0);
+    auto field = DisplacementFieldType::New();
+    field->CopyInformation(fixed);
+    field->SetRegions(fixed->GetLargestPossibleRegion());
+    field->Allocate();
+    field->FillBuffer(zero);
+
+    auto transform = DisplacementFieldTransformType::New();
+    transform->SetDisplacementField(field);
+
+    auto metric = MetricType::New();
+    metric->SetNumberOfHistogramBins(parameters.numberOfHistogramBins);
+    metric->SetUseFixedImageGradientFilter(false);
+    metric->SetUseMovingImageGradientFilter(false);
+
+    auto registration = RegistrationType::New();
+    registration->SetFixedImage(fixed);
+    registration->SetMovingImage(movingPyramid.GetImage());
+    registration->SetMetric(metric);
+    registration->SetInitialTransform(transform);
+    if (parameters.initialTransform)
+    {
+        registration->SetMovingInitialTransform(parameters.initialTransform);
+    }
+    registration->InPlaceOn();
+
+    RegistrationType::ShrinkFactorsArrayType      shrinkFactorsPerLevel(numberOfLevels);
+    RegistrationType::SmoothingSigmasArrayType    smoothingSigmasPerLevel(numberOfLevels);
+    RegistrationType::NumberOfIterationsArrayType iterationsPerLevel(numberOfLevels);
+    RegistrationType::TransformParametersAdaptorsContainerType adaptors;
+    std::vector<double>                                        voxelAreas(numberOfLevels); // mm^2 per voxel^2
+    for (unsigned int level = 0; level < numberOfLevels; ++level)
+    {
+        shrinkFactorsPerLevel[level]   = schedule.shrinkFactors[level];
+        smoothingSigmasPerLevel[level] = schedule.smoothingSigmas[level];
+        iterationsPerLevel[level]      = parameters.iterationsPerLevel[level];
+
+        // Field geometry of this level = the shrunk fixed image's.
+        using ShrinkFilterType = itk::ShrinkImageFilter<ImageType, ImageType>;
+        auto shrinker = ShrinkFilterType::New();
+        shrinker->SetInput(fixed);
+        shrinker->SetShrinkFactors(schedule.shrinkFactors[level]);
+        shrinker->UpdateOutputInformation();
+        const ImageType * shrunk = shrinker->GetOutput();
+        voxelAreas[level]        = std::pow(VoxelVolume(shrunk), 2.0 / 3.0);
+
+        auto adaptor = AdaptorType::New();
+        adaptor->SetRequiredSpacing(shrunk->GetSpacing());
+        adaptor->SetRequiredSize(shrunk->GetLargestPossibleRegion().GetSize());
+        adaptor->SetRequiredOrigin(shrunk->GetOrigin());
+        adaptor->SetRequiredDirection(shrunk->GetDirection());
+        adaptors.push_back(adaptor);
+    }
+    registration->SetNumberOfLevels(numberOfLevels);
+    registration->SetShrinkFactorsPerLevel(shrinkFactorsPerLevel);
+    registration->SetSmoothingSigmasPerLevel(smoothingSigmasPerLevel);
+    registration->SetSmoothingSigmasAreSpecifiedInPhysicalUnits(true);
+    registration->SetNumberOfIterationsPerLevel(iterationsPerLevel);
+    registration->SetTransformParametersAdaptorsPerLevel(adaptors);
+    registration->SetLearningRate(parameters.learningRate);
+
+    // SyN smooths with variances in voxels^2 of the current level; the
+    // parameters are in mm^2, so they are set again as each level starts.
+    RegistrationType * method       = registration;
+    auto               setVariances = [=](unsigned int level)
+    {
+        method->SetGaussianSmoothingVarianceForTheUpdateField(parameters.updateFieldVariance / voxelAreas[level]);
+        method->SetGaussianSmoothingVarianceForTheTotalField(parameters.totalFieldVariance / voxelAreas[level]);
+    };
+    setVariances(0);
+    registration->AddObserver(itk::MultiResolutionIterationEvent(),
+                              [=](const itk::EventObject &) { setVariances(method->GetCurrentLevel()); });
+
+    if (parameters.numberOfWorkUnits > 0)
+    {
+        registration->SetNumberOfWorkUnits(parameters.numberOfWorkUnits);
+        metric->SetMaximumNumberOfWorkUnits(parameters.numberOfWorkUnits);
+    }
+    if (parameters.iterations != nullptr)
+    {
+        IterationRecorder * iterations = parameters.iterations;
+        registration->AddObserver(itk::MultiResolutionIterationEvent(),
+                                  [=](const itk::EventObject &)
+                                  {
+                                      iterations->BeginLevel(method->GetCurrentLevel(),
+                                                             transform->GetNumberOfParameters());
+                                  });
+        registration->AddObserver(itk::IterationEvent(),
+                                  [=](const itk::EventObject &) { iterations->Iteration(metric->GetCurrentValue()); });
+    }
+    registration->Update();
+
+    return transform;
+}
+
+// =====================================================
+// Engine dispatch
+// =====================================================
+
+TransformBaseType::Pointer RegisterDeformable(ImagePyramid & fixed,
+                                              ImagePyramid & moving,
+                                              const DeformableParameters & parameters,
+                                              TransformBaseType * initialTransform,
+                                              unsigned int numberOfWorkUnits,
+                                              IterationRecorder * iterations)
+{
+    switch (parameters.engine)
+    {
+        case DeformableEngine::Demons:
+        {
+            DemonsParameters demons  = parameters.demons;
+            demons.initialTransform  = initialTransform;
+            demons.numberOfWorkUnits = numberOfWorkUnits;
+            demons.iterations        = iterations;
+            return RegisterDemons(fixed, moving, demons);
+        }
+        case DeformableEngine::SyN:
+        {
+            SyNParameters syn     = parameters.syn;
+            syn.initialTransform  = initialTransform;
+            syn.numberOfWorkUnits = numberOfWorkUnits;
+            syn.iterations        = iterations;
+            return RegisterSyN(fixed, moving, syn);
+        }
+        default:
+        {
+            BSplineParameters bspline = parameters.bspline;
+            bspline.initialTransform  = initialTransform;
+            bspline.numberOfWorkUnits = numberOfWorkUnits;
+            bspline.iterations        = iterations;
+            return RegisterBSpline(fixed, moving, bspline);
+        }
+    }
+}
+
+} // namespace tt
@@ -0,0 +1,100 @@
+//
+// Alternative deformable engines: diffeomorphic demons and SyN.
+//
+// Both return a dense displacement-field transform on the fixed grid, so
+// like the B-spline result they compose behind the rigid transform with
+// ComposeTransforms and feed the same field / warp / Jacobian outputs.
+//
+
+#ifndef TUMOURTRACKER_DEFORMABLE_ENGINES_H
+#define TUMOURTRACKER_DEFORMABLE_ENGINES_H
+
+#include <string>
+#include <vector>
+
+#include "image_types.h"
+#include "pyramid.h"
+#include "stages.h"
+
+namespace tt
+{
+
+enum class DeformableEngine
+{
+    BSpline, // Mattes MI + LBFGS (stages.h)
+    Demons,  // diffeomorphic demons, intensity differences (same-sequence, normalized)
+    SyN      // symmetric normalization, Mattes MI
+};
+
+// "bspline", "demons" or "syn"; throws std::invalid_argument otherwise.
+DeformableEngine ParseDeformableEngine(const std::string & name);
+const char *     DeformableEngineName(DeformableEngine engine);
+
+struct DemonsParameters
+{
+    PyramidSchedule     pyramid                   = { { 4, 2, 1 }, { 2.0, 1.0, 0.0 } };
+    unsigned int        numberOfIterations        = 50;   // per level
+    double              fieldSmoothingSigma       = 1.5;  // mm at every level, regularizes the total field
+    double              updateFieldSmoothingSigma = 0.0;  // mm at every level, 0 = no fluid-like smoothing
+    double              maximumUpdateStepLength   = 2.0;  // voxels per iteration
+    bool                symmetricForces           = true; // ESM gradient of both images
+    unsigned int        numberOfWorkUnits         = 0;
+    IterationRecorder * iterations                = nullptr; // not owned
+
+    // Fixed moving-side transform (rigid result). Demons needs the moving
+    // image on the fixed grid, so it is resampled through this once.
+    TransformBaseType::Pointer initialTransform;
+};
+
+struct SyNParameters
+{
+    unsigned int              numberOfHistogramBins = 50;
+    PyramidSchedule           pyramid               = { { 4, 2, 1 }, { 2.0, 1.0, 0.0 } };
+    std::vector<unsigned int> iterationsPerLevel    = { 40, 20, 10 };
+    double                    learningRate          = 0.25;
+    double                    updateFieldVariance   = 3.0; // mm^2 at every level
+    double                    totalFieldVariance    = 0.0; // mm^2 at every level
+    unsigned int              numberOfWorkUnits     = 0;
+    IterationRecorder *       iterations            = nullptr; // not owned
+
+    TransformBaseType::Pointer initialTransform;
+};
+
+// Levels come from the fixed / moving pyramids like the other stages. The
+// smoothing sigmas (demons) and variances (SyN) are physical and converted
+// to the voxels of each level, so a level smooths over the same distance
+// whatever its shrink factor.
+DisplacementFieldTransformType::Pointer RegisterDemons(ImagePyramid & fixed,
+                                                       ImagePyramid & moving,
+                                                       const DemonsParameters & parameters = DemonsParameters());
+
+// SyN keeps one field per level internally and therefore runs its own
+// shrink / smooth schedule from parameters.pyramid on the full-resolution images.
+DisplacementFieldTransformType::Pointer RegisterSyN(ImagePyramid & fixed,
+                                                    ImagePyramid & moving,
+                                                    const SyNParameters & parameters = SyNParameters());
+
+// Engine selection plus the settings of every engine; only the selected
+// engine's parameters are used.
+struct DeformableParameters
+{
+    DeformableEngine  engine = DeformableEngine::BSpline;
+    BSplineParameters bspline;
+    DemonsParameters  demons;
+    SyNParameters     syn;
+};
+
+// Runs the selected engine with initialTransform (may be null) as its fixed
+// moving-side transform. The result excludes initialTransform; compose the
+// two with ComposeTransforms for the full mapping. iterations, when given,
+// receives the engine's per-iteration telemetry.
+TransformBaseType::Pointer RegisterDeformable(ImagePyramid & fixed,
+                                              ImagePyramid & moving,
+                                              const DeformableParameters & parameters,
+                                              TransformBaseType * initialTransform,
+                                              unsigned int numberOfWorkUnits = 0,
+                                              IterationRecorder * iterations = nullptr);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_DEFORMABLE_ENGINES_H
@@ -4,35 +4,120 @@
 //
 
 #include <itkVersion.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iostream>
-#include <vector>
+#include <memory>
+#include <stdexcept>
 
-#include <itkImage.h>
-#include <itkImageFileReader.h>
-#include <itkImageFileWriter.h>
-#include <itkResampleImageFilter.h>
-
-#include <itkBSplineTransform.h>
-#include <itkBSplineTransformInitializer.h>
-#include <itkBSplineTransformParametersAdaptor.h>
-
-#include <itkLBFGSBOptimizerv4.h>
-#include <itkLBFGSOptimizerv4.h>
-#include <itkImageRegistrationMethodv4.h>
-#include <itkMattesMutualInformationImageToImageMetricv4.h>
-#include <itkLinearInterpolateImageFunction.h>
-
-#include <itkTransformToDisplacementFieldFilter.h>
-#include <itkDisplacementFieldJacobianDeterminantFilter.h>
-#include <itkStatisticsImageFilter.h>
+#include "deformable_engines.h"
+#include "jacobian.h"
+#include "json_writer.h"
+#include "piecewise_registration.h"
+#include "stages.h"
+#include "stage_options.h"
+#include "telemetry.h"
 
 int main(int argc, char* argv[])
 {
-    if (argc < 4)
+    // --deadline covers the whole case, reading and cropping included
+    const auto                   start = std::chrono::steady_clock::now();
+    tt::DeformableParameters     parameters;
+    unsigned int                 numberOfWorkUnits = 0;
+    std::vector<std::string>     files;
+    std::string                  initialTransformFile;
+    std::string                  transformFile;
+    std::string                  fieldFile;
+    std::string                  jacobianReportFile;
+    std::string                  telemetryFile;
+    tt::FieldPrecision           fieldPrecision = tt::FieldPrecision::Float;
+    tt::LevelStorage             levelStorage   = tt::LevelStorage::Float;
+    tt::ForegroundCropParameters crop;
+    bool                         cropForeground = false;
+    tt::Interpolation            interpolation  = tt::Interpolation::Linear;
+    std::string                  roiLabelsFile;
+    tt::PiecewiseParameters      piecewise;
+
+    try
+    {
+        tt::CommandLine cmd(argc, argv);
+        files = cmd.Positional();
+        // Engine options share names (--iterations, --shrink-factors, ...);
+        // they apply to the selected engine.
+        parameters.engine = tt::ParseDeformableEngine(cmd.GetString("engine", "bspline"));
+        switch (parameters.engine)
+        {
+            case tt::DeformableEngine::Demons:
+                tt::ParseDemonsOptions(cmd, "", parameters.demons);
+                break;
+            case tt::DeformableEngine::SyN:
+                tt::ParseSyNOptions(cmd, "", parameters.syn);
+                break;
+            default:
+                tt::ParseBSplineOptions(cmd, "", parameters.bspline);
+                tt::ReadFixedMaskOption(cmd, parameters.bspline.sampling);
+        }
+        numberOfWorkUnits    = cmd.GetUnsigned("threads", numberOfWorkUnits);
+        initialTransformFile = cmd.GetString("initial-transform", "");
+        transformFile        = cmd.GetString("transform", "");
+        fieldFile            = cmd.GetString("displacement-field", "");
+        fieldPrecision       = tt::ReadFieldPrecisionOption(cmd);
+        levelStorage         = tt::ReadLevelStorageOption(cmd);
+        jacobianReportFile   = cmd.GetString("jacobian-report", "");
+        telemetryFile        = cmd.GetString("telemetry", "");
+        cropForeground       = tt::ReadForegroundCropOptions(cmd, crop);
+        crop.numberOfWorkUnits = numberOfWorkUnits;
+        interpolation        = tt::ReadInterpolationOption(cmd);
+
+        // Multi-ROI mode: one B-spline per label, blended into one field
+        roiLabelsFile        = cmd.GetString("roi-labels", "");
+        piecewise.labels     = cmd.GetUnsignedList("roi-list", {});
+        piecewise.blendWidth = cmd.GetDouble("roi-blend", piecewise.blendWidth);
+        if (!roiLabelsFile.empty() && parameters.engine != tt::DeformableEngine::BSpline)
+        {
+            throw std::invalid_argument("--roi-labels needs --engine bspline");
+        }
+        if (!roiLabelsFile.empty() && parameters.bspline.roiMask)
+        {
+            throw std::invalid_argument("--roi-labels and --roi-mask cannot be combined");
+        }
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (files.size() < 3)
     {
         std::cerr << "Usage: "
                   << argv[0]
-                  << " <fixed> <moving> <output>\n";
+                  << " [options] <fixed> <moving> <output>\n";
+        tt::PrintOption(std::cerr, "", "initial-transform <rigid.tfm>",
+                        "fixed moving transform from rigid_register; <moving> is then the original T1");
+        tt::PrintOption(std::cerr, "", "engine <bspline|demons|syn>", "deformable engine (default bspline)");
+        tt::PrintOption(std::cerr, "", "transform <out.tfm>", "save the full (initial + deformable) transform");
+        tt::PrintOption(std::cerr, "", "displacement-field <field.nii.gz>",
+                        "bake the full transform into a dense field for TumourTracker warp");
+        tt::PrintOption(std::cerr, "", "field-type <float|double>", "displacement field precision (default float)");
+        tt::PrintOption(std::cerr, "", "level-storage <float|int16>", "pyramid level type (default float)");
+        tt::PrintOption(std::cerr, "", "jacobian-report <qa.json>", "Jacobian determinant / folding statistics");
+        tt::PrintOption(std::cerr, "", "interpolation <linear|nearest|bspline|sinc>", "output resampling (default linear)");
+        tt::PrintOption(std::cerr, "", "threads <n>", "work units (default: ITK default)");
+        tt::PrintOption(std::cerr, "", "telemetry <file>", "stage / iteration profile: .jsonl lines or .json Chrome trace");
+        tt::PrintOption(std::cerr, "", "profile <options.json>", "default options from a JSON object (command line wins)");
+        tt::PrintForegroundCropOptionsUsage(std::cerr);
+        std::cerr << "B-spline engine:\n";
+        tt::PrintBSplineOptionsUsage(std::cerr, "");
+        tt::PrintOption(std::cerr, "", "fixed-mask <mask.nii>", "evaluate the metric inside this mask only");
+        tt::PrintOption(std::cerr, "", "roi-labels <labels.nii>", "register every label's box on its own, concurrently, and blend");
+        tt::PrintOption(std::cerr, "", "roi-list <l1,l2,...>", "labels to register (default: all)");
+        tt::PrintOption(std::cerr, "", "roi-blend <mm>", "fall-off of each region outside its label (default 3)");
+        std::cerr << "Demons engine:\n";
+        tt::PrintDemonsOptionsUsage(std::cerr, "");
+        std::cerr << "SyN engine:\n";
+        tt::PrintSyNOptionsUsage(std::cerr, "");
         return EXIT_FAILURE;
     }
 
@@ -40,151 +125,74 @@ int main(int argc, char* argv[])
               << itk::Version::GetITKVersion()
               << std::endl;
 
-    using ImageType = itk::Image<float, 3>;
-    using ReaderType = itk::ImageFileReader<ImageType>;
-
-    auto fixedReader  = ReaderType::New();
-    auto movingReader = ReaderType::New();
-
-    fixedReader->SetFileName(argv[1]);
-    movingReader->SetFileName(argv[2]);
-
-    fixedReader->Update();
-    movingReader->Update();
-
-    auto fixedImage  = fixedReader->GetOutput();
-    auto movingImage = movingReader->GetOutput();
-
-    // =====================================================
-    // BSpline Transform
-    // =====================================================
-
-    using TransformType = itk::BSplineTransform<double, 3, 3>;
-    auto transform = TransformType::New();
-
-    using InitializerType =
-        itk::BSplineTransformInitializer<TransformType, ImageType>;
-
-    auto initializer = InitializerType::New();
-    initializer->SetTransform(transform);
-    initializer->SetImage(fixedImage);
-
-    // COARSE INITIAL GRID
-    TransformType::MeshSizeType meshSize;
-    meshSize.Fill(4);  // coarse start
-    initializer->SetTransformDomainMeshSize(meshSize);
-    initializer->InitializeTransform();
-
-    // =====================================================
-    // Metric
-    // =====================================================
-
-    using MetricType =
-        itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType>;
-
-    auto metric = MetricType::New();
-    metric->SetNumberOfHistogramBins(50);
-    metric->SetUseMovingImageGradientFilter(false);
-    metric->SetUseFixedImageGradientFilter(false);
-
-    // =====================================================
-    // Optimizer
-    // =====================================================
-
-    //using OptimizerType = itk::LBFGSBOptimizerv4;
-    using OptimizerType = itk::LBFGSOptimizerv4;
-    auto optimizer = OptimizerType::New();
-
-    optimizer->SetGradientConvergenceTolerance(1e-5);
-    // optimizer->SetNumberOfIterations(100);
-    // optimizer->SetMaximumNumberOfFunctionEvaluations(500);
-    optimizer->SetNumberOfIterations(30);
-    optimizer->SetMaximumNumberOfFunctionEvaluations(100);
-
-    // IMPORTANT:
-    // Do NOT pre-size bounds based on parameter count.
-    // ITK will resize parameters between levels.
-
-    // =====================================================
-    // Registration
-    // =====================================================
-
-    using RegistrationType =
-        itk::ImageRegistrationMethodv4<ImageType, ImageType>;
-
-    auto registration = RegistrationType::New();
-
-    registration->SetFixedImage(fixedImage);
-    registration->SetMovingImage(movingImage);
-
-    registration->SetMetric(metric);
-    registration->SetOptimizer(optimizer);
-    registration->SetInitialTransform(transform);
-
-    registration->InPlaceOn();
-
-    // ==============================
-    // MULTI-RESOLUTION SETTINGS
-    // ==============================
-
-    // const unsigned int numberOfLevels = 3;
-    const unsigned int numberOfLevels = 2;
-    registration->SetNumberOfLevels(numberOfLevels);
-
-    // Shrink factors + smoothing
-    RegistrationType::ShrinkFactorsArrayType shrinkFactorsPerLevel;
-    RegistrationType::SmoothingSigmasArrayType smoothingSigmasPerLevel;
-
-    shrinkFactorsPerLevel.SetSize(numberOfLevels);
-    smoothingSigmasPerLevel.SetSize(numberOfLevels);
-
-    for (unsigned int level = 0; level < numberOfLevels; ++level)
+    // Stage spans and engine iterations, labelled fixed / moving file
+    tt::Telemetry                          telemetry;
+    tt::Telemetry *                        profile = telemetryFile.empty() ? nullptr : &telemetry;
+    std::unique_ptr<tt::IterationRecorder> iterations;
+    if (profile != nullptr)
     {
-        shrinkFactorsPerLevel[level] = 4 >> level;   // 4,2
-        smoothingSigmasPerLevel[level] = 2 - level;  // 2,1
+        iterations = std::make_unique<tt::IterationRecorder>(telemetry, files[0], files[1],
+                                                             tt::DeformableEngineName(parameters.engine));
     }
 
-    registration->SetShrinkFactorsPerLevel(shrinkFactorsPerLevel);
-    registration->SetSmoothingSigmasPerLevel(smoothingSigmasPerLevel);
-
-    // =====================================================
-    // BSpline Adaptors (CRITICAL PART)
-    // =====================================================
-
-    using TransformAdaptorType =
-        itk::BSplineTransformParametersAdaptor<TransformType>;
-
-    RegistrationType::TransformParametersAdaptorsContainerType adaptors;
-
-    for (unsigned int level = 0; level < numberOfLevels; ++level)
+    tt::ImageType::Pointer         fixedImage;
+    tt::ImageType::Pointer         movingImage;
+    tt::TransformBaseType::Pointer initialTransform;
+    tt::MaskImageType::Pointer     roiLabels;
     {
-        auto adaptor = TransformAdaptorType::New();
-        adaptor->SetTransform(transform);
-
-        TransformType::MeshSizeType levelMesh;
-        // levelMesh.Fill(4 * std::pow(2, level));  // refine grid
-        levelMesh.Fill(3 + level);  // refine grid
-
-        adaptor->SetRequiredTransformDomainMeshSize(levelMesh);
-        adaptor->SetRequiredTransformDomainOrigin(
-            transform->GetTransformDomainOrigin());
-        adaptor->SetRequiredTransformDomainDirection(
-            transform->GetTransformDomainDirection());
-        adaptor->SetRequiredTransformDomainPhysicalDimensions(
-            transform->GetTransformDomainPhysicalDimensions());
-
-        adaptors.push_back(adaptor.GetPointer());
+        tt::StageSpan span(profile, files[0], files[1], "read");
+        fixedImage  = tt::ReadImage(files[0]);
+        movingImage = tt::ReadImage(files[1]);
+        if (!initialTransformFile.empty())
+        {
+            initialTransform = tt::ReadTransform(initialTransformFile);
+        }
+        if (!roiLabelsFile.empty())
+        {
+            roiLabels = tt::ReadMask(roiLabelsFile);
+        }
     }
 
-    registration->SetTransformParametersAdaptorsPerLevel(adaptors);
+    // --crop-mask is a T0 mask; T1 is cropped to its own foreground. The
+    // output and the displacement field then cover the cropped T0 grid.
+    if (cropForeground)
+    {
+        tt::StageSpan span(profile, files[0], files[1], "crop");
+        fixedImage  = tt::CropToForeground(fixedImage, crop);
+        crop.mask   = nullptr;
+        movingImage = tt::CropToForeground(movingImage, crop);
+    }
 
-    // =====================================================
-    // RUN REGISTRATION
-    // =====================================================
+    // What is left of the budget goes to the registration; the B-spline
+    // schedule reports how much of it ran.
+    tt::ScheduleReport schedule;
+    if (parameters.bspline.deadlineSeconds > 0.0)
+    {
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        parameters.bspline.deadlineSeconds = std::max(1e-3, parameters.bspline.deadlineSeconds - elapsed);
+    }
+    parameters.bspline.report = &schedule;
 
+    tt::TransformBaseType::Pointer transform;
     try
     {
-        registration->Update();
+        tt::StageSpan    span(profile, files[0], files[1], "deformable");
+        tt::ImagePyramid fixedPyramid(fixedImage, numberOfWorkUnits, levelStorage);
+        tt::ImagePyramid movingPyramid(movingImage, numberOfWorkUnits, levelStorage);
+        if (roiLabels)
+        {
+            piecewise.bspline           = parameters.bspline;
+            piecewise.numberOfWorkUnits = numberOfWorkUnits;
+            const tt::PiecewiseResult result =
+                tt::RegisterPiecewise(fixedPyramid, movingPyramid, roiLabels, initialTransform, piecewise);
+            tt::PrintPiecewiseResult(result, std::cout);
+            transform = result.blended;
+        }
+        else
+        {
+            transform = tt::RegisterDeformable(fixedPyramid, movingPyramid, parameters, initialTransform,
+                                               numberOfWorkUnits, iterations.get());
+        }
     }
     catch (itk::ExceptionObject & err)
     {
@@ -193,30 +201,90 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    std::cout << "Multi-resolution deformable registration completed.\n";
-
-    // =====================================================
-    // RESAMPLE RESULT
-    // =====================================================
-
-    using ResampleFilterType =
-        itk::ResampleImageFilter<ImageType, ImageType>;
+    std::cout << "Multi-resolution deformable registration (" << tt::DeformableEngineName(parameters.engine)
+              << ") completed.\n";
+    if (parameters.engine == tt::DeformableEngine::BSpline && !roiLabels)
+    {
+        std::cout << "  Schedule: " << schedule.levelsCompleted << " of "
+                  << schedule.pyramid.GetNumberOfLevels() << " levels in " << schedule.seconds << " s"
+                  << (schedule.truncated ? " (deadline)" : "") << std::endl;
+        for (unsigned int level = 0; level < schedule.pyramid.GetNumberOfLevels(); ++level)
+        {
+            std::cout << "    shrink " << schedule.pyramid.shrinkFactors[level]
+                      << ", sigma " << schedule.pyramid.smoothingSigmas[level]
+                      << ", mesh " << schedule.meshSizePerLevel[level]
+                      << ", iterations " << schedule.iterationsPerLevel[level] << std::endl;
+        }
+        size_t atBounds = 0;
+        for (size_t count : schedule.coefficientsAtBoundsPerLevel)
+        {
+            atBounds += count;
+        }
+        if (atBounds > 0)
+        {
+            std::cout << "  " << atBounds << " coefficients ended a level on their LBFGSB bound"
+                      << " (--bound-fraction limits each level's update)" << std::endl;
+        }
+    }
 
-    auto resampler = ResampleFilterType::New();
-    resampler->SetInput(movingImage);
-    resampler->SetTransform(transform);
-    resampler->SetReferenceImage(fixedImage);
-    resampler->UseReferenceImageOn();
-    resampler->SetInterpolator(
-        itk::LinearInterpolateImageFunction<ImageType, double>::New());
+    // Initial and deformable transforms together: one interpolation of the original T1
+    auto composite = tt::ComposeTransforms(initialTransform, transform);
+    if (!transformFile.empty())
+    {
+        tt::WriteTransform(composite, transformFile);
+    }
+    if (!fieldFile.empty())
+    {
+        tt::DisplacementFieldType::Pointer field;
+        {
+            tt::StageSpan span(profile, files[0], files[1], "field");
+            field = tt::ComputeDisplacementField(composite, fixedImage, numberOfWorkUnits);
+        }
+        {
+            tt::StageSpan span(profile, files[0], files[1], "write");
+            tt::WriteDisplacementField(field, fieldFile, fieldPrecision);
+        }
+    }
+    if (!jacobianReportFile.empty())
+    {
+        tt::JacobianParameters jacobianParameters;
+        jacobianParameters.numberOfWorkUnits = numberOfWorkUnits;
+        tt::JacobianStatistics jacobian;
+        {
+            tt::StageSpan span(profile, files[0], files[1], "jacobian");
+            jacobian = tt::ComputeJacobianStatistics(composite, fixedImage, jacobianParameters);
+        }
+        tt::PrintJacobianStatistics(jacobian, std::cout);
+
+        std::ofstream  report(jacobianReportFile);
+        tt::JsonWriter json(report);
+        json.BeginObject()
+            .Member("fixed", files[0])
+            .Member("moving", files[1])
+            .Member("engine", tt::DeformableEngineName(parameters.engine))
+            .Key("jacobian");
+        tt::WriteJacobianJson(jacobian, json);
+        json.EndObject();
+        report << std::endl;
+    }
 
-    using WriterType = itk::ImageFileWriter<ImageType>;
-    auto writer = WriterType::New();
-    writer->SetFileName(argv[3]);
-    writer->SetInput(resampler->GetOutput());
-    writer->Update();
+    tt::ImageType::Pointer resampled;
+    {
+        tt::StageSpan span(profile, files[0], files[1], "deformable_resample");
+        resampled = tt::ResampleToReference(movingImage, composite, fixedImage, numberOfWorkUnits,
+                                            tt::ComputeBackend::CPU, interpolation);
+    }
+    {
+        tt::StageSpan span(profile, files[0], files[1], "write");
+        tt::WriteImage(resampled, files[2]);
+    }
 
     std::cout << "Output written.\n";
 
+    if (profile != nullptr)
+    {
+        telemetry.Write(telemetryFile);
+    }
+
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,71 @@
+//
+// Per-patient cache of the fixed timepoint
+//
+
+#include "image_cache.h"
+
+namespace tt
+{
+
+template <typename T>
+T ImageCache::Lookup(std::map<std::string, std::shared_future<T>> & entries, const std::string & key,
+                     const std::function<T()> & create)
+{
+    std::promise<T>       promise;
+    std::shared_future<T> existing;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto                        it = entries.find(key);
+        if (it != entries.end())
+        {
+            ++m_Statistics.hits;
+            existing = it->second;
+        }
+        else
+        {
+            ++m_Statistics.misses;
+            entries[key] = promise.get_future().share();
+        }
+    }
+    if (existing.valid())
+    {
+        return existing.get(); // waits while another caller is still loading
+    }
+
+    try
+    {
+        T value = create();
+        promise.set_value(value);
+        return value;
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        entries.erase(key);
+        throw;
+    }
+}
+
+ImageType::ConstPointer ImageCache::GetImage(const std::string & key, const ImageLoader & load)
+{
+    return this->Lookup<ImageType::ConstPointer>(m_Images, key, load);
+}
+
+std::shared_ptr<ImagePyramid> ImageCache::GetPyramid(const std::string & key, const ImageType * image,
+                                                     unsigned int numberOfWorkUnits, LevelStorage storage)
+{
+    return this->Lookup<std::shared_ptr<ImagePyramid>>(
+        m_Pyramids,
+        key,
+        [image, numberOfWorkUnits, storage]()
+        { return std::make_shared<ImagePyramid>(image, numberOfWorkUnits, storage); });
+}
+
+ImageCache::Statistics ImageCache::GetStatistics() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Statistics;
+}
+
+} // namespace tt
@@ -0,0 +1,63 @@
+//
+// Per-patient cache of the fixed timepoint.
+//
+// Every follow-up of a patient is registered against the same T0, so its
+// preprocessed volume and Gaussian pyramid are computed on first use and
+// shared afterwards - across follow-ups of a case and across the cases of
+// one patient in a cohort. Entries are read-only once published.
+//
+
+#ifndef TUMOURTRACKER_IMAGE_CACHE_H
+#define TUMOURTRACKER_IMAGE_CACHE_H
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "image_types.h"
+#include "pyramid.h"
+
+namespace tt
+{
+
+class ImageCache
+{
+public:
+    using ImageLoader = std::function<ImageType::ConstPointer()>;
+
+    struct Statistics
+    {
+        size_t hits   = 0;
+        size_t misses = 0;
+    };
+
+    // The image stored under key, loaded by load() on the first request.
+    // Concurrent requests for a key that is being loaded wait for it; a
+    // failed load is not cached and rethrows in every waiting caller.
+    ImageType::ConstPointer GetImage(const std::string & key, const ImageLoader & load);
+
+    // Pyramid of a cached image, created on the first request for key.
+    std::shared_ptr<ImagePyramid> GetPyramid(const std::string & key, const ImageType * image,
+                                             unsigned int numberOfWorkUnits = 0,
+                                             LevelStorage storage = LevelStorage::Float);
+
+    Statistics GetStatistics() const;
+
+private:
+    template <typename T>
+    T Lookup(std::map<std::string, std::shared_future<T>> & entries, const std::string & key,
+             const std::function<T()> & create);
+
+    std::map<std::string, std::shared_future<ImageType::ConstPointer>>       m_Images;
+    std::map<std::string, std::shared_future<std::shared_ptr<ImagePyramid>>> m_Pyramids;
+    Statistics                                                               m_Statistics;
+    mutable std::mutex                                                       m_Mutex;
+};
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_IMAGE_CACHE_H
@@ -0,0 +1,148 @@
+//
+// Internal helpers shared by the stage sources
+//
+
+#include "image_helpers.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkSignedMaurerDistanceMapImageFilter.h>
+
+namespace tt
+{
+
+namespace
+{
+
+using RegionType = MaskImageType::RegionType;
+using IndexType  = MaskImageType::IndexType;
+
+} // namespace
+
+itk::MultiThreaderBase::Pointer MakeThreader(unsigned int numberOfWorkUnits)
+{
+    auto threader = itk::MultiThreaderBase::New();
+    if (numberOfWorkUnits > 0)
+    {
+        threader->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    return threader;
+}
+
+std::array<RegionType, kNumberOfLabels> LabelRegions(const MaskImageType * labels, std::vector<unsigned int> & present)
+{
+    std::array<IndexType, kNumberOfLabels> lower;
+    std::array<IndexType, kNumberOfLabels> upper;
+    std::array<bool, kNumberOfLabels>      seen{};
+    for (itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(labels, labels->GetBufferedRegion()); !it.IsAtEnd();
+         ++it)
+    {
+        const unsigned int label = it.Get();
+        if (label == 0)
+        {
+            continue;
+        }
+        const IndexType & index = it.GetIndex();
+        if (!seen[label])
+        {
+            seen[label]  = true;
+            lower[label] = index;
+            upper[label] = index;
+            continue;
+        }
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            lower[label][d] = std::min(lower[label][d], index[d]);
+            upper[label][d] = std::max(upper[label][d], index[d]);
+        }
+    }
+
+    std::array<RegionType, kNumberOfLabels> regions;
+    present.clear();
+    for (unsigned int label = 1; label < kNumberOfLabels; ++label)
+    {
+        if (!seen[label])
+        {
+            continue;
+        }
+        present.push_back(label);
+        regions[label].SetIndex(lower[label]);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            regions[label].SetSize(d, static_cast<itk::SizeValueType>(upper[label][d] - lower[label][d] + 1));
+        }
+    }
+    return regions;
+}
+
+std::vector<PointType> RegionCorners(const itk::ImageBase<3> * image, const RegionType & region)
+{
+    std::vector<PointType> corners;
+    for (unsigned int corner = 0; corner < 8; ++corner)
+    {
+        IndexType index = region.GetIndex();
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            if ((corner >> d) & 1)
+            {
+                index[d] += static_cast<itk::IndexValueType>(region.GetSize(d)) - 1;
+            }
+        }
+        PointType point;
+        image->TransformIndexToPhysicalPoint(index, point);
+        corners.push_back(point);
+    }
+    return corners;
+}
+
+bool RegionCovering(const itk::ImageBase<3> * grid, const std::vector<PointType> & points, double padding,
+                    RegionType & region)
+{
+    IndexType lower;
+    IndexType upper;
+    lower.Fill(std::numeric_limits<itk::IndexValueType>::max());
+    upper.Fill(std::numeric_limits<itk::IndexValueType>::lowest());
+    const auto spacing = grid->GetSpacing();
+    for (const PointType & point : points)
+    {
+        itk::ContinuousIndex<double, 3> index;
+        grid->TransformPhysicalPointToContinuousIndex(point, index);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            const double margin = padding / spacing[d];
+            lower[d] = std::min(lower[d], static_cast<itk::IndexValueType>(std::floor(index[d] - margin)));
+            upper[d] = std::max(upper[d], static_cast<itk::IndexValueType>(std::ceil(index[d] + margin)));
+        }
+    }
+    region.SetIndex(lower);
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        region.SetSize(d, static_cast<itk::SizeValueType>(std::max<itk::IndexValueType>(upper[d] - lower[d] + 1, 0)));
+    }
+    return region.Crop(grid->GetLargestPossibleRegion());
+}
+
+DistanceImageType::Pointer SignedDistance(const MaskImageType * mask, unsigned int numberOfWorkUnits)
+{
+    using FilterType = itk::SignedMaurerDistanceMapImageFilter<MaskImageType, DistanceImageType>;
+    auto filter = FilterType::New();
+    filter->SetInput(mask);
+    filter->SetBackgroundValue(0);
+    filter->SetUseImageSpacing(true);
+    filter->SetSquaredDistance(false);
+    filter->SetInsideIsPositive(false);
+    if (numberOfWorkUnits > 0)
+    {
+        filter->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    filter->Update();
+
+    DistanceImageType::Pointer distance = filter->GetOutput();
+    distance->DisconnectPipeline();
+    return distance;
+}
+
+} // namespace tt
@@ -0,0 +1,48 @@
+//
+// Internal helpers shared by the stage sources (not part of tumourtracker.h)
+//
+// The ITK threader every parallel loop runs on, per-label index boxes of a
+// label map, region / point conversions between grids and the signed
+// distance map of a binary mask.
+//
+
+#ifndef TUMOURTRACKER_IMAGE_HELPERS_H
+#define TUMOURTRACKER_IMAGE_HELPERS_H
+
+#include <array>
+#include <vector>
+
+#include <itkMultiThreaderBase.h>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+using DistanceImageType = itk::Image<float, 3>;
+
+constexpr unsigned int kNumberOfLabels = 256; // label maps are 8-bit
+
+// numberOfWorkUnits 0 = ITK default. Callers that split their work units
+// between parallel tasks pass the share of each.
+itk::MultiThreaderBase::Pointer MakeThreader(unsigned int numberOfWorkUnits);
+
+// Index bounding box of every nonzero label, in one pass over the image;
+// present lists the labels found, in increasing order.
+std::array<MaskImageType::RegionType, kNumberOfLabels> LabelRegions(const MaskImageType *        labels,
+                                                                    std::vector<unsigned int> & present);
+
+// The 8 corner voxel centres of region, in physical space.
+std::vector<PointType> RegionCorners(const itk::ImageBase<3> * image, const MaskImageType::RegionType & region);
+
+// Region of grid covering the physical points, grown by padding (mm) and
+// clipped to the grid; false when nothing is left.
+bool RegionCovering(const itk::ImageBase<3> * grid, const std::vector<PointType> & points, double padding,
+                    MaskImageType::RegionType & region);
+
+// Signed distance (mm, negative inside) to the surface of a binary mask.
+DistanceImageType::Pointer SignedDistance(const MaskImageType * mask, unsigned int numberOfWorkUnits = 0);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_IMAGE_HELPERS_H
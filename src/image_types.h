@@ -0,0 +1,38 @@
+//
+// Image and transform types used throughout TumourTracker
+//
+
+#ifndef TUMOURTRACKER_IMAGE_TYPES_H
+#define TUMOURTRACKER_IMAGE_TYPES_H
+
+#include <itkImage.h>
+#include <itkTransform.h>
+#include <itkEuler3DTransform.h>
+#include <itkBSplineTransform.h>
+#include <itkCompositeTransform.h>
+#include <itkDisplacementFieldTransform.h>
+
+namespace tt
+{
+
+//Image type (3D MRI stored as float)
+using ImageType     = itk::Image<float, 3>;
+using MaskImageType = itk::Image<unsigned char, 3>;
+
+// Compact copy of a float image (pyramid levels, see pyramid.h): int16
+// scaled to the image's own range, half the bytes per voxel.
+using CompactImageType = itk::Image<short, 3>;
+using PointType     = itk::Point<double, 3>;
+
+using TransformBaseType      = itk::Transform<double, 3, 3>;
+using RigidTransformType     = itk::Euler3DTransform<double>;
+using BSplineTransformType   = itk::BSplineTransform<double, 3, 3>;
+using CompositeTransformType = itk::CompositeTransform<double, 3>;
+
+// Dense fixed-to-moving displacement (mm) on the fixed grid.
+using DisplacementFieldTransformType = itk::DisplacementFieldTransform<double, 3>;
+using DisplacementFieldType          = DisplacementFieldTransformType::DisplacementFieldType;
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_IMAGE_TYPES_H
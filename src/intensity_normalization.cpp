@@ -0,0 +1,360 @@
+//
+// Single-pass, multithreaded intensity statistics and in-place normalization
+//
+
+#include "intensity_normalization.h"
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+
+#include <itkMacro.h>
+
+#include "image_helpers.h"
+
+namespace tt
+{
+
+namespace
+{
+
+// Chunk length for the statistics pass: small enough that the second,
+// centred sweep over a chunk is served from cache.
+constexpr size_t kChunkSize = 1 << 16;
+
+// Calls add(values, n, mask) over buffer[begin, begin + count) as float
+// runs of at most kChunkSize. Float buffers without a stride are passed
+// through; otherwise every stride-th voxel (by buffer index, so the sample
+// does not depend on how ranges are split) is converted into a local run.
+template <typename TPixel, typename TAdd>
+void AddRange(const TPixel * buffer, const unsigned char * mask, size_t begin, size_t count, unsigned int stride,
+              TAdd && add)
+{
+    if constexpr (std::is_same<TPixel, float>::value)
+    {
+        if (stride <= 1)
+        {
+            add(buffer + begin, count, mask ? mask + begin : nullptr);
+            return;
+        }
+    }
+    stride = std::max(1u, stride);
+
+    std::vector<float>         values;
+    std::vector<unsigned char> selected;
+    const size_t               end = begin + count;
+    size_t                     i   = (begin + stride - 1) / stride * stride;
+    while (i < end)
+    {
+        values.clear();
+        selected.clear();
+        for (; i < end && values.size() < kChunkSize; i += stride)
+        {
+            values.push_back(static_cast<float>(buffer[i]));
+            if (mask != nullptr)
+            {
+                selected.push_back(mask[i]);
+            }
+        }
+        add(values.data(), values.size(), mask ? selected.data() : nullptr);
+    }
+}
+
+} // namespace
+
+// =====================================================
+// IntensityAccumulator
+// =====================================================
+
+void IntensityAccumulator::Add(const float * values, size_t n,
+                               const unsigned char * mask, float threshold)
+{
+    IntensityAccumulator chunk;
+    double               sum = 0.0;
+
+    if (mask == nullptr && threshold == -std::numeric_limits<float>::infinity())
+    {
+        // Unmasked fast path: straight loops over contiguous memory.
+        float minimum = chunk.m_Minimum;
+        float maximum = chunk.m_Maximum;
+        for (size_t i = 0; i < n; ++i)
+        {
+            sum += values[i];
+            minimum = std::min(minimum, values[i]);
+            maximum = std::max(maximum, values[i]);
+        }
+        chunk.m_Count   = n;
+        chunk.m_Minimum = minimum;
+        chunk.m_Maximum = maximum;
+        if (n == 0)
+        {
+            return;
+        }
+        chunk.m_Mean = sum / n;
+
+        double m2 = 0.0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const double diff = values[i] - chunk.m_Mean;
+            m2 += diff * diff;
+        }
+        chunk.m_M2 = m2;
+    }
+    else
+    {
+        auto inside = [values, mask, threshold](size_t i)
+        {
+            return (mask == nullptr || mask[i] != 0) && values[i] > threshold;
+        };
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (inside(i))
+            {
+                sum += values[i];
+                ++chunk.m_Count;
+                chunk.m_Minimum = std::min(chunk.m_Minimum, values[i]);
+                chunk.m_Maximum = std::max(chunk.m_Maximum, values[i]);
+            }
+        }
+        if (chunk.m_Count == 0)
+        {
+            return;
+        }
+        chunk.m_Mean = sum / chunk.m_Count;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (inside(i))
+            {
+                const double diff = values[i] - chunk.m_Mean;
+                chunk.m_M2 += diff * diff;
+            }
+        }
+    }
+
+    this->Merge(chunk);
+}
+
+void IntensityAccumulator::Merge(const IntensityAccumulator & other)
+{
+    if (other.m_Count == 0)
+    {
+        return;
+    }
+    if (m_Count == 0)
+    {
+        *this = other;
+        return;
+    }
+
+    const double n     = static_cast<double>(m_Count + other.m_Count);
+    const double delta = other.m_Mean - m_Mean;
+
+    m_Mean += delta * other.m_Count / n;
+    m_M2 += other.m_M2 + delta * delta * (static_cast<double>(m_Count) * other.m_Count / n);
+    m_Count += other.m_Count;
+    m_Minimum = std::min(m_Minimum, other.m_Minimum);
+    m_Maximum = std::max(m_Maximum, other.m_Maximum);
+}
+
+// =====================================================
+// IntensityHistogram
+// =====================================================
+
+IntensityHistogram::IntensityHistogram(double minimum, double maximum, unsigned int numberOfBins)
+    : m_Minimum(minimum)
+    , m_BinWidth(std::max(maximum - minimum, 1e-12) / std::max(numberOfBins, 1u))
+    , m_Counts(std::max(numberOfBins, 1u), 0)
+{
+}
+
+void IntensityHistogram::Add(const float * values, size_t n,
+                             const unsigned char * mask, float threshold)
+{
+    const double inverseWidth = 1.0 / m_BinWidth;
+    const long   lastBin      = static_cast<long>(m_Counts.size()) - 1;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if ((mask == nullptr || mask[i] != 0) && values[i] > threshold)
+        {
+            long bin = static_cast<long>((values[i] - m_Minimum) * inverseWidth);
+            bin      = std::min(std::max(bin, 0L), lastBin);
+            ++m_Counts[bin];
+            ++m_Total;
+        }
+    }
+}
+
+void IntensityHistogram::Merge(const IntensityHistogram & other)
+{
+    for (size_t b = 0; b < m_Counts.size(); ++b)
+    {
+        m_Counts[b] += other.m_Counts[b];
+    }
+    m_Total += other.m_Total;
+}
+
+double IntensityHistogram::Quantile(double q) const
+{
+    const double target     = q * m_Total;
+    double       cumulative = 0.0;
+    for (size_t b = 0; b < m_Counts.size(); ++b)
+    {
+        if (m_Counts[b] > 0 && cumulative + m_Counts[b] >= target)
+        {
+            const double fraction = (target - cumulative) / m_Counts[b];
+            return m_Minimum + (b + fraction) * m_BinWidth;
+        }
+        cumulative += m_Counts[b];
+    }
+    return m_Minimum + m_Counts.size() * m_BinWidth;
+}
+
+// =====================================================
+// Statistics + normalization
+// =====================================================
+
+template <typename TImage>
+IntensityStatistics ComputeIntensityStatisticsOf(const TImage * image,
+                                                 const NormalizationParameters & parameters,
+                                                 const MaskImageType * mask)
+{
+    using PixelType = typename TImage::PixelType;
+
+    const PixelType *  buffer = image->GetBufferPointer();
+    const size_t       n      = image->GetBufferedRegion().GetNumberOfPixels();
+    const unsigned int stride = parameters.statisticsStride;
+
+    const unsigned char * maskBuffer = nullptr;
+    if (mask != nullptr)
+    {
+        if (mask->GetBufferedRegion().GetSize() != image->GetBufferedRegion().GetSize())
+        {
+            itkGenericExceptionMacro(<< "Normalization mask size " << mask->GetBufferedRegion().GetSize()
+                                     << " does not match image size " << image->GetBufferedRegion().GetSize());
+        }
+        maskBuffer = mask->GetBufferPointer();
+    }
+    const float threshold = parameters.useForegroundThreshold
+                                ? parameters.foregroundThreshold
+                                : -std::numeric_limits<float>::infinity();
+
+    auto threader = MakeThreader(parameters.numberOfWorkUnits);
+
+    // One accumulator per fixed-size chunk, merged in order: the result is
+    // independent of how chunks were spread over threads.
+    const size_t                      numberOfChunks = (n + kChunkSize - 1) / kChunkSize;
+    std::vector<IntensityAccumulator> partial(numberOfChunks);
+    threader->ParallelizeArray(
+        0,
+        numberOfChunks,
+        [&](itk::SizeValueType chunk)
+        {
+            const size_t begin = chunk * kChunkSize;
+            const size_t count = std::min(kChunkSize, n - begin);
+            AddRange(buffer, maskBuffer, begin, count, stride,
+                     [&](const float * values, size_t m, const unsigned char * selected)
+                     { partial[chunk].Add(values, m, selected, threshold); });
+        },
+        nullptr);
+
+    IntensityAccumulator total;
+    for (const auto & chunk : partial)
+    {
+        total.Merge(chunk);
+    }
+    if (total.Count() == 0)
+    {
+        itkGenericExceptionMacro(<< "No voxels selected for intensity statistics");
+    }
+
+    IntensityStatistics stats;
+    stats.count   = total.Count();
+    stats.minimum = total.Minimum();
+    stats.maximum = total.Maximum();
+    stats.mean    = total.Mean();
+    stats.stddev  = std::sqrt(total.Variance());
+
+    if (parameters.statistics == NormalizationParameters::Statistics::Robust)
+    {
+        // Contiguous range per work unit; integer counts merge exactly.
+        const unsigned int numberOfRanges = std::max(1u, threader->GetNumberOfWorkUnits());
+        const size_t       rangeSize      = (n + numberOfRanges - 1) / numberOfRanges;
+        std::vector<IntensityHistogram> histograms(
+            numberOfRanges,
+            IntensityHistogram(stats.minimum, stats.maximum, parameters.numberOfHistogramBins));
+
+        threader->ParallelizeArray(
+            0,
+            numberOfRanges,
+            [&](itk::SizeValueType range)
+            {
+                const size_t begin = std::min(n, range * rangeSize);
+                const size_t count = std::min(rangeSize, n - begin);
+                AddRange(buffer, maskBuffer, begin, count, stride,
+                         [&](const float * values, size_t m, const unsigned char * selected)
+                         { histograms[range].Add(values, m, selected, threshold); });
+            },
+            nullptr);
+
+        for (unsigned int r = 1; r < numberOfRanges; ++r)
+        {
+            histograms[0].Merge(histograms[r]);
+        }
+        stats.mean   = histograms[0].Quantile(0.5);
+        stats.stddev = (histograms[0].Quantile(0.75) - histograms[0].Quantile(0.25)) / 1.349;
+    }
+
+    if (!(stats.stddev > 0.0))
+    {
+        itkGenericExceptionMacro(<< "Zero intensity spread; cannot normalize");
+    }
+    return stats;
+}
+
+template IntensityStatistics ComputeIntensityStatisticsOf(const ImageType *, const NormalizationParameters &,
+                                                          const MaskImageType *);
+template IntensityStatistics ComputeIntensityStatisticsOf(const itk::Image<short, 3> *,
+                                                          const NormalizationParameters &, const MaskImageType *);
+template IntensityStatistics ComputeIntensityStatisticsOf(const itk::Image<unsigned short, 3> *,
+                                                          const NormalizationParameters &, const MaskImageType *);
+template IntensityStatistics ComputeIntensityStatisticsOf(const itk::Image<char, 3> *,
+                                                          const NormalizationParameters &, const MaskImageType *);
+template IntensityStatistics ComputeIntensityStatisticsOf(const itk::Image<unsigned char, 3> *,
+                                                          const NormalizationParameters &, const MaskImageType *);
+
+IntensityStatistics ComputeIntensityStatistics(const ImageType * image,
+                                               const NormalizationParameters & parameters,
+                                               const MaskImageType * mask)
+{
+    return ComputeIntensityStatisticsOf(image, parameters, mask);
+}
+
+void ApplyIntensityNormalization(ImageType * image,
+                                 const IntensityStatistics & statistics,
+                                 unsigned int numberOfWorkUnits)
+{
+    float *      buffer = image->GetBufferPointer();
+    const size_t n      = image->GetBufferedRegion().GetNumberOfPixels();
+
+    const float scale  = static_cast<float>(1.0 / statistics.stddev);
+    const float offset = static_cast<float>(-statistics.mean / statistics.stddev);
+
+    const size_t numberOfChunks = (n + kChunkSize - 1) / kChunkSize;
+    MakeThreader(numberOfWorkUnits)->ParallelizeArray(
+        0,
+        numberOfChunks,
+        [=](itk::SizeValueType chunk)
+        {
+            float *      p     = buffer + chunk * kChunkSize;
+            const size_t count = std::min(kChunkSize, n - chunk * kChunkSize);
+            for (size_t i = 0; i < count; ++i)
+            {
+                p[i] = p[i] * scale + offset;
+            }
+        },
+        nullptr);
+}
+
+} // namespace tt
@@ -0,0 +1,120 @@
+//
+// Single-pass, multithreaded intensity statistics and in-place normalization.
+//
+// Statistics are gathered per contiguous chunk of the pixel buffer and
+// merged with Chan's parallel update, so the result does not depend on the
+// number of threads and partial results (e.g. streamed slabs) can be merged.
+//
+
+#ifndef TUMOURTRACKER_INTENSITY_NORMALIZATION_H
+#define TUMOURTRACKER_INTENSITY_NORMALIZATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+// Running count / mean / sum of squared deviations / range.
+class IntensityAccumulator
+{
+public:
+    // Accumulate a contiguous run of values. A voxel is counted when
+    // mask is null or mask[i] != 0, and its value is above threshold.
+    void Add(const float * values, size_t n,
+             const unsigned char * mask = nullptr,
+             float threshold = -std::numeric_limits<float>::infinity());
+
+    void Merge(const IntensityAccumulator & other);
+
+    size_t Count() const { return m_Count; }
+    double Mean() const { return m_Mean; }
+    double Variance() const { return m_Count > 0 ? m_M2 / m_Count : 0.0; } // population
+    float  Minimum() const { return m_Minimum; }
+    float  Maximum() const { return m_Maximum; }
+
+private:
+    size_t m_Count   = 0;
+    double m_Mean    = 0.0;
+    double m_M2      = 0.0;
+    float  m_Minimum = std::numeric_limits<float>::max();
+    float  m_Maximum = std::numeric_limits<float>::lowest();
+};
+
+// Fixed-range histogram for percentile-based (robust) statistics.
+class IntensityHistogram
+{
+public:
+    IntensityHistogram(double minimum, double maximum, unsigned int numberOfBins);
+
+    void Add(const float * values, size_t n,
+             const unsigned char * mask = nullptr,
+             float threshold = -std::numeric_limits<float>::infinity());
+
+    void Merge(const IntensityHistogram & other);
+
+    // Linearly interpolated value below which a fraction q of the samples fall.
+    double Quantile(double q) const;
+
+private:
+    double                m_Minimum;
+    double                m_BinWidth;
+    std::vector<uint64_t> m_Counts;
+    uint64_t              m_Total = 0;
+};
+
+struct NormalizationParameters
+{
+    enum class Statistics
+    {
+        Mean,   // (x - mean) / stddev
+        Robust  // (x - median) / (IQR / 1.349), from a histogram
+    };
+
+    Statistics   statistics             = Statistics::Mean;
+    bool         useForegroundThreshold = false; // only voxels > foregroundThreshold
+    float        foregroundThreshold    = 0.0f;
+    unsigned int numberOfHistogramBins  = 4096;
+    unsigned int statisticsStride       = 1;     // statistics over every n-th voxel (buffer order)
+    unsigned int numberOfWorkUnits      = 0;     // 0 = ITK global default
+
+    // Statistics only over the voxels inside this mask (e.g. the brain), for
+    // the resample / normalize stages; any grid, it is brought onto the one
+    // the statistics are taken on. ComputeIntensityStatistics ignores it.
+    MaskImageType::ConstPointer mask;
+};
+
+struct IntensityStatistics
+{
+    double mean    = 0.0;  // centre that was subtracted
+    double stddev  = 1.0;  // scale that was divided by
+    size_t count   = 0;    // voxels contributing to the statistics
+    float  minimum = 0.0f;
+    float  maximum = 0.0f;
+};
+
+// Statistics over the (optionally masked / thresholded) voxels of image.
+// mask must share the image's buffer layout.
+IntensityStatistics ComputeIntensityStatistics(const ImageType * image,
+                                               const NormalizationParameters & parameters,
+                                               const MaskImageType * mask = nullptr);
+
+// The same for an image kept in its stored pixel type (float, short,
+// unsigned short, char or unsigned char), converted to float run by run.
+template <typename TImage>
+IntensityStatistics ComputeIntensityStatisticsOf(const TImage * image,
+                                                 const NormalizationParameters & parameters,
+                                                 const MaskImageType * mask = nullptr);
+
+// x -> (x - mean) / stddev over every voxel, in place; may be applied slab by slab.
+void ApplyIntensityNormalization(ImageType * image,
+                                 const IntensityStatistics & statistics,
+                                 unsigned int numberOfWorkUnits = 0);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_INTENSITY_NORMALIZATION_H
@@ -0,0 +1,287 @@
+//
+// Jacobian determinant QA of a deformable registration
+//
+
+#include "jacobian.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <itkDisplacementFieldJacobianDeterminantFilter.h>
+#include <itkMacro.h>
+#include <vnl/vnl_det.h>
+
+#include "image_helpers.h"
+#include "intensity_normalization.h"
+#include "json_writer.h"
+
+namespace tt
+{
+
+namespace
+{
+
+constexpr size_t kChunkSize = 1 << 16;
+
+struct ChunkSummary
+{
+    IntensityAccumulator accumulator;
+    size_t               folded     = 0;
+    size_t               outOfRange = 0;
+};
+
+std::string PercentileName(double fraction)
+{
+    std::ostringstream name;
+    name << "p" << fraction * 100.0;
+    return name.str();
+}
+
+// Moments, range, folding, out-of-range counts and percentiles of n
+// determinants, in parallel chunks merged in order.
+JacobianStatistics SummariseDeterminants(const float * buffer, size_t n, const JacobianParameters & parameters)
+{
+    if (n == 0)
+    {
+        itkGenericExceptionMacro(<< "Empty grid for the Jacobian determinant");
+    }
+
+    auto threader = MakeThreader(parameters.numberOfWorkUnits);
+
+    const float lower = static_cast<float>(parameters.lowerBound);
+    const float upper = static_cast<float>(parameters.upperBound);
+
+    const size_t              numberOfChunks = (n + kChunkSize - 1) / kChunkSize;
+    std::vector<ChunkSummary> partial(numberOfChunks);
+    threader->ParallelizeArray(
+        0,
+        numberOfChunks,
+        [&](itk::SizeValueType chunk)
+        {
+            const float * values = buffer + chunk * kChunkSize;
+            const size_t  count  = std::min(kChunkSize, n - chunk * kChunkSize);
+
+            ChunkSummary & summary = partial[chunk];
+            summary.accumulator.Add(values, count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                summary.folded += values[i] <= 0.0f;
+                summary.outOfRange += values[i] < lower || values[i] > upper;
+            }
+        },
+        nullptr);
+
+    IntensityAccumulator total;
+    JacobianStatistics   statistics;
+    for (const auto & chunk : partial)
+    {
+        total.Merge(chunk.accumulator);
+        statistics.numberOfFoldedVoxels += chunk.folded;
+        statistics.numberOfOutOfRangeVoxels += chunk.outOfRange;
+    }
+    statistics.numberOfVoxels = total.Count();
+    statistics.minimum        = total.Minimum();
+    statistics.maximum        = total.Maximum();
+    statistics.mean           = total.Mean();
+    statistics.stddev         = std::sqrt(total.Variance());
+    statistics.lowerBound     = parameters.lowerBound;
+    statistics.upperBound     = parameters.upperBound;
+
+    // Percentiles from per-work-unit histograms over [min, max].
+    const unsigned int numberOfRanges = std::max(1u, threader->GetNumberOfWorkUnits());
+    const size_t       rangeSize      = (n + numberOfRanges - 1) / numberOfRanges;
+    std::vector<IntensityHistogram> histograms(
+        numberOfRanges,
+        IntensityHistogram(statistics.minimum, statistics.maximum, parameters.numberOfHistogramBins));
+    threader->ParallelizeArray(
+        0,
+        numberOfRanges,
+        [&](itk::SizeValueType range)
+        {
+            const size_t begin = std::min(n, range * rangeSize);
+            histograms[range].Add(buffer + begin, std::min(rangeSize, n - begin));
+        },
+        nullptr);
+    for (unsigned int r = 1; r < numberOfRanges; ++r)
+    {
+        histograms[0].Merge(histograms[r]);
+    }
+    for (double fraction : parameters.percentiles)
+    {
+        statistics.percentiles.emplace_back(fraction, histograms[0].Quantile(fraction));
+    }
+
+    return statistics;
+}
+
+} // namespace
+
+JacobianStatistics ComputeJacobianStatistics(const DisplacementFieldType * field,
+                                             const JacobianParameters & parameters)
+{
+    using JacobianFilterType = itk::DisplacementFieldJacobianDeterminantFilter<DisplacementFieldType, float, ImageType>;
+
+    auto jacobian = JacobianFilterType::New();
+    jacobian->SetInput(field);
+    jacobian->SetUseImageSpacingOn();
+    if (parameters.numberOfWorkUnits > 0)
+    {
+        jacobian->SetNumberOfWorkUnits(parameters.numberOfWorkUnits);
+    }
+    jacobian->Update();
+
+    return SummariseDeterminants(jacobian->GetOutput()->GetBufferPointer(),
+                                 jacobian->GetOutput()->GetBufferedRegion().GetNumberOfPixels(), parameters);
+}
+
+JacobianStatistics ComputeJacobianStatistics(const TransformBaseType * transform,
+                                             const ImageType * reference,
+                                             const JacobianParameters & parameters)
+{
+    const auto   region = reference->GetLargestPossibleRegion();
+    const size_t nx     = region.GetSize(0);
+    const size_t ny     = region.GetSize(1);
+    const size_t nz     = region.GetSize(2);
+    const size_t plane  = nx * ny;
+
+    auto threader = MakeThreader(parameters.numberOfWorkUnits);
+
+    // det(dT/dx) = det(dT/di) * det(di/dx), with dT/di from central
+    // differences of TransformPoint on the grid (one-sided on its faces).
+    // Each work unit takes a slab of slices and keeps three planes of
+    // mapped points, so every voxel is mapped about once and the only
+    // per-voxel storage is the determinant, kept for the percentiles.
+    const double       indexDeterminant = vnl_det(reference->GetPhysicalPointToIndexMatrix().GetVnlMatrix());
+    const auto         indexToPhysical  = reference->GetIndexToPhysicalPoint(); // for single-voxel axes
+    const unsigned int numberOfSlabs    = static_cast<unsigned int>(
+        std::max<size_t>(1, std::min<size_t>(threader->GetNumberOfWorkUnits(), nz)));
+    std::vector<float> determinants(plane * nz);
+    threader->ParallelizeArray(
+        0,
+        numberOfSlabs,
+        [&](itk::SizeValueType slab)
+        {
+            const size_t first = slab * nz / numberOfSlabs;
+            const size_t last  = (slab + 1) * nz / numberOfSlabs;
+            if (first == last)
+            {
+                return;
+            }
+
+            auto mapPlane = [&](size_t z, std::vector<PointType> & mapped)
+            {
+                mapped.resize(plane);
+                ImageType::IndexType index = region.GetIndex();
+                index[2] += static_cast<itk::IndexValueType>(z);
+                PointType * out = mapped.data();
+                for (size_t y = 0; y < ny; ++y)
+                {
+                    index[1] = region.GetIndex(1) + static_cast<itk::IndexValueType>(y);
+                    for (size_t x = 0; x < nx; ++x)
+                    {
+                        index[0] = region.GetIndex(0) + static_cast<itk::IndexValueType>(x);
+                        PointType point;
+                        reference->TransformIndexToPhysicalPoint(index, point);
+                        *out++ = transform->TransformPoint(point);
+                    }
+                }
+            };
+
+            // below / here / above hold the mapped planes zBelow, z, zAbove
+            std::vector<PointType> below;
+            std::vector<PointType> here;
+            std::vector<PointType> above;
+            mapPlane(first, here);
+            if (first > 0)
+            {
+                mapPlane(first - 1, below);
+            }
+            for (size_t z = first; z < last; ++z)
+            {
+                if (z + 1 < nz)
+                {
+                    mapPlane(z + 1, above);
+                }
+                const std::vector<PointType> & lower  = z > 0 ? below : here;
+                const std::vector<PointType> & upper  = z + 1 < nz ? above : here;
+                const double                   zSteps = double((z + 1 < nz ? z + 1 : z) - (z > 0 ? z - 1 : z));
+
+                float * out = determinants.data() + z * plane;
+                for (size_t y = 0; y < ny; ++y)
+                {
+                    const size_t yBelow = y > 0 ? y - 1 : y;
+                    const size_t yAbove = y + 1 < ny ? y + 1 : y;
+                    for (size_t x = 0; x < nx; ++x)
+                    {
+                        const size_t xBelow = x > 0 ? x - 1 : x;
+                        const size_t xAbove = x + 1 < nx ? x + 1 : x;
+                        const size_t i      = y * nx + x;
+
+                        vnl_matrix_fixed<double, 3, 3> gradient;
+                        for (unsigned int d = 0; d < 3; ++d)
+                        {
+                            gradient(d, 0) = nx > 1 ? (here[y * nx + xAbove][d] - here[y * nx + xBelow][d]) /
+                                                          double(xAbove - xBelow)
+                                                    : indexToPhysical(d, 0);
+                            gradient(d, 1) = ny > 1 ? (here[yAbove * nx + x][d] - here[yBelow * nx + x][d]) /
+                                                          double(yAbove - yBelow)
+                                                    : indexToPhysical(d, 1);
+                            gradient(d, 2) = nz > 1 ? (upper[i][d] - lower[i][d]) / zSteps : indexToPhysical(d, 2);
+                        }
+                        *out++ = static_cast<float>(vnl_det(gradient) * indexDeterminant);
+                    }
+                }
+
+                below.swap(here);
+                here.swap(above);
+            }
+        },
+        nullptr);
+
+    return SummariseDeterminants(determinants.data(), determinants.size(), parameters);
+}
+
+void PrintJacobianStatistics(const JacobianStatistics & statistics, std::ostream & os)
+{
+    os << "Jacobian determinant: min " << statistics.minimum << ", max " << statistics.maximum
+       << ", mean " << statistics.mean << " +/- " << statistics.stddev << std::endl;
+    os << "  Percentiles:";
+    for (const auto & percentile : statistics.percentiles)
+    {
+        os << " " << PercentileName(percentile.first) << "=" << percentile.second;
+    }
+    os << std::endl;
+    os << "  Folded voxels (det <= 0): " << statistics.numberOfFoldedVoxels << " of "
+       << statistics.numberOfVoxels << std::endl;
+    os << "  Outside [" << statistics.lowerBound << ", " << statistics.upperBound
+       << "]: " << 100.0 * statistics.OutOfRangeFraction() << " %" << std::endl;
+}
+
+void WriteJacobianJson(const JacobianStatistics & statistics, JsonWriter & json)
+{
+    json.BeginObject()
+        .Member("voxels", statistics.numberOfVoxels)
+        .Member("folded_voxels", statistics.numberOfFoldedVoxels)
+        .Member("folded_fraction", statistics.FoldedFraction())
+        .Member("out_of_range_voxels", statistics.numberOfOutOfRangeVoxels)
+        .Member("out_of_range_fraction", statistics.OutOfRangeFraction())
+        .Member("range_lower", statistics.lowerBound)
+        .Member("range_upper", statistics.upperBound)
+        .Member("min", statistics.minimum)
+        .Member("max", statistics.maximum)
+        .Member("mean", statistics.mean)
+        .Member("stddev", statistics.stddev);
+
+    json.Key("percentiles").BeginObject();
+    for (const auto & percentile : statistics.percentiles)
+    {
+        json.Member(PercentileName(percentile.first), percentile.second);
+    }
+    json.EndObject();
+    json.EndObject();
+}
+
+} // namespace tt
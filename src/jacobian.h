@@ -0,0 +1,76 @@
+//
+// Jacobian determinant QA of a deformable registration.
+//
+// det(J) of the fixed-to-moving mapping is computed from the in-memory
+// displacement field, or from the transform itself on the fixed grid, and
+// summarised in one parallel pass: det <= 0 marks folding, and values far
+// from 1 mark implausible local volume change.
+//
+
+#ifndef TUMOURTRACKER_JACOBIAN_H
+#define TUMOURTRACKER_JACOBIAN_H
+
+#include <cstddef>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+class JsonWriter;
+
+struct JacobianParameters
+{
+    std::vector<double> percentiles           = { 0.01, 0.05, 0.5, 0.95, 0.99 };
+    double              lowerBound            = 0.9; // expected range for brain follow-ups
+    double              upperBound            = 1.1;
+    unsigned int        numberOfHistogramBins = 4096;
+    unsigned int        numberOfWorkUnits     = 0;
+};
+
+struct JacobianStatistics
+{
+    size_t numberOfVoxels           = 0;
+    size_t numberOfFoldedVoxels     = 0; // det <= 0
+    size_t numberOfOutOfRangeVoxels = 0; // det outside [lowerBound, upperBound]
+    double minimum                  = 0.0;
+    double maximum                  = 0.0;
+    double mean                     = 0.0;
+    double stddev                   = 0.0;
+    double lowerBound               = 0.0;
+    double upperBound               = 0.0;
+
+    std::vector<std::pair<double, double>> percentiles; // (fraction, det)
+
+    double FoldedFraction() const
+    {
+        return numberOfVoxels > 0 ? double(numberOfFoldedVoxels) / numberOfVoxels : 0.0;
+    }
+    double OutOfRangeFraction() const
+    {
+        return numberOfVoxels > 0 ? double(numberOfOutOfRangeVoxels) / numberOfVoxels : 0.0;
+    }
+};
+
+JacobianStatistics ComputeJacobianStatistics(const DisplacementFieldType * field,
+                                             const JacobianParameters & parameters = JacobianParameters());
+
+// The same from central differences of transform->TransformPoint on the
+// grid of reference, slab by slab, without a dense field (4 bytes per voxel
+// instead of 24 + 4). Only TransformPoint is used, which every transform
+// implements (the B-spline has no Jacobian with respect to position).
+JacobianStatistics ComputeJacobianStatistics(const TransformBaseType * transform,
+                                             const ImageType * reference,
+                                             const JacobianParameters & parameters = JacobianParameters());
+
+void PrintJacobianStatistics(const JacobianStatistics & statistics, std::ostream & os);
+
+// {"voxels":..,"folded_voxels":..,"folded_fraction":..,"min":..,...,"percentiles":{"p1":..}}
+void WriteJacobianJson(const JacobianStatistics & statistics, JsonWriter & json);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_JACOBIAN_H
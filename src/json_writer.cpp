@@ -0,0 +1,171 @@
+//
+// Minimal streaming JSON writer for machine-readable reports
+//
+
+#include "json_writer.h"
+
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+namespace tt
+{
+
+JsonWriter::JsonWriter(std::ostream & os)
+    : m_Stream(os)
+{
+}
+
+void JsonWriter::Separate()
+{
+    if (m_AfterKey)
+    {
+        m_AfterKey = false;
+        return;
+    }
+    if (!m_First.empty())
+    {
+        if (!m_First.back())
+        {
+            m_Stream << ',';
+        }
+        m_First.back() = false;
+    }
+}
+
+JsonWriter & JsonWriter::BeginObject()
+{
+    this->Separate();
+    m_Stream << '{';
+    m_First.push_back(true);
+    return *this;
+}
+
+JsonWriter & JsonWriter::EndObject()
+{
+    m_Stream << '}';
+    m_First.pop_back();
+    return *this;
+}
+
+JsonWriter & JsonWriter::BeginArray()
+{
+    this->Separate();
+    m_Stream << '[';
+    m_First.push_back(true);
+    return *this;
+}
+
+JsonWriter & JsonWriter::EndArray()
+{
+    m_Stream << ']';
+    m_First.pop_back();
+    return *this;
+}
+
+JsonWriter & JsonWriter::Key(const std::string & name)
+{
+    this->Separate();
+    m_Stream << '"' << Escape(name) << "\":";
+    m_AfterKey = true;
+    return *this;
+}
+
+JsonWriter & JsonWriter::Value(const std::string & value)
+{
+    this->Separate();
+    m_Stream << '"' << Escape(value) << '"';
+    return *this;
+}
+
+JsonWriter & JsonWriter::Value(const char * value)
+{
+    return this->Value(std::string(value));
+}
+
+JsonWriter & JsonWriter::Value(double value)
+{
+    if (!std::isfinite(value))
+    {
+        return this->Null();
+    }
+    this->Separate();
+    const auto precision = m_Stream.precision(std::numeric_limits<double>::max_digits10);
+    m_Stream << value;
+    m_Stream.precision(precision);
+    return *this;
+}
+
+JsonWriter & JsonWriter::Value(size_t value)
+{
+    this->Separate();
+    m_Stream << value;
+    return *this;
+}
+
+JsonWriter & JsonWriter::Value(unsigned int value)
+{
+    return this->Value(static_cast<size_t>(value));
+}
+
+JsonWriter & JsonWriter::Value(int value)
+{
+    this->Separate();
+    m_Stream << value;
+    return *this;
+}
+
+JsonWriter & JsonWriter::Value(bool value)
+{
+    this->Separate();
+    m_Stream << (value ? "true" : "false");
+    return *this;
+}
+
+JsonWriter & JsonWriter::Null()
+{
+    this->Separate();
+    m_Stream << "null";
+    return *this;
+}
+
+std::string JsonWriter::Escape(const std::string & value)
+{
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (const char c : value)
+    {
+        switch (c)
+        {
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            case '\r':
+                escaped += "\\r";
+                break;
+            case '\t':
+                escaped += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char buffer[8];
+                    std::snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned int>(c));
+                    escaped += buffer;
+                }
+                else
+                {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+} // namespace tt
@@ -0,0 +1,60 @@
+//
+// Minimal streaming JSON writer for machine-readable reports
+//
+// Output is compact (one line per document) so reports can also be
+// appended as JSON lines. Commas and string escaping are handled here;
+// the caller is responsible for balancing Begin/End calls.
+//
+
+#ifndef TUMOURTRACKER_JSON_WRITER_H
+#define TUMOURTRACKER_JSON_WRITER_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace tt
+{
+
+class JsonWriter
+{
+public:
+    explicit JsonWriter(std::ostream & os);
+
+    JsonWriter & BeginObject();
+    JsonWriter & EndObject();
+    JsonWriter & BeginArray();
+    JsonWriter & EndArray();
+
+    // Name of the next member; must be followed by a value or Begin*.
+    JsonWriter & Key(const std::string & name);
+
+    JsonWriter & Value(const std::string & value);
+    JsonWriter & Value(const char * value);
+    JsonWriter & Value(double value); // non-finite values are written as null
+    JsonWriter & Value(size_t value);
+    JsonWriter & Value(unsigned int value);
+    JsonWriter & Value(int value);
+    JsonWriter & Value(bool value);
+    JsonWriter & Null();
+
+    template <typename T>
+    JsonWriter & Member(const std::string & name, const T & value)
+    {
+        return this->Key(name).Value(value);
+    }
+
+    static std::string Escape(const std::string & value);
+
+private:
+    void Separate();
+
+    std::ostream &    m_Stream;
+    std::vector<bool> m_First; // one entry per open object / array
+    bool              m_AfterKey = false;
+};
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_JSON_WRITER_H
@@ -1,81 +1,131 @@
 #include <iostream>
-#include <itkImage.h>
-#include <itkImageFileReader.h>
-#include <itkImageFileWriter.h>
-#include <itkResampleImageFilter.h>
-#include <itkIdentityTransform.h>
-#include <itkLinearInterpolateImageFunction.h>
+#include <string>
+
+#include "stages.h"
+#include "pipeline.h"
+#include "cohort.h"
+#include "warp.h"
+#include "service.h"
+#include "command_line.h"
+#include "stage_options.h"
 
 int main(int argc, char* argv[])
 {
-    if (argc < 3) {
-        std::cerr <<"Usage: " << argv[0] << " <input_nifti.nii> <output_nifti.nii" << std::endl;
-        return EXIT_FAILURE;
+    if (argc > 1 && std::string(argv[1]) == "run") {
+        return tt::RunPipelineCommand(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "batch") {
+        return tt::RunBatchCommand(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "warp") {
+        return tt::RunWarpCommand(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "serve") {
+        return tt::RunServeCommand(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "submit") {
+        return tt::RunSubmitCommand(argc - 1, argv + 1);
     }
 
-    const char* inputFile = argv[1];
-    const char* outputFile = argv[2];
+    tt::StreamingResampleOptions options;
+    std::vector<std::string> files;
+    try {
+        tt::CommandLine cmd(argc, argv);
+        files = cmd.Positional();
+        options.spacing = cmd.GetDouble("spacing", options.spacing);
+        options.memoryBudgetMB = cmd.GetDouble("memory-budget", options.memoryBudgetMB);
+        options.numberOfWorkUnits = cmd.GetUnsigned("threads", options.numberOfWorkUnits);
+        options.backend = tt::ReadComputeBackendOption(cmd);
+        options.interpolation = tt::ReadInterpolationOption(cmd);
+        options.cropForeground = tt::ReadForegroundCropOptions(cmd, options.crop);
+        options.crop.numberOfWorkUnits = options.numberOfWorkUnits;
 
-    using ImageType =itk::Image<float, 3>; //you can now write ImageType instead of itk::Image<float,3> everywhere
-    using ReaderType = itk::ImageFileReader<ImageType>;
-    ReaderType::Pointer reader = ReaderType::New();
-    reader->SetFileName(inputFile);
+        // Resample and normalize in one pass instead of normalize_intensity afterwards
+        const std::string normalize = cmd.GetString("normalize", "off");
+        if (normalize == "mean" || normalize == "robust") {
+            options.normalize = true;
+            if (normalize == "robust") {
+                options.normalization.statistics = tt::NormalizationParameters::Statistics::Robust;
+            }
+        } else if (normalize != "off") {
+            throw std::invalid_argument("unknown --normalize '" + normalize + "' (off, mean or robust)");
+        }
+        if (cmd.Has("foreground-threshold")) {
+            options.normalization.useForegroundThreshold = true;
+            options.normalization.foregroundThreshold = static_cast<float>(cmd.GetDouble("foreground-threshold", 0.0));
+        }
+        options.normalization.statisticsStride = cmd.GetUnsigned("stats-stride", options.normalization.statisticsStride);
+        const std::string normalizationMask = cmd.GetString("normalization-mask", "");
+        if (!normalizationMask.empty()) {
+            options.normalization.mask = tt::ReadMask(normalizationMask);
+        }
 
-    try {
-        reader->Update();
-    } catch (itk::ExceptionObject &error) {
-        std::cerr <<"Error reading image: " << error << std::endl;
+        const std::string type = cmd.GetString("type", "float");
+        if (type == "int16") {
+            options.outputType = tt::VoxelType::Int16;
+        } else if (type != "float") {
+            throw std::invalid_argument("unknown --type '" + type + "' (float or int16)");
+        }
+        if (options.normalize && options.outputType == tt::VoxelType::Int16) {
+            throw std::invalid_argument("--normalize needs --type float");
+        }
+    } catch (std::exception &error) {
+        std::cerr << "Error: " << error.what() << std::endl;
         return EXIT_FAILURE;
     }
-    ImageType::Pointer inputImage = reader->GetOutput();
-
-    using ResampleFilterType = itk::ResampleImageFilter<ImageType, ImageType>;
-    ResampleFilterType::Pointer resampler = ResampleFilterType::New();
 
-    using TransformType = itk::IdentityTransform<double, 3>;
-    TransformType::Pointer transform =TransformType::New();
-
-    using InterpolatorType = itk::LinearInterpolateImageFunction<ImageType, double>;
-    InterpolatorType::Pointer interpolator = InterpolatorType::New();
-
-    ImageType::SpacingType newSpacing;
-    newSpacing.Fill(1.0);
-
-    ImageType::SizeType inputSize = inputImage->GetLargestPossibleRegion().GetSize();
-    ImageType::SpacingType inputSpacing = inputImage->GetSpacing();
-    ImageType::SizeType newSize;
-    for (unsigned int i =0; i < 3; i++) {
-        newSize[i] = static_cast<unsigned int>(inputSize[i] * (inputSpacing[i] / newSpacing[i]));
+    if (files.size() < 2) {
+        std::cerr <<"Usage: " << argv[0] << " [options] <input_nifti.nii> <output_nifti.nii>" << std::endl;
+        std::cerr <<"         --spacing <mm>         isotropic spacing (default 1.0)" << std::endl;
+        std::cerr <<"         --memory-budget <MB>   stream in slabs to stay within this budget" << std::endl;
+        std::cerr <<"         --type <float|int16>   output voxel type (default float)" << std::endl;
+        std::cerr <<"         --threads <n>          work units (default: ITK default)" << std::endl;
+        std::cerr <<"         --backend <cpu|opencl|auto>  resample on an OpenCL device (default cpu)" << std::endl;
+        std::cerr <<"         --interpolation <linear|nearest|bspline|sinc>  (default linear)" << std::endl;
+        std::cerr <<"         --crop <off|on>        resample only the foreground box (reads the input whole once)" << std::endl;
+        std::cerr <<"         --crop-margin <mm>     margin kept around it (default 10)" << std::endl;
+        std::cerr <<"         --crop-threshold <t>   foreground above t (default 5% of the maximum, --crop-fraction)" << std::endl;
+        std::cerr <<"         --crop-mask <mask.nii> crop to this brain mask's box instead" << std::endl;
+        std::cerr <<"         --normalize <off|mean|robust>  write z-scored (or median/IQR) intensities in the same pass" << std::endl;
+        std::cerr <<"         --foreground-threshold <t>     normalization statistics over voxels > t" << std::endl;
+        std::cerr <<"         --stats-stride <n>     statistics over every n-th input voxel (default 1)" << std::endl;
+        std::cerr <<"         --normalization-mask <mask.nii>  statistics inside this (brain) mask only" << std::endl;
+        std::cerr <<"       " << argv[0] << " run [options] <T0.nii> <T1.nii> [<T2.nii> ...]" << std::endl;
+        std::cerr <<"       " << argv[0] << " batch [options] <manifest.csv>" << std::endl;
+        std::cerr <<"       " << argv[0] << " warp --field <field.nii.gz> <in.nii> <out.nii> [...]" << std::endl;
+        std::cerr <<"       " << argv[0] << " serve [--socket <path>] [--jobs <n>] [--numa] [options]" << std::endl;
+        std::cerr <<"       " << argv[0] << " submit [--socket <path>] <patient,T0,T1,...,out_dir | ping | stats | shutdown>" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    resampler->SetInput(inputImage);
-    resampler->SetTransform(transform);
-    resampler->SetInterpolator(interpolator);
-    resampler->SetOutputSpacing(newSpacing);
-    resampler->SetSize(newSize);
-    resampler->SetOutputOrigin(inputImage->GetOrigin());
-    resampler->SetOutputDirection(inputImage->GetDirection());
-
-    using WriterType =itk::ImageFileWriter<ImageType>;
-    WriterType::Pointer writer = WriterType::New();
-    writer->SetFileName(outputFile);
-    writer->SetInput(resampler->GetOutput());
-
+    tt::StreamingResampleResult result;
     try {
-        writer->Update();
-    } catch(itk::ExceptionObject &error) {
-        std::cerr <<"Error writing image: " << error << std::endl;
+        result = tt::ResampleIsotropicFile(files[0], files[1], options);
+    } catch (itk::ExceptionObject &error) {
+        std::cerr <<"Error resampling image: " << error << std::endl;
         return EXIT_FAILURE;
     }
+
     std::cout <<"Resampling complete!" << std::endl;
     std::cout << "New spacing: "
-              << newSpacing[0] << " "
-              << newSpacing[1] << " "
-              << newSpacing[2] << std::endl;
+              << result.spacing[0] << " "
+              << result.spacing[1] << " "
+              << result.spacing[2] << std::endl;
     std::cout << "New size: "
-              << newSize[0] << " "
-              << newSize[1] << " "
-              << newSize[2] << std::endl;
+              << result.size[0] << " "
+              << result.size[1] << " "
+              << result.size[2] << std::endl;
+    if (options.normalize) {
+        std::cout << "Normalized: centre " << result.statistics.mean << ", scale " << result.statistics.stddev
+                  << " (" << result.statistics.count << " input voxels)" << std::endl;
+    }
+    if (result.numberOfDivisions > 1) {
+        std::cout << "Streamed in " << result.numberOfDivisions << " slabs";
+        if (!result.streamedWrite) {
+            std::cout << " (output format written in one piece; use .nii/.mha/.nrrd to bound it too)";
+        }
+        std::cout << std::endl;
+    }
 
     return EXIT_SUCCESS;
 }
@@ -2,57 +2,64 @@
 // Created by Dylan Haye on 04/01/2026.
 //
 #include <iostream>
-#include <itkImage.h>
-#include <itkImageFileReader.h>
-#include <itkImageFileWriter.h>
-#include <itkImageRegionIterator.h>
-#include <cmath>
+
+#include "stages.h"
+#include "command_line.h"
 
 int main (int argc, char *argv[]){
-  if(argc < 3){
+  tt::NormalizationParameters parameters;
+  std::string maskFile;
+  std::vector<std::string> files;
+
+  try {
+    tt::CommandLine cmd(argc, argv, 1, { "robust" });
+    files = cmd.Positional();
+    maskFile = cmd.GetString("mask", "");
+    if (cmd.Has("robust")) {
+      parameters.statistics = tt::NormalizationParameters::Statistics::Robust;
+    }
+    if (cmd.Has("foreground-threshold")) {
+      parameters.useForegroundThreshold = true;
+      parameters.foregroundThreshold = static_cast<float>(cmd.GetDouble("foreground-threshold", 0.0));
+    }
+    parameters.numberOfHistogramBins = cmd.GetUnsigned("bins", parameters.numberOfHistogramBins);
+    parameters.statisticsStride = cmd.GetUnsigned("stats-stride", parameters.statisticsStride);
+    parameters.numberOfWorkUnits = cmd.GetUnsigned("threads", parameters.numberOfWorkUnits);
+  } catch (std::exception &err) {
+    std::cerr << "Error: " << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if(files.size() < 2){
     std::cerr << "Usage: " << argv[0]
-              << " <input_resampled.nii> <output_normalized.nii>"
+              << " [options] <input_resampled.nii> <output_normalized.nii>\n"
+              << "  --mask <mask.nii>           statistics over nonzero mask voxels only\n"
+              << "  --foreground-threshold <t>  statistics over voxels > t only\n"
+              << "  --robust                    median / IQR instead of mean / stddev\n"
+              << "  --bins <n>                  histogram bins for --robust (default 4096)\n"
+              << "  --stats-stride <n>          statistics over every n-th voxel (default 1)\n"
+              << "  --threads <n>               work units (default: ITK default)"
               << std::endl;
         return EXIT_FAILURE;
   }
 
-  using ImageType = itk::Image<float, 3>;
-  using ReaderType = itk::ImageFileReader<ImageType>;
-  using WriterType = itk::ImageFileWriter<ImageType>;
-
-  ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(argv[1]);
-  reader->Update();
-
-  ImageType::Pointer image = reader->GetOutput();
-
-  itk::ImageRegionIterator<ImageType> it(image, image->GetLargestPossibleRegion());
-  double sum = 0.0;
-  size_t count = 0;
-
-  for (it.GoToBegin(); !it.IsAtEnd(); ++it){
-    sum += it.Get();
-    count++;
-  }
-
-  double mean = sum / count;
-
-  double variance = 0.0;
-  for (it.GoToBegin(); !it.IsAtEnd(); ++it){
-    double diff = it.Get() - mean;
-    variance += diff * diff;
-  }
+  tt::IntensityStatistics stats;
+  try {
+    tt::ImageType::Pointer image = tt::ReadImage(files[0]);
+    tt::MaskImageType::Pointer mask;
+    if (!maskFile.empty()) {
+      mask = tt::ReadMask(maskFile);
+    }
 
-  double stddev = std::sqrt(variance / count);
+    stats = tt::NormalizeIntensity(image, parameters, mask);
 
-  for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-    it.Set((it.Get() - mean) / stddev);
+    tt::WriteImage(image, files[1]);
+  } catch (itk::ExceptionObject &err) {
+    std::cerr << "Normalization failed:\n" << err << std::endl;
+    return EXIT_FAILURE;
   }
-  WriterType::Pointer writer = WriterType::New();
-  writer->SetFileName(argv[2]);
-  writer->SetInput(image);
-  writer->Update();
 
   std::cout << "Intensity normalization complete." << std::endl;
-  std::cout << "Mean: " << mean << " StdDev: " << stddev << std::endl;
-}
\ No newline at end of file
+  std::cout << "Mean: " << stats.mean << " StdDev: " << stats.stddev << std::endl;
+  std::cout << "Voxels used: " << stats.count << std::endl;
+}
@@ -0,0 +1,1155 @@
+//
+// Optional OpenCL backend for resampling and the Mattes MI metric
+//
+
+#include "opencl_backend.h"
+
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef TT_USE_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <itkMinimumMaximumImageCalculator.h>
+#include <itkMultiThreaderBase.h>
+#endif
+
+namespace tt
+{
+
+ComputeBackend ParseComputeBackend(const std::string & name)
+{
+    if (name == "cpu")
+    {
+        return ComputeBackend::CPU;
+    }
+    if (name == "opencl")
+    {
+        return ComputeBackend::OpenCL;
+    }
+    if (name == "auto")
+    {
+        return ComputeBackend::Auto;
+    }
+    throw std::invalid_argument("unknown backend '" + name + "' (cpu, opencl or auto)");
+}
+
+const char * ComputeBackendName(ComputeBackend backend)
+{
+    switch (backend)
+    {
+        case ComputeBackend::CPU:
+            return "cpu";
+        case ComputeBackend::OpenCL:
+            return "opencl";
+        case ComputeBackend::Auto:
+            return "auto";
+    }
+    return "cpu";
+}
+
+namespace
+{
+
+// Reported once per process; later fallbacks are silent.
+void WarnFallback(const std::string & reason)
+{
+    static std::once_flag warned;
+    std::call_once(warned, [&]() { std::cerr << "OpenCL: " << reason << "; using the CPU" << std::endl; });
+}
+
+} // namespace
+
+#ifndef TT_USE_OPENCL
+
+bool IsOpenCLAvailable()
+{
+    return false;
+}
+
+std::string OpenCLDeviceName()
+{
+    return std::string();
+}
+
+bool UseOpenCL(ComputeBackend backend)
+{
+    if (backend == ComputeBackend::OpenCL)
+    {
+        WarnFallback("built without TT_USE_OPENCL");
+    }
+    return false;
+}
+
+ImageType::Pointer ResampleLinearOpenCL(const ImageType *, const TransformBaseType *, const ImageType *)
+{
+    return nullptr;
+}
+
+MattesMetricType::Pointer NewMattesMetric(ComputeBackend)
+{
+    return MattesMetricType::New();
+}
+
+#else
+
+namespace
+{
+
+// =====================================================
+// Kernels
+// =====================================================
+
+// Continuous indices follow ITK: a point is inside when it lies within half
+// a voxel of the buffer, and linear interpolation clamps neighbours to it.
+const char * const kKernelSource = R"CLC(
+inline float3 MapRows(float4 r0, float4 r1, float4 r2, float3 p)
+{
+    const float4 h = (float4)(p, 1.0f);
+    return (float3)(dot(r0, h), dot(r1, h), dot(r2, h));
+}
+
+inline int Inside(float3 c, int4 size)
+{
+    return c.x >= -0.5f && c.y >= -0.5f && c.z >= -0.5f &&
+           c.x < size.x - 0.5f && c.y < size.y - 0.5f && c.z < size.z - 0.5f;
+}
+
+inline float Trilinear(__global const float * image, int4 size, float3 c)
+{
+    const float3 base = floor(c);
+    const float3 t    = c - base;
+    const int    x0   = clamp((int)base.x, 0, size.x - 1);
+    const int    x1   = clamp((int)base.x + 1, 0, size.x - 1);
+    const size_t sx   = (size_t)size.x;
+    const size_t sxy  = sx * (size_t)size.y;
+    const size_t y0   = (size_t)clamp((int)base.y, 0, size.y - 1) * sx;
+    const size_t y1   = (size_t)clamp((int)base.y + 1, 0, size.y - 1) * sx;
+    const size_t z0   = (size_t)clamp((int)base.z, 0, size.z - 1) * sxy;
+    const size_t z1   = (size_t)clamp((int)base.z + 1, 0, size.z - 1) * sxy;
+
+    const float c00 = mix(image[z0 + y0 + x0], image[z0 + y0 + x1], t.x);
+    const float c10 = mix(image[z0 + y1 + x0], image[z0 + y1 + x1], t.x);
+    const float c01 = mix(image[z1 + y0 + x0], image[z1 + y0 + x1], t.x);
+    const float c11 = mix(image[z1 + y1 + x0], image[z1 + y1 + x1], t.x);
+    return mix(mix(c00, c10, t.y), mix(c01, c11, t.y), t.z);
+}
+
+inline float3 GridIndex(size_t n, int4 size)
+{
+    const size_t sx  = (size_t)size.x;
+    const size_t sxy = sx * (size_t)size.y;
+    return (float3)((float)(n % sx), (float)((n / sx) % (size_t)size.y), (float)(n / sxy));
+}
+
+// index -> continuous moving index in m0..m2
+__kernel void ResampleLinear(__global const float * moving, int4 movingSize,
+                             float4 m0, float4 m1, float4 m2,
+                             int4 outputSize, float defaultValue, __global float * output)
+{
+    const size_t n = get_global_id(0);
+    if (n >= (size_t)outputSize.x * outputSize.y * outputSize.z)
+    {
+        return;
+    }
+    const float3 c = MapRows(m0, m1, m2, GridIndex(n, outputSize));
+    output[n] = Inside(c, movingSize) ? Trilinear(moving, movingSize, c) : defaultValue;
+}
+
+inline float CubicBSpline(float x)
+{
+    x = fabs(x);
+    if (x < 1.0f)
+    {
+        return (4.0f - 6.0f * x * x + 3.0f * x * x * x) / 6.0f;
+    }
+    if (x < 2.0f)
+    {
+        const float t = 2.0f - x;
+        return t * t * t / 6.0f;
+    }
+    return 0.0f;
+}
+
+inline float CubicBSplineDerivative(float x)
+{
+    const float a = fabs(x);
+    if (a < 1.0f)
+    {
+        return x * (1.5f * a - 2.0f);
+    }
+    if (a < 2.0f)
+    {
+        const float t = 2.0f - a;
+        return -0.5f * t * t * sign(x);
+    }
+    return 0.0f;
+}
+
+inline void AtomicAddFloat(volatile __global uint * address, float value)
+{
+    uint expected;
+    uint desired;
+    do
+    {
+        expected = *address;
+        desired  = as_uint(as_float(expected) + value);
+    } while (atomic_cmpxchg(address, expected, desired) != expected);
+}
+
+// Virtual point of sample n relative to the metric centre: from the
+// virtual grid (v0..v2) when grid.x > 0, else from the sampled points.
+inline float3 SamplePoint(size_t n, int4 grid, float4 v0, float4 v1, float4 v2, __global const float4 * points)
+{
+    return grid.x > 0 ? MapRows(v0, v1, v2, GridIndex(n, grid)) : points[n].xyz;
+}
+
+#define SAMPLE_ARGUMENTS                                                                              \
+    __global const float4 * points, int4 grid, float4 v0, float4 v1, float4 v2,                       \
+    __global const int * fixedBins, uint count, __global const float * moving, int4 movingSize,       \
+    float4 q0, float4 q1, float4 q2, float binScale, float binOffset, int bins
+
+// Joint histogram: one fixed bin, cubic B-spline Parzen window over four
+// moving bins.
+__kernel void MattesHistogram(SAMPLE_ARGUMENTS, volatile __global uint * joint, volatile __global uint * valid)
+{
+    const size_t n = get_global_id(0);
+    if (n >= count || fixedBins[n] < 0)
+    {
+        return;
+    }
+    const float3 c = MapRows(q0, q1, q2, SamplePoint(n, grid, v0, v1, v2, points));
+    if (!Inside(c, movingSize))
+    {
+        return;
+    }
+    const float term  = Trilinear(moving, movingSize, c) * binScale - binOffset;
+    const int   index = clamp((int)floor(term), 2, bins - 3);
+
+    volatile __global uint * row = joint + fixedBins[n] * bins;
+    for (int m = index - 1; m <= index + 2; ++m)
+    {
+        AtomicAddFloat(row + m, CubicBSpline((float)m - term));
+    }
+    atomic_inc(valid);
+}
+
+// Per sample g = -sum_m logRatio(f, m) * B3'(m - term) * grad M; per work
+// group sum(g) and sum(g (x) x), i.e. everything the derivative of a
+// linear transform needs.
+__kernel void MattesDerivative(SAMPLE_ARGUMENTS, float4 g0, float4 g1, float4 g2,
+                               __global const float * logRatio, __local float * scratch,
+                               __global float * partials)
+{
+    const size_t n     = get_global_id(0);
+    const size_t local = get_local_id(0);
+    const size_t width = get_local_size(0);
+
+    float sums[12];
+    for (int k = 0; k < 12; ++k)
+    {
+        sums[k] = 0.0f;
+    }
+
+    if (n < count && fixedBins[n] >= 0)
+    {
+        const float3 x = SamplePoint(n, grid, v0, v1, v2, points);
+        const float3 c = MapRows(q0, q1, q2, x);
+        if (Inside(c, movingSize))
+        {
+            const float term  = Trilinear(moving, movingSize, c) * binScale - binOffset;
+            const int   index = clamp((int)floor(term), 2, bins - 3);
+
+            __global const float * row = logRatio + fixedBins[n] * bins;
+            float                  s   = 0.0f;
+            for (int m = index - 1; m <= index + 2; ++m)
+            {
+                s += row[m] * CubicBSplineDerivative((float)m - term);
+            }
+
+            // Central differences in index space, then to physical space.
+            const float3 dx = (float3)(1.0f, 0.0f, 0.0f);
+            const float3 dy = (float3)(0.0f, 1.0f, 0.0f);
+            const float3 dz = (float3)(0.0f, 0.0f, 1.0f);
+            const float3 gi =
+                0.5f * (float3)(Trilinear(moving, movingSize, c + dx) - Trilinear(moving, movingSize, c - dx),
+                                Trilinear(moving, movingSize, c + dy) - Trilinear(moving, movingSize, c - dy),
+                                Trilinear(moving, movingSize, c + dz) - Trilinear(moving, movingSize, c - dz));
+            const float3 g = -s * (float3)(dot(g0.xyz, gi), dot(g1.xyz, gi), dot(g2.xyz, gi));
+
+            sums[0] = g.x;
+            sums[1] = g.y;
+            sums[2] = g.z;
+            const float ga[3] = { g.x, g.y, g.z };
+            const float xa[3] = { x.x, x.y, x.z };
+            for (int i = 0; i < 3; ++i)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    sums[3 + 3 * i + k] = ga[i] * xa[k];
+                }
+            }
+        }
+    }
+
+    for (int k = 0; k < 12; ++k)
+    {
+        scratch[k * width + local] = sums[k];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (size_t stride = width / 2; stride > 0; stride >>= 1)
+    {
+        if (local < stride)
+        {
+            for (int k = 0; k < 12; ++k)
+            {
+                scratch[k * width + local] += scratch[k * width + local + stride];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (local == 0)
+    {
+        for (int k = 0; k < 12; ++k)
+        {
+            partials[get_group_id(0) * 12 + k] = scratch[k * width];
+        }
+    }
+}
+)CLC";
+
+// =====================================================
+// Device
+// =====================================================
+
+void Check(cl_int status, const char * call)
+{
+    if (status != CL_SUCCESS)
+    {
+        throw std::runtime_error(std::string(call) + " failed (error " + std::to_string(status) + ")");
+    }
+}
+
+// Device, context, queue and built program, created on first use and kept
+// for the process. The queue is shared; kernels are created per call, so
+// concurrent cases can use the device at the same time.
+class Device
+{
+public:
+    static Device & Get()
+    {
+        static Device device;
+        return device;
+    }
+
+    bool                Valid() const { return m_Program != nullptr; }
+    const std::string & Name() const { return m_Name; }
+    const std::string & Error() const { return m_Error; }
+
+    cl_context       Context() const { return m_Context; }
+    cl_command_queue Queue() const { return m_Queue; }
+    cl_program       Program() const { return m_Program; }
+
+    // Largest power of two up to 256 the device accepts as work-group size.
+    size_t WorkGroupSize() const { return m_WorkGroupSize; }
+
+private:
+    Device()
+    {
+        try
+        {
+            Open();
+        }
+        catch (std::exception & err)
+        {
+            m_Error = err.what();
+            Release();
+        }
+    }
+
+    ~Device() { Release(); }
+
+    void Open()
+    {
+        cl_uint numberOfPlatforms = 0;
+        if (clGetPlatformIDs(0, nullptr, &numberOfPlatforms) != CL_SUCCESS || numberOfPlatforms == 0)
+        {
+            throw std::runtime_error("no OpenCL platform");
+        }
+        std::vector<cl_platform_id> platforms(numberOfPlatforms);
+        Check(clGetPlatformIDs(numberOfPlatforms, platforms.data(), nullptr), "clGetPlatformIDs");
+
+        // First GPU of any platform, else the first device at all.
+        cl_device_id device = nullptr;
+        for (cl_device_type type : { cl_device_type(CL_DEVICE_TYPE_GPU), cl_device_type(CL_DEVICE_TYPE_ALL) })
+        {
+            for (cl_platform_id platform : platforms)
+            {
+                if (device == nullptr && clGetDeviceIDs(platform, type, 1, &device, nullptr) != CL_SUCCESS)
+                {
+                    device = nullptr;
+                }
+            }
+        }
+        if (device == nullptr)
+        {
+            throw std::runtime_error("no OpenCL device");
+        }
+
+        char name[256] = {};
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, nullptr);
+        m_Name = name;
+
+        size_t maximumWorkGroupSize = 1;
+        Check(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maximumWorkGroupSize),
+                              &maximumWorkGroupSize, nullptr),
+              "clGetDeviceInfo");
+        m_WorkGroupSize = 1;
+        while (m_WorkGroupSize * 2 <= std::min<size_t>(maximumWorkGroupSize, 256))
+        {
+            m_WorkGroupSize *= 2;
+        }
+
+        cl_int status = CL_SUCCESS;
+        m_Context     = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &status);
+        Check(status, "clCreateContext");
+        m_Queue = clCreateCommandQueue(m_Context, device, 0, &status);
+        Check(status, "clCreateCommandQueue");
+
+        const char * source = kKernelSource;
+        m_Program           = clCreateProgramWithSource(m_Context, 1, &source, nullptr, &status);
+        Check(status, "clCreateProgramWithSource");
+        if (clBuildProgram(m_Program, 1, &device, "", nullptr, nullptr) != CL_SUCCESS)
+        {
+            size_t logSize = 0;
+            clGetProgramBuildInfo(m_Program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+            std::string log(logSize, '\0');
+            clGetProgramBuildInfo(m_Program, device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], nullptr);
+            throw std::runtime_error("kernel build failed on " + m_Name + ":\n" + log);
+        }
+    }
+
+    void Release()
+    {
+        if (m_Program != nullptr)
+        {
+            clReleaseProgram(m_Program);
+            m_Program = nullptr;
+        }
+        if (m_Queue != nullptr)
+        {
+            clReleaseCommandQueue(m_Queue);
+            m_Queue = nullptr;
+        }
+        if (m_Context != nullptr)
+        {
+            clReleaseContext(m_Context);
+            m_Context = nullptr;
+        }
+    }
+
+    cl_context       m_Context       = nullptr;
+    cl_command_queue m_Queue         = nullptr;
+    cl_program       m_Program       = nullptr;
+    size_t           m_WorkGroupSize = 1;
+    std::string      m_Name;
+    std::string      m_Error;
+};
+
+class Buffer
+{
+public:
+    Buffer() = default;
+
+    Buffer(size_t bytes, const void * data = nullptr)
+        : m_Bytes(bytes)
+    {
+        cl_int status = CL_SUCCESS;
+        m_Memory      = clCreateBuffer(Device::Get().Context(),
+                                  data != nullptr ? CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR : CL_MEM_READ_WRITE,
+                                  std::max<size_t>(bytes, 1), const_cast<void *>(data), &status);
+        Check(status, "clCreateBuffer");
+    }
+
+    Buffer(const Buffer &) = delete;
+    Buffer & operator=(const Buffer &) = delete;
+
+    Buffer(Buffer && other) noexcept { *this = std::move(other); }
+    Buffer & operator=(Buffer && other) noexcept
+    {
+        std::swap(m_Memory, other.m_Memory);
+        std::swap(m_Bytes, other.m_Bytes);
+        return *this;
+    }
+
+    ~Buffer()
+    {
+        if (m_Memory != nullptr)
+        {
+            clReleaseMemObject(m_Memory);
+        }
+    }
+
+    const cl_mem & Get() const { return m_Memory; }
+
+    void Write(const void * data) const
+    {
+        Check(clEnqueueWriteBuffer(Device::Get().Queue(), m_Memory, CL_TRUE, 0, m_Bytes, data, 0, nullptr,
+                                   nullptr),
+              "clEnqueueWriteBuffer");
+    }
+
+    void Read(void * data) const
+    {
+        Check(clEnqueueReadBuffer(Device::Get().Queue(), m_Memory, CL_TRUE, 0, m_Bytes, data, 0, nullptr,
+                                  nullptr),
+              "clEnqueueReadBuffer");
+    }
+
+private:
+    cl_mem m_Memory = nullptr;
+    size_t m_Bytes  = 0;
+};
+
+class Kernel
+{
+public:
+    explicit Kernel(const char * name)
+    {
+        cl_int status = CL_SUCCESS;
+        m_Kernel      = clCreateKernel(Device::Get().Program(), name, &status);
+        Check(status, "clCreateKernel");
+    }
+
+    Kernel(const Kernel &) = delete;
+    Kernel & operator=(const Kernel &) = delete;
+
+    ~Kernel() { clReleaseKernel(m_Kernel); }
+
+    // Arguments in declaration order.
+    template <typename T>
+    Kernel & Argument(const T & value)
+    {
+        Check(clSetKernelArg(m_Kernel, m_NextArgument++, sizeof(T), &value), "clSetKernelArg");
+        return *this;
+    }
+
+    Kernel & LocalArgument(size_t bytes)
+    {
+        Check(clSetKernelArg(m_Kernel, m_NextArgument++, bytes, nullptr), "clSetKernelArg");
+        return *this;
+    }
+
+    void Run(size_t numberOfItems, size_t workGroupSize) const
+    {
+        const size_t global = (numberOfItems + workGroupSize - 1) / workGroupSize * workGroupSize;
+        Check(clEnqueueNDRangeKernel(Device::Get().Queue(), m_Kernel, 1, nullptr, &global, &workGroupSize, 0,
+                                     nullptr, nullptr),
+              "clEnqueueNDRangeKernel");
+    }
+
+private:
+    cl_kernel m_Kernel       = nullptr;
+    cl_uint   m_NextArgument = 0;
+};
+
+// =====================================================
+// Geometry
+// =====================================================
+
+using Matrix3 = itk::Matrix<double, 3, 3>;
+
+// index -> physical point is origin + IndexToPhysical(image) * index.
+Matrix3 IndexToPhysical(const ImageType * image)
+{
+    Matrix3 scaling;
+    scaling.SetIdentity();
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        scaling(i, i) = image->GetSpacing()[i];
+    }
+    return image->GetDirection() * scaling;
+}
+
+Matrix3 PhysicalToIndex(const ImageType * image)
+{
+    return Matrix3(IndexToPhysical(image).GetInverse());
+}
+
+// A linear transform as y = matrix * (x - centre) + offset; exact for any
+// transform that is linear, whatever its parameterization.
+struct LinearMap
+{
+    Matrix3                matrix;
+    itk::Vector<double, 3> offset;
+};
+
+LinearMap MakeLinearMap(const TransformBaseType * transform, const PointType & centre)
+{
+    LinearMap map;
+    map.matrix.SetIdentity();
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        map.offset[i] = centre[i];
+    }
+    if (transform == nullptr)
+    {
+        return map;
+    }
+
+    const PointType mappedCentre = transform->TransformPoint(centre);
+    for (unsigned int k = 0; k < 3; ++k)
+    {
+        PointType unit = centre;
+        unit[k] += 1.0;
+        const PointType mapped = transform->TransformPoint(unit);
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            map.matrix(i, k) = mapped[i] - mappedCentre[i];
+        }
+    }
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        map.offset[i] = mappedCentre[i];
+    }
+    return map;
+}
+
+// Rows of the affine map p -> matrix * p + offset, as kernel arguments.
+void SetRows(const Matrix3 & matrix, const itk::Vector<double, 3> & offset, cl_float4 rows[3])
+{
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        for (unsigned int k = 0; k < 3; ++k)
+        {
+            rows[i].s[k] = static_cast<float>(matrix(i, k));
+        }
+        rows[i].s[3] = static_cast<float>(offset[i]);
+    }
+}
+
+cl_int4 ToInt4(const ImageType::SizeType & size)
+{
+    cl_int4 result;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        result.s[i] = static_cast<cl_int>(size[i]);
+    }
+    result.s[3] = 0;
+    return result;
+}
+
+// p (relative to the centre) -> continuous moving index, through map.
+void MovingIndexRows(const ImageType * moving, const LinearMap & map, cl_float4 rows[3])
+{
+    const Matrix3 toIndex = PhysicalToIndex(moving);
+    itk::Vector<double, 3> offset;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        offset[i] = map.offset[i] - moving->GetOrigin()[i];
+    }
+    SetRows(toIndex * map.matrix, toIndex * offset, rows);
+}
+
+bool BufferIsWhole(const ImageType * image)
+{
+    return image->GetBufferedRegion() == image->GetLargestPossibleRegion() &&
+           image->GetBufferPointer() != nullptr;
+}
+
+// =====================================================
+// Mattes MI on the device
+// =====================================================
+
+// Histogram bins kept empty at either end for the Parzen window, as in ITK.
+const int kPadding = 2;
+
+class OpenCLMattesMetric : public MattesMetricType
+{
+public:
+    using Self         = OpenCLMattesMetric;
+    using Superclass   = MattesMetricType;
+    using Pointer      = itk::SmartPointer<Self>;
+    using ConstPointer = itk::SmartPointer<const Self>;
+
+    itkNewMacro(Self);
+    itkTypeMacro(OpenCLMattesMetric, MattesMutualInformationImageToImageMetricv4);
+
+    // Per level: the ITK set-up, then samples, fixed bins and the moving
+    // image are uploaded once.
+    void Initialize() override
+    {
+        Superclass::Initialize();
+        m_Samples.reset();
+        try
+        {
+            if (this->GetMovingImageMask() == nullptr && BufferIsWhole(this->GetMovingImage()))
+            {
+                m_Samples = UploadSamples();
+            }
+        }
+        catch (std::exception & err)
+        {
+            WarnFallback(err.what());
+        }
+    }
+
+    MeasureType GetValue() const override
+    {
+        MeasureType value = 0.0;
+        if (Evaluate(value, nullptr))
+        {
+            return value;
+        }
+        return Superclass::GetValue();
+    }
+
+    void GetValueAndDerivative(MeasureType & value, DerivativeType & derivative) const override
+    {
+        if (!Evaluate(value, &derivative))
+        {
+            Superclass::GetValueAndDerivative(value, derivative);
+        }
+    }
+
+protected:
+    OpenCLMattesMetric()           = default;
+    ~OpenCLMattesMetric() override = default;
+
+private:
+    // Device-side state of one level.
+    struct Samples
+    {
+        cl_uint   count = 0;
+        PointType centre;
+        bool      onGrid = false; // points generated from the virtual grid
+        cl_int4   grid;
+        cl_float4 gridRows[3];
+
+        Buffer points;
+        Buffer fixedBins;
+        Buffer moving;
+        Buffer joint;
+        Buffer valid;
+        Buffer logRatio;
+        Buffer partials;
+        size_t numberOfGroups = 0;
+
+        int   bins            = 0;
+        float movingBinScale  = 0.0f; // 1 / bin size
+        float movingBinOffset = 0.0f; // normalized minimum minus padding
+    };
+
+    struct BinMapping
+    {
+        double scale  = 1.0;
+        double offset = 0.0;
+    };
+
+    BinMapping MakeBinMapping(const ImageType * image) const
+    {
+        auto calculator = itk::MinimumMaximumImageCalculator<ImageType>::New();
+        calculator->SetImage(image);
+        calculator->SetRegion(image->GetBufferedRegion());
+        calculator->Compute();
+
+        const double minimum = calculator->GetMinimum();
+        const double range   = std::max(double(calculator->GetMaximum()) - minimum, 1e-12);
+        const double binSize = range / (static_cast<int>(this->GetNumberOfHistogramBins()) - 2 * kPadding);
+
+        BinMapping mapping;
+        mapping.scale  = 1.0 / binSize;
+        mapping.offset = minimum / binSize - kPadding;
+        return mapping;
+    }
+
+    std::unique_ptr<Samples> UploadSamples() const
+    {
+        auto samples  = std::make_unique<Samples>();
+        samples->bins = static_cast<int>(this->GetNumberOfHistogramBins());
+
+        const BinMapping fixedBins  = MakeBinMapping(this->GetFixedImage());
+        const BinMapping movingBins = MakeBinMapping(this->GetMovingImage());
+        samples->movingBinScale     = static_cast<float>(movingBins.scale);
+        samples->movingBinOffset    = static_cast<float>(movingBins.offset);
+
+        // Virtual points: the sampled point set, or every voxel of the
+        // virtual domain (generated on the device, only the bins are stored).
+        const ImageType::RegionType region = this->GetVirtualRegion();
+        std::vector<cl_float4>      points;
+        if (this->m_UseSampledPointSet)
+        {
+            const auto * pointSet = this->m_VirtualSampledPointSet.GetPointer();
+            samples->count        = static_cast<cl_uint>(pointSet->GetNumberOfPoints());
+            points.resize(samples->count);
+        }
+        else
+        {
+            samples->onGrid = true;
+            samples->count  = static_cast<cl_uint>(region.GetNumberOfPixels());
+        }
+        if (samples->count == 0)
+        {
+            return nullptr;
+        }
+
+        // Centre the points so single precision keeps sub-micron resolution.
+        const auto *                    virtualImage = this->GetVirtualImage();
+        itk::ContinuousIndex<double, 3> middle;
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            middle[i] = region.GetIndex()[i] + 0.5 * (region.GetSize()[i] - 1.0);
+        }
+        virtualImage->TransformContinuousIndexToPhysicalPoint(middle, samples->centre);
+
+        PointType regionOrigin;
+        virtualImage->TransformIndexToPhysicalPoint(region.GetIndex(), regionOrigin);
+        samples->grid = ToInt4(region.GetSize());
+        SetRows(IndexToPhysical(virtualImage), regionOrigin - samples->centre, samples->gridRows);
+
+        // Fixed bin per sample (-1 outside the fixed image or mask).
+        std::vector<cl_int> bins(samples->count, -1);
+        const auto *        fixedTransform = this->GetFixedTransform();
+        const auto *        fixedMask      = this->GetFixedImageMask();
+        const auto *        interpolator   = this->m_FixedInterpolator.GetPointer();
+        const int           lastBin        = samples->bins - kPadding - 1;
+
+        auto threader = itk::MultiThreaderBase::New();
+        if (this->GetMaximumNumberOfWorkUnits() > 0)
+        {
+            threader->SetNumberOfWorkUnits(this->GetMaximumNumberOfWorkUnits());
+        }
+        threader->ParallelizeArray(
+            0, samples->count,
+            [&](itk::SizeValueType n)
+            {
+                PointType virtualPoint;
+                if (samples->onGrid)
+                {
+                    ImageType::IndexType index = region.GetIndex();
+                    itk::SizeValueType   rest  = n;
+                    for (unsigned int i = 0; i < 3; ++i)
+                    {
+                        index[i] += static_cast<itk::IndexValueType>(rest % region.GetSize()[i]);
+                        rest /= region.GetSize()[i];
+                    }
+                    virtualImage->TransformIndexToPhysicalPoint(index, virtualPoint);
+                }
+                else
+                {
+                    virtualPoint = this->m_VirtualSampledPointSet->GetPoint(n);
+                    for (unsigned int i = 0; i < 3; ++i)
+                    {
+                        points[n].s[i] = static_cast<float>(virtualPoint[i] - samples->centre[i]);
+                    }
+                    points[n].s[3] = 0.0f;
+                }
+
+                const PointType fixedPoint = fixedTransform->TransformPoint(virtualPoint);
+                if ((fixedMask != nullptr && !fixedMask->IsInsideInWorldSpace(fixedPoint)) ||
+                    !interpolator->IsInsideBuffer(fixedPoint))
+                {
+                    return;
+                }
+                const double term = interpolator->Evaluate(fixedPoint) * fixedBins.scale - fixedBins.offset;
+                bins[n]           = std::min(std::max(static_cast<int>(std::floor(term)), kPadding), lastBin);
+            },
+            nullptr);
+
+        const Device &    device = Device::Get();
+        const ImageType * moving = this->GetMovingImage();
+        samples->points    = Buffer(std::max<size_t>(points.size(), 1) * sizeof(cl_float4),
+                                 points.empty() ? nullptr : points.data());
+        samples->fixedBins = Buffer(bins.size() * sizeof(cl_int), bins.data());
+        samples->moving    = Buffer(moving->GetBufferedRegion().GetNumberOfPixels() * sizeof(float),
+                                 moving->GetBufferPointer());
+        samples->joint     = Buffer(size_t(samples->bins) * samples->bins * sizeof(cl_uint));
+        samples->valid     = Buffer(sizeof(cl_uint));
+        samples->logRatio  = Buffer(size_t(samples->bins) * samples->bins * sizeof(cl_float));
+        samples->numberOfGroups = (samples->count + device.WorkGroupSize() - 1) / device.WorkGroupSize();
+        samples->partials       = Buffer(samples->numberOfGroups * 12 * sizeof(cl_float));
+        return samples;
+    }
+
+    void SetSampleArguments(Kernel & kernel, const cl_float4 movingRows[3]) const
+    {
+        const Samples & samples = *m_Samples;
+        cl_int4         grid    = samples.grid;
+        if (!samples.onGrid)
+        {
+            grid.s[0] = 0;
+        }
+        kernel.Argument(samples.points.Get())
+            .Argument(grid)
+            .Argument(samples.gridRows[0])
+            .Argument(samples.gridRows[1])
+            .Argument(samples.gridRows[2])
+            .Argument(samples.fixedBins.Get())
+            .Argument(samples.count)
+            .Argument(samples.moving.Get())
+            .Argument(ToInt4(this->GetMovingImage()->GetBufferedRegion().GetSize()))
+            .Argument(movingRows[0])
+            .Argument(movingRows[1])
+            .Argument(movingRows[2])
+            .Argument(samples.movingBinScale)
+            .Argument(samples.movingBinOffset)
+            .Argument(cl_int(samples.bins));
+    }
+
+    // False when this evaluation has to run on the CPU.
+    bool Evaluate(MeasureType & value, DerivativeType * derivative) const
+    {
+        const auto * transform = this->GetMovingTransform();
+        if (!m_Samples || transform == nullptr || !transform->IsLinear())
+        {
+            return false;
+        }
+
+        try
+        {
+            const Samples & samples   = *m_Samples;
+            const Device &  device    = Device::Get();
+            const LinearMap map       = MakeLinearMap(transform, samples.centre);
+            const int       bins      = samples.bins;
+            const size_t    jointSize = size_t(bins) * bins;
+
+            cl_float4 movingRows[3];
+            MovingIndexRows(this->GetMovingImage(), map, movingRows);
+
+            const std::vector<cl_uint> zeros(jointSize, 0); // 0u is 0.0f
+            samples.joint.Write(zeros.data());
+            samples.valid.Write(zeros.data());
+
+            Kernel histogram("MattesHistogram");
+            SetSampleArguments(histogram, movingRows);
+            histogram.Argument(samples.joint.Get()).Argument(samples.valid.Get());
+            histogram.Run(samples.count, device.WorkGroupSize());
+
+            std::vector<cl_float> joint(jointSize);
+            cl_uint               valid = 0;
+            samples.joint.Read(joint.data());
+            samples.valid.Read(&valid);
+            if (valid == 0)
+            {
+                return false; // the CPU path reports it
+            }
+            this->m_NumberOfValidPoints = valid;
+
+            // Normalized joint and marginal PDFs, MI and log(p(f,m) / p(m)).
+            double total = 0.0;
+            for (cl_float weight : joint)
+            {
+                total += weight;
+            }
+            std::vector<double> fixedPDF(bins, 0.0);
+            std::vector<double> movingPDF(bins, 0.0);
+            for (int f = 0; f < bins; ++f)
+            {
+                for (int m = 0; m < bins; ++m)
+                {
+                    const double p = joint[f * bins + m] / total;
+                    fixedPDF[f] += p;
+                    movingPDF[m] += p;
+                }
+            }
+
+            const double         epsilon = 1e-16;
+            double               mutualInformation = 0.0;
+            std::vector<cl_float> logRatio(jointSize, 0.0f);
+            for (int f = 0; f < bins; ++f)
+            {
+                for (int m = 0; m < bins; ++m)
+                {
+                    const double p = joint[f * bins + m] / total;
+                    if (p > epsilon && movingPDF[m] > epsilon)
+                    {
+                        mutualInformation += p * std::log(p / (fixedPDF[f] * movingPDF[m]));
+                        logRatio[f * bins + m] = static_cast<float>(std::log(p / movingPDF[m]));
+                    }
+                }
+            }
+            value         = -mutualInformation;
+            this->m_Value = value;
+
+            if (derivative == nullptr)
+            {
+                return true;
+            }
+
+            // Physical moving gradient = (index-to-physical)^-T * index gradient.
+            const Matrix3 physicalToIndex = PhysicalToIndex(this->GetMovingImage());
+            cl_float4     gradientRows[3];
+            SetRows(Matrix3(physicalToIndex.GetTranspose()), itk::Vector<double, 3>(0.0), gradientRows);
+
+            samples.logRatio.Write(logRatio.data());
+            Kernel kernel("MattesDerivative");
+            SetSampleArguments(kernel, movingRows);
+            kernel.Argument(gradientRows[0])
+                .Argument(gradientRows[1])
+                .Argument(gradientRows[2])
+                .Argument(samples.logRatio.Get())
+                .LocalArgument(12 * device.WorkGroupSize() * sizeof(cl_float))
+                .Argument(samples.partials.Get());
+            kernel.Run(samples.count, device.WorkGroupSize());
+
+            std::vector<cl_float> partials(samples.numberOfGroups * 12);
+            samples.partials.Read(partials.data());
+            double sums[12] = {};
+            for (size_t group = 0; group < samples.numberOfGroups; ++group)
+            {
+                for (int k = 0; k < 12; ++k)
+                {
+                    sums[k] += partials[group * 12 + k];
+                }
+            }
+
+            // The parameter Jacobian of a linear transform is affine in x:
+            // J(x) = J(c) + sum_k (x - c)_k (J(c + e_k) - J(c)), so the
+            // per-sample sums above give the exact total.
+            using JacobianType = MovingTransformType::JacobianType;
+            JacobianType centreJacobian;
+            transform->ComputeJacobianWithRespectToParameters(samples.centre, centreJacobian);
+            JacobianType axisJacobian[3];
+            for (unsigned int k = 0; k < 3; ++k)
+            {
+                PointType unit = samples.centre;
+                unit[k] += 1.0;
+                transform->ComputeJacobianWithRespectToParameters(unit, axisJacobian[k]);
+            }
+
+            const double normalization = 1.0 / (total / samples.movingBinScale);
+            const unsigned int numberOfParameters = this->GetNumberOfParameters();
+            derivative->SetSize(numberOfParameters);
+            for (unsigned int p = 0; p < numberOfParameters; ++p)
+            {
+                double sum = 0.0;
+                for (unsigned int i = 0; i < 3; ++i)
+                {
+                    sum += sums[i] * centreJacobian(i, p);
+                    for (unsigned int k = 0; k < 3; ++k)
+                    {
+                        sum += sums[3 + 3 * i + k] * (axisJacobian[k](i, p) - centreJacobian(i, p));
+                    }
+                }
+                (*derivative)[p] = sum * normalization;
+            }
+            return true;
+        }
+        catch (std::exception & err)
+        {
+            WarnFallback(err.what());
+            m_Samples.reset();
+            return false;
+        }
+    }
+
+    mutable std::unique_ptr<Samples> m_Samples; // null = CPU
+};
+
+} // namespace
+
+bool IsOpenCLAvailable()
+{
+    return Device::Get().Valid();
+}
+
+std::string OpenCLDeviceName()
+{
+    return Device::Get().Name();
+}
+
+bool UseOpenCL(ComputeBackend backend)
+{
+    if (backend == ComputeBackend::CPU)
+    {
+        return false;
+    }
+    if (!IsOpenCLAvailable())
+    {
+        if (backend == ComputeBackend::OpenCL)
+        {
+            WarnFallback(Device::Get().Error());
+        }
+        return false;
+    }
+    return true;
+}
+
+ImageType::Pointer ResampleLinearOpenCL(const ImageType * moving,
+                                        const TransformBaseType * transform,
+                                        const ImageType * reference)
+{
+    if (!IsOpenCLAvailable() || (transform != nullptr && !transform->IsLinear()) || !BufferIsWhole(moving))
+    {
+        return nullptr;
+    }
+
+    try
+    {
+        const ImageType::RegionType region = reference->GetLargestPossibleRegion();
+        auto output = ImageType::New();
+        output->SetRegions(region);
+        output->SetSpacing(reference->GetSpacing());
+        output->SetOrigin(reference->GetOrigin());
+        output->SetDirection(reference->GetDirection());
+        output->Allocate();
+
+        // output index -> output point -> moving point -> moving index, with the
+        // transform linearized about the output origin.
+        PointType regionOrigin;
+        output->TransformIndexToPhysicalPoint(region.GetIndex(), regionOrigin);
+        LinearMap map = MakeLinearMap(transform, regionOrigin);
+        map.matrix    = map.matrix * IndexToPhysical(output);
+
+        cl_float4 rows[3];
+        MovingIndexRows(moving, map, rows);
+
+        const Device & device = Device::Get();
+        const size_t   count  = region.GetNumberOfPixels();
+        Buffer         input(moving->GetBufferedRegion().GetNumberOfPixels() * sizeof(float),
+                     moving->GetBufferPointer());
+        Buffer         result(count * sizeof(float));
+
+        Kernel kernel("ResampleLinear");
+        kernel.Argument(input.Get())
+            .Argument(ToInt4(moving->GetBufferedRegion().GetSize()))
+            .Argument(rows[0])
+            .Argument(rows[1])
+            .Argument(rows[2])
+            .Argument(ToInt4(region.GetSize()))
+            .Argument(cl_float(0.0f))
+            .Argument(result.Get());
+        kernel.Run(count, device.WorkGroupSize());
+        result.Read(output->GetBufferPointer());
+        return output;
+    }
+    catch (std::exception & err)
+    {
+        WarnFallback(err.what());
+        return nullptr;
+    }
+}
+
+MattesMetricType::Pointer NewMattesMetric(ComputeBackend backend)
+{
+    if (UseOpenCL(backend))
+    {
+        return OpenCLMattesMetric::New().GetPointer();
+    }
+    return MattesMetricType::New();
+}
+
+#endif // TT_USE_OPENCL
+
+} // namespace tt
@@ -0,0 +1,63 @@
+//
+// Optional OpenCL backend for the per-voxel work of resampling and of the
+// Mattes MI metric.
+//
+// Built when TT_USE_OPENCL is on; every entry point falls back to the ITK
+// (CPU) implementation when the tree was built without it, no OpenCL
+// device is found or the transform is not linear (rotation, translation,
+// affine and compositions of them run on the device; B-spline and
+// displacement-field transforms do not). Interpolation is trilinear in
+// single precision, so results match the CPU path to float rounding.
+//
+
+#ifndef TUMOURTRACKER_OPENCL_BACKEND_H
+#define TUMOURTRACKER_OPENCL_BACKEND_H
+
+#include <string>
+
+#include <itkMattesMutualInformationImageToImageMetricv4.h>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+enum class ComputeBackend
+{
+    CPU,
+    OpenCL, // falls back to the CPU (with a one-time warning) when unavailable
+    Auto    // OpenCL when a device is found, silently the CPU otherwise
+};
+
+// "cpu", "opencl" or "auto"; throws std::invalid_argument otherwise.
+ComputeBackend ParseComputeBackend(const std::string & name);
+const char *   ComputeBackendName(ComputeBackend backend);
+
+// Whether an OpenCL device was found (the first GPU, else the first
+// device of any type). Probed once per process.
+bool        IsOpenCLAvailable();
+std::string OpenCLDeviceName(); // empty when unavailable
+
+// True when work requested on backend should go to the OpenCL device.
+bool UseOpenCL(ComputeBackend backend);
+
+// Trilinear resample of moving onto the grid of reference (only its
+// geometry is used) through the linear transform (null = identity).
+// Returns null when that cannot run on the device; the caller then takes
+// the CPU path.
+ImageType::Pointer ResampleLinearOpenCL(const ImageType * moving,
+                                        const TransformBaseType * transform,
+                                        const ImageType * reference);
+
+using MattesMetricType = itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType>;
+
+// Mattes MI for the registration stages. With OpenCL in use, value and
+// derivative are evaluated on the device (joint histogram with a cubic
+// B-spline Parzen window on the moving side, a single bin on the fixed
+// side, as in ITK) whenever the moving transform is linear; otherwise the
+// plain ITK metric is returned.
+MattesMetricType::Pointer NewMattesMetric(ComputeBackend backend);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_OPENCL_BACKEND_H
@@ -0,0 +1,215 @@
+//
+// Piecewise (multi-ROI) deformable registration
+//
+
+#include "piecewise_registration.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <itkImageRegionIterator.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkMultiThreaderBase.h>
+
+#include "image_helpers.h"
+
+namespace tt
+{
+
+namespace
+{
+
+using RegionType      = MaskImageType::RegionType;
+using IndexType       = MaskImageType::IndexType;
+using DistanceType    = DistanceImageType;
+using WeightImageType = itk::Image<float, 3>;
+
+// Weights below this are dropped rather than evaluating the B-spline.
+constexpr double kMinimumWeight = 1e-3;
+
+// region grown by padding (mm) on every side, clipped to the image.
+RegionType PadRegion(const itk::ImageBase<3> * image, RegionType region, double padding)
+{
+    const auto spacing = image->GetSpacing();
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        const auto margin = static_cast<itk::IndexValueType>(std::ceil(padding / spacing[d]));
+        region.SetIndex(d, region.GetIndex(d) - margin);
+        region.SetSize(d, region.GetSize(d) + 2 * static_cast<itk::SizeValueType>(margin));
+    }
+    region.Crop(image->GetLargestPossibleRegion());
+    return region;
+}
+
+// Binary mask of one label over region of the label map.
+MaskImageType::Pointer LabelMask(const MaskImageType * labels, unsigned int label, const RegionType & region)
+{
+    auto mask = MaskImageType::New();
+    mask->CopyInformation(labels);
+    mask->SetRegions(region);
+    mask->Allocate(true);
+
+    itk::ImageRegionConstIterator<MaskImageType> in(labels, region);
+    itk::ImageRegionIterator<MaskImageType>      out(mask, region);
+    for (; !in.IsAtEnd(); ++in, ++out)
+    {
+        out.Set(in.Get() == label ? 1 : 0);
+    }
+    return mask;
+}
+
+// Adds weight * displacement of one region's transform to field and the
+// weight to weights, over the fixed voxels its distance map covers.
+void AccumulateRegion(const ImageType * fixed, const DistanceType * distance, const BSplineTransformType * transform,
+                      double blendWidth, DisplacementFieldType * field, WeightImageType * weights,
+                      unsigned int numberOfWorkUnits)
+{
+    RegionType region;
+    if (!RegionCovering(fixed, RegionCorners(distance, distance->GetBufferedRegion()), 0.0, region))
+    {
+        return;
+    }
+
+    const double falloff = blendWidth > 0.0 ? -0.5 / (blendWidth * blendWidth) : 0.0;
+    MakeThreader(numberOfWorkUnits)
+        ->ParallelizeImageRegion<3>(
+            region,
+            [&](const RegionType & piece)
+            {
+                itk::ImageRegionIteratorWithIndex<DisplacementFieldType> out(field, piece);
+                itk::ImageRegionIterator<WeightImageType>                sum(weights, piece);
+                for (; !out.IsAtEnd(); ++out, ++sum)
+                {
+                    PointType point;
+                    fixed->TransformIndexToPhysicalPoint(out.GetIndex(), point);
+                    IndexType index;
+                    if (!distance->TransformPhysicalPointToIndex(point, index))
+                    {
+                        continue;
+                    }
+                    const double d      = distance->GetPixel(index);
+                    const double weight = d <= 0.0 ? 1.0 : (falloff < 0.0 ? std::exp(falloff * d * d) : 0.0);
+                    if (weight < kMinimumWeight)
+                    {
+                        continue;
+                    }
+                    out.Set(out.Get() + (transform->TransformPoint(point) - point) * weight);
+                    sum.Set(sum.Get() + static_cast<float>(weight));
+                }
+            },
+            nullptr);
+}
+
+} // namespace
+
+PiecewiseResult RegisterPiecewise(ImagePyramid & fixedPyramid, ImagePyramid & movingPyramid,
+                                  const MaskImageType * labels, TransformBaseType * initialTransform,
+                                  const PiecewiseParameters & parameters)
+{
+    std::vector<unsigned int> present;
+    const auto                boxes = LabelRegions(labels, present);
+    std::vector<unsigned int> selected;
+    for (unsigned int label : present)
+    {
+        if (parameters.labels.empty() ||
+            std::find(parameters.labels.begin(), parameters.labels.end(), label) != parameters.labels.end())
+        {
+            selected.push_back(label);
+        }
+    }
+    if (selected.empty())
+    {
+        itkGenericExceptionMacro(<< "No region labels to register in the label map");
+    }
+
+    // Regions in parallel, splitting the work units between them; the
+    // pyramids are shared, so each level is built by whichever region
+    // asks first.
+    const unsigned int workUnits = parameters.numberOfWorkUnits > 0
+                                       ? parameters.numberOfWorkUnits
+                                       : itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+    const auto         regions   = static_cast<unsigned int>(selected.size());
+    const unsigned int perRegion = std::max(1u, workUnits / regions);
+
+    PiecewiseResult result;
+    result.regions.resize(selected.size());
+    MakeThreader(std::min(regions, workUnits))
+        ->ParallelizeArray(
+            0,
+            selected.size(),
+            [&](itk::SizeValueType i)
+            {
+                const auto         start = std::chrono::steady_clock::now();
+                const unsigned int label = selected[i];
+
+                BSplineParameters bspline = parameters.bspline;
+                bspline.roiMask           = LabelMask(labels, label, boxes[label]);
+                bspline.initialTransform  = initialTransform;
+                bspline.numberOfWorkUnits = perRegion;
+                bspline.iterations        = nullptr;
+                bspline.warmStart         = nullptr;
+                bspline.report            = nullptr;
+
+                RegionResult & region = result.regions[i];
+                region.label          = label;
+                region.transform      = RegisterBSpline(fixedPyramid, movingPyramid, bspline);
+                region.seconds =
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            },
+            nullptr);
+
+    // Blend on the fixed grid. Regions are added one after another, each
+    // over its own box in parallel; far from every label the field is zero,
+    // i.e. the initial transform alone.
+    const ImageType * fixed = fixedPyramid.GetImage();
+    auto              field = DisplacementFieldType::New();
+    field->CopyInformation(fixed);
+    field->SetRegions(fixed->GetLargestPossibleRegion());
+    field->Allocate();
+    field->FillBuffer(DisplacementFieldType::PixelType(0.0));
+
+    auto weights = WeightImageType::New();
+    weights->CopyInformation(fixed);
+    weights->SetRegions(fixed->GetLargestPossibleRegion());
+    weights->Allocate(true);
+
+    for (const RegionResult & region : result.regions)
+    {
+        const RegionType      padded   = PadRegion(labels, boxes[region.label], parameters.bspline.roiPadding);
+        DistanceType::Pointer distance = SignedDistance(LabelMask(labels, region.label, padded), workUnits);
+        AccumulateRegion(fixed, distance, region.transform, parameters.blendWidth, field, weights, workUnits);
+    }
+
+    // Where regions overlap the weights add up past one
+    MakeThreader(workUnits)
+        ->ParallelizeImageRegion<3>(
+            field->GetBufferedRegion(),
+            [&](const RegionType & piece)
+            {
+                itk::ImageRegionIterator<DisplacementFieldType> out(field, piece);
+                itk::ImageRegionConstIterator<WeightImageType>  sum(weights, piece);
+                for (; !out.IsAtEnd(); ++out, ++sum)
+                {
+                    if (sum.Get() > 1.0f)
+                    {
+                        out.Set(out.Get() / static_cast<double>(sum.Get()));
+                    }
+                }
+            },
+            nullptr);
+
+    result.blended = MakeDisplacementFieldTransform(field);
+    return result;
+}
+
+void PrintPiecewiseResult(const PiecewiseResult & result, std::ostream & os)
+{
+    for (const RegionResult & region : result.regions)
+    {
+        os << "  Region " << region.label << ": " << region.transform->GetNumberOfParameters()
+           << " B-spline parameters, " << region.seconds << " s" << std::endl;
+    }
+}
+
+} // namespace tt
@@ -0,0 +1,65 @@
+//
+// Piecewise (multi-ROI) deformable registration
+//
+// Every label of a T0 label map (tumour, contralateral hemisphere,
+// ventricles, ...) gets its own B-spline in ROI mode: its control grid and
+// metric cover only the label's padded box, starting from the shared
+// whole-brain transform. All regions share the fixed / moving pyramids, so
+// each level is smoothed and shrunk once, and they run concurrently. N
+// regions then cost about one registration, not N full-volume ones.
+//
+// The region transforms are blended into one displacement field on the
+// fixed grid (polyaffine-style weighted average of the displacements):
+// inside a label its own transform, fading out over blendWidth (Gaussian
+// of the distance to the label) to the whole-brain transform alone, with
+// the weights normalized where regions meet.
+//
+
+#ifndef TUMOURTRACKER_PIECEWISE_REGISTRATION_H
+#define TUMOURTRACKER_PIECEWISE_REGISTRATION_H
+
+#include <ostream>
+#include <vector>
+
+#include "image_types.h"
+#include "pyramid.h"
+#include "stages.h"
+
+namespace tt
+{
+
+struct PiecewiseParameters
+{
+    BSplineParameters         bspline;                  // per region; roiMask is set per label
+    std::vector<unsigned int> labels;                   // empty = every label in the map
+    double                    blendWidth        = 3.0;  // mm, Gaussian fall-off outside each label
+    unsigned int              numberOfWorkUnits = 0;    // shared by all regions
+};
+
+struct RegionResult
+{
+    unsigned int                  label = 0;
+    BSplineTransformType::Pointer transform; // deformable part only; identity outside the region
+    double                        seconds = 0.0;
+};
+
+struct PiecewiseResult
+{
+    std::vector<RegionResult> regions; // ascending labels
+
+    // Blended deformable part on the fixed grid; the full mapping is
+    // ComposeTransforms(initialTransform, blended).
+    DisplacementFieldTransformType::Pointer blended;
+};
+
+// labels may be on any grid covering T0 (used in physical space); label 0
+// is background. bspline.roiPadding sets the margin of each region's box.
+PiecewiseResult RegisterPiecewise(ImagePyramid & fixed, ImagePyramid & moving, const MaskImageType * labels,
+                                  TransformBaseType * initialTransform,
+                                  const PiecewiseParameters & parameters = PiecewiseParameters());
+
+void PrintPiecewiseResult(const PiecewiseResult & result, std::ostream & os);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_PIECEWISE_REGISTRATION_H
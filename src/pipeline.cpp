@@ -0,0 +1,797 @@
+//
+// In-memory longitudinal pipeline driver (TumourTracker run)
+//
+
+#include "pipeline.h"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <itksys/SystemTools.hxx>
+
+#include "command_line.h"
+#include "json_writer.h"
+#include "stage_options.h"
+#include "volume_cache.h"
+
+namespace tt
+{
+
+namespace
+{
+
+const std::set<std::string> kKnownArtefacts = { "resampled", "normalized", "rigid", "deformed", "field",
+                                                 "transform" };
+
+// Starts the named time and memory probes on construction and stops them
+// when leaving scope; the span also goes to the telemetry, if any, labelled
+// with the case and timepoint.
+class StageProbe
+{
+public:
+    StageProbe(StageProbes & probes, const char * stage, const CaseSpec & spec, const std::string & timepoint)
+        : m_Probes(probes), m_Stage(stage), m_Span(probes.telemetry, spec.patient, timepoint, stage)
+    {
+        m_Probes.memory.Start(m_Stage);
+        m_Probes.time.Start(m_Stage);
+    }
+
+    ~StageProbe()
+    {
+        m_Probes.time.Stop(m_Stage);
+        m_Probes.memory.Stop(m_Stage);
+    }
+
+private:
+    StageProbes & m_Probes;
+    const char *  m_Stage;
+    StageSpan     m_Span;
+};
+
+// File name stem of a timepoint's outputs: its input's name, with its
+// position in the case appended when another timepoint has the same name.
+std::string OutputStem(const CaseSpec & spec, const std::string & timepoint)
+{
+    const std::string name  = itksys::SystemTools::GetFilenameWithoutExtension(timepoint);
+    const size_t      index = std::find(spec.timepoints.begin(), spec.timepoints.end(), timepoint) -
+                              spec.timepoints.begin();
+    for (size_t t = 0; t < spec.timepoints.size(); ++t)
+    {
+        if (t != index && itksys::SystemTools::GetFilenameWithoutExtension(spec.timepoints[t]) == name)
+        {
+            return name + "_t" + std::to_string(index);
+        }
+    }
+    return name;
+}
+
+std::string ArtefactPath(const CaseSpec & spec, const PipelineOptions & options,
+                         const std::string & timepoint, const std::string & artefact)
+{
+    return spec.outputDirectory + "/" + OutputStem(spec, timepoint) + "_" + artefact + options.extension;
+}
+
+// Writes in place, or queues write on the case's output writer; write must
+// keep what it writes alive. The queued write is still a "write" span in the
+// telemetry, and "write_queue" times any wait for the queue to drain.
+void WriteOutput(const CaseIO & io, StageProbes & probes, const CaseSpec & spec, const std::string & timepoint,
+                 size_t bytes, std::function<void()> write)
+{
+    if (io.outputs == nullptr)
+    {
+        StageProbe probe(probes, "write", spec, timepoint);
+        write();
+        return;
+    }
+    StageProbe probe(probes, "write_queue", spec, timepoint);
+    io.outputs->Submit(io.caseIndex, bytes,
+                       [telemetry = probes.telemetry, patient = spec.patient, timepoint, write = std::move(write)]()
+                       {
+                           StageSpan span(telemetry, patient, timepoint, "write");
+                           write();
+                       });
+}
+
+void MaybeWrite(const ImageType * image, const CaseSpec & spec, const PipelineOptions & options,
+                const std::string & timepoint, const std::string & artefact,
+                StageProbes & probes, const CaseIO & io)
+{
+    if (!options.artefacts.count(artefact))
+    {
+        return;
+    }
+    ImageType::ConstPointer output = image;
+    const std::string       path   = ArtefactPath(spec, options, timepoint, artefact);
+    WriteOutput(io, probes, spec, timepoint,
+                image->GetBufferedRegion().GetNumberOfPixels() * sizeof(ImageType::PixelType),
+                [output, path]() { WriteImage(output, path); });
+}
+
+// Everything the preprocessed volume depends on besides the input's content.
+std::string PreprocessSignature(const PipelineOptions & options, const ForegroundCropParameters & crop,
+                                const NormalizationParameters & normalization)
+{
+    std::ostringstream signature;
+    signature << std::setprecision(17) << "spacing=" << options.isotropicSpacing
+              << ";interpolation=" << InterpolationName(options.interpolation)
+              << ";statistics=" << static_cast<int>(normalization.statistics)
+              << ";threshold=" << normalization.useForegroundThreshold << ":" << normalization.foregroundThreshold
+              << ";bins=" << normalization.numberOfHistogramBins
+              << ";statistics_grid=input;stride=" << normalization.statisticsStride;
+    if (normalization.mask)
+    {
+        signature << ";statistics_mask=" << HashFile(options.normalizationMaskFile);
+    }
+    if (options.cropForeground)
+    {
+        signature << ";crop=" << crop.margin;
+        if (crop.mask)
+        {
+            signature << ":mask=" << HashFile(options.cropMaskFile);
+        }
+        else
+        {
+            signature << ":" << crop.threshold << ":" << crop.thresholdFraction;
+        }
+    }
+    return signature.str();
+}
+
+// Read + foreground crop + isotropic resample + z-score normalization of one
+// timepoint.
+// With a cache directory, an unchanged input skips all three.
+ImageType::Pointer Preprocess(const CaseSpec & spec, const PipelineOptions & options,
+                              const std::string & timepoint,
+                              StageProbes & probes, const CaseIO & io)
+{
+    // The crop and normalization masks belong to T0
+    ForegroundCropParameters crop = options.crop;
+    crop.numberOfWorkUnits        = options.numberOfWorkUnits;
+    NormalizationParameters normalization = options.normalization;
+    normalization.numberOfWorkUnits       = options.numberOfWorkUnits;
+    if (timepoint != spec.timepoints[0])
+    {
+        crop.mask          = nullptr;
+        normalization.mask = nullptr;
+    }
+
+    const VolumeCache cache(options.cacheDirectory);
+    std::string       key;
+    if (cache.IsEnabled() && !options.artefacts.count("resampled"))
+    {
+        StageProbe probe(probes, "cache", spec, timepoint);
+        key = VolumeCache::MakeKey("preprocessed", HashFile(timepoint),
+                                     PreprocessSignature(options, crop, normalization));
+        if (ImageType::Pointer cached = cache.Find(key))
+        {
+            MaybeWrite(cached, spec, options, timepoint, "normalized", probes, io);
+            return cached;
+        }
+    }
+
+    // Unless the un-normalized volume is wanted as well, normalization is
+    // folded into the resample (statistics from the input grid), so the
+    // isotropic volume is produced once. Integer inputs are resampled while
+    // still in their stored type, so reading and resampling do not separate;
+    // a prefetched timepoint was decoded in that type as well.
+    const ForegroundCropParameters * cropping = options.cropForeground ? &crop : nullptr;
+    const itk::ImageBase<3>::Pointer stored   = io.inputs ? io.inputs->Take(timepoint) : nullptr;
+    ImageType::Pointer               image;
+    if (!options.artefacts.count("resampled"))
+    {
+        StageProbe probe(probes, "read_resample_normalize", spec, timepoint);
+        image = stored ? ResampleStoredIsotropicNormalized(stored, normalization, options.isotropicSpacing,
+                                                           options.numberOfWorkUnits, options.backend, cropping,
+                                                           nullptr, options.interpolation)
+                       : ReadIsotropicNormalized(timepoint, normalization, options.isotropicSpacing,
+                                                 options.numberOfWorkUnits, options.backend, cropping, nullptr,
+                                                 options.interpolation);
+    }
+    else
+    {
+        {
+            StageProbe probe(probes, "read_resample", spec, timepoint);
+            image = stored ? ResampleStoredIsotropic(stored, options.isotropicSpacing, options.numberOfWorkUnits,
+                                                     options.backend, cropping, options.interpolation)
+                           : ReadIsotropic(timepoint, options.isotropicSpacing, options.numberOfWorkUnits,
+                                           options.backend, cropping, options.interpolation);
+        }
+        // Normalized in place next, so never queued
+        MaybeWrite(image, spec, options, timepoint, "resampled", probes, CaseIO());
+        StageProbe probe(probes, "normalize", spec, timepoint);
+        NormalizeIntensity(image, normalization);
+    }
+    MaybeWrite(image, spec, options, timepoint, "normalized", probes, io);
+    if (!key.empty())
+    {
+        StageProbe probe(probes, "cache", spec, timepoint);
+        cache.Store(key, image);
+    }
+    return image;
+}
+
+std::string TransformPath(const CaseSpec & spec, const std::string & timepoint)
+{
+    return spec.outputDirectory + "/" + OutputStem(spec, timepoint) + "_transform.h5";
+}
+
+// What a follow-up's transform was computed from: both inputs' content, the
+// preprocessing and the registration settings. Stored next to the
+// transform; a transform without a matching one is never reused.
+std::string TransformSignature(const CaseSpec & spec, const PipelineOptions & options,
+                               const std::string & timepoint)
+{
+    std::ostringstream signature;
+    signature << "fixed=" << HashFile(spec.timepoints[0]) << ";moving=" << HashFile(timepoint)
+              << ";engine=" << DeformableEngineName(options.deformable.engine)
+              << ";longitudinal=" << static_cast<int>(options.longitudinal)
+              << ";preprocess=" << PreprocessSignature(options, options.crop, options.normalization)
+              << ";options=" << options.registrationOptions;
+    return signature.str();
+}
+
+std::string SignaturePath(const std::string & transformFile)
+{
+    return transformFile + ".signature";
+}
+
+bool SignatureMatches(const std::string & transformFile, const std::string & signature)
+{
+    std::ifstream file(SignaturePath(transformFile));
+    std::string   stored;
+    return file && std::getline(file, stored) && stored == signature;
+}
+
+// Whether fileName was written after every one of the inputs was last changed.
+bool IsNewerThan(const std::string & fileName, const std::vector<std::string> & inputs)
+{
+    if (!itksys::SystemTools::FileExists(fileName))
+    {
+        return false;
+    }
+    for (const auto & input : inputs)
+    {
+        int result = 0;
+        if (!itksys::SystemTools::FileTimeCompare(fileName, input, &result) || result <= 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Splits a transform written by RunCase back into its rigid and deformable
+// parts; false when the file holds anything else.
+bool ReadCaseTransform(const std::string & fileName, RigidTransformType::Pointer & rigid,
+                       TransformBaseType::Pointer & deformable)
+{
+    TransformBaseType::Pointer transform = ReadTransform(fileName);
+    auto composite = dynamic_cast<CompositeTransformType *>(transform.GetPointer());
+    if (composite == nullptr || composite->GetNumberOfTransforms() != 2)
+    {
+        return false;
+    }
+    rigid      = dynamic_cast<RigidTransformType *>(composite->GetNthTransform(0).GetPointer());
+    deformable = composite->GetNthTransform(1);
+    return rigid.IsNotNull();
+}
+
+// second o first: T0 -> T(n-1) through first, then T(n-1) -> T(n).
+RigidTransformType::Pointer ComposeRigid(const RigidTransformType * first, const RigidTransformType * second)
+{
+    auto composed = RigidTransformType::New();
+    composed->SetCenter(first->GetCenter());
+    composed->SetMatrix(second->GetMatrix() * first->GetMatrix());
+    composed->SetOffset(second->GetMatrix() * first->GetOffset() + second->GetOffset());
+    return composed;
+}
+
+} // namespace
+
+LongitudinalMode ParseLongitudinalMode(const std::string & name)
+{
+    if (name == "off")
+    {
+        return LongitudinalMode::Off;
+    }
+    if (name == "previous")
+    {
+        return LongitudinalMode::Previous;
+    }
+    if (name == "chain")
+    {
+        return LongitudinalMode::Chain;
+    }
+    throw std::invalid_argument("unknown longitudinal mode '" + name + "' (off, previous or chain)");
+}
+
+CaseReport RunCase(const CaseSpec & spec,
+                   const PipelineOptions & options,
+                   StageProbes & probes,
+                   ImageCache * cache,
+                   const CaseIO & io)
+{
+    if (spec.timepoints.size() < 2)
+    {
+        throw std::invalid_argument("a case needs T0 and at least one follow-up timepoint");
+    }
+    itksys::SystemTools::MakeDirectory(spec.outputDirectory);
+
+    CaseReport report;
+    report.patient = spec.patient;
+    report.engine  = DeformableEngineName(options.deformable.engine);
+
+    RigidParameters rigidParameters = options.rigid;
+    rigidParameters.numberOfWorkUnits = options.numberOfWorkUnits;
+
+    ImageCache   localCache;
+    ImageCache & imageCache = cache != nullptr ? *cache : localCache;
+
+    // T0 is preprocessed once per patient. Its pyramid is shared by the rigid
+    // and deformable stages of every follow-up; levels with matching
+    // (shrink, sigma) are built only once.
+    const std::string &     fixedTimepoint = spec.timepoints[0];
+    ImageType::ConstPointer fixedImage     = imageCache.GetImage(
+        fixedTimepoint,
+        [&]() -> ImageType::ConstPointer
+        {
+            report.fixedImageCached = false;
+            return Preprocess(spec, options, fixedTimepoint, probes, io);
+        });
+    std::shared_ptr<ImagePyramid> sharedFixedPyramid =
+        imageCache.GetPyramid(fixedTimepoint, fixedImage, options.numberOfWorkUnits, options.levelStorage);
+    ImagePyramid & fixedPyramid = *sharedFixedPyramid;
+
+    // Longitudinal mode: the previous follow-up's result (and, for chain, its
+    // pyramid) warm-starts the next one.
+    const bool                         longitudinal = options.longitudinal != LongitudinalMode::Off;
+    RigidTransformType::Pointer        previousRigid;
+    BSplineTransformType::ConstPointer previousBSpline;
+    std::unique_ptr<ImagePyramid>      previousPyramid;
+
+    for (size_t t = 1; t < spec.timepoints.size(); ++t)
+    {
+        const std::string & timepoint = spec.timepoints[t];
+
+        ImageType::Pointer movingImage = Preprocess(spec, options, timepoint, probes, io);
+
+        // Both stages see the original moving image: the rigid transform is
+        // handed to the B-spline stage as a fixed initial transform, so the
+        // moving pyramid is shared and T1 is interpolated only once.
+        auto movingPyramid =
+            std::make_unique<ImagePyramid>(movingImage, options.numberOfWorkUnits, options.levelStorage);
+
+        TimepointReport timepointReport;
+        timepointReport.name = timepoint;
+
+        RigidTransformType::Pointer rigid;
+        TransformBaseType::Pointer  deformable;
+        const std::string           transformFile = TransformPath(spec, timepoint);
+        const std::string           signature =
+            options.artefacts.count("transform") ? TransformSignature(spec, options, timepoint) : std::string();
+        if (longitudinal && IsNewerThan(transformFile, { timepoint, fixedTimepoint }) &&
+            SignatureMatches(transformFile, signature))
+        {
+            StageProbe probe(probes, "read", spec, timepoint);
+            if (ReadCaseTransform(transformFile, rigid, deformable))
+            {
+                timepointReport.warmStart = "reused";
+            }
+            else
+            {
+                rigid      = nullptr;
+                deformable = nullptr;
+            }
+        }
+
+        std::unique_ptr<IterationRecorder> rigidIterations;
+        std::unique_ptr<IterationRecorder> deformableIterations;
+        if (probes.telemetry != nullptr)
+        {
+            rigidIterations = std::make_unique<IterationRecorder>(*probes.telemetry, spec.patient, timepoint, "rigid");
+            deformableIterations = std::make_unique<IterationRecorder>(*probes.telemetry, spec.patient, timepoint,
+                                                                       report.engine);
+        }
+        rigidParameters.iterations = rigidIterations.get();
+
+        bool warmStartAccepted = false;
+        if (!rigid)
+        {
+            RigidParameters parameters = rigidParameters;
+            if (longitudinal && previousRigid)
+            {
+                parameters.warmStart         = previousRigid;
+                parameters.warmStartLevels   = options.warmStartLevels;
+                parameters.warmStartAccepted = &warmStartAccepted;
+            }
+            if (options.longitudinal == LongitudinalMode::Chain && previousRigid && previousPyramid)
+            {
+                // T(n) -> T(n-1) is close to the identity, so it starts there
+                // and usually runs on the finest levels only.
+                StageProbe      probe(probes, "rigid_chain", spec, timepoint);
+                RigidParameters step   = rigidParameters;
+                step.iterations        = nullptr;
+                step.startAngleRange   = 0.0;
+                step.warmStart         = RigidTransformType::New();
+                step.warmStartLevels   = options.warmStartLevels;
+                parameters.warmStart   = ComposeRigid(previousRigid,
+                                                      RegisterRigid(*previousPyramid, *movingPyramid, step));
+            }
+
+            StageProbe probe(probes, "rigid", spec, timepoint);
+            rigid = RegisterRigid(fixedPyramid, *movingPyramid, parameters);
+            if (parameters.warmStart)
+            {
+                timepointReport.warmStart = warmStartAccepted ? "accepted" : "rejected";
+            }
+        }
+
+        if (options.artefacts.count("rigid"))
+        {
+            ImageType::Pointer rigidImage;
+            {
+                StageProbe probe(probes, "rigid_resample", spec, timepoint);
+                rigidImage = ResampleToReference(movingImage, rigid, fixedImage,
+                                                 options.numberOfWorkUnits, options.backend, options.interpolation);
+            }
+            MaybeWrite(rigidImage, spec, options, timepoint, "rigid", probes, io);
+        }
+
+        if (!deformable)
+        {
+            // The B-spline warm start is only trusted when the rigid one was.
+            DeformableParameters parameters = options.deformable;
+            if (warmStartAccepted && previousBSpline)
+            {
+                parameters.bspline.warmStart       = previousBSpline;
+                parameters.bspline.warmStartLevels = options.warmStartLevels;
+            }
+
+            StageProbe probe(probes, "deformable", spec, timepoint);
+            deformable = RegisterDeformable(fixedPyramid, *movingPyramid, parameters, rigid,
+                                            options.numberOfWorkUnits, deformableIterations.get());
+        }
+
+        // The Jacobian QA and the deformed image both work from the composite;
+        // the dense field is only built when it is written.
+        CompositeTransformType::Pointer fullTransform = ComposeTransforms(rigid, deformable);
+        if (options.artefacts.count("transform"))
+        {
+            timepointReport.transformFile = transformFile;
+            if (timepointReport.warmStart != "reused")
+            {
+                // The signature goes down after the transform, so an interrupted
+                // write leaves nothing that would be reused.
+                WriteOutput(io, probes, spec, timepoint, fullTransform->GetNumberOfParameters() * sizeof(double),
+                            [fullTransform, transformFile, signature]()
+                            {
+                                WriteTransform(fullTransform, transformFile);
+                                std::ofstream(SignaturePath(transformFile)) << signature << "\n";
+                            });
+            }
+        }
+
+        previousRigid   = rigid;
+        previousBSpline = dynamic_cast<const BSplineTransformType *>(deformable.GetPointer());
+        if (options.longitudinal == LongitudinalMode::Chain)
+        {
+            previousPyramid = std::move(movingPyramid);
+        }
+        if (options.artefacts.count("field"))
+        {
+            DisplacementFieldType::Pointer field;
+            {
+                StageProbe probe(probes, "field", spec, timepoint);
+                field = ComputeDisplacementField(fullTransform, fixedImage, options.numberOfWorkUnits);
+            }
+            const std::string    path      = ArtefactPath(spec, options, timepoint, "field");
+            const FieldPrecision precision = options.fieldPrecision;
+            WriteOutput(io, probes, spec, timepoint,
+                        field->GetBufferedRegion().GetNumberOfPixels() * sizeof(DisplacementFieldType::PixelType),
+                        [field, path, precision]() { WriteDisplacementField(field, path, precision); });
+        }
+
+        ImageType::Pointer deformedImage;
+        {
+            StageProbe probe(probes, "deformable_resample", spec, timepoint);
+            deformedImage = ResampleToReference(movingImage, fullTransform, fixedImage, options.numberOfWorkUnits,
+                                                options.backend, options.interpolation);
+        }
+        MaybeWrite(deformedImage, spec, options, timepoint, "deformed", probes, io);
+        {
+            StageProbe probe(probes, "jacobian", spec, timepoint);
+            JacobianParameters jacobianParameters;
+            jacobianParameters.numberOfWorkUnits = options.numberOfWorkUnits;
+            timepointReport.jacobian = ComputeJacobianStatistics(fullTransform, fixedImage, jacobianParameters);
+        }
+        {
+            StageProbe probe(probes, "centroid", spec, timepoint);
+            timepointReport.centroid = CentroidCheck(fixedImage, deformedImage,
+                                                     options.numberOfWorkUnits);
+        }
+        report.timepoints.push_back(timepointReport);
+    }
+
+    report.fixedPyramidLevelsBuilt  = fixedPyramid.GetNumberOfMisses();
+    report.fixedPyramidLevelsReused = fixedPyramid.GetNumberOfHits();
+    return report;
+}
+
+void StageProbes::Report(std::ostream & os) const
+{
+    time.Report(os);
+    memory.Report(os);
+}
+
+const std::set<std::string> & PipelineSwitches()
+{
+    static const std::set<std::string> switches = { "robust-normalization" };
+    return switches;
+}
+
+PipelineOptions ParsePipelineOptions(const CommandLine & cmd)
+{
+    PipelineOptions options;
+
+    std::vector<std::string> artefacts =
+        cmd.GetList("write", std::vector<std::string>(options.artefacts.begin(), options.artefacts.end()));
+    options.artefacts.clear();
+    for (const auto & artefact : artefacts)
+    {
+        if (artefact == "none")
+        {
+            continue;
+        }
+        if (!kKnownArtefacts.count(artefact))
+        {
+            throw std::invalid_argument("unknown artefact '" + artefact + "'");
+        }
+        options.artefacts.insert(artefact);
+    }
+    options.extension         = cmd.GetString("extension", options.extension);
+    options.isotropicSpacing  = cmd.GetDouble("spacing", options.isotropicSpacing);
+    options.numberOfWorkUnits = cmd.GetUnsigned("threads", options.numberOfWorkUnits);
+    options.fieldPrecision    = ReadFieldPrecisionOption(cmd);
+    options.cacheDirectory    = cmd.GetString("cache-dir", options.cacheDirectory);
+    options.telemetryFile     = cmd.GetString("telemetry", options.telemetryFile);
+    options.backend           = ReadComputeBackendOption(cmd);
+    options.interpolation     = ReadInterpolationOption(cmd);
+    options.levelStorage      = ReadLevelStorageOption(cmd);
+    options.longitudinal      = ParseLongitudinalMode(cmd.GetString("longitudinal", "off"));
+    options.warmStartLevels   = cmd.GetUnsigned("warm-levels", options.warmStartLevels);
+    if (options.longitudinal != LongitudinalMode::Off)
+    {
+        options.artefacts.insert("transform");
+    }
+
+    ParseRigidOptions(cmd, "rigid-", options.rigid);
+    options.rigid.backend = options.backend;
+    options.deformable.engine = ParseDeformableEngine(cmd.GetString("engine", "bspline"));
+    ParseBSplineOptions(cmd, "bspline-", options.deformable.bspline);
+    ParseDemonsOptions(cmd, "demons-", options.deformable.demons);
+    ParseSyNOptions(cmd, "syn-", options.deformable.syn);
+    ReadFixedMaskOption(cmd, options.rigid.sampling);
+    options.deformable.bspline.sampling.fixedMask = options.rigid.sampling.fixedMask;
+
+    // T0 is cropped to the brain mask's box unless another crop mask is given
+    options.cropForeground = ReadForegroundCropOptions(cmd, options.crop);
+    options.cropMaskFile   = cmd.GetString("crop-mask", cmd.GetString("fixed-mask", ""));
+    if (!options.crop.mask)
+    {
+        options.crop.mask = options.rigid.sampling.fixedMask;
+    }
+
+    if (cmd.Has("robust-normalization"))
+    {
+        options.normalization.statistics = NormalizationParameters::Statistics::Robust;
+    }
+    if (cmd.Has("foreground-threshold"))
+    {
+        options.normalization.useForegroundThreshold = true;
+        options.normalization.foregroundThreshold =
+            static_cast<float>(cmd.GetDouble("foreground-threshold", 0.0));
+    }
+    options.normalization.statisticsStride = cmd.GetUnsigned("stats-stride", options.normalization.statisticsStride);
+    options.normalizationMaskFile          = cmd.GetString("normalization-mask", "");
+    if (!options.normalizationMaskFile.empty())
+    {
+        options.normalization.mask = ReadMask(options.normalizationMaskFile);
+    }
+
+    options.registrationOptions =
+        cmd.Signature({ "backend", "field-type", "fixed-mask", "level-storage", "warm-levels" },
+                      { "rigid-", "bspline-", "demons-", "syn-" });
+    if (options.rigid.sampling.fixedMask)
+    {
+        const uint64_t content = HashFile(cmd.GetString("fixed-mask", ""));
+        options.registrationOptions += "fixed-mask-content=" + std::to_string(content) + ";";
+    }
+    return options;
+}
+
+void PrintPipelineOptionsUsage(std::ostream & os)
+{
+    PrintOption(os, "", "write <list>", "artefacts to write: resampled,normalized,rigid,deformed,field,transform or none");
+    PrintOption(os, "", "extension <ext>", "output file extension (default .nii.gz)");
+    PrintOption(os, "", "spacing <mm>", "isotropic spacing (default 1.0)");
+    PrintOption(os, "", "field-type <float|double>", "displacement field precision (default float)");
+    PrintOption(os, "", "cache-dir <dir>", "reuse preprocessed timepoints with unchanged inputs");
+    PrintOption(os, "", "telemetry <file>", "stage / iteration profile: .jsonl lines or .json Chrome trace");
+    PrintOption(os, "", "backend <cpu|opencl|auto>", "resampling and rigid metric on an OpenCL device (default cpu)");
+    PrintOption(os, "", "interpolation <linear|nearest|bspline|sinc>", "image resampling, all stages (default linear)");
+    PrintOption(os, "", "level-storage <float|int16>", "pyramid level type; int16 halves level memory (default float)");
+    PrintOption(os, "", "longitudinal <off|previous|chain>", "warm-start each follow-up from the one before (default off)");
+    PrintOption(os, "", "warm-levels <n>", "finest pyramid levels run from an accepted warm start (default 1)");
+    PrintOption(os, "", "foreground-threshold <t>", "normalization statistics over voxels > t");
+    PrintOption(os, "", "robust-normalization", "median / IQR normalization");
+    PrintOption(os, "", "stats-stride <n>", "normalization statistics over every n-th input voxel (default 1)");
+    PrintOption(os, "", "normalization-mask <mask.nii>", "T0 normalization statistics inside this (brain) mask only");
+    PrintOption(os, "", "fixed-mask <mask.nii>", "T0 brain mask restricting both registrations");
+    PrintForegroundCropOptionsUsage(os);
+    PrintRigidOptionsUsage(os, "rigid-");
+    PrintOption(os, "", "engine <bspline|demons|syn>", "deformable engine (default bspline)");
+    PrintBSplineOptionsUsage(os, "bspline-");
+    PrintDemonsOptionsUsage(os, "demons-");
+    PrintSyNOptionsUsage(os, "syn-");
+}
+
+void PrintCaseReport(const CaseReport & report, std::ostream & os)
+{
+    os << "Patient: " << report.patient << " (" << report.engine << ")" << std::endl;
+    os << "T0 preprocessing: " << (report.fixedImageCached ? "cache hit" : "cache miss")
+       << "; fixed pyramid levels built " << report.fixedPyramidLevelsBuilt << ", reused "
+       << report.fixedPyramidLevelsReused << std::endl;
+    if (!report.writeError.empty())
+    {
+        os << "Artefacts not written: " << report.writeError << std::endl;
+    }
+    for (const auto & timepoint : report.timepoints)
+    {
+        os << timepoint.name;
+        if (!timepoint.warmStart.empty())
+        {
+            os << " (warm start " << timepoint.warmStart << ")";
+        }
+        os << std::endl;
+        os << "  Fixed centroid:      " << timepoint.centroid.fixed << std::endl;
+        os << "  Registered centroid: " << timepoint.centroid.registered << std::endl;
+        os << "  Distance (mm): " << timepoint.centroid.distance << std::endl;
+        os << "  Foreground volume delta (mm^3): " << timepoint.centroid.volumeDelta
+           << ", bounding-box IoU: " << timepoint.centroid.boundingBoxOverlap << std::endl;
+        os << "  ";
+        PrintJacobianStatistics(timepoint.jacobian, os);
+    }
+}
+
+void WriteCaseReportJson(const CaseReport & report, std::ostream & os)
+{
+    JsonWriter json(os);
+    WriteCaseReportJson(report, json);
+    os << std::endl;
+}
+
+void WriteCaseReportJson(const CaseReport & report, JsonWriter & json)
+{
+    json.BeginObject()
+        .Member("patient", report.patient)
+        .Member("engine", report.engine)
+        .Member("fixed_image_cached", report.fixedImageCached)
+        .Member("fixed_pyramid_levels_built", report.fixedPyramidLevelsBuilt)
+        .Member("fixed_pyramid_levels_reused", report.fixedPyramidLevelsReused);
+    if (!report.writeError.empty())
+    {
+        json.Member("write_error", report.writeError);
+    }
+    json.Key("timepoints").BeginArray();
+    for (const auto & timepoint : report.timepoints)
+    {
+        json.BeginObject().Member("name", timepoint.name);
+        if (!timepoint.transformFile.empty())
+        {
+            json.Member("transform", timepoint.transformFile);
+        }
+        if (!timepoint.warmStart.empty())
+        {
+            json.Member("warm_start", timepoint.warmStart);
+        }
+
+        json.Key("centroid")
+            .BeginObject()
+            .Key("fixed").BeginArray();
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            json.Value(timepoint.centroid.fixed[i]);
+        }
+        json.EndArray().Key("registered").BeginArray();
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            json.Value(timepoint.centroid.registered[i]);
+        }
+        json.EndArray()
+            .Member("distance_mm", timepoint.centroid.distance)
+            .Member("fixed_volume_mm3", timepoint.centroid.fixedForeground.volume)
+            .Member("registered_volume_mm3", timepoint.centroid.registeredForeground.volume)
+            .Member("volume_delta_mm3", timepoint.centroid.volumeDelta)
+            .Member("bounding_box_iou", timepoint.centroid.boundingBoxOverlap)
+            .EndObject();
+
+        json.Key("jacobian");
+        WriteJacobianJson(timepoint.jacobian, json);
+        json.EndObject();
+    }
+    json.EndArray().EndObject();
+}
+
+int RunPipelineCommand(int argc, char * argv[])
+{
+    CaseSpec        spec;
+    PipelineOptions options;
+
+    try
+    {
+        CommandLine cmd(argc, argv, 1, PipelineSwitches());
+        spec.timepoints      = cmd.Positional();
+        spec.outputDirectory = cmd.GetString("output-dir", spec.outputDirectory);
+        spec.patient         = cmd.GetString("patient", "case");
+        options              = ParsePipelineOptions(cmd);
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (spec.timepoints.size() < 2)
+    {
+        std::cerr << "Usage: TumourTracker run [options] <T0.nii> <T1.nii> [<T2.nii> ...]\n";
+        PrintOption(std::cerr, "", "output-dir <dir>", "where artefacts are written (default .)");
+        PrintOption(std::cerr, "", "patient <id>", "label used in the report");
+        PrintOption(std::cerr, "", "threads <n>", "ITK work units per stage (default: ITK default)");
+        PrintPipelineOptionsUsage(std::cerr);
+        return EXIT_FAILURE;
+    }
+
+    Telemetry   telemetry;
+    StageProbes probes;
+    if (!options.telemetryFile.empty())
+    {
+        probes.telemetry = &telemetry;
+    }
+
+    CaseReport report;
+    try
+    {
+        report = RunCase(spec, options, probes);
+        if (probes.telemetry != nullptr)
+        {
+            telemetry.Write(options.telemetryFile);
+        }
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "Pipeline failed:\n" << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Pipeline failed: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    PrintCaseReport(report, std::cout);
+    std::ofstream jsonReport(spec.outputDirectory + "/report.json");
+    WriteCaseReportJson(report, jsonReport);
+
+    std::cout << "\nPer-stage wall time and memory:" << std::endl;
+    probes.Report(std::cout);
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace tt
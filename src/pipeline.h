@@ -0,0 +1,162 @@
+//
+// In-memory longitudinal pipeline driver (TumourTracker run)
+//
+// Chains resample -> normalize -> rigid -> deformable -> Jacobian and
+// centroid QA for every follow-up timepoint against T0 without
+// intermediate files.
+//
+
+#ifndef TUMOURTRACKER_PIPELINE_H
+#define TUMOURTRACKER_PIPELINE_H
+
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <itkMemoryProbesCollectorBase.h>
+#include <itkTimeProbesCollectorBase.h>
+
+#include "case_io.h"
+#include "deformable_engines.h"
+#include "image_cache.h"
+#include "jacobian.h"
+#include "stages.h"
+#include "telemetry.h"
+
+namespace tt
+{
+
+struct CaseSpec
+{
+    std::string              patient;
+    std::vector<std::string> timepoints;      // T0 (fixed) first, then follow-ups
+    std::string              outputDirectory = ".";
+};
+
+// How a follow-up uses the result of the one before it.
+enum class LongitudinalMode
+{
+    Off,      // every follow-up registered to T0 from scratch
+    Previous, // warm start from T(n-1) -> T0
+    Chain     // warm start from (T(n-1) -> T0) composed with a rigid T(n) -> T(n-1)
+};
+
+// "off", "previous" or "chain"; throws std::invalid_argument otherwise.
+LongitudinalMode ParseLongitudinalMode(const std::string & name);
+
+struct PipelineOptions
+{
+    // Artefacts written to disk: resampled, normalized, rigid, deformed,
+    // field (T1-to-T0 displacement field for TumourTracker warp), transform
+    // (rigid + deformable composite, <timepoint>_transform.h5). Timepoints of
+    // a case whose file names coincide (ses-01/T1c, ses-02/T1c) are told
+    // apart by their position: T1c_t1_deformed, T1c_t2_deformed.
+    std::set<std::string> artefacts = { "deformed" };
+    std::string           extension = ".nii.gz";
+    FieldPrecision        fieldPrecision = FieldPrecision::Float;
+
+    // Content-keyed cache of preprocessed timepoints (raw .ttv volumes);
+    // empty = disabled.
+    std::string cacheDirectory;
+
+    // Stage and iteration telemetry: .jsonl for JSON lines, .json for a
+    // Chrome trace; empty = not recorded.
+    std::string telemetryFile;
+
+    double       isotropicSpacing  = 1.0;
+    unsigned int numberOfWorkUnits = 0; // ITK work units per stage (0 = ITK default)
+    ComputeBackend backend         = ComputeBackend::CPU; // resampling; rigid.backend for the metric
+    Interpolation  interpolation   = Interpolation::Linear; // preprocess, rigid and deformed resampling
+    LevelStorage   levelStorage    = LevelStorage::Float; // pyramid levels of T0 and the follow-ups
+
+    // Every timepoint is cropped to its foreground box before resampling;
+    // T0 to the box of crop.mask when one is given (cropMaskFile keys the
+    // preprocessing cache), the follow-ups by threshold.
+    bool                     cropForeground = false;
+    ForegroundCropParameters crop;
+    std::string              cropMaskFile;
+
+    // Longitudinal mode writes every transform and warm-starts each
+    // follow-up from the previous one. A follow-up whose transform file is
+    // newer than both its input and T0, and whose .signature file next to it
+    // matches the inputs' content and the registration settings, is not
+    // registered again.
+    LongitudinalMode longitudinal    = LongitudinalMode::Off;
+    unsigned int     warmStartLevels = 1; // finest levels run from an accepted warm start
+
+    // Registration-related options as given (CommandLine::Signature), part of
+    // the transform signature; filled in by ParsePipelineOptions.
+    std::string registrationOptions;
+
+    // normalization.mask restricts T0's statistics (normalizationMaskFile
+    // keys the preprocessing cache); the follow-ups are not masked.
+    NormalizationParameters normalization;
+    std::string             normalizationMaskFile;
+    RigidParameters         rigid;
+    DeformableParameters    deformable;
+};
+
+struct TimepointReport
+{
+    std::string        name;
+    std::string        transformFile; // when the "transform" artefact is written
+    std::string        warmStart;     // longitudinal: reused, accepted or rejected (empty = cold start)
+    CentroidResult     centroid;
+    JacobianStatistics jacobian;
+};
+
+struct CaseReport
+{
+    std::string                  patient;
+    std::string                  engine; // deformable engine that produced the fields
+    std::vector<TimepointReport> timepoints;
+
+    bool   fixedImageCached         = true; // preprocessed T0 taken from the cache
+    size_t fixedPyramidLevelsBuilt  = 0;    // of the (possibly shared) T0 pyramid so far
+    size_t fixedPyramidLevelsReused = 0;
+
+    std::string writeError; // batch: first artefact the background writer failed on
+};
+
+// Per-stage wall time and memory growth of one case. With telemetry set,
+// every stage and registration iteration is recorded there as well.
+struct StageProbes
+{
+    itk::TimeProbesCollectorBase   time;
+    itk::MemoryProbesCollectorBase memory;
+    Telemetry *                    telemetry = nullptr; // not owned
+
+    void Report(std::ostream & os) const;
+};
+
+// Runs one case; per-stage wall time and memory are accumulated into
+// probes. T0 and its pyramid come from cache when given (shared by the
+// cases of one patient), otherwise from a cache local to this call. With
+// io.inputs, timepoints decoded ahead are taken from there; with
+// io.outputs, artefacts are queued there and may still be being written
+// on return (io.outputs->Wait(io.caseIndex)).
+CaseReport RunCase(const CaseSpec & spec,
+                   const PipelineOptions & options,
+                   StageProbes & probes,
+                   ImageCache * cache = nullptr,
+                   const CaseIO & io = CaseIO());
+
+class CommandLine;
+class JsonWriter;
+
+// Options shared by "run" and "batch" (--write, --extension, --spacing, --threads, ...).
+// Valueless options understood by ParsePipelineOptions.
+const std::set<std::string> & PipelineSwitches();
+PipelineOptions ParsePipelineOptions(const CommandLine & cmd);
+void            PrintPipelineOptionsUsage(std::ostream & os);
+void            PrintCaseReport(const CaseReport & report, std::ostream & os);
+void            WriteCaseReportJson(const CaseReport & report, std::ostream & os); // one line
+void            WriteCaseReportJson(const CaseReport & report, JsonWriter & json); // as one value
+
+// Entry point for "TumourTracker run ..." (argv[0] is "run").
+int RunPipelineCommand(int argc, char * argv[]);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_PIPELINE_H
@@ -0,0 +1,225 @@
+//
+// Gaussian image pyramids shared between registration stages
+//
+
+#include "pyramid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <itkDiscreteGaussianImageFilter.h>
+#include <itkMinimumMaximumImageCalculator.h>
+#include <itkShrinkImageFilter.h>
+#include <itkUnaryGeneratorImageFilter.h>
+
+namespace tt
+{
+
+PyramidSchedule MakePyramidSchedule(const std::vector<unsigned int> & shrinkFactors,
+                                    const std::vector<double> & smoothingSigmas)
+{
+    if (shrinkFactors.empty() || shrinkFactors.size() != smoothingSigmas.size())
+    {
+        throw std::invalid_argument("shrink factors and smoothing sigmas need one value per level");
+    }
+    for (size_t level = 0; level < shrinkFactors.size(); ++level)
+    {
+        if (shrinkFactors[level] == 0 || smoothingSigmas[level] < 0.0)
+        {
+            throw std::invalid_argument("shrink factors must be >= 1 and smoothing sigmas >= 0");
+        }
+    }
+
+    PyramidSchedule schedule;
+    schedule.shrinkFactors   = shrinkFactors;
+    schedule.smoothingSigmas = smoothingSigmas;
+    return schedule;
+}
+
+LevelStorage ParseLevelStorage(const std::string & name)
+{
+    if (name == "float")
+    {
+        return LevelStorage::Float;
+    }
+    if (name == "int16")
+    {
+        return LevelStorage::Int16;
+    }
+    throw std::invalid_argument("unknown level storage '" + name + "' (float or int16)");
+}
+
+ImagePyramid::ImagePyramid(const ImageType * image, unsigned int numberOfWorkUnits, LevelStorage storage)
+    : m_Image(image), m_NumberOfWorkUnits(numberOfWorkUnits), m_Storage(storage)
+{
+}
+
+ImageType::ConstPointer ImagePyramid::BuildLevel(unsigned int shrinkFactor, double sigma) const
+{
+    ImageType::ConstPointer level = m_Image;
+
+    if (sigma > 0.0)
+    {
+        // Same smoothing as ImageRegistrationMethodv4 (sigma in physical units)
+        using SmoothingFilterType = itk::DiscreteGaussianImageFilter<ImageType, ImageType>;
+        auto smoother = SmoothingFilterType::New();
+        smoother->SetInput(level);
+        smoother->SetUseImageSpacingOn();
+        smoother->SetVariance(sigma * sigma);
+        smoother->SetMaximumError(0.01);
+        if (m_NumberOfWorkUnits > 0)
+        {
+            smoother->SetNumberOfWorkUnits(m_NumberOfWorkUnits);
+        }
+        smoother->Update();
+
+        ImageType::Pointer smoothed = smoother->GetOutput();
+        smoothed->DisconnectPipeline();
+        level = smoothed;
+    }
+
+    if (shrinkFactor > 1)
+    {
+        using ShrinkFilterType = itk::ShrinkImageFilter<ImageType, ImageType>;
+        auto shrinker = ShrinkFilterType::New();
+        shrinker->SetInput(level);
+        shrinker->SetShrinkFactors(shrinkFactor);
+        if (m_NumberOfWorkUnits > 0)
+        {
+            shrinker->SetNumberOfWorkUnits(m_NumberOfWorkUnits);
+        }
+        shrinker->Update();
+
+        ImageType::Pointer shrunk = shrinker->GetOutput();
+        shrunk->DisconnectPipeline();
+        level = shrunk;
+    }
+
+    return level;
+}
+
+ImageType::ConstPointer ImagePyramid::GetLevel(unsigned int shrinkFactor, double sigma)
+{
+    if (shrinkFactor <= 1 && sigma <= 0.0)
+    {
+        return m_Image;
+    }
+
+    if (m_Storage == LevelStorage::Int16)
+    {
+        const CompactLevel compact = FindOrBuildCompactLevel(shrinkFactor, sigma);
+
+        auto expand = itk::UnaryGeneratorImageFilter<CompactImageType, ImageType>::New();
+        expand->SetInput(compact.image);
+        const float inverseScale = static_cast<float>(1.0 / compact.scale);
+        expand->SetFunctor([inverseScale](const short & value) -> float { return value * inverseScale; });
+        if (m_NumberOfWorkUnits > 0)
+        {
+            expand->SetNumberOfWorkUnits(m_NumberOfWorkUnits);
+        }
+        expand->Update();
+
+        ImageType::Pointer expanded = expand->GetOutput();
+        expanded->DisconnectPipeline();
+        return expanded;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    const LevelKey key(shrinkFactor, sigma);
+    auto           it = m_Levels.find(key);
+    if (it != m_Levels.end())
+    {
+        ++m_Hits;
+        return it->second;
+    }
+    ++m_Misses;
+
+    ImageType::ConstPointer level = BuildLevel(shrinkFactor, sigma);
+    m_Levels[key] = level;
+    return level;
+}
+
+CompactImageType::ConstPointer ImagePyramid::GetCompactLevel(unsigned int shrinkFactor, double sigma)
+{
+    return FindOrBuildCompactLevel(shrinkFactor, sigma).image;
+}
+
+ImagePyramid::CompactLevel ImagePyramid::FindOrBuildCompactLevel(unsigned int shrinkFactor, double sigma)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    const LevelKey key(shrinkFactor, sigma);
+    auto           it = m_CompactLevels.find(key);
+    if (it != m_CompactLevels.end())
+    {
+        ++m_Hits;
+        return it->second;
+    }
+    ++m_Misses;
+
+    // From the cached float level when there is one, else built here and
+    // dropped once quantized.
+    ImageType::ConstPointer level;
+    if (shrinkFactor <= 1 && sigma <= 0.0)
+    {
+        level = m_Image;
+    }
+    else
+    {
+        auto cached = m_Levels.find(key);
+        level       = cached != m_Levels.end() ? cached->second : BuildLevel(shrinkFactor, sigma);
+    }
+
+    auto range = itk::MinimumMaximumImageCalculator<ImageType>::New();
+    range->SetImage(level);
+    range->Compute();
+    const double largest =
+        std::max(std::fabs(double(range->GetMinimum())), std::fabs(double(range->GetMaximum())));
+
+    CompactLevel compact;
+    compact.scale = largest > 0.0 ? 32767.0 / largest : 1.0;
+
+    auto quantize = itk::UnaryGeneratorImageFilter<ImageType, CompactImageType>::New();
+    quantize->SetInput(level);
+    const double scale = compact.scale;
+    quantize->SetFunctor(
+        [scale](const float & value) -> short
+        {
+            const double scaled = std::min(std::max(value * scale, -32767.0), 32767.0);
+            return static_cast<short>(std::lround(scaled));
+        });
+    if (m_NumberOfWorkUnits > 0)
+    {
+        quantize->SetNumberOfWorkUnits(m_NumberOfWorkUnits);
+    }
+    quantize->Update();
+
+    CompactImageType::Pointer quantized = quantize->GetOutput();
+    quantized->DisconnectPipeline();
+    compact.image = quantized;
+
+    m_CompactLevels[key] = compact;
+    return compact;
+}
+
+size_t ImagePyramid::GetNumberOfCachedLevels() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Levels.size() + m_CompactLevels.size();
+}
+
+size_t ImagePyramid::GetNumberOfHits() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Hits;
+}
+
+size_t ImagePyramid::GetNumberOfMisses() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Misses;
+}
+
+} // namespace tt
@@ -0,0 +1,98 @@
+//
+// Gaussian image pyramids shared between registration stages.
+//
+// A level is the image smoothed with sigma (mm) and shrunk by an integer
+// factor. Levels are built on first use and cached, so the fixed image's
+// pyramid is computed once and reused by the rigid and deformable stages.
+//
+// With LevelStorage::Int16 the smoothed levels are kept as int16 scaled to
+// each level's range instead of float: half the memory at rest, and the
+// Mattes MI stages register on them directly (MI does not depend on the
+// intensity scale, only on the quantization, which is ~1/32767 of the range).
+//
+
+#ifndef TUMOURTRACKER_PYRAMID_H
+#define TUMOURTRACKER_PYRAMID_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+struct PyramidSchedule
+{
+    std::vector<unsigned int> shrinkFactors;   // coarse to fine
+    std::vector<double>       smoothingSigmas; // physical units (mm)
+
+    unsigned int GetNumberOfLevels() const { return static_cast<unsigned int>(shrinkFactors.size()); }
+};
+
+// Validated schedule, e.g. from "--shrink-factors 4,2,1 --smoothing-sigmas 2,1,0".
+PyramidSchedule MakePyramidSchedule(const std::vector<unsigned int> & shrinkFactors,
+                                    const std::vector<double> & smoothingSigmas);
+
+enum class LevelStorage
+{
+    Float,
+    Int16
+};
+
+// "float" or "int16"; throws std::invalid_argument otherwise.
+LevelStorage ParseLevelStorage(const std::string & name);
+
+class ImagePyramid
+{
+public:
+    explicit ImagePyramid(const ImageType * image, unsigned int numberOfWorkUnits = 0,
+                          LevelStorage storage = LevelStorage::Float);
+
+    const ImageType * GetImage() const { return m_Image; }
+    LevelStorage      GetStorage() const { return m_Storage; }
+
+    // Smoothed + shrunk level; (1, 0) is the image itself. With int16
+    // storage, other levels are expanded from the compact copy on each call
+    // (uncached, to keep the memory saving), so callers that can work on
+    // int16 take GetCompactLevel instead.
+    ImageType::ConstPointer GetLevel(unsigned int shrinkFactor, double sigma);
+
+    // The level as int16 (scaled to its range); cached in either storage.
+    CompactImageType::ConstPointer GetCompactLevel(unsigned int shrinkFactor, double sigma);
+
+    size_t GetNumberOfCachedLevels() const;
+
+    // Smoothed/shrunk level requests served from the cache vs. built.
+    size_t GetNumberOfHits() const;
+    size_t GetNumberOfMisses() const;
+
+private:
+    using LevelKey = std::pair<unsigned int, double>;
+
+    struct CompactLevel
+    {
+        CompactImageType::ConstPointer image;
+        double                         scale = 1.0; // float value = int16 value / scale
+    };
+
+    // Smoothed + shrunk float level, not cached.
+    ImageType::ConstPointer BuildLevel(unsigned int shrinkFactor, double sigma) const;
+    CompactLevel            FindOrBuildCompactLevel(unsigned int shrinkFactor, double sigma);
+
+    ImageType::ConstPointer                     m_Image;
+    unsigned int                                m_NumberOfWorkUnits;
+    LevelStorage                                m_Storage;
+    std::map<LevelKey, ImageType::ConstPointer> m_Levels;
+    std::map<LevelKey, CompactLevel>            m_CompactLevels;
+    size_t                                      m_Hits   = 0;
+    size_t                                      m_Misses = 0;
+    mutable std::mutex                          m_Mutex;
+};
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_PYRAMID_H
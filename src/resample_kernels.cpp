@@ -0,0 +1,288 @@
+//
+// CPU resampling loops for the common cases of the resample step
+//
+
+#include "resample_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "image_helpers.h"
+
+namespace tt
+{
+
+namespace
+{
+
+using Matrix3 = itk::Matrix<double, 3, 3>;
+using Vector3 = itk::Vector<double, 3>;
+
+// Output voxel j (relative to the grid's region start) -> input continuous
+// index matrix * j + offset.
+struct IndexMap
+{
+    Matrix3 matrix;
+    Vector3 offset;
+};
+
+Vector3 ContinuousIndexOf(const itk::ImageBase<3> * image, const PointType & point)
+{
+    return image->GetPhysicalPointToIndexMatrix() * (point - image->GetOrigin());
+}
+
+IndexMap MakeIndexMap(const itk::ImageBase<3> * input, const TransformBaseType * transform,
+                      const itk::ImageBase<3> * grid)
+{
+    const auto mapped = [&](const itk::ImageBase<3>::IndexType & index)
+    {
+        PointType point;
+        grid->TransformIndexToPhysicalPoint(index, point);
+        return ContinuousIndexOf(input, transform != nullptr ? transform->TransformPoint(point) : point);
+    };
+
+    const itk::ImageBase<3>::IndexType start = grid->GetLargestPossibleRegion().GetIndex();
+    IndexMap                           map;
+    map.offset = mapped(start);
+    for (unsigned int k = 0; k < 3; ++k)
+    {
+        itk::ImageBase<3>::IndexType unit = start;
+        ++unit[k];
+        const Vector3 column = mapped(unit) - map.offset;
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            map.matrix(i, k) = column[i];
+        }
+    }
+    return map;
+}
+
+bool IsAxisAligned(const Matrix3 & matrix)
+{
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        for (unsigned int k = 0; k < 3; ++k)
+        {
+            if (i != k && std::fabs(matrix(i, k)) > 1e-9)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Lower / upper input voxel and upper weight along one axis. Nearest
+// neighbour uses lower == upper, so both interpolators share one loop.
+struct Taps
+{
+    itk::IndexValueType lower  = 0;
+    itk::IndexValueType upper  = 0;
+    double              weight = 0.0;
+    bool                inside = false;
+};
+
+Taps MakeTaps(double c, itk::SizeValueType size, Interpolation interpolation)
+{
+    const auto last = static_cast<itk::IndexValueType>(size) - 1;
+
+    Taps taps;
+    taps.inside = c >= -0.5 && c < last + 0.5;
+    if (interpolation == Interpolation::NearestNeighbor)
+    {
+        taps.lower = taps.upper = std::min(std::max(static_cast<itk::IndexValueType>(std::floor(c + 0.5)),
+                                                    itk::IndexValueType(0)),
+                                           last);
+        return taps;
+    }
+    const double clamped = std::min(std::max(c, 0.0), double(last));
+    taps.lower           = static_cast<itk::IndexValueType>(std::floor(clamped));
+    taps.upper           = std::min(taps.lower + 1, last);
+    taps.weight          = clamped - taps.lower;
+    return taps;
+}
+
+template <typename TPixel>
+void ResampleSeparable(const TPixel * buffer, const itk::Size<3> & inputSize, float * output,
+                       const itk::Size<3> & outputSize, const IndexMap & map, Interpolation interpolation,
+                       double scale, double offset, unsigned int numberOfWorkUnits)
+{
+    std::vector<Taps> axes[3];
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        for (itk::SizeValueType j = 0; j < outputSize[d]; ++j)
+        {
+            axes[d].push_back(MakeTaps(map.matrix(d, d) * j + map.offset[d], inputSize[d], interpolation));
+        }
+    }
+
+    // Input columns the x pass reads
+    itk::IndexValueType first = static_cast<itk::IndexValueType>(inputSize[0]);
+    itk::IndexValueType last  = -1;
+    for (const Taps & taps : axes[0])
+    {
+        if (taps.inside)
+        {
+            first = std::min(first, taps.lower);
+            last  = std::max(last, taps.upper);
+        }
+    }
+
+    const float              background = static_cast<float>(offset);
+    const itk::SizeValueType nx         = inputSize[0];
+    const itk::SizeValueType rowStride  = nx;
+    const itk::SizeValueType sliceStride = nx * inputSize[1];
+    MakeThreader(numberOfWorkUnits)
+        ->ParallelizeArray(
+            0,
+            outputSize[2],
+            [&](itk::SizeValueType z)
+            {
+                std::vector<double> row(nx);
+                const Taps &        tz = axes[2][z];
+                for (itk::SizeValueType y = 0; y < outputSize[1]; ++y)
+                {
+                    float *      out = output + (z * outputSize[1] + y) * outputSize[0];
+                    const Taps & ty  = axes[1][y];
+                    if (!tz.inside || !ty.inside || last < first)
+                    {
+                        std::fill(out, out + outputSize[0], background);
+                        continue;
+                    }
+
+                    // The four input rows around (y, z), blended once
+                    const TPixel * r00 = buffer + tz.lower * sliceStride + ty.lower * rowStride;
+                    const TPixel * r01 = buffer + tz.lower * sliceStride + ty.upper * rowStride;
+                    const TPixel * r10 = buffer + tz.upper * sliceStride + ty.lower * rowStride;
+                    const TPixel * r11 = buffer + tz.upper * sliceStride + ty.upper * rowStride;
+                    const double   wy  = ty.weight;
+                    const double   wz  = tz.weight;
+                    for (itk::IndexValueType x = first; x <= last; ++x)
+                    {
+                        row[x] = (1.0 - wz) * ((1.0 - wy) * r00[x] + wy * r01[x]) +
+                                 wz * ((1.0 - wy) * r10[x] + wy * r11[x]);
+                    }
+
+                    for (itk::SizeValueType x = 0; x < outputSize[0]; ++x)
+                    {
+                        const Taps & tx = axes[0][x];
+                        out[x]          = tx.inside ? static_cast<float>(
+                                                 (row[tx.lower] + tx.weight * (row[tx.upper] - row[tx.lower])) * scale +
+                                                 offset)
+                                                    : background;
+                    }
+                }
+            },
+            nullptr);
+}
+
+template <typename TPixel>
+void ResampleAffine(const TPixel * buffer, const itk::Size<3> & inputSize, float * output,
+                    const itk::Size<3> & outputSize, const IndexMap & map, Interpolation interpolation,
+                    double scale, double offset, unsigned int numberOfWorkUnits)
+{
+    const float              background  = static_cast<float>(offset);
+    const itk::SizeValueType rowStride   = inputSize[0];
+    const itk::SizeValueType sliceStride = inputSize[0] * inputSize[1];
+    Vector3                  step;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        step[i] = map.matrix(i, 0);
+    }
+
+    MakeThreader(numberOfWorkUnits)
+        ->ParallelizeArray(
+            0,
+            outputSize[2],
+            [&](itk::SizeValueType z)
+            {
+                for (itk::SizeValueType y = 0; y < outputSize[1]; ++y)
+                {
+                    float * out = output + (z * outputSize[1] + y) * outputSize[0];
+                    Vector3 rowStart;
+                    for (unsigned int i = 0; i < 3; ++i)
+                    {
+                        rowStart[i] = map.matrix(i, 1) * y + map.matrix(i, 2) * z + map.offset[i];
+                    }
+                    for (itk::SizeValueType x = 0; x < outputSize[0]; ++x)
+                    {
+                        const Taps tx = MakeTaps(rowStart[0] + step[0] * x, inputSize[0], interpolation);
+                        const Taps ty = MakeTaps(rowStart[1] + step[1] * x, inputSize[1], interpolation);
+                        const Taps tz = MakeTaps(rowStart[2] + step[2] * x, inputSize[2], interpolation);
+                        if (!tx.inside || !ty.inside || !tz.inside)
+                        {
+                            out[x] = background;
+                            continue;
+                        }
+
+                        const TPixel * s0 = buffer + tz.lower * sliceStride;
+                        const TPixel * s1 = buffer + tz.upper * sliceStride;
+                        const auto     lerp = [&](const TPixel * row)
+                        { return row[tx.lower] + tx.weight * (double(row[tx.upper]) - row[tx.lower]); };
+                        const double v0 = lerp(s0 + ty.lower * rowStride) +
+                                          ty.weight * (lerp(s0 + ty.upper * rowStride) - lerp(s0 + ty.lower * rowStride));
+                        const double v1 = lerp(s1 + ty.lower * rowStride) +
+                                          ty.weight * (lerp(s1 + ty.upper * rowStride) - lerp(s1 + ty.lower * rowStride));
+                        out[x] = static_cast<float>((v0 + tz.weight * (v1 - v0)) * scale + offset);
+                    }
+                }
+            },
+            nullptr);
+}
+
+} // namespace
+
+template <typename TInputImage>
+ImageType::Pointer ResampleDirect(const TInputImage * input, const TransformBaseType * transform,
+                                  const itk::ImageBase<3> * grid, Interpolation interpolation,
+                                  const IntensityStatistics * normalization, unsigned int numberOfWorkUnits)
+{
+    const bool supported = interpolation == Interpolation::Linear || interpolation == Interpolation::NearestNeighbor;
+    const typename TInputImage::RegionType buffered = input->GetBufferedRegion();
+    if (!supported || (transform != nullptr && !transform->IsLinear()) ||
+        buffered != input->GetLargestPossibleRegion() || buffered.GetIndex() != itk::Index<3>::Filled(0) ||
+        buffered.GetNumberOfPixels() == 0)
+    {
+        return nullptr;
+    }
+
+    auto output = ImageType::New();
+    output->SetRegions(grid->GetLargestPossibleRegion());
+    output->SetOrigin(grid->GetOrigin());
+    output->SetSpacing(grid->GetSpacing());
+    output->SetDirection(grid->GetDirection());
+    output->Allocate();
+
+    const double   scale  = normalization != nullptr ? 1.0 / normalization->stddev : 1.0;
+    const double   offset = normalization != nullptr ? -normalization->mean / normalization->stddev : 0.0;
+    const IndexMap map    = MakeIndexMap(input, transform, grid);
+    if (IsAxisAligned(map.matrix))
+    {
+        ResampleSeparable(input->GetBufferPointer(), buffered.GetSize(), output->GetBufferPointer(),
+                          output->GetBufferedRegion().GetSize(), map, interpolation, scale, offset, numberOfWorkUnits);
+    }
+    else
+    {
+        ResampleAffine(input->GetBufferPointer(), buffered.GetSize(), output->GetBufferPointer(),
+                       output->GetBufferedRegion().GetSize(), map, interpolation, scale, offset, numberOfWorkUnits);
+    }
+    return output;
+}
+
+template ImageType::Pointer ResampleDirect(const ImageType *, const TransformBaseType *, const itk::ImageBase<3> *,
+                                           Interpolation, const IntensityStatistics *, unsigned int);
+template ImageType::Pointer ResampleDirect(const itk::Image<short, 3> *, const TransformBaseType *,
+                                           const itk::ImageBase<3> *, Interpolation, const IntensityStatistics *,
+                                           unsigned int);
+template ImageType::Pointer ResampleDirect(const itk::Image<unsigned short, 3> *, const TransformBaseType *,
+                                           const itk::ImageBase<3> *, Interpolation, const IntensityStatistics *,
+                                           unsigned int);
+template ImageType::Pointer ResampleDirect(const itk::Image<char, 3> *, const TransformBaseType *,
+                                           const itk::ImageBase<3> *, Interpolation, const IntensityStatistics *,
+                                           unsigned int);
+template ImageType::Pointer ResampleDirect(const itk::Image<unsigned char, 3> *, const TransformBaseType *,
+                                           const itk::ImageBase<3> *, Interpolation, const IntensityStatistics *,
+                                           unsigned int);
+
+} // namespace tt
@@ -0,0 +1,46 @@
+//
+// CPU resampling loops for the common cases of the resample step
+//
+// ResampleImageFilter calls the transform and the interpolator through
+// virtual functions for every output voxel. With a linear transform and a
+// nearest-neighbour or linear interpolator, the output index maps to the
+// input's continuous index through one fixed affine map, evaluated here
+// directly:
+//
+//  - axis-aligned maps (identity / isotropic resampling, or any map that
+//    only scales and shifts each axis) are separable: the y / z weights are
+//    applied once per input row, and the x pass reads per-column tables;
+//  - any other linear transform (rigid, affine) takes one affine step per
+//    voxel along each output row, then a trilinear or nearest lookup.
+//
+// Boundaries follow ITK: a voxel is inside when its continuous index lies
+// in [-0.5, size - 0.5) on every axis, linear weights are clamped at the
+// first and last voxel, and outside voxels get the default value (0).
+//
+
+#ifndef TUMOURTRACKER_RESAMPLE_KERNELS_H
+#define TUMOURTRACKER_RESAMPLE_KERNELS_H
+
+#include "image_types.h"
+#include "intensity_normalization.h"
+#include "stages.h"
+
+namespace tt
+{
+
+// Resample input onto grid (only its geometry is used) through transform
+// (null = identity). normalization, when given, maps every output value,
+// background included, by x -> (x - mean) / stddev. Returns null when the
+// case is not covered (other interpolators, a non-linear transform, an
+// input buffer that is not its whole image); the caller then runs
+// ResampleImageFilter. Instantiated for float, short, unsigned short, char
+// and unsigned char inputs.
+template <typename TInputImage>
+ImageType::Pointer ResampleDirect(const TInputImage * input, const TransformBaseType * transform,
+                                  const itk::ImageBase<3> * grid, Interpolation interpolation,
+                                  const IntensityStatistics * normalization = nullptr,
+                                  unsigned int numberOfWorkUnits = 0);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_RESAMPLE_KERNELS_H
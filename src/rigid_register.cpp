@@ -5,51 +5,77 @@
 //
 
 #include <iostream>
+#include <memory>
 
-// --------------------
-// Core ITK image types
-// --------------------
-#include <itkImage.h>
-#include <itkImageFileReader.h>
-#include <itkImageFileWriter.h>
-
-// --------------------
-// Registration components
-// --------------------
-#include <itkImageRegistrationMethodv4.h>
-#include <itkMattesMutualInformationImageToImageMetricv4.h>
-#include <itkRegularStepGradientDescentOptimizerv4.h>
-#include <itkEuler3DTransform.h>
-
-// --------------------
-// Resampling
-// --------------------
-#include <itkResampleImageFilter.h>
-#include <itkLinearInterpolateImageFunction.h>
+#include "stages.h"
+#include "stage_options.h"
+#include "telemetry.h"
 
 int main(int argc, char* argv[])
 {
-    if (argc < 4)
+    tt::RigidParameters          parameters;
+    std::vector<std::string>     files;
+    std::string                  transformFile;
+    std::string                  telemetryFile;
+    tt::ForegroundCropParameters crop;
+    bool                         cropForeground = false;
+    tt::Interpolation            interpolation  = tt::Interpolation::Linear;
+
+    try
     {
-        std::cerr << "Usage: " << argv[0]
-                  << " <fixed_T0.nii> <moving_T1.nii> <output_rigid.nii>\n";
+        tt::CommandLine cmd(argc, argv);
+        files = cmd.Positional();
+        tt::ParseRigidOptions(cmd, "", parameters);
+        parameters.numberOfWorkUnits = cmd.GetUnsigned("threads", parameters.numberOfWorkUnits);
+        parameters.backend = tt::ReadComputeBackendOption(cmd);
+        tt::ReadFixedMaskOption(cmd, parameters.sampling);
+        transformFile = cmd.GetString("transform", "");
+        telemetryFile = cmd.GetString("telemetry", "");
+        cropForeground = tt::ReadForegroundCropOptions(cmd, crop);
+        crop.numberOfWorkUnits = parameters.numberOfWorkUnits;
+        interpolation = tt::ReadInterpolationOption(cmd);
+    }
+    catch (std::exception &err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
         return EXIT_FAILURE;
     }
 
-    //Image type (3D MRI stored as float)
-    using ImageType = itk::Image<float, 3>;
-    using ReaderType = itk::ImageFileReader<ImageType>;
+    // The resampled image is optional once the transform is saved: the
+    // deformable stage can start from the transform and the original T1.
+    if (files.size() < 2 || files.size() > 3 || (files.size() == 2 && transformFile.empty()))
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " [options] <fixed_T0.nii> <moving_T1.nii> [<output_rigid.nii>]\n";
+        tt::PrintOption(std::cerr, "", "transform <rigid.tfm>", "save the Euler3D transform (ITK .tfm / .h5)");
+        tt::PrintRigidOptionsUsage(std::cerr, "");
+        tt::PrintOption(std::cerr, "", "fixed-mask <mask.nii>", "evaluate the metric inside this mask only");
+        tt::PrintOption(std::cerr, "", "threads <n>", "work units (default: ITK default)");
+        tt::PrintOption(std::cerr, "", "backend <cpu|opencl|auto>", "metric and resampling device (default cpu)");
+        tt::PrintOption(std::cerr, "", "interpolation <linear|nearest|bspline|sinc>", "output resampling (default linear)");
+        tt::PrintOption(std::cerr, "", "telemetry <file>", "stage / iteration profile: .jsonl lines or .json Chrome trace");
+        tt::PrintForegroundCropOptionsUsage(std::cerr);
+        return EXIT_FAILURE;
+    }
 
-    auto fixedReader  = ReaderType::New();
-    auto movingReader = ReaderType::New();
+    // Stage spans and optimizer iterations, labelled fixed / moving file
+    tt::Telemetry                          telemetry;
+    tt::Telemetry *                        profile = telemetryFile.empty() ? nullptr : &telemetry;
+    std::unique_ptr<tt::IterationRecorder> iterations;
+    if (profile != nullptr)
+    {
+        iterations = std::make_unique<tt::IterationRecorder>(telemetry, files[0], files[1], "rigid");
+        parameters.iterations = iterations.get();
+    }
 
-    fixedReader->SetFileName(argv[1]);
-    movingReader->SetFileName(argv[2]);
+    tt::ImageType::Pointer fixedImage;
+    tt::ImageType::Pointer movingImage;
 
     try
     {
-        fixedReader->Update();
-        movingReader->Update();
+        tt::StageSpan span(profile, files[0], files[1], "read");
+        fixedImage  = tt::ReadImage(files[0]);
+        movingImage = tt::ReadImage(files[1]);
     }
     catch (itk::ExceptionObject &err)
     {
@@ -57,73 +83,20 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    ImageType::Pointer fixedImage  = fixedReader->GetOutput();
-    ImageType::Pointer movingImage = movingReader->GetOutput();
-
-    //Rigid transform (3 rotations + 3 translations)
-    using TransformType = itk::Euler3DTransform<double>;
-    auto transform = TransformType::New();
-    transform->SetIdentity();
-
-
-    //Set center of rotation to image center
-    ImageType::RegionType region = fixedImage->GetLargestPossibleRegion();
-    ImageType::SizeType   size   = region.GetSize();
-    ImageType::SpacingType spacing = fixedImage->GetSpacing();
-    ImageType::PointType  origin  = fixedImage->GetOrigin();
-
-    TransformType::InputPointType center;
-    for (unsigned int i = 0; i < 3; ++i)
+    // --crop-mask is a T0 mask; T1 is cropped to its own foreground
+    if (cropForeground)
     {
-        center[i] = origin[i] + spacing[i] * size[i] / 2.0;
+        tt::StageSpan span(profile, files[0], files[1], "crop");
+        fixedImage  = tt::CropToForeground(fixedImage, crop);
+        crop.mask   = nullptr;
+        movingImage = tt::CropToForeground(movingImage, crop);
     }
-    transform->SetCenter(center);
-
-    //Metric: Mutual Information (robust for MRI)
-    using MetricType =
-        itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType>;
-
-    auto metric = MetricType::New();
-    metric->SetNumberOfHistogramBins(50);
-    metric->SetUseFixedImageGradientFilter(false);
-    metric->SetUseMovingImageGradientFilter(false);
-
-    // Optimizer
-    using OptimizerType =
-        itk::RegularStepGradientDescentOptimizerv4<double>;
-
-    auto optimizer = OptimizerType::New();
-    optimizer->SetLearningRate(4.0);
-    optimizer->SetMinimumStepLength(0.01);
-    optimizer->SetNumberOfIterations(200);
-
-    //Parameter scaling
-    //Rotations (radians) vs translations (mm)
-    OptimizerType::ScalesType scales(transform->GetNumberOfParameters());
-    scales[0] = 1.0;          // rot X
-    scales[1] = 1.0;          // rot Y
-    scales[2] = 1.0;          // rot Z
-    scales[3] = 1.0 / 1000.0; // trans X
-    scales[4] = 1.0 / 1000.0; // trans Y
-    scales[5] = 1.0 / 1000.0; // trans Z
-    optimizer->SetScales(scales);
-
-    // Registration setup
-    using RegistrationType =
-        itk::ImageRegistrationMethodv4<ImageType, ImageType>;
-
-    auto registration = RegistrationType::New();
-
-    registration->SetFixedImage(fixedImage);
-    registration->SetMovingImage(movingImage);
-    registration->SetMetric(metric);
-    registration->SetOptimizer(optimizer);
-    registration->SetInitialTransform(transform);
-    registration->InPlaceOn();
 
+    tt::RigidTransformType::Pointer transform;
     try
     {
-        registration->Update();
+        tt::StageSpan span(profile, files[0], files[1], "rigid");
+        transform = tt::RegisterRigid(fixedImage, movingImage, parameters);
     }
     catch (itk::ExceptionObject &err)
     {
@@ -131,27 +104,28 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    // Resample moving image using optimized transform
-    using ResampleFilterType =
-        itk::ResampleImageFilter<ImageType, ImageType>;
-
-    auto resampler = ResampleFilterType::New();
-    resampler->SetInput(movingImage);
-    resampler->SetTransform(transform);
-    resampler->SetReferenceImage(fixedImage);
-    resampler->UseReferenceImageOn();
-    resampler->SetInterpolator(
-        itk::LinearInterpolateImageFunction<ImageType, double>::New());
-
-    // Write output
-    using WriterType = itk::ImageFileWriter<ImageType>;
-    auto writer = WriterType::New();
-    writer->SetFileName(argv[3]);
-    writer->SetInput(resampler->GetOutput());
-
+    // Save the transform and/or resample moving image and write output
     try
     {
-        writer->Update();
+        if (!transformFile.empty())
+        {
+            tt::WriteTransform(transform, transformFile);
+        }
+        if (files.size() > 2)
+        {
+            tt::ImageType::Pointer resampled;
+            {
+                tt::StageSpan span(profile, files[0], files[1], "rigid_resample");
+                resampled = tt::ResampleToReference(movingImage, transform, fixedImage,
+                                                    parameters.numberOfWorkUnits, parameters.backend, interpolation);
+            }
+            tt::StageSpan span(profile, files[0], files[1], "write");
+            tt::WriteImage(resampled, files[2]);
+        }
+        if (profile != nullptr)
+        {
+            telemetry.Write(telemetryFile);
+        }
     }
     catch (itk::ExceptionObject &err)
     {
@@ -161,4 +135,4 @@ int main(int argc, char* argv[])
 
     std::cout << "Rigid registration completed successfully." << std::endl;
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
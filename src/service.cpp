@@ -0,0 +1,718 @@
+//
+// Long-running registration service (TumourTracker serve / submit)
+//
+
+#include "service.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <itkMultiThreaderBase.h>
+
+#include "cohort.h"
+#include "command_line.h"
+#include "json_writer.h"
+#include "pipeline.h"
+#include "stage_options.h"
+#include "telemetry.h"
+
+namespace tt
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::string StatusReply(const char * status, const std::string & message = std::string())
+{
+    std::ostringstream reply;
+    JsonWriter         json(reply);
+    json.BeginObject().Member("status", status);
+    if (!message.empty())
+    {
+        json.Member("error", message);
+    }
+    json.EndObject();
+    return reply.str();
+}
+
+// =====================================================
+// Socket I/O
+// =====================================================
+
+sockaddr_un MakeAddress(const std::string & path)
+{
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        throw std::invalid_argument("socket path must be 1-" + std::to_string(sizeof(address.sun_path) - 1) +
+                                    " characters");
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+// Newline-delimited reads from a stream socket.
+class LineReader
+{
+public:
+    explicit LineReader(int fd)
+        : m_Fd(fd)
+    {
+    }
+
+    // False at end of stream (a final unterminated line is still returned).
+    bool Next(std::string & line)
+    {
+        for (;;)
+        {
+            const auto newline = m_Buffer.find('\n');
+            if (newline != std::string::npos)
+            {
+                line = m_Buffer.substr(0, newline);
+                m_Buffer.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.pop_back();
+                }
+                return true;
+            }
+
+            char          chunk[4096];
+            const ssize_t received = ::recv(m_Fd, chunk, sizeof(chunk), 0);
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (received <= 0)
+            {
+                if (m_Buffer.empty())
+                {
+                    return false;
+                }
+                line.swap(m_Buffer);
+                m_Buffer.clear();
+                return true;
+            }
+            m_Buffer.append(chunk, static_cast<size_t>(received));
+        }
+    }
+
+private:
+    int         m_Fd;
+    std::string m_Buffer;
+};
+
+bool WriteLine(int fd, const std::string & line)
+{
+    const std::string data = line + '\n';
+    size_t            sent = 0;
+    while (sent < data.size())
+    {
+        const ssize_t written = ::send(fd, data.data() + sent, data.size() - sent, 0);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        sent += static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// =====================================================
+// NUMA placement
+// =====================================================
+
+// CPUs of every NUMA node from sysfs ("0-15,32-47"); empty off Linux or
+// when the topology is not exposed.
+std::vector<std::vector<unsigned int>> ReadNumaNodes()
+{
+    std::vector<std::vector<unsigned int>> nodes;
+    for (unsigned int node = 0;; ++node)
+    {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string   list;
+        if (!file || !std::getline(file, list))
+        {
+            break;
+        }
+
+        std::vector<unsigned int> cpus;
+        std::istringstream        ranges(list);
+        std::string               range;
+        while (std::getline(ranges, range, ','))
+        {
+            const auto   dash  = range.find('-');
+            const auto   first = static_cast<unsigned int>(std::stoul(range.substr(0, dash)));
+            const auto   last  = dash == std::string::npos ? first
+                                                           : static_cast<unsigned int>(std::stoul(range.substr(dash + 1)));
+            for (unsigned int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty())
+        {
+            nodes.push_back(cpus);
+        }
+    }
+    return nodes;
+}
+
+bool PinCurrentThread(const std::vector<unsigned int> & cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned int cpu : cpus)
+    {
+        CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+// =====================================================
+// Job queue
+// =====================================================
+
+// Fixed set of workers running cases from a FIFO queue. Every worker gets
+// an equal share of the thread budget; T0 caches are kept per patient
+// across jobs.
+class RegistrationService
+{
+public:
+    RegistrationService(const PipelineOptions & options, const ServiceOptions & service, std::ostream & log)
+        : m_Options(options)
+        , m_Service(service)
+        , m_Log(log)
+        , m_Start(Clock::now())
+    {
+        const unsigned int numberOfThreads = service.numberOfThreads > 0
+                                                 ? service.numberOfThreads
+                                                 : itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+        const unsigned int numberOfJobs =
+            service.numberOfJobs > 0 ? service.numberOfJobs : std::max(1u, numberOfThreads / 4);
+        m_Options.numberOfWorkUnits = std::max(1u, numberOfThreads / numberOfJobs);
+        m_Options.artefacts.insert("transform");
+
+        if (service.pinToNumaNodes)
+        {
+            m_Nodes = ReadNumaNodes();
+        }
+        if (m_Nodes.size() > 1)
+        {
+            // Pool threads would run a job anywhere; threads created per
+            // filter inherit the worker's node affinity, so compute and
+            // first-touch allocation stay on that node.
+            itk::MultiThreaderBase::SetGlobalDefaultThreader(itk::MultiThreaderBase::ThreaderEnum::Platform);
+            itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(m_Options.numberOfWorkUnits);
+        }
+        else
+        {
+            if (service.pinToNumaNodes)
+            {
+                m_Log << "Single NUMA node (or topology unknown); not pinning" << std::endl;
+            }
+            m_Nodes.clear();
+            ConfigureThreadPool(numberOfThreads);
+        }
+
+        m_Log << "Service: " << numberOfJobs << " workers x " << m_Options.numberOfWorkUnits << " threads";
+        if (!m_Nodes.empty())
+        {
+            m_Log << " on " << m_Nodes.size() << " NUMA nodes";
+        }
+        m_Log << std::endl;
+
+        for (unsigned int worker = 0; worker < numberOfJobs; ++worker)
+        {
+            m_Workers.emplace_back(&RegistrationService::Work, this, worker);
+        }
+    }
+
+    // Queued jobs are finished before the workers exit.
+    ~RegistrationService()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_QueueMutex);
+            m_Stopping = true;
+        }
+        m_QueueChanged.notify_all();
+        for (auto & worker : m_Workers)
+        {
+            worker.join();
+        }
+    }
+
+    // The reply (one JSON line) once the case has run.
+    std::future<std::string> Submit(const CaseSpec & spec)
+    {
+        Job job;
+        job.spec      = spec;
+        job.submitted = Clock::now();
+        std::future<std::string> reply = job.reply.get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_QueueMutex);
+            m_Queue.push_back(std::move(job));
+        }
+        m_QueueChanged.notify_one();
+        return reply;
+    }
+
+    std::string Statistics() const
+    {
+        size_t queued = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_QueueMutex);
+            queued = m_Queue.size();
+        }
+        size_t cachedPatients = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_CacheMutex);
+            cachedPatients = m_Caches.size();
+        }
+
+        std::ostringstream reply;
+        JsonWriter         json(reply);
+        json.BeginObject()
+            .Member("status", "ok")
+            .Member("succeeded", m_Succeeded.load())
+            .Member("failed", m_Failed.load())
+            .Member("queued", queued)
+            .Member("workers", m_Workers.size())
+            .Member("threads_per_job", m_Options.numberOfWorkUnits)
+            .Member("numa_nodes", m_Nodes.size())
+            .Member("cached_patients", cachedPatients)
+            .Member("uptime_seconds", SecondsSince(m_Start))
+            .EndObject();
+        return reply.str();
+    }
+
+private:
+    struct Job
+    {
+        CaseSpec                  spec;
+        Clock::time_point         submitted;
+        std::promise<std::string> reply;
+    };
+
+    void Work(unsigned int worker)
+    {
+        if (!m_Nodes.empty() && !PinCurrentThread(m_Nodes[worker % m_Nodes.size()]))
+        {
+            std::lock_guard<std::mutex> lock(m_LogMutex);
+            m_Log << "Worker " << worker << ": could not pin to NUMA node " << worker % m_Nodes.size()
+                  << std::endl;
+        }
+
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(m_QueueMutex);
+                m_QueueChanged.wait(lock, [this]() { return m_Stopping || !m_Queue.empty(); });
+                if (m_Queue.empty())
+                {
+                    return;
+                }
+                job = std::move(m_Queue.front());
+                m_Queue.pop_front();
+            }
+            job.reply.set_value(Run(job.spec, SecondsSince(job.submitted)));
+        }
+    }
+
+    std::string Run(const CaseSpec & spec, double queueSeconds)
+    {
+        const auto start = Clock::now();
+
+        Telemetry   telemetry;
+        StageProbes probes;
+        probes.telemetry = &telemetry;
+
+        std::ostringstream reply;
+        bool               succeeded = false;
+        try
+        {
+            const CaseReport report = RunCase(spec, m_Options, probes, PatientCache(spec).get());
+            {
+                std::ofstream jsonReport(spec.outputDirectory + "/report.json");
+                WriteCaseReportJson(report, jsonReport);
+            }
+
+            std::map<std::string, double> stageSeconds;
+            for (const auto & event : telemetry.GetStageEvents())
+            {
+                stageSeconds[event.stage] += event.duration * 1e-6;
+            }
+
+            JsonWriter json(reply);
+            json.BeginObject()
+                .Member("status", "ok")
+                .Member("patient", spec.patient)
+                .Member("queue_seconds", queueSeconds)
+                .Member("run_seconds", SecondsSince(start));
+            json.Key("transforms").BeginArray();
+            for (const auto & timepoint : report.timepoints)
+            {
+                json.Value(timepoint.transformFile);
+            }
+            json.EndArray().Key("stage_seconds").BeginObject();
+            for (const auto & [stage, seconds] : stageSeconds)
+            {
+                json.Member(stage, seconds);
+            }
+            json.EndObject().Key("report");
+            WriteCaseReportJson(report, json);
+            json.EndObject();
+            ++m_Succeeded;
+            succeeded = true;
+        }
+        catch (std::exception & err)
+        {
+            ++m_Failed;
+            reply.str(StatusReply("error", err.what()));
+        }
+
+        std::lock_guard<std::mutex> lock(m_LogMutex);
+        m_Log << spec.patient << ": " << (succeeded ? "done" : "failed")
+              << " in " << SecondsSince(start) << " s (queued " << queueSeconds << " s)" << std::endl;
+        return reply.str();
+    }
+
+    // T0 cache of the patient, keyed by the T0 file and its modification
+    // time so a re-exported T0 is preprocessed again.
+    std::shared_ptr<ImageCache> PatientCache(const CaseSpec & spec)
+    {
+        std::string key = spec.patient + '\n' + spec.timepoints.front();
+        struct stat status;
+        if (::stat(spec.timepoints.front().c_str(), &status) == 0)
+        {
+            key += '\n' + std::to_string(status.st_mtime) + ':' + std::to_string(status.st_size);
+        }
+
+        std::lock_guard<std::mutex> lock(m_CacheMutex);
+        for (auto entry = m_Caches.begin(); entry != m_Caches.end(); ++entry)
+        {
+            if (entry->first == key)
+            {
+                m_Caches.splice(m_Caches.begin(), m_Caches, entry);
+                return m_Caches.front().second;
+            }
+        }
+        m_Caches.emplace_front(key, std::make_shared<ImageCache>());
+        if (m_Caches.size() > std::max<size_t>(m_Service.cachedPatients, 1))
+        {
+            m_Caches.pop_back(); // jobs still using it keep their reference
+        }
+        return m_Caches.front().second;
+    }
+
+    PipelineOptions                        m_Options;
+    ServiceOptions                         m_Service;
+    std::ostream &                         m_Log;
+    Clock::time_point                      m_Start;
+    std::vector<std::vector<unsigned int>> m_Nodes; // empty = not pinned
+
+    mutable std::mutex      m_QueueMutex;
+    std::condition_variable m_QueueChanged;
+    std::deque<Job>         m_Queue;
+    bool                    m_Stopping = false;
+
+    // Most recently used first.
+    mutable std::mutex                                              m_CacheMutex;
+    std::list<std::pair<std::string, std::shared_ptr<ImageCache>>> m_Caches;
+
+    std::atomic<size_t>      m_Succeeded{ 0 };
+    std::atomic<size_t>      m_Failed{ 0 };
+    std::mutex               m_LogMutex;
+    std::vector<std::thread> m_Workers;
+};
+
+// Accept loop; one thread per connection, requests of a connection are
+// answered in order. Returns after "shutdown" once in-flight jobs replied.
+void Serve(const PipelineOptions & options, const ServiceOptions & service)
+{
+    std::signal(SIGPIPE, SIG_IGN); // a vanished client must not kill the service
+
+    const sockaddr_un address  = MakeAddress(service.socketPath);
+    const int         listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        throw std::runtime_error(std::string("cannot create socket: ") + std::strerror(errno));
+    }
+    ::unlink(service.socketPath.c_str());
+    if (::bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+        ::listen(listener, 64) != 0)
+    {
+        const std::string error = std::strerror(errno);
+        ::close(listener);
+        throw std::runtime_error("cannot listen on " + service.socketPath + ": " + error);
+    }
+
+    // "shutdown" writes to wake[1] so the accept loop's poll() returns; a
+    // shut-down listening socket only wakes accept() on Linux.
+    int wake[2];
+    if (::pipe(wake) != 0)
+    {
+        const std::string error = std::strerror(errno);
+        ::close(listener);
+        throw std::runtime_error("cannot create pipe: " + error);
+    }
+
+    RegistrationService registration(options, service, std::cout);
+    std::cout << "Listening on " << service.socketPath << std::endl;
+
+    std::atomic<bool>       stopping{ false };
+    std::mutex              connectionsMutex;
+    std::condition_variable connectionsClosed;
+    std::set<int>           connections;
+
+    auto handle = [&](int fd)
+    {
+        LineReader  reader(fd);
+        std::string line;
+        while (!stopping && reader.Next(line))
+        {
+            const std::vector<std::string> fields = SplitManifestLine(line);
+            if (fields.empty() || fields[0].empty())
+            {
+                continue;
+            }
+
+            std::string reply;
+            if (fields.size() == 1 && fields[0] == "ping")
+            {
+                reply = StatusReply("ok");
+            }
+            else if (fields.size() == 1 && fields[0] == "stats")
+            {
+                reply = registration.Statistics();
+            }
+            else if (fields.size() == 1 && fields[0] == "shutdown")
+            {
+                reply    = StatusReply("ok");
+                stopping = true;
+                [[maybe_unused]] const ssize_t woken = ::write(wake[1], "", 1); // the pipe is empty
+            }
+            else
+            {
+                try
+                {
+                    reply = registration.Submit(MakeCaseSpec(fields)).get();
+                }
+                catch (std::invalid_argument & err)
+                {
+                    reply = StatusReply("error", err.what());
+                }
+            }
+            if (!WriteLine(fd, reply))
+            {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        connections.erase(fd);
+        ::close(fd);
+        connectionsClosed.notify_all();
+    };
+
+    while (!stopping)
+    {
+        pollfd ready[2] = { { listener, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+        if (::poll(ready, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (ready[1].revents != 0)
+        {
+            break;
+        }
+        if ((ready[0].revents & POLLIN) == 0)
+        {
+            if (ready[0].revents != 0)
+            {
+                break; // listener error
+            }
+            continue;
+        }
+
+        const int fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        connections.insert(fd);
+        std::thread(handle, fd).detach();
+    }
+
+    // Idle clients stop being read; running jobs still finish and reply.
+    std::unique_lock<std::mutex> lock(connectionsMutex);
+    for (int fd : connections)
+    {
+        ::shutdown(fd, SHUT_RD);
+    }
+    connectionsClosed.wait(lock, [&]() { return connections.empty(); });
+
+    ::close(listener);
+    ::close(wake[0]);
+    ::close(wake[1]);
+    ::unlink(service.socketPath.c_str());
+}
+
+} // namespace
+
+int RunServeCommand(int argc, char * argv[])
+{
+    PipelineOptions options;
+    ServiceOptions  service;
+
+    try
+    {
+        std::set<std::string> switches = PipelineSwitches();
+        switches.insert("numa");
+
+        CommandLine cmd(argc, argv, 1, switches);
+        if (!cmd.Positional().empty())
+        {
+            std::cerr << "Usage: TumourTracker serve [options]\n"
+                      << "  requests (one per line): patient,T0,T1[,T2...],output_dir | ping | stats | shutdown\n";
+            PrintOption(std::cerr, "", "socket <path>", "Unix socket to listen on (default /tmp/tumourtracker.sock)");
+            PrintOption(std::cerr, "", "threads <n>", "total thread budget (default: all cores)");
+            PrintOption(std::cerr, "", "jobs <n>", "concurrent cases (default: threads / 4)");
+            PrintOption(std::cerr, "", "cached-patients <n>", "preprocessed T0s kept warm (default 16)");
+            PrintOption(std::cerr, "", "numa", "pin each worker (and its threads) to one NUMA node");
+            PrintPipelineOptionsUsage(std::cerr);
+            return EXIT_FAILURE;
+        }
+
+        options                 = ParsePipelineOptions(cmd);
+        service.socketPath      = cmd.GetString("socket", service.socketPath);
+        service.numberOfThreads = cmd.GetUnsigned("threads", service.numberOfThreads);
+        service.numberOfJobs    = cmd.GetUnsigned("jobs", service.numberOfJobs);
+        service.cachedPatients  = cmd.GetUnsigned("cached-patients", static_cast<unsigned int>(service.cachedPatients));
+        service.pinToNumaNodes  = cmd.Has("numa");
+
+        Serve(options, service);
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int RunSubmitCommand(int argc, char * argv[])
+{
+    std::string              socketPath = ServiceOptions().socketPath;
+    std::vector<std::string> requests;
+    try
+    {
+        CommandLine cmd(argc, argv);
+        socketPath = cmd.GetString("socket", socketPath);
+        requests   = cmd.Positional();
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (requests.empty())
+    {
+        std::cerr << "Usage: TumourTracker submit [--socket <path>] <request> [<request> ...]\n"
+                  << "  request: patient,T0,T1[,T2...],output_dir | ping | stats | shutdown\n";
+        return EXIT_FAILURE;
+    }
+
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    try
+    {
+        const sockaddr_un address = MakeAddress(socketPath);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            throw std::runtime_error("cannot connect to " + socketPath + ": " + std::strerror(errno));
+        }
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+
+    // Requests are pipelined; the service answers them in order.
+    bool failed = false;
+    for (const auto & request : requests)
+    {
+        failed |= !WriteLine(fd, request);
+    }
+    LineReader  reader(fd);
+    std::string reply;
+    for (size_t i = 0; i < requests.size() && reader.Next(reply); ++i)
+    {
+        std::cout << reply << std::endl;
+        failed |= reply.find("\"status\":\"error\"") != std::string::npos;
+    }
+    ::close(fd);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+} // namespace tt
@@ -0,0 +1,43 @@
+//
+// Long-running registration service (TumourTracker serve / submit)
+//
+// One warm process accepts cases over a local (Unix domain) socket, so a
+// new follow-up scan costs neither process startup nor re-reading and
+// re-preprocessing its patient's T0: ITK's IO factories, the thread pool
+// and a per-patient image cache stay alive between jobs.
+//
+// Protocol: one request per line, one JSON reply per line, in order.
+//   patient,T0,T1[,T2...],output_dir   register a case (manifest format)
+//   ping | stats | shutdown            service control
+// A case reply carries the written transform(s), the QA report, the time
+// spent queued and running, and per-stage seconds.
+//
+
+#ifndef TUMOURTRACKER_SERVICE_H
+#define TUMOURTRACKER_SERVICE_H
+
+#include <cstddef>
+#include <string>
+
+namespace tt
+{
+
+struct ServiceOptions
+{
+    std::string  socketPath      = "/tmp/tumourtracker.sock";
+    unsigned int numberOfThreads = 0;     // total thread budget (0 = ITK global default)
+    unsigned int numberOfJobs    = 0;     // concurrent cases (0 = one per 4 threads)
+    size_t       cachedPatients  = 16;    // T0 caches kept, least recently used dropped first
+    bool         pinToNumaNodes  = false; // worker j runs on node j % nodes (Linux)
+};
+
+// Entry point for "TumourTracker serve ..." (argv[0] is "serve").
+int RunServeCommand(int argc, char * argv[]);
+
+// Entry point for "TumourTracker submit ..." (argv[0] is "submit"): sends
+// each positional argument as one request and prints the replies.
+int RunSubmitCommand(int argc, char * argv[]);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_SERVICE_H
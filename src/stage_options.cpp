@@ -0,0 +1,287 @@
+//
+// Command-line options for the registration stages
+//
+
+#include "stage_options.h"
+
+#include <iomanip>
+#include <stdexcept>
+
+namespace tt
+{
+
+void PrintOption(std::ostream & os, const std::string & prefix, const std::string & name,
+                 const std::string & help)
+{
+    os << "  " << std::left << std::setw(38) << ("--" + prefix + name) << help << "\n";
+}
+
+namespace
+{
+
+void ParseSamplingOptions(const CommandLine & cmd, const std::string & prefix,
+                          MetricSamplingParameters & sampling)
+{
+    const std::string strategy = cmd.GetString(prefix + "sampling", "none");
+    if (strategy == "none")
+    {
+        sampling.strategy = MetricSamplingParameters::Strategy::None;
+    }
+    else if (strategy == "regular")
+    {
+        sampling.strategy = MetricSamplingParameters::Strategy::Regular;
+    }
+    else if (strategy == "random")
+    {
+        sampling.strategy = MetricSamplingParameters::Strategy::Random;
+    }
+    else
+    {
+        throw std::invalid_argument("unknown --" + prefix + "sampling '" + strategy +
+                                    "' (none, regular or random)");
+    }
+
+    sampling.percentagePerLevel =
+        cmd.GetDoubleList(prefix + "sampling-percentage", sampling.percentagePerLevel);
+    for (double percentage : sampling.percentagePerLevel)
+    {
+        if (percentage <= 0.0 || percentage > 1.0)
+        {
+            throw std::invalid_argument("--" + prefix + "sampling-percentage values must be in (0, 1]");
+        }
+    }
+    sampling.seed = static_cast<int>(cmd.GetUnsigned(prefix + "sampling-seed", sampling.seed));
+}
+
+void PrintSamplingOptionsUsage(std::ostream & os, const std::string & prefix)
+{
+    PrintOption(os, prefix, "sampling <none|regular|random>", "metric sampling strategy (default none)");
+    PrintOption(os, prefix, "sampling-percentage <list>", "fraction of voxels sampled, per level (default 1)");
+    PrintOption(os, prefix, "sampling-seed <n>", "seed for reproducible sampling (default 121212)");
+}
+
+} // namespace
+
+void ReadFixedMaskOption(const CommandLine & cmd, MetricSamplingParameters & sampling)
+{
+    const std::string fileName = cmd.GetString("fixed-mask", "");
+    if (!fileName.empty())
+    {
+        sampling.fixedMask = ReadMask(fileName);
+    }
+}
+
+bool ReadForegroundCropOptions(const CommandLine & cmd, ForegroundCropParameters & parameters)
+{
+    const std::string crop = cmd.GetString("crop", "off");
+    if (crop != "off" && crop != "on")
+    {
+        throw std::invalid_argument("unknown --crop '" + crop + "' (off or on)");
+    }
+    parameters.margin            = cmd.GetDouble("crop-margin", parameters.margin);
+    parameters.threshold         = cmd.GetDouble("crop-threshold", parameters.threshold);
+    parameters.thresholdFraction = cmd.GetDouble("crop-fraction", parameters.thresholdFraction);
+    const std::string maskFile   = cmd.GetString("crop-mask", "");
+    if (!maskFile.empty())
+    {
+        parameters.mask = ReadMask(maskFile);
+    }
+    return crop == "on";
+}
+
+void PrintForegroundCropOptionsUsage(std::ostream & os)
+{
+    PrintOption(os, "", "crop <off|on>", "crop to the foreground box before resampling (default off)");
+    PrintOption(os, "", "crop-margin <mm>", "margin kept around the foreground (default 10)");
+    PrintOption(os, "", "crop-threshold <t>", "foreground intensity threshold (default: fraction of max)");
+    PrintOption(os, "", "crop-fraction <x>", "threshold as a fraction of the maximum (default 0.05)");
+    PrintOption(os, "", "crop-mask <mask.nii>", "crop to this brain mask's box instead");
+}
+
+FieldPrecision ReadFieldPrecisionOption(const CommandLine & cmd)
+{
+    const std::string type = cmd.GetString("field-type", "float");
+    if (type == "float")
+    {
+        return FieldPrecision::Float;
+    }
+    if (type == "double")
+    {
+        return FieldPrecision::Double;
+    }
+    throw std::invalid_argument("unknown --field-type '" + type + "' (float or double)");
+}
+
+Interpolation ReadInterpolationOption(const CommandLine & cmd)
+{
+    return ParseInterpolation(cmd.GetString("interpolation", "linear"));
+}
+
+ComputeBackend ReadComputeBackendOption(const CommandLine & cmd)
+{
+    return ParseComputeBackend(cmd.GetString("backend", "cpu"));
+}
+
+LevelStorage ReadLevelStorageOption(const CommandLine & cmd)
+{
+    return ParseLevelStorage(cmd.GetString("level-storage", "float"));
+}
+
+void ParseRigidOptions(const CommandLine & cmd, const std::string & prefix, RigidParameters & parameters)
+{
+    if (cmd.Has(prefix + "shrink-factors") || cmd.Has(prefix + "smoothing-sigmas"))
+    {
+        parameters.pyramid = MakePyramidSchedule(
+            cmd.GetUnsignedList(prefix + "shrink-factors", parameters.pyramid.shrinkFactors),
+            cmd.GetDoubleList(prefix + "smoothing-sigmas", parameters.pyramid.smoothingSigmas));
+    }
+    parameters.numberOfIterations = cmd.GetUnsigned(prefix + "iterations", parameters.numberOfIterations);
+    parameters.learningRate       = cmd.GetDouble(prefix + "learning-rate", parameters.learningRate);
+
+    const std::string initialization = cmd.GetString(prefix + "init", "geometry");
+    if (initialization != "geometry" && initialization != "moments")
+    {
+        throw std::invalid_argument("unknown --" + prefix + "init '" + initialization + "' (geometry or moments)");
+    }
+    parameters.initialization = initialization == "moments" ? RigidParameters::Initialization::Moments
+                                                            : RigidParameters::Initialization::Geometry;
+    parameters.startAngleRange = cmd.GetDouble(prefix + "start-range", parameters.startAngleRange);
+    parameters.startSteps      = cmd.GetUnsigned(prefix + "start-steps", parameters.startSteps);
+    parameters.startCandidates = cmd.GetUnsigned(prefix + "start-candidates", parameters.startCandidates);
+    ParseSamplingOptions(cmd, prefix, parameters.sampling);
+}
+
+void PrintRigidOptionsUsage(std::ostream & os, const std::string & prefix)
+{
+    PrintOption(os, prefix, "shrink-factors <list>", "pyramid shrink factors (default 4,2,1)");
+    PrintOption(os, prefix, "smoothing-sigmas <list>", "pyramid sigmas in mm (default 2,1,0)");
+    PrintOption(os, prefix, "iterations <n>", "iterations per level (default 200)");
+    PrintOption(os, prefix, "learning-rate <x>", "initial step (default 4.0)");
+    PrintOption(os, prefix, "init <geometry|moments>", "image centres or centres of mass (default geometry)");
+    PrintOption(os, prefix, "start-range <deg>", "multi-start rotations over +-deg per axis (default 0 = off)");
+    PrintOption(os, prefix, "start-steps <n>", "multi-start rotations per axis (default 5)");
+    PrintOption(os, prefix, "start-candidates <n>", "best starts refined at full resolution (default 2)");
+    PrintSamplingOptionsUsage(os, prefix);
+}
+
+void ParseBSplineOptions(const CommandLine & cmd, const std::string & prefix, BSplineParameters & parameters)
+{
+    if (cmd.Has(prefix + "shrink-factors") || cmd.Has(prefix + "smoothing-sigmas"))
+    {
+        parameters.pyramid = MakePyramidSchedule(
+            cmd.GetUnsignedList(prefix + "shrink-factors", parameters.pyramid.shrinkFactors),
+            cmd.GetDoubleList(prefix + "smoothing-sigmas", parameters.pyramid.smoothingSigmas));
+    }
+    parameters.meshSizePerLevel = cmd.GetUnsignedList(prefix + "mesh-sizes", parameters.meshSizePerLevel);
+    parameters.numberOfIterations = cmd.GetUnsigned(prefix + "iterations", parameters.numberOfIterations);
+    parameters.maximumNumberOfFunctionEvaluations =
+        cmd.GetUnsigned(prefix + "evaluations", parameters.maximumNumberOfFunctionEvaluations);
+
+    const std::string optimizer = cmd.GetString(prefix + "optimizer", "lbfgsb");
+    if (optimizer != "lbfgsb" && optimizer != "lbfgs")
+    {
+        throw std::invalid_argument("unknown --" + prefix + "optimizer '" + optimizer + "' (lbfgsb or lbfgs)");
+    }
+    parameters.optimizer = optimizer == "lbfgsb" ? BSplineParameters::Optimizer::LBFGSB
+                                                 : BSplineParameters::Optimizer::LBFGS;
+    parameters.boundFraction = cmd.GetDouble(prefix + "bound-fraction", parameters.boundFraction);
+    parameters.convergenceWindowSize =
+        cmd.GetUnsigned(prefix + "convergence-window", parameters.convergenceWindowSize);
+    parameters.convergenceThreshold =
+        cmd.GetDouble(prefix + "convergence-threshold", parameters.convergenceThreshold);
+    ParseSamplingOptions(cmd, prefix, parameters.sampling);
+
+    const std::string roiMask = cmd.GetString(prefix + "roi-mask", "");
+    if (!roiMask.empty())
+    {
+        parameters.roiMask = ReadMask(roiMask);
+    }
+    parameters.roiPadding = cmd.GetDouble(prefix + "roi-padding", parameters.roiPadding);
+
+    const std::string schedule = cmd.GetString(prefix + "schedule", "fixed");
+    if (schedule != "fixed" && schedule != "auto")
+    {
+        throw std::invalid_argument("unknown --" + prefix + "schedule '" + schedule + "' (fixed or auto)");
+    }
+    parameters.adaptiveSchedule   = schedule == "auto";
+    parameters.iterationsPerLevel = cmd.GetUnsignedList(prefix + "level-iterations", parameters.iterationsPerLevel);
+    parameters.deadlineSeconds    = cmd.GetDouble(prefix + "deadline", parameters.deadlineSeconds);
+}
+
+void PrintBSplineOptionsUsage(std::ostream & os, const std::string & prefix)
+{
+    PrintOption(os, prefix, "shrink-factors <list>", "pyramid shrink factors (default 4,2)");
+    PrintOption(os, prefix, "smoothing-sigmas <list>", "pyramid sigmas in mm (default 2,1)");
+    PrintOption(os, prefix, "mesh-sizes <list>", "control-point mesh per level (default 3,4)");
+    PrintOption(os, prefix, "optimizer <lbfgsb|lbfgs>", "bounded or unbounded optimizer (default lbfgsb)");
+    PrintOption(os, prefix, "bound-fraction <f>", "LBFGSB bound as a fraction of control-point spacing (default 0.4)");
+    PrintOption(os, prefix, "iterations <n>", "maximum iterations per level (default 100)");
+    PrintOption(os, prefix, "evaluations <n>", "metric evaluations per level (default 250)");
+    PrintOption(os, prefix, "convergence-window <n>", "iterations the plateau test looks back over (default 10)");
+    PrintOption(os, prefix, "convergence-threshold <t>", "stop a level below this metric slope (default 1e-6, 0 = off)");
+    PrintOption(os, prefix, "roi-mask <mask.nii>", "register only a padded box around this mask (mesh over the box)");
+    PrintOption(os, prefix, "roi-padding <mm>", "margin around the ROI mask (default 15)");
+    PrintOption(os, prefix, "schedule <fixed|auto>", "levels, sigmas, mesh and iteration caps from the image (default fixed)");
+    PrintOption(os, prefix, "level-iterations <list>", "maximum iterations per level (default: --" + prefix + "iterations)");
+    PrintOption(os, prefix, "deadline <s>", "wall-clock budget; stop at the last level reached (default none)");
+    PrintSamplingOptionsUsage(os, prefix);
+}
+
+void ParseDemonsOptions(const CommandLine & cmd, const std::string & prefix, DemonsParameters & parameters)
+{
+    if (cmd.Has(prefix + "shrink-factors") || cmd.Has(prefix + "smoothing-sigmas"))
+    {
+        parameters.pyramid = MakePyramidSchedule(
+            cmd.GetUnsignedList(prefix + "shrink-factors", parameters.pyramid.shrinkFactors),
+            cmd.GetDoubleList(prefix + "smoothing-sigmas", parameters.pyramid.smoothingSigmas));
+    }
+    parameters.numberOfIterations  = cmd.GetUnsigned(prefix + "iterations", parameters.numberOfIterations);
+    parameters.fieldSmoothingSigma = cmd.GetDouble(prefix + "field-sigma", parameters.fieldSmoothingSigma);
+    parameters.updateFieldSmoothingSigma =
+        cmd.GetDouble(prefix + "update-sigma", parameters.updateFieldSmoothingSigma);
+    parameters.maximumUpdateStepLength = cmd.GetDouble(prefix + "max-step", parameters.maximumUpdateStepLength);
+
+    const std::string gradient = cmd.GetString(prefix + "gradient", "symmetric");
+    if (gradient != "symmetric" && gradient != "fixed")
+    {
+        throw std::invalid_argument("unknown --" + prefix + "gradient '" + gradient + "' (symmetric or fixed)");
+    }
+    parameters.symmetricForces = gradient == "symmetric";
+}
+
+void PrintDemonsOptionsUsage(std::ostream & os, const std::string & prefix)
+{
+    PrintOption(os, prefix, "shrink-factors <list>", "pyramid shrink factors (default 4,2,1)");
+    PrintOption(os, prefix, "smoothing-sigmas <list>", "pyramid sigmas in mm (default 2,1,0)");
+    PrintOption(os, prefix, "iterations <n>", "demons iterations per level (default 50)");
+    PrintOption(os, prefix, "field-sigma <mm>", "displacement field smoothing, physical at every level (default 1.5)");
+    PrintOption(os, prefix, "update-sigma <mm>", "update field smoothing, physical at every level (default 0, off)");
+    PrintOption(os, prefix, "max-step <voxels>", "maximum update step (default 2)");
+    PrintOption(os, prefix, "gradient <symmetric|fixed>", "demons forces (default symmetric)");
+}
+
+void ParseSyNOptions(const CommandLine & cmd, const std::string & prefix, SyNParameters & parameters)
+{
+    if (cmd.Has(prefix + "shrink-factors") || cmd.Has(prefix + "smoothing-sigmas"))
+    {
+        parameters.pyramid = MakePyramidSchedule(
+            cmd.GetUnsignedList(prefix + "shrink-factors", parameters.pyramid.shrinkFactors),
+            cmd.GetDoubleList(prefix + "smoothing-sigmas", parameters.pyramid.smoothingSigmas));
+    }
+    parameters.iterationsPerLevel  = cmd.GetUnsignedList(prefix + "iterations", parameters.iterationsPerLevel);
+    parameters.learningRate        = cmd.GetDouble(prefix + "learning-rate", parameters.learningRate);
+    parameters.updateFieldVariance = cmd.GetDouble(prefix + "update-variance", parameters.updateFieldVariance);
+    parameters.totalFieldVariance  = cmd.GetDouble(prefix + "total-variance", parameters.totalFieldVariance);
+}
+
+void PrintSyNOptionsUsage(std::ostream & os, const std::string & prefix)
+{
+    PrintOption(os, prefix, "shrink-factors <list>", "pyramid shrink factors (default 4,2,1)");
+    PrintOption(os, prefix, "smoothing-sigmas <list>", "pyramid sigmas in mm (default 2,1,0)");
+    PrintOption(os, prefix, "iterations <list>", "SyN iterations per level (default 40,20,10)");
+    PrintOption(os, prefix, "learning-rate <r>", "gradient step (default 0.25)");
+    PrintOption(os, prefix, "update-variance <mm2>", "update field smoothing variance, physical at every level (default 3)");
+    PrintOption(os, prefix, "total-variance <mm2>", "total field smoothing variance, physical at every level (default 0)");
+}
+
+} // namespace tt
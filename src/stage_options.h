@@ -0,0 +1,60 @@
+//
+// Command-line options for the registration stages, shared by the
+// stand-alone tools (no prefix, e.g. --shrink-factors) and the pipeline
+// driver (prefixed, e.g. --rigid-shrink-factors).
+//
+
+#ifndef TUMOURTRACKER_STAGE_OPTIONS_H
+#define TUMOURTRACKER_STAGE_OPTIONS_H
+
+#include <ostream>
+#include <string>
+
+#include "command_line.h"
+#include "deformable_engines.h"
+#include "stages.h"
+
+namespace tt
+{
+
+// "  --<prefix><name>   <help>" usage line, aligned with the other options.
+void PrintOption(std::ostream & os, const std::string & prefix, const std::string & name,
+                 const std::string & help);
+
+// --fixed-mask <mask.nii>: read the mask into the sampling parameters. The
+// mask is used in physical space, so any grid covering T0 works.
+void ReadFixedMaskOption(const CommandLine & cmd, MetricSamplingParameters & sampling);
+
+// --crop off|on (off unless given) with --crop-margin <mm>, --crop-threshold
+// <t> (default: --crop-fraction of the maximum) and --crop-mask <mask.nii>.
+// Returns whether cropping is on.
+bool ReadForegroundCropOptions(const CommandLine & cmd, ForegroundCropParameters & parameters);
+void PrintForegroundCropOptionsUsage(std::ostream & os);
+
+// --field-type float|double (float unless given).
+FieldPrecision ReadFieldPrecisionOption(const CommandLine & cmd);
+
+// --interpolation linear|nearest|bspline|sinc (linear unless given).
+Interpolation ReadInterpolationOption(const CommandLine & cmd);
+
+// --backend cpu|opencl|auto (cpu unless given).
+ComputeBackend ReadComputeBackendOption(const CommandLine & cmd);
+
+// --level-storage float|int16 (float unless given).
+LevelStorage ReadLevelStorageOption(const CommandLine & cmd);
+
+void ParseRigidOptions(const CommandLine & cmd, const std::string & prefix, RigidParameters & parameters);
+void PrintRigidOptionsUsage(std::ostream & os, const std::string & prefix);
+
+void ParseBSplineOptions(const CommandLine & cmd, const std::string & prefix, BSplineParameters & parameters);
+void PrintBSplineOptionsUsage(std::ostream & os, const std::string & prefix);
+
+void ParseDemonsOptions(const CommandLine & cmd, const std::string & prefix, DemonsParameters & parameters);
+void PrintDemonsOptionsUsage(std::ostream & os, const std::string & prefix);
+
+void ParseSyNOptions(const CommandLine & cmd, const std::string & prefix, SyNParameters & parameters);
+void PrintSyNOptionsUsage(std::ostream & os, const std::string & prefix);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_STAGE_OPTIONS_H
@@ -0,0 +1,2419 @@
+//
+// Processing stages shared by the command-line tools and the pipeline driver
+//
+
+#include "stages.h"
+#include "resample_kernels.h"
+#include "volume_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+// --------------------
+// Core ITK image types
+// --------------------
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+#include <itkImageIOFactory.h>
+#include <itkTransformFileReader.h>
+#include <itkTransformFileWriter.h>
+#include <itkStreamingImageFilter.h>
+#include <itkUnaryGeneratorImageFilter.h>
+
+// --------------------
+// Resampling
+// --------------------
+#include <itkResampleImageFilter.h>
+#include <itkIdentityTransform.h>
+#include <itkLinearInterpolateImageFunction.h>
+#include <itkNearestNeighborInterpolateImageFunction.h>
+#include <itkBSplineInterpolateImageFunction.h>
+#include <itkWindowedSincInterpolateImageFunction.h>
+#include <itkTransformToDisplacementFieldFilter.h>
+#include <itkCastImageFilter.h>
+
+// --------------------
+// Registration components
+// --------------------
+#include <itkImageRegistrationMethodv4.h>
+#include <itkMattesMutualInformationImageToImageMetricv4.h>
+#include <itkRegularStepGradientDescentOptimizerv4.h>
+#include <itkLBFGSOptimizerv4.h>
+#include <itkLBFGSBOptimizerv4.h>
+#include <itkWindowConvergenceMonitoringFunction.h>
+#include <itkCommand.h>
+#include <itkBSplineTransformInitializer.h>
+#include <itkBSplineTransformParametersAdaptor.h>
+#include <itkImageMaskSpatialObject.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkMath.h>
+#include <itkRegionOfInterestImageFilter.h>
+
+// --------------------
+// QA
+// --------------------
+#include <itkMultiThreaderBase.h>
+
+namespace tt
+{
+
+namespace
+{
+
+template <typename TImage>
+using LevelMetricType = itk::MattesMutualInformationImageToImageMetricv4<TImage, TImage>;
+template <typename TImage>
+using LevelRegistrationType = itk::ImageRegistrationMethodv4<TImage, TImage>;
+
+// Mattes MI settings shared by the rigid and B-spline stages.
+struct MetricSettings
+{
+    unsigned int                     numberOfHistogramBins = 50;
+    const MetricSamplingParameters * sampling              = nullptr;
+    ComputeBackend                   backend               = ComputeBackend::CPU;
+};
+
+// The OpenCL metric (opencl_backend.h) takes float images only.
+template <typename TImage>
+typename LevelMetricType<TImage>::Pointer NewLevelMetric(ComputeBackend)
+{
+    return LevelMetricType<TImage>::New();
+}
+
+template <>
+LevelMetricType<ImageType>::Pointer NewLevelMetric<ImageType>(ComputeBackend backend)
+{
+    return NewMattesMetric(backend);
+}
+
+// Bound the registration, its metric and its optimizer to the job's share of
+// the thread pool (0 keeps the ITK defaults).
+template <typename TRegistration, typename TMetric>
+void SetWorkUnits(TRegistration * registration, TMetric * metric,
+                  itk::ObjectToObjectOptimizerBaseTemplate<double> * optimizer,
+                  unsigned int numberOfWorkUnits)
+{
+    if (numberOfWorkUnits == 0)
+    {
+        return;
+    }
+    registration->SetNumberOfWorkUnits(numberOfWorkUnits);
+    metric->SetMaximumNumberOfWorkUnits(numberOfWorkUnits);
+    optimizer->SetNumberOfWorkUnits(numberOfWorkUnits);
+}
+
+// Restrict the metric (and hence REGULAR/RANDOM sample points) to the mask.
+template <typename TMetric>
+void SetFixedMask(TMetric * metric, const MetricSamplingParameters & sampling)
+{
+    if (!sampling.fixedMask)
+    {
+        return;
+    }
+    using MaskSpatialObjectType = itk::ImageMaskSpatialObject<3>;
+    auto maskObject = MaskSpatialObjectType::New();
+    maskObject->SetImage(sampling.fixedMask);
+    maskObject->Update();
+    metric->SetFixedImageMask(maskObject);
+}
+
+// One resolution level on precomputed pyramid images. The registration
+// method's own pyramid is collapsed to a single unshrunk, unsmoothed level
+// so the cached levels are used as they are. movingInitialTransform, when
+// given, is composed in front of transform but left untouched.
+template <typename TImage>
+void RegisterLevel(const TImage * fixed, const TImage * moving,
+                   const MetricSettings & settings,
+                   itk::ObjectToObjectOptimizerBaseTemplate<double> * optimizer,
+                   TransformBaseType * transform,
+                   const TransformBaseType * movingInitialTransform,
+                   unsigned int level,
+                   unsigned int numberOfWorkUnits,
+                   IterationRecorder * iterations)
+{
+    using RegistrationType = LevelRegistrationType<TImage>;
+    const MetricSamplingParameters & sampling = *settings.sampling;
+
+    auto metric = NewLevelMetric<TImage>(settings.backend);
+    metric->SetNumberOfHistogramBins(settings.numberOfHistogramBins);
+    metric->SetUseFixedImageGradientFilter(false);
+    metric->SetUseMovingImageGradientFilter(false);
+    SetFixedMask(metric.GetPointer(), sampling);
+
+    auto registration = RegistrationType::New();
+    registration->SetFixedImage(fixed);
+    registration->SetMovingImage(moving);
+    registration->SetMetric(metric);
+    registration->SetOptimizer(optimizer);
+    registration->SetInitialTransform(transform);
+    if (movingInitialTransform != nullptr)
+    {
+        registration->SetMovingInitialTransform(movingInitialTransform);
+    }
+    registration->InPlaceOn();
+
+    typename RegistrationType::ShrinkFactorsArrayType   shrinkFactorsPerLevel(1);
+    typename RegistrationType::SmoothingSigmasArrayType smoothingSigmasPerLevel(1);
+    shrinkFactorsPerLevel.Fill(1);
+    smoothingSigmasPerLevel.Fill(0.0);
+
+    registration->SetNumberOfLevels(1);
+    registration->SetShrinkFactorsPerLevel(shrinkFactorsPerLevel);
+    registration->SetSmoothingSigmasPerLevel(smoothingSigmasPerLevel);
+
+    if (sampling.strategy != MetricSamplingParameters::Strategy::None)
+    {
+        registration->SetMetricSamplingStrategy(
+            sampling.strategy == MetricSamplingParameters::Strategy::Regular
+                ? RegistrationType::MetricSamplingStrategyEnum::REGULAR
+                : RegistrationType::MetricSamplingStrategyEnum::RANDOM);
+
+        const std::vector<double> & percentages = sampling.percentagePerLevel;
+        registration->SetMetricSamplingPercentage(
+            percentages.empty() ? 1.0 : percentages[std::min<size_t>(level, percentages.size() - 1)]);
+        registration->MetricSamplingReinitializeSeed(sampling.seed + static_cast<int>(level));
+    }
+
+    SetWorkUnits(registration.GetPointer(), metric.GetPointer(), optimizer, numberOfWorkUnits);
+
+    // The optimizer outlives this level, so its observer is removed again.
+    unsigned long iterationTag = 0;
+    if (iterations != nullptr)
+    {
+        registration->AddObserver(itk::MultiResolutionIterationEvent(),
+                                  [=](const itk::EventObject &)
+                                  { iterations->BeginLevel(level, transform->GetNumberOfParameters()); });
+        iterationTag = optimizer->AddObserver(itk::IterationEvent(),
+                                              [=](const itk::EventObject &)
+                                              { iterations->Iteration(optimizer->GetCurrentMetricValue()); });
+    }
+
+    registration->Update();
+
+    if (iterations != nullptr)
+    {
+        optimizer->RemoveObserver(iterationTag);
+    }
+}
+
+// Smallest region of image covering the physical box, clipped to the image.
+ImageType::RegionType RegionCoveringBox(const itk::ImageBase<3> * image, const PointType & minimum,
+                                        const PointType & maximum)
+{
+    ImageType::IndexType lower;
+    ImageType::IndexType upper;
+    lower.Fill(std::numeric_limits<itk::IndexValueType>::max());
+    upper.Fill(std::numeric_limits<itk::IndexValueType>::lowest());
+    for (unsigned int corner = 0; corner < 8; ++corner)
+    {
+        PointType point;
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            point[d] = (corner >> d) & 1 ? maximum[d] : minimum[d];
+        }
+        itk::ContinuousIndex<double, 3> index;
+        image->TransformPhysicalPointToContinuousIndex(point, index);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            lower[d] = std::min(lower[d], static_cast<itk::IndexValueType>(std::floor(index[d])));
+            upper[d] = std::max(upper[d], static_cast<itk::IndexValueType>(std::ceil(index[d])));
+        }
+    }
+
+    ImageType::RegionType region;
+    region.SetIndex(lower);
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        region.SetSize(d, static_cast<itk::SizeValueType>(upper[d] - lower[d] + 1));
+    }
+    if (!region.Crop(image->GetLargestPossibleRegion()))
+    {
+        itkGenericExceptionMacro(<< "ROI does not overlap the fixed image");
+    }
+    return region;
+}
+
+template <typename TImage>
+typename TImage::Pointer CropToRegion(const TImage * image, const typename TImage::RegionType & region,
+                                      unsigned int numberOfWorkUnits)
+{
+    using CropFilterType = itk::RegionOfInterestImageFilter<TImage, TImage>;
+    auto crop = CropFilterType::New();
+    crop->SetInput(image);
+    crop->SetRegionOfInterest(region);
+    if (numberOfWorkUnits > 0)
+    {
+        crop->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    crop->Update();
+
+    typename TImage::Pointer cropped = crop->GetOutput();
+    cropped->DisconnectPipeline();
+    return cropped;
+}
+
+// A fixed pyramid level, cropped to the physical box [*roiMinimum,
+// *roiMaximum] when one is given.
+template <typename TImage>
+typename TImage::ConstPointer FixedLevel(typename TImage::ConstPointer level, const PointType * roiMinimum,
+                                         const PointType * roiMaximum, unsigned int numberOfWorkUnits)
+{
+    if (roiMinimum == nullptr)
+    {
+        return level;
+    }
+    return CropToRegion<TImage>(level, RegionCoveringBox(level, *roiMinimum, *roiMaximum), numberOfWorkUnits);
+}
+
+// Registers one level on the int16 copies of the pyramid levels when both
+// pyramids keep them and the metric runs on the CPU, on float levels
+// otherwise.
+void RegisterPyramidLevel(ImagePyramid & fixedPyramid, ImagePyramid & movingPyramid,
+                          unsigned int shrink, double sigma,
+                          const PointType * roiMinimum, const PointType * roiMaximum,
+                          const MetricSettings & settings,
+                          itk::ObjectToObjectOptimizerBaseTemplate<double> * optimizer,
+                          TransformBaseType * transform,
+                          const TransformBaseType * movingInitialTransform,
+                          unsigned int level,
+                          unsigned int numberOfWorkUnits,
+                          IterationRecorder * iterations)
+{
+    if (fixedPyramid.GetStorage() == LevelStorage::Int16 && movingPyramid.GetStorage() == LevelStorage::Int16 &&
+        !UseOpenCL(settings.backend))
+    {
+        const auto fixedLevel = FixedLevel<CompactImageType>(fixedPyramid.GetCompactLevel(shrink, sigma),
+                                                             roiMinimum, roiMaximum, numberOfWorkUnits);
+        RegisterLevel<CompactImageType>(fixedLevel, movingPyramid.GetCompactLevel(shrink, sigma), settings,
+                                        optimizer, transform, movingInitialTransform, level,
+                                        numberOfWorkUnits, iterations);
+        return;
+    }
+
+    const auto fixedLevel = FixedLevel<ImageType>(fixedPyramid.GetLevel(shrink, sigma), roiMinimum, roiMaximum,
+                                                  numberOfWorkUnits);
+    RegisterLevel<ImageType>(fixedLevel, movingPyramid.GetLevel(shrink, sigma), settings, optimizer, transform,
+                             movingInitialTransform, level, numberOfWorkUnits, iterations);
+}
+
+} // namespace
+
+// =====================================================
+// I/O
+// =====================================================
+
+ImageType::Pointer ReadImage(const std::string & fileName)
+{
+    if (IsRawVolumeFile(fileName))
+    {
+        return ReadRawVolume(fileName);
+    }
+
+    using ReaderType = itk::ImageFileReader<ImageType>;
+    auto reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+
+    ImageType::Pointer image = reader->GetOutput();
+    image->DisconnectPipeline();
+    return image;
+}
+
+MaskImageType::Pointer ReadMask(const std::string & fileName)
+{
+    using ReaderType = itk::ImageFileReader<MaskImageType>;
+    auto reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+
+    MaskImageType::Pointer mask = reader->GetOutput();
+    mask->DisconnectPipeline();
+    return mask;
+}
+
+void WriteImage(const ImageType * image, const std::string & fileName)
+{
+    if (IsRawVolumeFile(fileName))
+    {
+        WriteRawVolume(image, fileName);
+        return;
+    }
+
+    using WriterType = itk::ImageFileWriter<ImageType>;
+    auto writer = WriterType::New();
+    writer->SetFileName(fileName);
+    writer->SetInput(image);
+    writer->Update();
+}
+
+void WriteMask(const MaskImageType * mask, const std::string & fileName)
+{
+    using WriterType = itk::ImageFileWriter<MaskImageType>;
+    auto writer = WriterType::New();
+    writer->SetFileName(fileName);
+    writer->SetInput(mask);
+    writer->Update();
+}
+
+void WriteTransform(const TransformBaseType * transform, const std::string & fileName)
+{
+    using WriterType = itk::TransformFileWriterTemplate<double>;
+    auto writer = WriterType::New();
+    writer->SetFileName(fileName);
+    writer->SetInput(transform);
+    writer->Update();
+}
+
+TransformBaseType::Pointer ReadTransform(const std::string & fileName)
+{
+    using ReaderType = itk::TransformFileReaderTemplate<double>;
+    auto reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+
+    const ReaderType::TransformListType * transforms = reader->GetTransformList();
+    if (transforms->empty())
+    {
+        itkGenericExceptionMacro(<< "No transform in " << fileName);
+    }
+    auto transform = dynamic_cast<TransformBaseType *>(transforms->front().GetPointer());
+    if (transform == nullptr)
+    {
+        itkGenericExceptionMacro(<< fileName << " does not hold a 3D double-precision transform");
+    }
+    return transform;
+}
+
+// =====================================================
+// Resampling
+// =====================================================
+
+Interpolation ParseInterpolation(const std::string & name)
+{
+    if (name == "linear")
+    {
+        return Interpolation::Linear;
+    }
+    if (name == "nearest")
+    {
+        return Interpolation::NearestNeighbor;
+    }
+    if (name == "bspline")
+    {
+        return Interpolation::BSpline;
+    }
+    if (name == "sinc")
+    {
+        return Interpolation::WindowedSinc;
+    }
+    throw std::invalid_argument("unknown interpolation '" + name + "' (linear, nearest, bspline or sinc)");
+}
+
+const char * InterpolationName(Interpolation interpolation)
+{
+    switch (interpolation)
+    {
+        case Interpolation::Linear:
+            return "linear";
+        case Interpolation::NearestNeighbor:
+            return "nearest";
+        case Interpolation::BSpline:
+            return "bspline";
+        case Interpolation::WindowedSinc:
+            return "sinc";
+    }
+    return "linear";
+}
+
+namespace
+{
+
+template <typename TInputImage>
+using IsotropicResampleFilterType = itk::ResampleImageFilter<TInputImage, ImageType>;
+
+// Any interpolator followed by x -> x * scale + offset, so that a resample
+// writes normalized intensities in its own per-voxel loop.
+template <typename TInputImage>
+class IntensityMappedInterpolateImageFunction : public itk::InterpolateImageFunction<TInputImage, double>
+{
+public:
+    ITK_DISALLOW_COPY_AND_MOVE(IntensityMappedInterpolateImageFunction);
+
+    using Self       = IntensityMappedInterpolateImageFunction;
+    using Superclass = itk::InterpolateImageFunction<TInputImage, double>;
+    using Pointer    = itk::SmartPointer<Self>;
+
+    using typename Superclass::ContinuousIndexType;
+    using typename Superclass::InputImageType;
+    using typename Superclass::OutputType;
+    using typename Superclass::SizeType;
+
+    itkNewMacro(Self);
+    itkOverrideGetNameOfClassMacro(IntensityMappedInterpolateImageFunction);
+
+    void SetInterpolator(Superclass * interpolator) { m_Interpolator = interpolator; }
+
+    void SetIntensityMap(const IntensityStatistics & statistics)
+    {
+        m_Scale  = 1.0 / statistics.stddev;
+        m_Offset = -statistics.mean / statistics.stddev;
+    }
+
+    void SetInputImage(const InputImageType * image) override
+    {
+        Superclass::SetInputImage(image);
+        m_Interpolator->SetInputImage(image);
+    }
+
+    SizeType GetRadius() const override { return m_Interpolator->GetRadius(); }
+
+    OutputType EvaluateAtContinuousIndex(const ContinuousIndexType & index) const override
+    {
+        return m_Interpolator->EvaluateAtContinuousIndex(index) * m_Scale + m_Offset;
+    }
+
+protected:
+    IntensityMappedInterpolateImageFunction()           = default;
+    ~IntensityMappedInterpolateImageFunction() override = default;
+
+private:
+    typename Superclass::Pointer m_Interpolator;
+    double                       m_Scale  = 1.0;
+    double                       m_Offset = 0.0;
+};
+
+template <typename TImage>
+typename itk::InterpolateImageFunction<TImage, double>::Pointer MakeInterpolator(Interpolation interpolation)
+{
+    switch (interpolation)
+    {
+        case Interpolation::NearestNeighbor:
+            return itk::NearestNeighborInterpolateImageFunction<TImage, double>::New();
+        case Interpolation::BSpline:
+            return itk::BSplineInterpolateImageFunction<TImage, double, double>::New();
+        case Interpolation::WindowedSinc:
+            return itk::WindowedSincInterpolateImageFunction<TImage, 3, itk::Function::HammingWindowFunction<3>>::New();
+        case Interpolation::Linear:
+            break;
+    }
+    return itk::LinearInterpolateImageFunction<TImage, double>::New();
+}
+
+// Identity-transform resampler onto the isotropic grid spanning input.
+// Only the input's output information is needed, so it can sit behind a
+// reader that has not been updated. The output is float whatever the input
+// pixel type; with normalization, intensities are mapped as they are
+// interpolated (background included, as an in-place pass would).
+template <typename TInputImage>
+typename IsotropicResampleFilterType<TInputImage>::Pointer
+MakeIsotropicResampler(const TInputImage * input, double spacing, unsigned int numberOfWorkUnits,
+                       const IntensityStatistics * normalization = nullptr,
+                       Interpolation interpolation = Interpolation::Linear)
+{
+    using TransformType = itk::IdentityTransform<double, 3>;
+
+    ImageType::SpacingType newSpacing;
+    newSpacing.Fill(spacing);
+
+    typename TInputImage::SizeType inputSize = input->GetLargestPossibleRegion().GetSize();
+    ImageType::SpacingType inputSpacing = input->GetSpacing();
+    ImageType::SizeType    newSize;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        newSize[i] = static_cast<unsigned int>(inputSize[i] * (inputSpacing[i] / newSpacing[i]));
+    }
+
+    auto resampler = IsotropicResampleFilterType<TInputImage>::New();
+    resampler->SetInput(input);
+    resampler->SetTransform(TransformType::New());
+    if (normalization != nullptr)
+    {
+        auto interpolator = IntensityMappedInterpolateImageFunction<TInputImage>::New();
+        interpolator->SetInterpolator(MakeInterpolator<TInputImage>(interpolation));
+        interpolator->SetIntensityMap(*normalization);
+        resampler->SetInterpolator(interpolator);
+        resampler->SetDefaultPixelValue(static_cast<float>(-normalization->mean / normalization->stddev));
+    }
+    else
+    {
+        resampler->SetInterpolator(MakeInterpolator<TInputImage>(interpolation));
+    }
+    resampler->SetOutputSpacing(newSpacing);
+    resampler->SetSize(newSize);
+    resampler->SetOutputOrigin(input->GetOrigin());
+    resampler->SetOutputDirection(input->GetDirection());
+    if (numberOfWorkUnits > 0)
+    {
+        resampler->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    return resampler;
+}
+
+// Runs an isotropic resampler built on a buffered input: in the direct
+// loops when the interpolator allows, else through the filter.
+template <typename TInputImage>
+ImageType::Pointer RunIsotropicResample(const TInputImage * input, double spacing, unsigned int numberOfWorkUnits,
+                                        const IntensityStatistics * normalization, Interpolation interpolation)
+{
+    auto resampler = MakeIsotropicResampler(input, spacing, numberOfWorkUnits, normalization, interpolation);
+    resampler->UpdateOutputInformation();
+    if (ImageType::Pointer output =
+            ResampleDirect(input, nullptr, resampler->GetOutput(), interpolation, normalization, numberOfWorkUnits))
+    {
+        return output;
+    }
+    resampler->Update();
+
+    ImageType::Pointer output = resampler->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+// Write through the requested-region pipeline in numberOfDivisions slabs.
+// When the output format cannot be written piecewise, a StreamingImageFilter
+// still streams everything upstream of the writer.
+template <typename TImage>
+bool WriteStreamed(const TImage * image, const std::string & fileName, unsigned int numberOfDivisions)
+{
+    itk::ImageIOBase::Pointer io =
+        itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::IOFileModeEnum::WriteMode);
+    const bool canStreamWrite = io && io->CanStreamWrite();
+
+    using WriterType = itk::ImageFileWriter<TImage>;
+    auto writer = WriterType::New();
+    writer->SetFileName(fileName);
+
+    if (canStreamWrite || numberOfDivisions <= 1)
+    {
+        writer->SetInput(image);
+        writer->SetNumberOfStreamDivisions(numberOfDivisions);
+        writer->Update();
+    }
+    else
+    {
+        using StreamerType = itk::StreamingImageFilter<TImage, TImage>;
+        auto streamer = StreamerType::New();
+        streamer->SetInput(image);
+        streamer->SetNumberOfStreamDivisions(numberOfDivisions);
+        writer->SetInput(streamer->GetOutput());
+        writer->Update();
+    }
+    return canStreamWrite;
+}
+
+} // namespace
+
+ImageType::Pointer ResampleIsotropic(const ImageType * input, double spacing,
+                                     unsigned int numberOfWorkUnits, ComputeBackend backend,
+                                     Interpolation interpolation)
+{
+    if (interpolation == Interpolation::Linear && UseOpenCL(backend))
+    {
+        auto resampler = MakeIsotropicResampler(input, spacing, numberOfWorkUnits);
+        resampler->UpdateOutputInformation();
+        if (ImageType::Pointer output = ResampleLinearOpenCL(input, nullptr, resampler->GetOutput()))
+        {
+            return output;
+        }
+    }
+    return RunIsotropicResample(input, spacing, numberOfWorkUnits, nullptr, interpolation);
+}
+
+namespace
+{
+
+// Region of image covering the nonzero voxels of mask (any grid) plus the
+// margin.
+ImageType::RegionType MaskForegroundRegion(const itk::ImageBase<3> * image, const MaskImageType * mask,
+                                           double margin)
+{
+    ImageType::IndexType lower;
+    ImageType::IndexType upper;
+    lower.Fill(std::numeric_limits<itk::IndexValueType>::max());
+    upper.Fill(std::numeric_limits<itk::IndexValueType>::lowest());
+    bool any = false;
+    for (itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(mask, mask->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+        if (it.Get() != 0)
+        {
+            any = true;
+            for (unsigned int d = 0; d < 3; ++d)
+            {
+                lower[d] = std::min(lower[d], it.GetIndex()[d]);
+                upper[d] = std::max(upper[d], it.GetIndex()[d]);
+            }
+        }
+    }
+    if (!any)
+    {
+        return image->GetLargestPossibleRegion();
+    }
+
+    PointType minimum;
+    PointType maximum;
+    minimum.Fill(std::numeric_limits<double>::max());
+    maximum.Fill(std::numeric_limits<double>::lowest());
+    for (unsigned int corner = 0; corner < 8; ++corner)
+    {
+        ImageType::IndexType index;
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            index[d] = (corner >> d) & 1 ? upper[d] : lower[d];
+        }
+        PointType point;
+        mask->TransformIndexToPhysicalPoint(index, point);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            minimum[d] = std::min(minimum[d], point[d] - margin);
+            maximum[d] = std::max(maximum[d], point[d] + margin);
+        }
+    }
+    return RegionCoveringBox(image, minimum, maximum);
+}
+
+// Voxels above the threshold (by default a fraction of the maximum), one
+// z-slice per item: each slice's x/y box, then the boxes merged.
+template <typename TImage>
+ImageType::RegionType ForegroundRegionOf(const TImage * image, const ForegroundCropParameters & parameters)
+{
+    if (parameters.mask)
+    {
+        return MaskForegroundRegion(image, parameters.mask, parameters.margin);
+    }
+
+    using PixelType = typename TImage::PixelType;
+
+    const ImageType::RegionType region    = image->GetBufferedRegion();
+    const ImageType::SizeType   size      = region.GetSize();
+    const itk::SizeValueType    sliceSize = size[0] * size[1];
+    const PixelType *           buffer    = image->GetBufferPointer();
+
+    auto threader = itk::MultiThreaderBase::New();
+    if (parameters.numberOfWorkUnits > 0)
+    {
+        threader->SetNumberOfWorkUnits(parameters.numberOfWorkUnits);
+    }
+
+    double threshold = parameters.threshold;
+    if (threshold < 0.0)
+    {
+        std::vector<double> maxima(size[2], std::numeric_limits<double>::lowest());
+        threader->ParallelizeArray(
+            0,
+            size[2],
+            [&](itk::SizeValueType z)
+            {
+                const PixelType * slice = buffer + z * sliceSize;
+                maxima[z]               = double(*std::max_element(slice, slice + sliceSize));
+            },
+            nullptr);
+        threshold = parameters.thresholdFraction * *std::max_element(maxima.begin(), maxima.end());
+    }
+
+    constexpr itk::IndexValueType kNone = std::numeric_limits<itk::IndexValueType>::max();
+    struct SliceBox
+    {
+        itk::IndexValueType minimum[2] = { kNone, kNone };
+        itk::IndexValueType maximum[2] = { -kNone, -kNone };
+    };
+    std::vector<SliceBox> boxes(size[2]);
+    threader->ParallelizeArray(
+        0,
+        size[2],
+        [&](itk::SizeValueType z)
+        {
+            SliceBox & box = boxes[z];
+            for (itk::SizeValueType y = 0; y < size[1]; ++y)
+            {
+                const PixelType * row = buffer + z * sliceSize + y * size[0];
+                for (itk::SizeValueType x = 0; x < size[0]; ++x)
+                {
+                    if (double(row[x]) > threshold)
+                    {
+                        box.minimum[0] = std::min<itk::IndexValueType>(box.minimum[0], x);
+                        box.maximum[0] = std::max<itk::IndexValueType>(box.maximum[0], x);
+                        box.minimum[1] = std::min<itk::IndexValueType>(box.minimum[1], y);
+                        box.maximum[1] = std::max<itk::IndexValueType>(box.maximum[1], y);
+                    }
+                }
+            }
+        },
+        nullptr);
+
+    ImageType::IndexType lower;
+    ImageType::IndexType upper;
+    lower.Fill(kNone);
+    upper.Fill(-kNone);
+    for (itk::SizeValueType z = 0; z < size[2]; ++z)
+    {
+        if (boxes[z].minimum[0] == kNone)
+        {
+            continue;
+        }
+        for (unsigned int d = 0; d < 2; ++d)
+        {
+            lower[d] = std::min(lower[d], boxes[z].minimum[d]);
+            upper[d] = std::max(upper[d], boxes[z].maximum[d]);
+        }
+        lower[2] = std::min<itk::IndexValueType>(lower[2], z);
+        upper[2] = std::max<itk::IndexValueType>(upper[2], z);
+    }
+    if (lower[2] == kNone)
+    {
+        return image->GetLargestPossibleRegion();
+    }
+
+    ImageType::RegionType foreground;
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        const auto pad = static_cast<itk::IndexValueType>(std::ceil(parameters.margin / image->GetSpacing()[d]));
+        foreground.SetIndex(d, region.GetIndex(d) + lower[d] - pad);
+        foreground.SetSize(d, static_cast<itk::SizeValueType>(upper[d] - lower[d] + 1 + 2 * pad));
+    }
+    foreground.Crop(image->GetLargestPossibleRegion());
+    return foreground;
+}
+
+// normalization.mask on the grid of image: as given when it already shares
+// that grid, else resampled onto it (nearest neighbour, physical space;
+// outside the mask's extent counts as background). Null without a mask.
+MaskImageType::ConstPointer StatisticsMask(const NormalizationParameters & normalization,
+                                           const itk::ImageBase<3> * image)
+{
+    const MaskImageType * mask = normalization.mask;
+    if (mask == nullptr)
+    {
+        return nullptr;
+    }
+    if (mask->GetBufferedRegion() == image->GetBufferedRegion() && mask->GetOrigin() == image->GetOrigin() &&
+        mask->GetSpacing() == image->GetSpacing() && mask->GetDirection() == image->GetDirection())
+    {
+        return mask;
+    }
+
+    using ResampleFilterType = itk::ResampleImageFilter<MaskImageType, MaskImageType>;
+    auto resampler = ResampleFilterType::New();
+    resampler->SetInput(mask);
+    resampler->SetOutputOrigin(image->GetOrigin());
+    resampler->SetOutputSpacing(image->GetSpacing());
+    resampler->SetOutputDirection(image->GetDirection());
+    resampler->SetOutputStartIndex(image->GetBufferedRegion().GetIndex());
+    resampler->SetSize(image->GetBufferedRegion().GetSize());
+    resampler->SetInterpolator(MakeInterpolator<MaskImageType>(Interpolation::NearestNeighbor));
+    resampler->SetDefaultPixelValue(0);
+    if (normalization.numberOfWorkUnits > 0)
+    {
+        resampler->SetNumberOfWorkUnits(normalization.numberOfWorkUnits);
+    }
+    resampler->Update();
+
+    MaskImageType::Pointer output = resampler->GetOutput();
+    output->DisconnectPipeline();
+    return output.GetPointer();
+}
+
+// Reads fileName with its stored pixel type.
+template <typename TPixel>
+itk::ImageBase<3>::Pointer ReadImageAs(const std::string & fileName)
+{
+    using InputImageType = itk::Image<TPixel, 3>;
+    using ReaderType     = itk::ImageFileReader<InputImageType>;
+    auto reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+
+    typename InputImageType::Pointer image = reader->GetOutput();
+    image->DisconnectPipeline();
+    return image.GetPointer();
+}
+
+// Resamples a volume in its stored pixel type straight to float, so the
+// full-resolution volume is only ever held in that type. With
+// normalization, the statistics are taken on the stored voxels.
+template <typename TPixel>
+ImageType::Pointer ResampleStoredAs(const itk::Image<TPixel, 3> * stored, double spacing,
+                                    unsigned int numberOfWorkUnits, const ForegroundCropParameters * crop,
+                                    const NormalizationParameters * normalization, IntensityStatistics * statistics,
+                                    Interpolation interpolation)
+{
+    using InputImageType = itk::Image<TPixel, 3>;
+
+    typename InputImageType::ConstPointer input = stored;
+    if (crop != nullptr)
+    {
+        input = CropToRegion<InputImageType>(input, ForegroundRegionOf(input.GetPointer(), *crop), numberOfWorkUnits);
+    }
+
+    IntensityStatistics stats;
+    if (normalization != nullptr)
+    {
+        NormalizationParameters parameters = *normalization;
+        parameters.numberOfWorkUnits       = numberOfWorkUnits;
+        const MaskImageType::ConstPointer mask = StatisticsMask(parameters, input.GetPointer());
+        stats = ComputeIntensityStatisticsOf(input.GetPointer(), parameters, mask.GetPointer());
+        if (statistics != nullptr)
+        {
+            *statistics = stats;
+        }
+    }
+
+    return RunIsotropicResample<InputImageType>(input, spacing, numberOfWorkUnits, normalization ? &stats : nullptr,
+                                                interpolation);
+}
+
+template <typename TPixel>
+ImageType::Pointer CastToFloat(const itk::Image<TPixel, 3> * stored)
+{
+    using CastType = itk::CastImageFilter<itk::Image<TPixel, 3>, ImageType>;
+    auto cast = CastType::New();
+    cast->SetInput(stored);
+    cast->Update();
+
+    ImageType::Pointer image = cast->GetOutput();
+    image->DisconnectPipeline();
+    return image;
+}
+
+} // namespace
+
+ImageType::RegionType ForegroundRegion(const ImageType * image, const ForegroundCropParameters & parameters)
+{
+    return ForegroundRegionOf(image, parameters);
+}
+
+ImageType::Pointer CropToForeground(const ImageType * image, const ForegroundCropParameters & parameters)
+{
+    return CropToRegion<ImageType>(image, ForegroundRegionOf(image, parameters), parameters.numberOfWorkUnits);
+}
+
+ImageType::Pointer ResampleIsotropicNormalized(const ImageType * input, const NormalizationParameters & normalization,
+                                               double spacing, unsigned int numberOfWorkUnits,
+                                               ComputeBackend backend, IntensityStatistics * statistics,
+                                               Interpolation interpolation)
+{
+    NormalizationParameters parameters = normalization;
+    parameters.numberOfWorkUnits       = numberOfWorkUnits;
+    const MaskImageType::ConstPointer mask  = StatisticsMask(parameters, input);
+    const IntensityStatistics         stats = ComputeIntensityStatistics(input, parameters, mask.GetPointer());
+    if (statistics != nullptr)
+    {
+        *statistics = stats;
+    }
+
+    // The device resamples without the map; it is applied afterwards there.
+    if (interpolation == Interpolation::Linear && UseOpenCL(backend))
+    {
+        ImageType::Pointer output = ResampleIsotropic(input, spacing, numberOfWorkUnits, backend);
+        ApplyIntensityNormalization(output, stats, numberOfWorkUnits);
+        return output;
+    }
+    return RunIsotropicResample(input, spacing, numberOfWorkUnits, &stats, interpolation);
+}
+
+namespace
+{
+
+ImageType::Pointer ResampleStoredImpl(const itk::ImageBase<3> * stored, double spacing, unsigned int numberOfWorkUnits,
+                                      ComputeBackend backend, const ForegroundCropParameters * crop,
+                                      const NormalizationParameters * normalization,
+                                      IntensityStatistics * statistics, Interpolation interpolation)
+{
+    const bool device = interpolation == Interpolation::Linear && UseOpenCL(backend);
+
+    // The device only takes float volumes
+    ImageType::ConstPointer image = dynamic_cast<const ImageType *>(stored);
+    if (!image)
+    {
+        if (auto input = dynamic_cast<const itk::Image<short, 3> *>(stored))
+        {
+            if (!device)
+            {
+                return ResampleStoredAs(input, spacing, numberOfWorkUnits, crop, normalization, statistics,
+                                        interpolation);
+            }
+            image = CastToFloat(input);
+        }
+        else if (auto input = dynamic_cast<const itk::Image<unsigned short, 3> *>(stored))
+        {
+            if (!device)
+            {
+                return ResampleStoredAs(input, spacing, numberOfWorkUnits, crop, normalization, statistics,
+                                        interpolation);
+            }
+            image = CastToFloat(input);
+        }
+        else if (auto input = dynamic_cast<const itk::Image<char, 3> *>(stored))
+        {
+            if (!device)
+            {
+                return ResampleStoredAs(input, spacing, numberOfWorkUnits, crop, normalization, statistics,
+                                        interpolation);
+            }
+            image = CastToFloat(input);
+        }
+        else if (auto input = dynamic_cast<const itk::Image<unsigned char, 3> *>(stored))
+        {
+            if (!device)
+            {
+                return ResampleStoredAs(input, spacing, numberOfWorkUnits, crop, normalization, statistics,
+                                        interpolation);
+            }
+            image = CastToFloat(input);
+        }
+        else
+        {
+            itkGenericExceptionMacro(<< "Unsupported stored pixel type for isotropic resampling");
+        }
+    }
+
+    if (crop != nullptr)
+    {
+        image = CropToForeground(image, *crop);
+    }
+    if (normalization != nullptr)
+    {
+        return ResampleIsotropicNormalized(image, *normalization, spacing, numberOfWorkUnits, backend, statistics,
+                                           interpolation);
+    }
+    return ResampleIsotropic(image, spacing, numberOfWorkUnits, backend, interpolation);
+}
+
+// The device path reads float directly rather than casting a stored copy.
+itk::ImageBase<3>::Pointer ReadForResample(const std::string & fileName, ComputeBackend backend,
+                                           Interpolation interpolation)
+{
+    if (interpolation == Interpolation::Linear && UseOpenCL(backend))
+    {
+        return ReadImage(fileName).GetPointer();
+    }
+    return ReadStoredImage(fileName);
+}
+
+} // namespace
+
+itk::ImageBase<3>::Pointer ReadStoredImage(const std::string & fileName)
+{
+    if (!IsRawVolumeFile(fileName))
+    {
+        itk::ImageIOBase::Pointer io =
+            itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::IOFileModeEnum::ReadMode);
+        if (io)
+        {
+            io->SetFileName(fileName);
+            io->ReadImageInformation();
+            if (io->GetNumberOfComponents() == 1)
+            {
+                switch (io->GetComponentType())
+                {
+                    case itk::IOComponentEnum::SHORT:
+                        return ReadImageAs<short>(fileName);
+                    case itk::IOComponentEnum::USHORT:
+                        return ReadImageAs<unsigned short>(fileName);
+                    case itk::IOComponentEnum::CHAR:
+                        return ReadImageAs<char>(fileName);
+                    case itk::IOComponentEnum::UCHAR:
+                        return ReadImageAs<unsigned char>(fileName);
+                    default:
+                        break;
+                }
+            }
+        }
+    }
+    return ReadImage(fileName).GetPointer();
+}
+
+ImageType::Pointer ResampleStoredIsotropic(const itk::ImageBase<3> * stored, double spacing,
+                                           unsigned int numberOfWorkUnits, ComputeBackend backend,
+                                           const ForegroundCropParameters * crop, Interpolation interpolation)
+{
+    return ResampleStoredImpl(stored, spacing, numberOfWorkUnits, backend, crop, nullptr, nullptr, interpolation);
+}
+
+ImageType::Pointer ResampleStoredIsotropicNormalized(const itk::ImageBase<3> * stored,
+                                                     const NormalizationParameters & normalization, double spacing,
+                                                     unsigned int numberOfWorkUnits, ComputeBackend backend,
+                                                     const ForegroundCropParameters * crop,
+                                                     IntensityStatistics * statistics, Interpolation interpolation)
+{
+    return ResampleStoredImpl(stored, spacing, numberOfWorkUnits, backend, crop, &normalization, statistics,
+                              interpolation);
+}
+
+ImageType::Pointer ReadIsotropic(const std::string & fileName, double spacing,
+                                 unsigned int numberOfWorkUnits, ComputeBackend backend,
+                                 const ForegroundCropParameters * crop, Interpolation interpolation)
+{
+    return ResampleStoredIsotropic(ReadForResample(fileName, backend, interpolation), spacing, numberOfWorkUnits,
+                                   backend, crop, interpolation);
+}
+
+ImageType::Pointer ReadIsotropicNormalized(const std::string & fileName, const NormalizationParameters & normalization,
+                                           double spacing, unsigned int numberOfWorkUnits, ComputeBackend backend,
+                                           const ForegroundCropParameters * crop, IntensityStatistics * statistics,
+                                           Interpolation interpolation)
+{
+    return ResampleStoredIsotropicNormalized(ReadForResample(fileName, backend, interpolation), normalization,
+                                             spacing, numberOfWorkUnits, backend, crop, statistics, interpolation);
+}
+
+StreamingResampleResult ResampleIsotropicFile(const std::string & inputFile,
+                                              const std::string & outputFile,
+                                              const StreamingResampleOptions & options)
+{
+    using ReaderType = itk::ImageFileReader<ImageType>;
+    auto reader = ReaderType::New();
+    reader->SetFileName(inputFile);
+    reader->UpdateOutputInformation();
+
+    // Finding the foreground box needs the whole input once; the resample
+    // of the box still streams in slabs.
+    using CropFilterType = itk::RegionOfInterestImageFilter<ImageType, ImageType>;
+    const ImageType *       input = reader->GetOutput();
+    CropFilterType::Pointer crop;
+    if (options.cropForeground)
+    {
+        reader->Update();
+        crop = CropFilterType::New();
+        crop->SetInput(reader->GetOutput());
+        crop->SetRegionOfInterest(ForegroundRegion(reader->GetOutput(), options.crop));
+        if (options.numberOfWorkUnits > 0)
+        {
+            crop->SetNumberOfWorkUnits(options.numberOfWorkUnits);
+        }
+        crop->UpdateOutputInformation();
+        input = crop->GetOutput();
+    }
+
+    // Normalization statistics are taken on the whole input grid; the map is
+    // then applied as each slab is resampled.
+    StreamingResampleResult result;
+    if (options.normalize)
+    {
+        if (options.outputType == VoxelType::Int16)
+        {
+            itkGenericExceptionMacro(<< "Normalized intensities cannot be written as int16");
+        }
+        if (crop)
+        {
+            crop->Update();
+        }
+        else
+        {
+            reader->Update();
+        }
+        NormalizationParameters parameters = options.normalization;
+        parameters.numberOfWorkUnits       = options.numberOfWorkUnits;
+        const MaskImageType::ConstPointer mask = StatisticsMask(parameters, input);
+        result.statistics = ComputeIntensityStatistics(input, parameters, mask.GetPointer());
+    }
+
+    auto resampler = MakeIsotropicResampler(input, options.spacing, options.numberOfWorkUnits,
+                                            options.normalize ? &result.statistics : nullptr, options.interpolation);
+    resampler->UpdateOutputInformation();
+
+    result.spacing = resampler->GetOutput()->GetSpacing();
+    result.size    = resampler->GetOutput()->GetLargestPossibleRegion().GetSize();
+
+    // Per slab, the reader's input slab (float) and the resampled slab (float,
+    // plus the int16 copy when converting) are alive at the same time.
+    const double inputBytes =
+        double(input->GetLargestPossibleRegion().GetNumberOfPixels()) * sizeof(float);
+    const double outputBytes =
+        double(resampler->GetOutput()->GetLargestPossibleRegion().GetNumberOfPixels()) *
+        (sizeof(float) + (options.outputType == VoxelType::Int16 ? sizeof(short) : 0));
+    result.numberOfDivisions = 1;
+    if (options.memoryBudgetMB > 0.0)
+    {
+        const double budgetBytes = options.memoryBudgetMB * 1024.0 * 1024.0;
+        result.numberOfDivisions =
+            static_cast<unsigned int>(std::ceil((inputBytes + outputBytes) / budgetBytes));
+        result.numberOfDivisions =
+            std::max(1u, std::min<unsigned int>(result.numberOfDivisions, result.size[2]));
+    }
+
+    // In one piece the device, or else the direct loops, can take the whole
+    // volume instead.
+    const ImageType *  resampled = resampler->GetOutput();
+    ImageType::Pointer whole;
+    if (result.numberOfDivisions == 1)
+    {
+        if (crop)
+        {
+            crop->Update();
+        }
+        else
+        {
+            reader->Update();
+        }
+        if (options.interpolation == Interpolation::Linear && UseOpenCL(options.backend))
+        {
+            whole = ResampleLinearOpenCL(input, nullptr, resampler->GetOutput());
+            if (whole && options.normalize)
+            {
+                ApplyIntensityNormalization(whole, result.statistics, options.numberOfWorkUnits);
+            }
+        }
+        if (!whole)
+        {
+            whole = ResampleDirect(input, nullptr, resampler->GetOutput(), options.interpolation,
+                                   options.normalize ? &result.statistics : nullptr, options.numberOfWorkUnits);
+        }
+        if (whole)
+        {
+            resampled = whole;
+        }
+    }
+
+    if (options.outputType == VoxelType::Int16)
+    {
+        using ShortImageType = itk::Image<short, 3>;
+        using CastType       = itk::UnaryGeneratorImageFilter<ImageType, ShortImageType>;
+        auto cast = CastType::New();
+        cast->SetInput(resampled);
+        cast->SetFunctor(
+            [](const float & value) -> short
+            {
+                const float clamped = std::min(std::max(value, -32768.0f), 32767.0f);
+                return static_cast<short>(std::lround(clamped));
+            });
+        if (options.numberOfWorkUnits > 0)
+        {
+            cast->SetNumberOfWorkUnits(options.numberOfWorkUnits);
+        }
+        result.streamedWrite = WriteStreamed(cast->GetOutput(), outputFile, result.numberOfDivisions);
+    }
+    else
+    {
+        result.streamedWrite = WriteStreamed(resampled, outputFile, result.numberOfDivisions);
+    }
+    return result;
+}
+
+ImageType::Pointer ResampleToReference(const ImageType * moving,
+                                       const TransformBaseType * transform,
+                                       const ImageType * reference,
+                                       unsigned int numberOfWorkUnits,
+                                       ComputeBackend backend,
+                                       Interpolation interpolation)
+{
+    if (interpolation == Interpolation::Linear && UseOpenCL(backend))
+    {
+        if (ImageType::Pointer output = ResampleLinearOpenCL(moving, transform, reference))
+        {
+            return output;
+        }
+    }
+    if (ImageType::Pointer output = ResampleDirect(moving, transform, reference, interpolation, nullptr,
+                                                   numberOfWorkUnits))
+    {
+        return output;
+    }
+
+    using ResampleFilterType = itk::ResampleImageFilter<ImageType, ImageType>;
+
+    auto resampler = ResampleFilterType::New();
+    resampler->SetInput(moving);
+    resampler->SetTransform(transform);
+    resampler->SetReferenceImage(reference);
+    resampler->UseReferenceImageOn();
+    resampler->SetInterpolator(MakeInterpolator<ImageType>(interpolation));
+    if (numberOfWorkUnits > 0)
+    {
+        resampler->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    resampler->Update();
+
+    ImageType::Pointer output = resampler->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+// =====================================================
+// Displacement fields
+// =====================================================
+
+namespace
+{
+
+template <typename TImage>
+typename TImage::Pointer ResampleThroughField(const TImage * moving,
+                                              const DisplacementFieldTransformType * transform,
+                                              Interpolation interpolation,
+                                              unsigned int numberOfWorkUnits)
+{
+    using ResampleFilterType = itk::ResampleImageFilter<TImage, TImage>;
+
+    auto resampler = ResampleFilterType::New();
+    resampler->SetInput(moving);
+    resampler->SetTransform(transform);
+    resampler->SetReferenceImage(transform->GetDisplacementField());
+    resampler->UseReferenceImageOn();
+    resampler->SetInterpolator(MakeInterpolator<TImage>(interpolation));
+    if (numberOfWorkUnits > 0)
+    {
+        resampler->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    resampler->Update();
+
+    typename TImage::Pointer output = resampler->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+template <typename TField>
+void WriteCompressed(const TField * field, const std::string & fileName)
+{
+    using WriterType = itk::ImageFileWriter<TField>;
+    auto writer = WriterType::New();
+    writer->SetFileName(fileName);
+    writer->SetInput(field);
+    writer->UseCompressionOn();
+    writer->Update();
+}
+
+} // namespace
+
+DisplacementFieldType::Pointer ComputeDisplacementField(const TransformBaseType * transform,
+                                                        const ImageType * reference,
+                                                        unsigned int numberOfWorkUnits)
+{
+    using FieldFilterType = itk::TransformToDisplacementFieldFilter<DisplacementFieldType, double>;
+
+    auto filter = FieldFilterType::New();
+    filter->SetTransform(transform);
+    filter->SetReferenceImage(reference);
+    filter->UseReferenceImageOn();
+    if (numberOfWorkUnits > 0)
+    {
+        filter->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    filter->Update();
+
+    DisplacementFieldType::Pointer field = filter->GetOutput();
+    field->DisconnectPipeline();
+    return field;
+}
+
+void WriteDisplacementField(const DisplacementFieldType * field, const std::string & fileName,
+                            FieldPrecision precision)
+{
+    if (precision == FieldPrecision::Double)
+    {
+        WriteCompressed(field, fileName);
+        return;
+    }
+
+    using FloatFieldType = itk::Image<itk::Vector<float, 3>, 3>;
+    using CastType       = itk::CastImageFilter<DisplacementFieldType, FloatFieldType>;
+    auto cast = CastType::New();
+    cast->SetInput(field);
+    cast->Update();
+    WriteCompressed(cast->GetOutput(), fileName);
+}
+
+DisplacementFieldType::Pointer ReadDisplacementField(const std::string & fileName)
+{
+    // Float fields are widened on read.
+    using ReaderType = itk::ImageFileReader<DisplacementFieldType>;
+    auto reader = ReaderType::New();
+    reader->SetFileName(fileName);
+    reader->Update();
+
+    DisplacementFieldType::Pointer field = reader->GetOutput();
+    field->DisconnectPipeline();
+    return field;
+}
+
+DisplacementFieldTransformType::Pointer MakeDisplacementFieldTransform(DisplacementFieldType * field)
+{
+    auto transform = DisplacementFieldTransformType::New();
+    transform->SetDisplacementField(field);
+    return transform;
+}
+
+ImageType::Pointer WarpImage(const ImageType * moving,
+                             const DisplacementFieldTransformType * transform,
+                             Interpolation interpolation,
+                             unsigned int numberOfWorkUnits)
+{
+    return ResampleThroughField(moving, transform, interpolation, numberOfWorkUnits);
+}
+
+MaskImageType::Pointer WarpMask(const MaskImageType * mask,
+                                const DisplacementFieldTransformType * transform,
+                                unsigned int numberOfWorkUnits)
+{
+    return ResampleThroughField(mask, transform, Interpolation::NearestNeighbor, numberOfWorkUnits);
+}
+
+// =====================================================
+// Intensity normalization
+// =====================================================
+
+IntensityStatistics NormalizeIntensity(ImageType * image,
+                                       const NormalizationParameters & parameters,
+                                       const MaskImageType * mask)
+{
+    const MaskImageType::ConstPointer statisticsMask = mask ? MaskImageType::ConstPointer(mask)
+                                                            : StatisticsMask(parameters, image);
+    IntensityStatistics stats = ComputeIntensityStatistics(image, parameters, statisticsMask.GetPointer());
+    ApplyIntensityNormalization(image, stats, parameters.numberOfWorkUnits);
+    return stats;
+}
+
+// =====================================================
+// Rigid registration
+// =====================================================
+
+namespace
+{
+
+// First moments of one z-slice of the buffer, in index space relative to
+// the buffer start.
+struct SliceMoments
+{
+    float  minimum   = std::numeric_limits<float>::max();
+    double sum       = 0.0;                 // sum of I
+    double moment[3] = { 0.0, 0.0, 0.0 };   // sum of I * index
+};
+
+// Centre of mass with the intensities shifted to start at zero: after
+// z-score normalization the raw intensities sum to about zero, which
+// leaves the plain first moments undefined. With weights I - minimum the
+// moments follow from the sums of I and I * index and the (closed-form)
+// sums of the index, so one parallel pass over the slices suffices;
+// the mean index is mapped to physical space once. The centre does not
+// depend on the intensity scale, so int16 levels are used as they are.
+template <typename TImage>
+PointType CentreOfMass(const TImage * image, unsigned int numberOfWorkUnits)
+{
+    using PixelType = typename TImage::PixelType;
+
+    const ImageType::RegionType region = image->GetBufferedRegion();
+    const ImageType::SizeType   size   = region.GetSize();
+
+    std::vector<SliceMoments> slices(size[2]);
+    auto                      threader = itk::MultiThreaderBase::New();
+    if (numberOfWorkUnits > 0)
+    {
+        threader->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    threader->ParallelizeArray(
+        0,
+        size[2],
+        [&](itk::SizeValueType z)
+        {
+            const PixelType * voxel = image->GetBufferPointer() + z * size[0] * size[1];
+            SliceMoments  moments;
+            for (itk::SizeValueType y = 0; y < size[1]; ++y)
+            {
+                double rowSum    = 0.0;
+                double rowMoment = 0.0;
+                for (itk::SizeValueType x = 0; x < size[0]; ++x, ++voxel)
+                {
+                    moments.minimum = std::min(moments.minimum, static_cast<float>(*voxel));
+                    rowSum += *voxel;
+                    rowMoment += double(*voxel) * x;
+                }
+                moments.sum += rowSum;
+                moments.moment[0] += rowMoment;
+                moments.moment[1] += rowSum * y;
+            }
+            moments.moment[2] = moments.sum * z;
+            slices[z]         = moments;
+        },
+        nullptr);
+
+    SliceMoments total;
+    for (const SliceMoments & slice : slices)
+    {
+        total.minimum = std::min(total.minimum, slice.minimum);
+        total.sum += slice.sum;
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            total.moment[d] += slice.moment[d];
+        }
+    }
+
+    // sum (I - m) = sum I - m N and sum (I - m) i = sum I i - m N (n - 1) / 2
+    const double numberOfVoxels = double(region.GetNumberOfPixels());
+    const double mass           = total.sum - total.minimum * numberOfVoxels;
+    if (mass <= 0.0)
+    {
+        itkGenericExceptionMacro(<< "Cannot compute the centre of mass of a constant image");
+    }
+
+    itk::ContinuousIndex<double, 3> centre;
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        const double indexSum = numberOfVoxels * (size[d] - 1) / 2.0;
+        centre[d]             = region.GetIndex(d) + (total.moment[d] - total.minimum * indexSum) / mass;
+    }
+    PointType point;
+    image->TransformContinuousIndexToPhysicalPoint(centre, point);
+    return point;
+}
+
+// Multi-start rotations: a startSteps^3 grid over +-startAngleRange
+// degrees about each axis, composed onto the initial parameters, which
+// come first.
+std::vector<RigidTransformType::ParametersType> MakeStartGrid(const RigidTransformType * initial,
+                                                              const RigidParameters & parameters)
+{
+    std::vector<RigidTransformType::ParametersType> starts = { initial->GetParameters() };
+    if (parameters.startAngleRange <= 0.0 || parameters.startSteps < 2)
+    {
+        return starts;
+    }
+
+    const unsigned int steps = parameters.startSteps;
+    const double       range = parameters.startAngleRange * itk::Math::pi / 180.0;
+    const auto         angle = [=](unsigned int i) { return -range + 2.0 * range * i / (steps - 1); };
+    for (unsigned int i = 0; i < steps; ++i)
+    {
+        for (unsigned int j = 0; j < steps; ++j)
+        {
+            for (unsigned int k = 0; k < steps; ++k)
+            {
+                if (angle(i) == 0.0 && angle(j) == 0.0 && angle(k) == 0.0)
+                {
+                    continue; // the initial parameters
+                }
+                RigidTransformType::ParametersType start = starts.front();
+                start[0] += angle(i);
+                start[1] += angle(j);
+                start[2] += angle(k);
+                starts.push_back(start);
+            }
+        }
+    }
+    return starts;
+}
+
+// Mattes MI of every start on one level pair (lower is better). The starts
+// are split into one chunk per work unit, each scored by its own
+// single-threaded metric.
+template <typename TImage>
+std::vector<double> ScoreStarts(const TImage * fixed, const TImage * moving,
+                                const RigidTransformType * initial,
+                                const std::vector<RigidTransformType::ParametersType> & starts,
+                                const RigidParameters & parameters)
+{
+    const unsigned int workUnits = parameters.numberOfWorkUnits > 0
+                                       ? parameters.numberOfWorkUnits
+                                       : itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+    const size_t numberOfChunks = std::max<size_t>(1, std::min<size_t>(workUnits, starts.size()));
+
+    std::vector<double>             values(starts.size(), std::numeric_limits<double>::max());
+    std::vector<std::exception_ptr> failures(numberOfChunks);
+
+    auto threader = itk::MultiThreaderBase::New();
+    threader->SetNumberOfWorkUnits(static_cast<unsigned int>(numberOfChunks));
+    threader->ParallelizeArray(
+        0,
+        numberOfChunks,
+        [&](itk::SizeValueType chunk)
+        {
+            try
+            {
+                auto transform = RigidTransformType::New();
+                transform->SetFixedParameters(initial->GetFixedParameters());
+
+                auto metric = LevelMetricType<TImage>::New();
+                metric->SetNumberOfHistogramBins(parameters.numberOfHistogramBins);
+                metric->SetUseFixedImageGradientFilter(false);
+                metric->SetUseMovingImageGradientFilter(false);
+                SetFixedMask(metric.GetPointer(), parameters.sampling);
+                metric->SetFixedImage(fixed);
+                metric->SetMovingImage(moving);
+                metric->SetMovingTransform(transform);
+                metric->SetMaximumNumberOfWorkUnits(1);
+                metric->Initialize();
+
+                const size_t first = chunk * starts.size() / numberOfChunks;
+                const size_t last  = (chunk + 1) * starts.size() / numberOfChunks;
+                for (size_t i = first; i < last; ++i)
+                {
+                    transform->SetParameters(starts[i]);
+                    try
+                    {
+                        values[i] = metric->GetValue();
+                    }
+                    catch (itk::ExceptionObject &)
+                    {
+                        // Rotated out of the moving image; keeps the worst score
+                    }
+                }
+            }
+            catch (...)
+            {
+                failures[chunk] = std::current_exception();
+            }
+        },
+        nullptr);
+
+    for (const auto & failure : failures)
+    {
+        if (failure)
+        {
+            std::rethrow_exception(failure);
+        }
+    }
+    return values;
+}
+
+// CentreOfMass / ScoreStarts on a pyramid level: on the cached int16 copy
+// when the pyramids keep one, so repeated calls do not expand a fresh float
+// copy each time (ImagePyramid::GetLevel does not cache those).
+PointType LevelCentreOfMass(ImagePyramid & pyramid, unsigned int shrink, double sigma,
+                            unsigned int numberOfWorkUnits)
+{
+    if (pyramid.GetStorage() == LevelStorage::Int16)
+    {
+        return CentreOfMass(pyramid.GetCompactLevel(shrink, sigma).GetPointer(), numberOfWorkUnits);
+    }
+    return CentreOfMass(pyramid.GetLevel(shrink, sigma).GetPointer(), numberOfWorkUnits);
+}
+
+std::vector<double> ScoreStartsOnLevel(ImagePyramid & fixedPyramid, ImagePyramid & movingPyramid,
+                                       unsigned int shrink, double sigma, const RigidTransformType * initial,
+                                       const std::vector<RigidTransformType::ParametersType> & starts,
+                                       const RigidParameters & parameters)
+{
+    if (fixedPyramid.GetStorage() == LevelStorage::Int16 && movingPyramid.GetStorage() == LevelStorage::Int16)
+    {
+        return ScoreStarts(fixedPyramid.GetCompactLevel(shrink, sigma).GetPointer(),
+                           movingPyramid.GetCompactLevel(shrink, sigma).GetPointer(), initial, starts, parameters);
+    }
+    return ScoreStarts(fixedPyramid.GetLevel(shrink, sigma).GetPointer(),
+                       movingPyramid.GetLevel(shrink, sigma).GetPointer(), initial, starts, parameters);
+}
+
+// transform's mapping expressed as parameters about centre.
+RigidTransformType::ParametersType ParametersAbout(const RigidTransformType * transform, const PointType & centre)
+{
+    auto recentred = RigidTransformType::New();
+    recentred->SetCenter(centre);
+    recentred->SetMatrix(transform->GetMatrix());
+    recentred->SetOffset(transform->GetOffset());
+    return recentred->GetParameters();
+}
+
+// The coarse-to-fine schedule from transform's current parameters, starting
+// at firstLevel; returns the final metric value.
+double RefineRigid(ImagePyramid & fixedPyramid, ImagePyramid & movingPyramid,
+                   const RigidParameters & parameters, RigidTransformType * transform,
+                   unsigned int firstLevel = 0)
+{
+    const PyramidSchedule & schedule = parameters.pyramid;
+
+    //Metric: Mutual Information (robust for MRI), one per level
+    MetricSettings metric;
+    metric.numberOfHistogramBins = parameters.numberOfHistogramBins;
+    metric.sampling              = &parameters.sampling;
+    metric.backend               = parameters.backend;
+
+    // Optimizer
+    using OptimizerType = itk::RegularStepGradientDescentOptimizerv4<double>;
+    auto optimizer = OptimizerType::New();
+    optimizer->SetLearningRate(parameters.learningRate);
+    optimizer->SetMinimumStepLength(parameters.minimumStepLength);
+    optimizer->SetNumberOfIterations(parameters.numberOfIterations);
+
+    //Parameter scaling
+    //Rotations (radians) vs translations (mm)
+    OptimizerType::ScalesType scales(transform->GetNumberOfParameters());
+    scales[0] = 1.0;                         // rot X
+    scales[1] = 1.0;                         // rot Y
+    scales[2] = 1.0;                         // rot Z
+    scales[3] = parameters.translationScale; // trans X
+    scales[4] = parameters.translationScale; // trans Y
+    scales[5] = parameters.translationScale; // trans Z
+    optimizer->SetScales(scales);
+
+    // Coarse to fine; the transform carries over between levels
+    for (unsigned int level = firstLevel; level < schedule.GetNumberOfLevels(); ++level)
+    {
+        const unsigned int shrink = schedule.shrinkFactors[level];
+        const double       sigma  = schedule.smoothingSigmas[level];
+
+        RegisterPyramidLevel(fixedPyramid, movingPyramid, shrink, sigma, nullptr, nullptr, metric, optimizer,
+                             transform, nullptr, level, parameters.numberOfWorkUnits, parameters.iterations);
+    }
+
+    return optimizer->GetCurrentMetricValue();
+}
+
+} // namespace
+
+RigidTransformType::Pointer RegisterRigid(ImagePyramid & fixedPyramid,
+                                          ImagePyramid & movingPyramid,
+                                          const RigidParameters & parameters)
+{
+    const ImageType *       fixed    = fixedPyramid.GetImage();
+    const PyramidSchedule & schedule = parameters.pyramid;
+
+    //Rigid transform (3 rotations + 3 translations)
+    auto initial = RigidTransformType::New();
+    initial->SetIdentity();
+
+    if (parameters.initialization == RigidParameters::Initialization::Moments)
+    {
+        // Centres of mass from the coarsest scheduled level, which is built
+        // for the registration anyway
+        const unsigned int shrink = schedule.shrinkFactors.front();
+        const double       sigma  = schedule.smoothingSigmas.front();
+        const unsigned int workUnits = parameters.numberOfWorkUnits;
+        const PointType    fixedCentre  = LevelCentreOfMass(fixedPyramid, shrink, sigma, workUnits);
+        const PointType    movingCentre = LevelCentreOfMass(movingPyramid, shrink, sigma, workUnits);
+
+        initial->SetCenter(fixedCentre);
+        initial->SetTranslation(movingCentre - fixedCentre);
+    }
+    else
+    {
+        //Set center of rotation to image center
+        ImageType::RegionType  region  = fixed->GetLargestPossibleRegion();
+        ImageType::SizeType    size    = region.GetSize();
+        ImageType::SpacingType spacing = fixed->GetSpacing();
+        ImageType::PointType   origin  = fixed->GetOrigin();
+
+        RigidTransformType::InputPointType center;
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            center[i] = origin[i] + spacing[i] * size[i] / 2.0;
+        }
+        initial->SetCenter(center);
+    }
+
+    if (parameters.warmStart)
+    {
+        const unsigned int shrink = schedule.shrinkFactors.front();
+        const double       sigma  = schedule.smoothingSigmas.front();
+        const RigidTransformType::ParametersType warm = ParametersAbout(parameters.warmStart, initial->GetCenter());
+        const std::vector<double>                values =
+            ScoreStartsOnLevel(fixedPyramid, movingPyramid, shrink, sigma, initial,
+                               { initial->GetParameters(), warm }, parameters);
+
+        const bool accepted = values[1] <= values[0];
+        if (parameters.warmStartAccepted != nullptr)
+        {
+            *parameters.warmStartAccepted = accepted;
+        }
+        if (accepted)
+        {
+            const unsigned int levels = schedule.GetNumberOfLevels();
+            auto               transform = RigidTransformType::New();
+            transform->SetFixedParameters(initial->GetFixedParameters());
+            transform->SetParameters(warm);
+            RefineRigid(fixedPyramid, movingPyramid, parameters, transform,
+                        levels - std::min(levels, std::max(1u, parameters.warmStartLevels)));
+            return transform;
+        }
+    }
+
+    // Multi-start: score the rotation grid on one coarse level and refine
+    // only the best few through the whole schedule
+    const std::vector<RigidTransformType::ParametersType> starts = MakeStartGrid(initial, parameters);
+    std::vector<size_t>                                   candidates(starts.size());
+    std::iota(candidates.begin(), candidates.end(), size_t(0));
+    if (starts.size() > 1)
+    {
+        const std::vector<double> values =
+            ScoreStartsOnLevel(fixedPyramid, movingPyramid, parameters.startShrinkFactor, parameters.startSigma,
+                               initial, starts, parameters);
+        std::stable_sort(candidates.begin(), candidates.end(),
+                         [&](size_t a, size_t b) { return values[a] < values[b]; });
+        candidates.resize(std::min<size_t>(std::max(1u, parameters.startCandidates), candidates.size()));
+    }
+
+    RigidTransformType::Pointer best;
+    double                      bestValue = std::numeric_limits<double>::max();
+    for (size_t candidate : candidates)
+    {
+        auto transform = RigidTransformType::New();
+        transform->SetFixedParameters(initial->GetFixedParameters());
+        transform->SetParameters(starts[candidate]);
+
+        const double value = RefineRigid(fixedPyramid, movingPyramid, parameters, transform);
+        if (!best || value < bestValue)
+        {
+            best      = transform;
+            bestValue = value;
+        }
+    }
+    return best;
+}
+
+RigidTransformType::Pointer RegisterRigid(const ImageType * fixed,
+                                          const ImageType * moving,
+                                          const RigidParameters & parameters)
+{
+    ImagePyramid fixedPyramid(fixed, parameters.numberOfWorkUnits);
+    ImagePyramid movingPyramid(moving, parameters.numberOfWorkUnits);
+    return RegisterRigid(fixedPyramid, movingPyramid, parameters);
+}
+
+// =====================================================
+// Deformable (B-spline) registration
+// =====================================================
+
+namespace
+{
+
+// Axis-aligned physical box through the centres of the mask's nonzero voxels.
+void MaskBoundingBox(const MaskImageType * mask, PointType & minimum, PointType & maximum)
+{
+    MaskImageType::IndexType lower;
+    MaskImageType::IndexType upper;
+    lower.Fill(std::numeric_limits<itk::IndexValueType>::max());
+    upper.Fill(std::numeric_limits<itk::IndexValueType>::lowest());
+
+    itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(mask, mask->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it)
+    {
+        if (it.Get() != 0)
+        {
+            const MaskImageType::IndexType & index = it.GetIndex();
+            for (unsigned int d = 0; d < 3; ++d)
+            {
+                lower[d] = std::min(lower[d], index[d]);
+                upper[d] = std::max(upper[d], index[d]);
+            }
+        }
+    }
+    if (lower[0] > upper[0])
+    {
+        itkGenericExceptionMacro(<< "ROI mask is empty");
+    }
+
+    minimum.Fill(std::numeric_limits<double>::max());
+    maximum.Fill(std::numeric_limits<double>::lowest());
+    for (unsigned int corner = 0; corner < 8; ++corner)
+    {
+        MaskImageType::IndexType index;
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            index[d] = (corner >> d) & 1 ? upper[d] : lower[d];
+        }
+        PointType point;
+        mask->TransformIndexToPhysicalPoint(index, point);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            minimum[d] = std::min(minimum[d], point[d]);
+            maximum[d] = std::max(maximum[d], point[d]);
+        }
+    }
+}
+
+struct ControlPointBounds
+{
+    itk::LBFGSBOptimizerv4::BoundValueType lower;
+    itk::LBFGSBOptimizerv4::BoundValueType upper;
+};
+
+// LBFGSB bounds for the current grid: the parameters are the x, then y,
+// then z coefficient images, each allowed to move by a fraction of its
+// spacing from where the level starts. The box is centred on the
+// coefficients carried over from the coarser levels, so the optimizer
+// never projects (clips) them when the grid is refined.
+ControlPointBounds SetControlPointBounds(itk::LBFGSBOptimizerv4 * optimizer, const BSplineTransformType * transform,
+                                         double boundFraction)
+{
+    const unsigned int numberOfParameters = transform->GetNumberOfParameters();
+    const unsigned int perAxis            = numberOfParameters / 3;
+    const auto         spacing            = transform->GetCoefficientImages()[0]->GetSpacing();
+    const auto &       start              = transform->GetParameters();
+
+    itk::LBFGSBOptimizerv4::BoundSelectionType selection(numberOfParameters);
+    ControlPointBounds                         bounds;
+    bounds.lower.SetSize(numberOfParameters);
+    bounds.upper.SetSize(numberOfParameters);
+    selection.Fill(2); // vnl_lbfgsb: both lower and upper bound
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        const double bound = boundFraction * spacing[d];
+        for (unsigned int i = d * perAxis; i < (d + 1) * perAxis; ++i)
+        {
+            bounds.lower[i] = start[i] - bound;
+            bounds.upper[i] = start[i] + bound;
+        }
+    }
+    optimizer->SetBoundSelection(selection);
+    optimizer->SetLowerBound(bounds.lower);
+    optimizer->SetUpperBound(bounds.upper);
+    return bounds;
+}
+
+// Coefficients that finished the level on their box: there the bound, not
+// the metric, decided the result.
+size_t CountCoefficientsAtBounds(const ControlPointBounds & bounds, const BSplineTransformType * transform)
+{
+    const auto & parameters = transform->GetParameters();
+    size_t       count      = 0;
+    for (unsigned int i = 0; i < parameters.GetSize(); ++i)
+    {
+        const double tolerance = 1e-6 * (bounds.upper[i] - bounds.lower[i]);
+        if (parameters[i] <= bounds.lower[i] + tolerance || parameters[i] >= bounds.upper[i] - tolerance)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+// Window convergence monitor on the metric value, fed once per optimizer
+// iteration. The vnl LBFGS(B) loops stop as soon as the iteration count
+// exceeds the optimizer's limit, so lowering the limit ends the level after
+// the current iteration.
+class ConvergenceMonitor : public itk::Command
+{
+public:
+    using Self    = ConvergenceMonitor;
+    using Pointer = itk::SmartPointer<Self>;
+    itkNewMacro(Self);
+
+    using Clock = std::chrono::steady_clock;
+
+    void Reset(unsigned int windowSize, double threshold)
+    {
+        m_Monitor = MonitorType::New();
+        m_Monitor->SetWindowSize(windowSize);
+        m_Threshold = threshold;
+        m_Stopped   = false;
+    }
+
+    // The level also ends at the first iteration past the deadline.
+    void SetDeadline(Clock::time_point deadline)
+    {
+        m_Deadline    = deadline;
+        m_HasDeadline = true;
+    }
+
+    bool DeadlineReached() const { return m_DeadlineReached; }
+
+    void Execute(const itk::Object * caller, const itk::EventObject & event) override
+    {
+        Execute(const_cast<itk::Object *>(caller), event);
+    }
+
+    void Execute(itk::Object * caller, const itk::EventObject & event) override
+    {
+        if (!itk::IterationEvent().CheckEvent(&event))
+        {
+            return;
+        }
+        auto * optimizer = dynamic_cast<itk::ObjectToObjectOptimizerBaseTemplate<double> *>(caller);
+        if (optimizer == nullptr)
+        {
+            return;
+        }
+        m_Monitor->AddEnergyValue(optimizer->GetCurrentMetricValue());
+        if (m_HasDeadline && !m_DeadlineReached && Clock::now() >= m_Deadline)
+        {
+            m_DeadlineReached = true;
+        }
+        else if (m_Stopped || m_Threshold <= 0.0 || m_Monitor->GetConvergenceValue() >= m_Threshold)
+        {
+            return;
+        }
+
+        m_Stopped = true;
+        if (auto * lbfgsb = dynamic_cast<itk::LBFGSBOptimizerv4 *>(optimizer))
+        {
+            lbfgsb->SetNumberOfIterations(0);
+        }
+        else if (auto * lbfgs = dynamic_cast<itk::LBFGSOptimizerv4 *>(optimizer))
+        {
+            lbfgs->SetNumberOfIterations(0);
+        }
+    }
+
+private:
+    using MonitorType = itk::Function::WindowConvergenceMonitoringFunction<double>;
+
+    MonitorType::Pointer m_Monitor;
+    double               m_Threshold = 0.0;
+    bool                 m_Stopped   = false;
+    Clock::time_point    m_Deadline;
+    bool                 m_HasDeadline     = false;
+    bool                 m_DeadlineReached = false;
+};
+
+// Shortest axis (voxels) of the coarsest adaptive level, and the size above
+// which the finest level stays at shrink 2.
+constexpr itk::SizeValueType kMinimumCoarseVoxels   = 24;
+constexpr unsigned int       kMaximumShrinkFactor   = 8;
+constexpr double             kFullResolutionVoxels  = 20e6;
+constexpr double             kCoarseControlSpacing  = 50.0; // mm
+constexpr double             kMinimumControlSpacing = 10.0; // mm
+
+} // namespace
+
+void AdaptBSplineSchedule(const itk::ImageBase<3> * domain, BSplineParameters & parameters)
+{
+    const ImageType::SizeType    size    = domain->GetLargestPossibleRegion().GetSize();
+    const ImageType::SpacingType spacing = domain->GetSpacing();
+
+    itk::SizeValueType shortest = size[0];
+    double             extent   = 0.0;
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        shortest = std::min(shortest, size[d]);
+        extent   = std::max(extent, size[d] * spacing[d]);
+    }
+    const double minimumSpacing = std::min({ spacing[0], spacing[1], spacing[2] });
+
+    unsigned int coarsest = 1;
+    while (coarsest < kMaximumShrinkFactor && shortest / (2 * coarsest) >= kMinimumCoarseVoxels)
+    {
+        coarsest *= 2;
+    }
+    const double       voxels = double(domain->GetLargestPossibleRegion().GetNumberOfPixels());
+    const unsigned int finest = std::min(coarsest, voxels > kFullResolutionVoxels ? 2u : 1u);
+
+    std::vector<unsigned int> shrinkFactors;
+    std::vector<double>       sigmas;
+    for (unsigned int shrink = coarsest; shrink >= finest; shrink /= 2)
+    {
+        shrinkFactors.push_back(shrink);
+        sigmas.push_back(shrink > 1 ? 0.5 * shrink * minimumSpacing : 0.0);
+    }
+    parameters.pyramid = MakePyramidSchedule(shrinkFactors, sigmas);
+
+    const auto levels = static_cast<unsigned int>(shrinkFactors.size());
+    parameters.meshSizePerLevel.clear();
+    parameters.iterationsPerLevel.clear();
+    double controlSpacing = kCoarseControlSpacing;
+    for (unsigned int level = 0; level < levels; ++level)
+    {
+        const double mesh = std::ceil(extent / std::max(controlSpacing, kMinimumControlSpacing));
+        parameters.meshSizePerLevel.push_back(std::max(1u, static_cast<unsigned int>(mesh)));
+        controlSpacing /= 2.0;
+
+        // 2x numberOfIterations on the coarsest level to 0.5x on the finest
+        const double fraction   = levels > 1 ? double(level) / (levels - 1) : 0.5;
+        const double iterations = parameters.numberOfIterations * 2.0 * std::pow(0.25, fraction);
+        parameters.iterationsPerLevel.push_back(std::max(1u, static_cast<unsigned int>(std::lround(iterations))));
+    }
+    parameters.initialMeshSize = parameters.meshSizePerLevel.front();
+}
+
+BSplineTransformType::Pointer RegisterBSpline(ImagePyramid & fixedPyramid,
+                                              ImagePyramid & movingPyramid,
+                                              const BSplineParameters & requested)
+{
+    using Clock = ConvergenceMonitor::Clock;
+    const Clock::time_point start = Clock::now();
+
+    const ImageType * fixed = fixedPyramid.GetImage();
+
+    // ROI mode: the transform domain (and below, every fixed level) is the
+    // padded mask box instead of the whole field of view. The domain image
+    // only carries geometry and is never allocated.
+    PointType          roiMinimum;
+    PointType          roiMaximum;
+    ImageType::Pointer domain;
+    if (requested.roiMask)
+    {
+        MaskBoundingBox(requested.roiMask, roiMinimum, roiMaximum);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            roiMinimum[d] -= requested.roiPadding;
+            roiMaximum[d] += requested.roiPadding;
+        }
+
+        domain = ImageType::New();
+        domain->CopyInformation(fixed);
+        domain->SetRegions(RegionCoveringBox(fixed, roiMinimum, roiMaximum));
+    }
+
+    BSplineParameters parameters = requested;
+    if (parameters.adaptiveSchedule)
+    {
+        AdaptBSplineSchedule(domain ? domain.GetPointer() : fixed, parameters);
+    }
+    const PyramidSchedule & schedule = parameters.pyramid;
+
+    if (parameters.meshSizePerLevel.size() != schedule.GetNumberOfLevels())
+    {
+        itkGenericExceptionMacro(<< "B-spline registration needs one mesh size per pyramid level ("
+                                 << parameters.meshSizePerLevel.size() << " given for "
+                                 << schedule.GetNumberOfLevels() << " levels)");
+    }
+    if (!parameters.iterationsPerLevel.empty() &&
+        parameters.iterationsPerLevel.size() != schedule.GetNumberOfLevels())
+    {
+        itkGenericExceptionMacro(<< "B-spline registration needs one iteration cap per pyramid level ("
+                                 << parameters.iterationsPerLevel.size() << " given for "
+                                 << schedule.GetNumberOfLevels() << " levels)");
+    }
+    const auto iterationsAt = [&](unsigned int level)
+    {
+        return parameters.iterationsPerLevel.empty() ? parameters.numberOfIterations
+                                                     : parameters.iterationsPerLevel[level];
+    };
+
+    auto transform = BSplineTransformType::New();
+
+    using InitializerType =
+        itk::BSplineTransformInitializer<BSplineTransformType, ImageType>;
+
+    auto initializer = InitializerType::New();
+    initializer->SetTransform(transform);
+    initializer->SetImage(domain ? domain.GetPointer() : fixed);
+
+    // COARSE INITIAL GRID
+    BSplineTransformType::MeshSizeType meshSize;
+    meshSize.Fill(parameters.initialMeshSize);
+    initializer->SetTransformDomainMeshSize(meshSize);
+    initializer->InitializeTransform();
+
+    // The domain is computed the same way from the same fixed image and ROI,
+    // so a usable warm start matches it exactly.
+    const unsigned int levels     = schedule.GetNumberOfLevels();
+    unsigned int       firstLevel = 0;
+    if (parameters.warmStart &&
+        parameters.warmStart->GetTransformDomainOrigin() == transform->GetTransformDomainOrigin() &&
+        parameters.warmStart->GetTransformDomainPhysicalDimensions() ==
+            transform->GetTransformDomainPhysicalDimensions() &&
+        parameters.warmStart->GetTransformDomainDirection() == transform->GetTransformDomainDirection())
+    {
+        transform->SetFixedParameters(parameters.warmStart->GetFixedParameters());
+        transform->SetParametersByValue(parameters.warmStart->GetParameters());
+        firstLevel = levels - std::min(levels, std::max(1u, parameters.warmStartLevels));
+    }
+
+    MetricSettings metric;
+    metric.numberOfHistogramBins = parameters.numberOfHistogramBins;
+    metric.sampling              = &parameters.sampling;
+
+    // The iteration limit is reset before every level since the convergence
+    // monitor lowers it to stop early.
+    itk::LBFGSBOptimizerv4::Pointer boundedOptimizer;
+    itk::LBFGSOptimizerv4::Pointer  unboundedOptimizer;
+    itk::ObjectToObjectOptimizerBaseTemplate<double>::Pointer optimizer;
+    if (parameters.optimizer == BSplineParameters::Optimizer::LBFGSB)
+    {
+        boundedOptimizer = itk::LBFGSBOptimizerv4::New();
+        boundedOptimizer->SetGradientConvergenceTolerance(parameters.gradientConvergenceTolerance);
+        boundedOptimizer->SetMaximumNumberOfFunctionEvaluations(parameters.maximumNumberOfFunctionEvaluations);
+        optimizer = boundedOptimizer;
+    }
+    else
+    {
+        unboundedOptimizer = itk::LBFGSOptimizerv4::New();
+        unboundedOptimizer->SetGradientConvergenceTolerance(parameters.gradientConvergenceTolerance);
+        unboundedOptimizer->SetMaximumNumberOfFunctionEvaluations(parameters.maximumNumberOfFunctionEvaluations);
+        optimizer = unboundedOptimizer;
+    }
+
+    auto monitor = ConvergenceMonitor::New();
+    if (parameters.convergenceThreshold > 0.0 || parameters.deadlineSeconds > 0.0)
+    {
+        optimizer->AddObserver(itk::IterationEvent(), monitor);
+    }
+    const Clock::time_point deadline =
+        start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(parameters.deadlineSeconds));
+
+    // BSpline adaptor: refine the control-point grid at each level
+    using TransformAdaptorType =
+        itk::BSplineTransformParametersAdaptor<BSplineTransformType>;
+
+    const auto domainOrigin     = transform->GetTransformDomainOrigin();
+    const auto domainDirection  = transform->GetTransformDomainDirection();
+    const auto domainDimensions = transform->GetTransformDomainPhysicalDimensions();
+
+    ScheduleReport report;
+    double         lastLevelSeconds = 0.0;
+    for (unsigned int level = firstLevel; level < levels; ++level)
+    {
+        // Next level ~ the last one scaled by its voxel count and iteration cap
+        if (parameters.deadlineSeconds > 0.0 && level > firstLevel)
+        {
+            const double ratio    = double(schedule.shrinkFactors[level - 1]) / schedule.shrinkFactors[level];
+            const double estimate = lastLevelSeconds * ratio * ratio * ratio * iterationsAt(level) /
+                                    std::max(1u, iterationsAt(level - 1));
+            if (monitor->DeadlineReached() ||
+                Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(estimate)) >
+                    deadline)
+            {
+                report.truncated = true;
+                break;
+            }
+        }
+        const Clock::time_point levelStart = Clock::now();
+
+        auto adaptor = TransformAdaptorType::New();
+        adaptor->SetTransform(transform);
+
+        BSplineTransformType::MeshSizeType levelMesh;
+        levelMesh.Fill(parameters.meshSizePerLevel[level]);  // refine grid
+
+        adaptor->SetRequiredTransformDomainMeshSize(levelMesh);
+        adaptor->SetRequiredTransformDomainOrigin(domainOrigin);
+        adaptor->SetRequiredTransformDomainDirection(domainDirection);
+        adaptor->SetRequiredTransformDomainPhysicalDimensions(domainDimensions);
+        adaptor->AdaptTransformParameters();
+
+        // The parameter count changed with the grid, so the bounds follow it
+        ControlPointBounds bounds;
+        if (boundedOptimizer)
+        {
+            bounds = SetControlPointBounds(boundedOptimizer, transform, parameters.boundFraction);
+            boundedOptimizer->SetNumberOfIterations(iterationsAt(level));
+        }
+        else
+        {
+            unboundedOptimizer->SetNumberOfIterations(iterationsAt(level));
+        }
+        monitor->Reset(parameters.convergenceWindowSize, parameters.convergenceThreshold);
+        if (parameters.deadlineSeconds > 0.0)
+        {
+            monitor->SetDeadline(deadline);
+        }
+
+        const unsigned int shrink = schedule.shrinkFactors[level];
+        const double       sigma  = schedule.smoothingSigmas[level];
+
+        const bool roi = parameters.roiMask.IsNotNull();
+        RegisterPyramidLevel(fixedPyramid, movingPyramid, shrink, sigma, roi ? &roiMinimum : nullptr,
+                             roi ? &roiMaximum : nullptr, metric, optimizer, transform,
+                             parameters.initialTransform, level, parameters.numberOfWorkUnits,
+                             parameters.iterations);
+
+        lastLevelSeconds = std::chrono::duration<double>(Clock::now() - levelStart).count();
+        ++report.levelsCompleted;
+        report.coefficientsAtBoundsPerLevel.push_back(boundedOptimizer ? CountCoefficientsAtBounds(bounds, transform)
+                                                                       : 0);
+    }
+    report.truncated = report.truncated || monitor->DeadlineReached();
+
+    if (parameters.report != nullptr)
+    {
+        report.pyramid          = schedule;
+        report.meshSizePerLevel = parameters.meshSizePerLevel;
+        for (unsigned int level = 0; level < levels; ++level)
+        {
+            report.iterationsPerLevel.push_back(iterationsAt(level));
+        }
+        report.seconds     = std::chrono::duration<double>(Clock::now() - start).count();
+        *parameters.report = report;
+    }
+    return transform;
+}
+
+BSplineTransformType::Pointer RegisterBSpline(const ImageType * fixed,
+                                              const ImageType * moving,
+                                              const BSplineParameters & parameters)
+{
+    ImagePyramid fixedPyramid(fixed, parameters.numberOfWorkUnits);
+    ImagePyramid movingPyramid(moving, parameters.numberOfWorkUnits);
+    return RegisterBSpline(fixedPyramid, movingPyramid, parameters);
+}
+
+CompositeTransformType::Pointer ComposeTransforms(TransformBaseType * initial,
+                                                  TransformBaseType * deformable)
+{
+    // The last transform added is applied first: fixed point -> B-spline -> rigid.
+    auto composite = CompositeTransformType::New();
+    if (initial != nullptr)
+    {
+        composite->AddTransform(initial);
+    }
+    composite->AddTransform(deformable);
+    return composite;
+}
+
+// =====================================================
+// Centroid QA
+// =====================================================
+
+namespace
+{
+
+// Foreground voxels of one z-slice: count, index sums and index bounding box.
+struct SliceForeground
+{
+    static constexpr itk::IndexValueType kNone = std::numeric_limits<itk::IndexValueType>::max();
+
+    size_t              count      = 0;
+    double              sum[3]     = { 0.0, 0.0, 0.0 };
+    itk::IndexValueType minimum[3] = { kNone, kNone, kNone };
+    itk::IndexValueType maximum[3] = { -kNone, -kNone, -kNone };
+
+    void Merge(const SliceForeground & other)
+    {
+        count += other.count;
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            sum[d] += other.sum[d];
+            minimum[d] = std::min(minimum[d], other.minimum[d]);
+            maximum[d] = std::max(maximum[d], other.maximum[d]);
+        }
+    }
+};
+
+constexpr float kForegroundLower = 1.0f;
+constexpr float kForegroundUpper = 1e9f;
+
+SliceForeground ScanSlice(const ImageType * image, itk::IndexValueType z)
+{
+    const ImageType::RegionType region = image->GetBufferedRegion();
+    const ImageType::SizeType   size   = region.GetSize();
+    const ImageType::IndexType  start  = region.GetIndex();
+    const float *               slice  = image->GetBufferPointer() + z * size[0] * size[1];
+
+    SliceForeground result;
+    double          sumX = 0.0;
+    double          sumY = 0.0;
+    for (itk::SizeValueType y = 0; y < size[1]; ++y)
+    {
+        const float * row      = slice + y * size[0];
+        size_t        rowCount = 0;
+        for (itk::SizeValueType x = 0; x < size[0]; ++x)
+        {
+            if (row[x] >= kForegroundLower && row[x] <= kForegroundUpper)
+            {
+                ++rowCount;
+                sumX += x;
+                result.minimum[0] = std::min<itk::IndexValueType>(result.minimum[0], x);
+                result.maximum[0] = std::max<itk::IndexValueType>(result.maximum[0], x);
+            }
+        }
+        if (rowCount > 0)
+        {
+            result.count += rowCount;
+            sumY += double(rowCount) * y;
+            result.minimum[1] = std::min<itk::IndexValueType>(result.minimum[1], y);
+            result.maximum[1] = std::max<itk::IndexValueType>(result.maximum[1], y);
+        }
+    }
+    if (result.count > 0)
+    {
+        result.sum[0]     = sumX + double(result.count) * start[0];
+        result.sum[1]     = sumY + double(result.count) * start[1];
+        result.sum[2]     = double(result.count) * (z + start[2]);
+        result.minimum[0] += start[0];
+        result.maximum[0] += start[0];
+        result.minimum[1] += start[1];
+        result.maximum[1] += start[1];
+        result.minimum[2] = result.maximum[2] = z + start[2];
+    }
+    return result;
+}
+
+ForegroundSummary Summarize(const ImageType * image, const SliceForeground & total)
+{
+    if (total.count == 0)
+    {
+        itkGenericExceptionMacro(<< "No foreground voxels (intensity >= " << kForegroundLower << ")");
+    }
+
+    ForegroundSummary summary;
+    summary.numberOfVoxels = total.count;
+
+    const ImageType::SpacingType spacing = image->GetSpacing();
+    summary.volume = total.count * spacing[0] * spacing[1] * spacing[2];
+
+    // Index -> physical is affine, so the mean index maps to the centroid.
+    itk::ContinuousIndex<double, 3> centre;
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        centre[d] = total.sum[d] / total.count;
+    }
+    image->TransformContinuousIndexToPhysicalPoint(centre, summary.centroid);
+
+    summary.boundingBoxMinimum.Fill(std::numeric_limits<double>::max());
+    summary.boundingBoxMaximum.Fill(std::numeric_limits<double>::lowest());
+    for (unsigned int corner = 0; corner < 8; ++corner)
+    {
+        ImageType::IndexType index;
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            index[d] = (corner >> d) & 1 ? total.maximum[d] : total.minimum[d];
+        }
+        PointType point;
+        image->TransformIndexToPhysicalPoint(index, point);
+        for (unsigned int d = 0; d < 3; ++d)
+        {
+            summary.boundingBoxMinimum[d] = std::min(summary.boundingBoxMinimum[d], point[d]);
+            summary.boundingBoxMaximum[d] = std::max(summary.boundingBoxMaximum[d], point[d]);
+        }
+    }
+    return summary;
+}
+
+double BoundingBoxOverlap(const ForegroundSummary & a, const ForegroundSummary & b)
+{
+    double intersection = 1.0;
+    double volumeA      = 1.0;
+    double volumeB      = 1.0;
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        const double lower = std::max(a.boundingBoxMinimum[d], b.boundingBoxMinimum[d]);
+        const double upper = std::min(a.boundingBoxMaximum[d], b.boundingBoxMaximum[d]);
+        intersection *= std::max(0.0, upper - lower);
+        volumeA *= a.boundingBoxMaximum[d] - a.boundingBoxMinimum[d];
+        volumeB *= b.boundingBoxMaximum[d] - b.boundingBoxMinimum[d];
+    }
+    const double unionVolume = volumeA + volumeB - intersection;
+    return unionVolume > 0.0 ? intersection / unionVolume : 0.0;
+}
+
+} // namespace
+
+CentroidResult CentroidCheck(const ImageType * fixed, const ImageType * registered,
+                             unsigned int numberOfWorkUnits)
+{
+    // Both images' slices form one work list, so the two reductions run
+    // concurrently; per-slice results are merged in order afterwards.
+    const itk::SizeValueType fixedSlices      = fixed->GetBufferedRegion().GetSize(2);
+    const itk::SizeValueType registeredSlices = registered->GetBufferedRegion().GetSize(2);
+
+    std::vector<SliceForeground> slices(fixedSlices + registeredSlices);
+
+    auto threader = itk::MultiThreaderBase::New();
+    if (numberOfWorkUnits > 0)
+    {
+        threader->SetNumberOfWorkUnits(numberOfWorkUnits);
+    }
+    threader->ParallelizeArray(
+        0,
+        fixedSlices + registeredSlices,
+        [&](itk::SizeValueType item)
+        {
+            slices[item] = item < fixedSlices ? ScanSlice(fixed, item)
+                                              : ScanSlice(registered, item - fixedSlices);
+        },
+        nullptr);
+
+    SliceForeground fixedTotal;
+    SliceForeground registeredTotal;
+    for (itk::SizeValueType z = 0; z < fixedSlices; ++z)
+    {
+        fixedTotal.Merge(slices[z]);
+    }
+    for (itk::SizeValueType z = 0; z < registeredSlices; ++z)
+    {
+        registeredTotal.Merge(slices[fixedSlices + z]);
+    }
+
+    CentroidResult result;
+    result.fixedForeground      = Summarize(fixed, fixedTotal);
+    result.registeredForeground = Summarize(registered, registeredTotal);
+    result.fixed                = result.fixedForeground.centroid;
+    result.registered           = result.registeredForeground.centroid;
+    result.distance             = result.fixed.EuclideanDistanceTo(result.registered);
+    result.volumeDelta          = result.registeredForeground.volume - result.fixedForeground.volume;
+    result.boundingBoxOverlap   = BoundingBoxOverlap(result.fixedForeground, result.registeredForeground);
+    return result;
+}
+
+} // namespace tt
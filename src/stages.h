@@ -0,0 +1,436 @@
+//
+// Processing stages shared by the command-line tools and the pipeline driver.
+// Each stage takes and returns in-memory ITK objects; file I/O is left to
+// the caller.
+//
+
+#ifndef TUMOURTRACKER_STAGES_H
+#define TUMOURTRACKER_STAGES_H
+
+#include <string>
+#include <vector>
+
+#include "image_types.h"
+#include "intensity_normalization.h"
+#include "opencl_backend.h"
+#include "pyramid.h"
+#include "telemetry.h"
+
+namespace tt
+{
+
+// --------------------
+// I/O
+// --------------------
+// ".ttv" files are raw, memory-mapped volumes (volume_cache.h); anything
+// else goes through the ITK image IO factories.
+ImageType::Pointer ReadImage(const std::string & fileName);
+void WriteImage(const ImageType * image, const std::string & fileName);
+
+MaskImageType::Pointer ReadMask(const std::string & fileName);
+void WriteMask(const MaskImageType * mask, const std::string & fileName);
+
+// ITK transform files (.tfm text or .h5). ReadTransform returns the first
+// transform in the file; a composite transform is returned as one object.
+void WriteTransform(const TransformBaseType * transform, const std::string & fileName);
+TransformBaseType::Pointer ReadTransform(const std::string & fileName);
+
+// --------------------
+// Resampling
+// --------------------
+
+// numberOfWorkUnits = 0 everywhere below means "ITK global default".
+// backend selects where linear resampling runs (opencl_backend.h); the
+// CPU is used whenever the device cannot take the work.
+//
+// Nearest and linear resampling through an identity or other linear
+// transform run in direct loops (resample_kernels.h); B-spline and
+// windowed sinc, and any non-linear transform, go through ITK's
+// ResampleImageFilter.
+
+enum class Interpolation
+{
+    Linear,
+    NearestNeighbor, // label maps
+    BSpline,         // cubic; sharper, slower, may overshoot
+    WindowedSinc     // Hamming window, radius 3; slowest
+};
+
+// "linear", "nearest", "bspline" or "sinc"; throws std::invalid_argument
+// otherwise.
+Interpolation ParseInterpolation(const std::string & name);
+const char * InterpolationName(Interpolation interpolation);
+
+// Resample onto an isotropic grid (1 mm by default) keeping origin and direction.
+ImageType::Pointer ResampleIsotropic(const ImageType * input, double spacing = 1.0,
+                                     unsigned int numberOfWorkUnits = 0,
+                                     ComputeBackend backend = ComputeBackend::CPU,
+                                     Interpolation interpolation = Interpolation::Linear);
+
+// Box around the head / brain, so the air around it is neither resampled
+// nor visited by the metrics. The foreground is either the nonzero voxels
+// of a brain mask (in physical space, any grid) or the voxels above an
+// intensity threshold.
+struct ForegroundCropParameters
+{
+    double                      threshold         = -1.0; // intensity; negative = thresholdFraction
+    double                      thresholdFraction = 0.05; //   of the image maximum
+    double                      margin            = 10.0; // mm kept on every side
+    MaskImageType::ConstPointer mask;
+    unsigned int                numberOfWorkUnits = 0;
+};
+
+// Index region of image covering the foreground plus the margin, clipped to
+// the image; the whole image when nothing is foreground.
+ImageType::RegionType ForegroundRegion(const ImageType * image,
+                                       const ForegroundCropParameters & parameters = ForegroundCropParameters());
+
+// Copy of that region (RegionOfInterestImageFilter): the origin moves to the
+// first voxel kept, spacing and direction are unchanged, so transforms and
+// physical coordinates stay valid.
+ImageType::Pointer CropToForeground(const ImageType * image,
+                                    const ForegroundCropParameters & parameters = ForegroundCropParameters());
+
+// ReadImage followed by ResampleIsotropic, except that 8- and 16-bit
+// integer files are read in their stored type and resampled straight to
+// float: the full-resolution float copy of the input is never allocated.
+// With crop, the input is cropped to its foreground before resampling.
+ImageType::Pointer ReadIsotropic(const std::string & fileName, double spacing = 1.0,
+                                 unsigned int numberOfWorkUnits = 0,
+                                 ComputeBackend backend = ComputeBackend::CPU,
+                                 const ForegroundCropParameters * crop = nullptr,
+                                 Interpolation interpolation = Interpolation::Linear);
+
+// Resampling and intensity normalization in one pass over the output: the
+// statistics are taken on the input grid (inside normalization.mask when
+// set; statisticsStride subsamples it) and the intensity map is applied per output voxel inside
+// the interpolator, so the isotropic volume is allocated once, already
+// normalized. statistics, when given, receives what was applied.
+ImageType::Pointer ResampleIsotropicNormalized(const ImageType * input,
+                                               const NormalizationParameters & normalization,
+                                               double spacing = 1.0, unsigned int numberOfWorkUnits = 0,
+                                               ComputeBackend backend = ComputeBackend::CPU,
+                                               IntensityStatistics * statistics = nullptr,
+                                               Interpolation interpolation = Interpolation::Linear);
+ImageType::Pointer ReadIsotropicNormalized(const std::string & fileName,
+                                           const NormalizationParameters & normalization,
+                                           double spacing = 1.0, unsigned int numberOfWorkUnits = 0,
+                                           ComputeBackend backend = ComputeBackend::CPU,
+                                           const ForegroundCropParameters * crop = nullptr,
+                                           IntensityStatistics * statistics = nullptr,
+                                           Interpolation interpolation = Interpolation::Linear);
+
+// The input volume in its stored pixel type: 8- and 16-bit integer scalar
+// files as such, anything else (and .ttv volumes) as float.
+itk::ImageBase<3>::Pointer ReadStoredImage(const std::string & fileName);
+
+// ReadIsotropic / ReadIsotropicNormalized on a volume from ReadStoredImage,
+// e.g. one decoded ahead of time by the batch prefetcher (case_io.h).
+ImageType::Pointer ResampleStoredIsotropic(const itk::ImageBase<3> * stored, double spacing = 1.0,
+                                           unsigned int numberOfWorkUnits = 0,
+                                           ComputeBackend backend = ComputeBackend::CPU,
+                                           const ForegroundCropParameters * crop = nullptr,
+                                           Interpolation interpolation = Interpolation::Linear);
+ImageType::Pointer ResampleStoredIsotropicNormalized(const itk::ImageBase<3> * stored,
+                                                     const NormalizationParameters & normalization,
+                                                     double spacing = 1.0, unsigned int numberOfWorkUnits = 0,
+                                                     ComputeBackend backend = ComputeBackend::CPU,
+                                                     const ForegroundCropParameters * crop = nullptr,
+                                                     IntensityStatistics * statistics = nullptr,
+                                                     Interpolation interpolation = Interpolation::Linear);
+
+enum class VoxelType
+{
+    Float,
+    Int16  // rounded and clamped; halves what is written
+};
+
+struct StreamingResampleOptions
+{
+    double                   spacing           = 1.0;
+    double                   memoryBudgetMB    = 0.0; // 0 = resample in one piece
+    VoxelType                outputType        = VoxelType::Float;
+    unsigned int             numberOfWorkUnits = 0;
+    ComputeBackend           backend           = ComputeBackend::CPU; // used when not streamed in slabs
+    bool                     cropForeground    = false; // resample only the foreground box (see above)
+    ForegroundCropParameters crop;
+    bool                     normalize         = false; // write normalized intensities (float output only)
+    NormalizationParameters  normalization;
+    Interpolation            interpolation     = Interpolation::Linear;
+};
+
+struct StreamingResampleResult
+{
+    ImageType::SpacingType spacing;
+    ImageType::SizeType    size;
+    unsigned int           numberOfDivisions = 1;
+    bool                   streamedWrite     = false; // output format accepted piecewise writes
+    IntensityStatistics    statistics;                // with normalize
+};
+
+// File-to-file isotropic resampling through the requested-region pipeline:
+// the volume is processed in slabs so peak memory follows the budget rather
+// than the volume size. Bounding the writer side as well needs an output
+// format that supports streamed writes (e.g. uncompressed .nii, .mha, .nrrd).
+StreamingResampleResult ResampleIsotropicFile(const std::string & inputFile,
+                                              const std::string & outputFile,
+                                              const StreamingResampleOptions & options);
+
+// Resample the moving image onto the reference grid through the given transform.
+ImageType::Pointer ResampleToReference(const ImageType * moving,
+                                       const TransformBaseType * transform,
+                                       const ImageType * reference,
+                                       unsigned int numberOfWorkUnits = 0,
+                                       ComputeBackend backend = ComputeBackend::CPU,
+                                       Interpolation interpolation = Interpolation::Linear);
+
+// --------------------
+// Displacement fields
+// --------------------
+
+enum class FieldPrecision
+{
+    Float, // half the size on disk; sub-micron rounding
+    Double
+};
+
+// Evaluate transform once per voxel of reference, e.g. to warp several
+// sequences and masks without re-evaluating the B-spline for each.
+DisplacementFieldType::Pointer ComputeDisplacementField(const TransformBaseType * transform,
+                                                        const ImageType * reference,
+                                                        unsigned int numberOfWorkUnits = 0);
+
+// Written compressed (.nii.gz, or .mha / .nrrd with compression).
+void WriteDisplacementField(const DisplacementFieldType * field, const std::string & fileName,
+                            FieldPrecision precision = FieldPrecision::Float);
+DisplacementFieldType::Pointer ReadDisplacementField(const std::string & fileName);
+
+DisplacementFieldTransformType::Pointer MakeDisplacementFieldTransform(DisplacementFieldType * field);
+
+// Resample onto the field's grid through a displacement-field transform.
+ImageType::Pointer WarpImage(const ImageType * moving,
+                             const DisplacementFieldTransformType * transform,
+                             Interpolation interpolation = Interpolation::Linear,
+                             unsigned int numberOfWorkUnits = 0);
+MaskImageType::Pointer WarpMask(const MaskImageType * mask,
+                                const DisplacementFieldTransformType * transform,
+                                unsigned int numberOfWorkUnits = 0); // nearest neighbour
+
+// --------------------
+// Intensity normalization
+// --------------------
+
+// Z-score (or robust median/IQR) normalization, applied in place.
+// Statistics and rescale are both single parallel passes over the buffer.
+// mask (same buffer layout) takes precedence over parameters.mask.
+IntensityStatistics NormalizeIntensity(ImageType * image,
+                                       const NormalizationParameters & parameters = NormalizationParameters(),
+                                       const MaskImageType * mask = nullptr);
+
+// --------------------
+// Registration
+// --------------------
+// Which virtual-domain points the Mattes MI metric is evaluated on.
+struct MetricSamplingParameters
+{
+    enum class Strategy
+    {
+        None,    // every voxel
+        Regular, // regular grid with a random offset per point
+        Random
+    };
+
+    Strategy            strategy           = Strategy::None;
+    std::vector<double> percentagePerLevel = { 1.0 }; // fraction in (0, 1]; one value applies to all levels
+    int                 seed               = 121212;  // fixed for reproducible runs
+
+    // Restricts the metric (and the sampled points) to nonzero voxels, e.g. a
+    // brain mask in the fixed image's physical space.
+    MaskImageType::ConstPointer fixedMask;
+};
+
+struct RigidParameters
+{
+    enum class Initialization
+    {
+        Geometry, // rotation about the fixed image centre, no translation
+        Moments   // centres of mass aligned, rotation about the fixed one
+    };
+
+    unsigned int             numberOfHistogramBins = 50;
+    double                   learningRate          = 4.0;
+    double                   minimumStepLength     = 0.01;
+    unsigned int             numberOfIterations    = 200;          // per level
+    double                   translationScale      = 1.0 / 1000.0; // rotations (radians) vs translations (mm)
+    PyramidSchedule          pyramid               = { { 4, 2, 1 }, { 2.0, 1.0, 0.0 } };
+    Initialization           initialization        = Initialization::Geometry;
+    MetricSamplingParameters sampling;
+    unsigned int             numberOfWorkUnits     = 0;
+    ComputeBackend           backend               = ComputeBackend::CPU; // Mattes MI evaluation
+
+    // Multi-start search: a startSteps^3 grid of rotations over
+    // +-startAngleRange degrees is scored in parallel on one coarse level,
+    // and the best startCandidates are refined through the whole pyramid.
+    double                   startAngleRange       = 0.0; // degrees; 0 = single start
+    unsigned int             startSteps            = 5;   // per axis
+    unsigned int             startCandidates       = 2;
+    unsigned int             startShrinkFactor     = 8;
+    double                   startSigma            = 4.0; // mm
+
+    // Warm start (e.g. the previous timepoint's result): used instead of the
+    // search when it scores at least as well as the cold start on the
+    // coarsest level, and then only the finest warmStartLevels levels run.
+    // warmStartAccepted, when given, receives the decision.
+    RigidTransformType::ConstPointer warmStart;
+    unsigned int                     warmStartLevels   = 1;
+    bool *                           warmStartAccepted = nullptr; // not owned
+    IterationRecorder *      iterations            = nullptr; // per-iteration telemetry; not owned
+};
+
+// How a B-spline registration was actually scheduled and run.
+struct ScheduleReport
+{
+    PyramidSchedule           pyramid;
+    std::vector<unsigned int> meshSizePerLevel;
+    std::vector<unsigned int> iterationsPerLevel;
+    std::vector<size_t>       coefficientsAtBoundsPerLevel; // LBFGSB, levels run; see boundFraction
+    unsigned int              levelsCompleted = 0;
+    bool                      truncated       = false; // the deadline cut the schedule short
+    double                    seconds         = 0.0;
+};
+
+struct BSplineParameters
+{
+    enum class Optimizer
+    {
+        LBFGS,  // unbounded
+        LBFGSB  // control-point displacements bounded per level
+    };
+
+    unsigned int              numberOfHistogramBins              = 50;
+    unsigned int              initialMeshSize                    = 4;
+    PyramidSchedule           pyramid                            = { { 4, 2 }, { 2.0, 1.0 } };
+    std::vector<unsigned int> meshSizePerLevel                   = { 3, 4 }; // refined grid per level
+    Optimizer                 optimizer                          = Optimizer::LBFGSB;
+    double                    gradientConvergenceTolerance       = 1e-5;
+    unsigned int              numberOfIterations                 = 100; // per level; upper limit
+    std::vector<unsigned int> iterationsPerLevel;                           // empty = numberOfIterations
+    unsigned int              maximumNumberOfFunctionEvaluations = 250;
+    MetricSamplingParameters  sampling;
+    unsigned int              numberOfWorkUnits                  = 0;
+    IterationRecorder *       iterations                         = nullptr; // not owned
+
+    // LBFGSB: each level may move a coefficient by at most +/- boundFraction
+    // of that level's control-point spacing along its axis, around the value
+    // it starts the level with, so what the coarser levels found is never
+    // clipped. This limits each level's update (below ~0.4 an update alone
+    // cannot fold), not the accumulated deformation, so folding is still
+    // checked by the Jacobian QA. Coefficients ending a level on the bound
+    // are counted in ScheduleReport.
+    double boundFraction = 0.4;
+
+    // Stop a level once the metric has plateaued: the slope of the
+    // normalized metric over the last convergenceWindowSize iterations falls
+    // below convergenceThreshold (0 disables the monitor).
+    unsigned int convergenceWindowSize = 10;
+    double       convergenceThreshold  = 1e-6;
+
+    // Tumour / brain ROI: when set, the metric is evaluated and the control
+    // grid laid out only over the mask's bounding box padded by roiPadding
+    // (mm), so meshSizePerLevel buys a much finer grid around the lesion.
+    // Outside the box the B-spline is the identity.
+    MaskImageType::ConstPointer roiMask;
+    double                      roiPadding = 15.0;
+
+    // Fixed moving-side transform (typically the rigid result) applied before
+    // the B-spline; it is not optimized. The moving image is then the original,
+    // not a rigidly resampled copy.
+    TransformBaseType::Pointer initialTransform;
+
+    // Warm start on the same transform domain (else ignored): its
+    // coefficients replace the coarse initial grid and only the finest
+    // warmStartLevels levels run.
+    BSplineTransformType::ConstPointer warmStart;
+    unsigned int                       warmStartLevels = 1;
+
+    // Adaptive schedule: levels, sigmas, mesh sizes and per-level iteration
+    // caps follow from the size and spacing of the registered domain (the
+    // fixed image or ROI box; AdaptBSplineSchedule) instead of the values above.
+    bool adaptiveSchedule = false;
+
+    // Wall-clock budget in seconds; 0 = none. The first level always runs;
+    // a later level that would not finish in time (estimated from the one
+    // before) is not started, and a running level stops at the deadline, so
+    // the result is the last level reached rather than nothing.
+    double           deadlineSeconds = 0.0;
+    ScheduleReport * report          = nullptr; // not owned
+};
+
+// The adaptive schedule for a domain: shrink factors halving from the
+// largest (at most 8) that keeps 24 voxels along the shortest axis down to
+// 1 (2 above 20M voxels), sigmas of half the shrink factor in voxels,
+// control points every 50 mm on the coarsest level and twice as dense on
+// each finer one (never closer than 10 mm), and iteration caps from
+// 2 x numberOfIterations on the coarsest level down to half of it on the
+// finest.
+void AdaptBSplineSchedule(const itk::ImageBase<3> * domain, BSplineParameters & parameters);
+
+// Mattes MI + regular step gradient descent, rotation centred on the fixed
+// image, run coarse to fine over parameters.pyramid. Levels are taken from
+// (and added to) the given pyramids so later stages can reuse them.
+RigidTransformType::Pointer RegisterRigid(ImagePyramid & fixed,
+                                          ImagePyramid & moving,
+                                          const RigidParameters & parameters = RigidParameters());
+
+RigidTransformType::Pointer RegisterRigid(const ImageType * fixed,
+                                          const ImageType * moving,
+                                          const RigidParameters & parameters = RigidParameters());
+
+// Multi-resolution B-spline registration (Mattes MI + LBFGSB or LBFGS); the
+// control grid is refined to meshSizePerLevel[level] before each level.
+BSplineTransformType::Pointer RegisterBSpline(ImagePyramid & fixed,
+                                              ImagePyramid & moving,
+                                              const BSplineParameters & parameters = BSplineParameters());
+
+BSplineTransformType::Pointer RegisterBSpline(const ImageType * fixed,
+                                              const ImageType * moving,
+                                              const BSplineParameters & parameters = BSplineParameters());
+
+// initial o deformable: the full fixed-to-moving mapping for a single
+// resample of the original moving image. initial may be null.
+CompositeTransformType::Pointer ComposeTransforms(TransformBaseType * initial,
+                                                  TransformBaseType * deformable);
+
+// --------------------
+// QA
+// --------------------
+struct ForegroundSummary
+{
+    PointType centroid;
+    size_t    numberOfVoxels = 0;
+    double    volume         = 0.0; // mm^3
+    PointType boundingBoxMinimum;   // axis-aligned, physical, through voxel centres
+    PointType boundingBoxMaximum;
+};
+
+struct CentroidResult
+{
+    PointType fixed;
+    PointType registered;
+    double    distance = 0.0;
+
+    ForegroundSummary fixedForeground;
+    ForegroundSummary registeredForeground;
+    double            volumeDelta        = 0.0; // registered - fixed (mm^3)
+    double            boundingBoxOverlap = 0.0; // intersection over union of the two boxes
+};
+
+// Foreground (intensity >= 1) centroid comparison for registration sanity check.
+// Threshold, centroid, volume and bounding box come from one parallel pass
+// over both images; no mask image is allocated.
+CentroidResult CentroidCheck(const ImageType * fixed, const ImageType * registered,
+                             unsigned int numberOfWorkUnits = 0);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_STAGES_H
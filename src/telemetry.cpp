@@ -0,0 +1,254 @@
+//
+// Profiling telemetry: stage spans and registration iterations
+//
+
+#include "telemetry.h"
+
+#include <fstream>
+
+#include <sys/resource.h>
+
+#include <itkMacro.h>
+
+#include "json_writer.h"
+
+namespace tt
+{
+
+size_t GetPeakResidentSetSize()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss) / 1024; // bytes on macOS
+#else
+    return static_cast<size_t>(usage.ru_maxrss);
+#endif
+}
+
+// =====================================================
+// Telemetry
+// =====================================================
+
+Telemetry::Telemetry()
+    : m_Epoch(Clock::now())
+{
+}
+
+double Telemetry::Now() const
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - m_Epoch).count();
+}
+
+unsigned int Telemetry::ThreadIndex()
+{
+    const auto inserted = m_ThreadIndices.emplace(std::this_thread::get_id(),
+                                                  static_cast<unsigned int>(m_ThreadIndices.size()));
+    return inserted.first->second;
+}
+
+void Telemetry::Record(const StageEvent & event)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stages.emplace_back(event, ThreadIndex());
+}
+
+void Telemetry::Record(const IterationEvent & event)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Iterations.emplace_back(event, ThreadIndex());
+}
+
+std::vector<Telemetry::StageEvent> Telemetry::GetStageEvents() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    std::vector<StageEvent>     events;
+    events.reserve(m_Stages.size());
+    for (const auto & stage : m_Stages)
+    {
+        events.push_back(stage.first);
+    }
+    return events;
+}
+
+Telemetry::Format Telemetry::FormatForFile(const std::string & fileName)
+{
+    const std::string extension = ".json";
+    const bool chrome = fileName.size() >= extension.size() &&
+                        fileName.compare(fileName.size() - extension.size(), extension.size(), extension) == 0;
+    return chrome ? Format::ChromeTrace : Format::JsonLines;
+}
+
+void Telemetry::Write(const std::string & fileName) const
+{
+    std::ofstream file(fileName);
+    if (!file)
+    {
+        itkGenericExceptionMacro(<< "Cannot write " << fileName);
+    }
+    Write(file, FormatForFile(fileName));
+}
+
+namespace
+{
+
+void WriteStageMembers(JsonWriter & json, const Telemetry::StageEvent & event)
+{
+    json.Member("case", event.caseName)
+        .Member("timepoint", event.timepoint)
+        .Member("memory_delta_kb", event.memoryDelta)
+        .Member("peak_rss_kb", event.peakResidentSetSize);
+}
+
+void WriteIterationMembers(JsonWriter & json, const Telemetry::IterationEvent & event)
+{
+    json.Member("case", event.caseName)
+        .Member("timepoint", event.timepoint)
+        .Member("level", event.level)
+        .Member("iteration", event.iteration)
+        .Member("metric", event.metric)
+        .Member("parameters", event.numberOfParameters);
+}
+
+} // namespace
+
+void Telemetry::Write(std::ostream & os, Format format) const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (format == Format::JsonLines)
+    {
+        for (const auto & [event, thread] : m_Stages)
+        {
+            JsonWriter json(os);
+            json.BeginObject().Member("type", "stage").Member("stage", event.stage);
+            WriteStageMembers(json, event);
+            json.Member("start_us", event.start).Member("duration_us", event.duration).Member("thread", thread);
+            json.EndObject();
+            os << '\n';
+        }
+        for (const auto & [event, thread] : m_Iterations)
+        {
+            JsonWriter json(os);
+            json.BeginObject().Member("type", "iteration").Member("stage", event.stage);
+            WriteIterationMembers(json, event);
+            json.Member("start_us", event.start).Member("duration_us", event.duration).Member("thread", thread);
+            json.EndObject();
+            os << '\n';
+        }
+        os.flush();
+        return;
+    }
+
+    // Complete ("X") events: stages and iterations nest on the thread that
+    // ran them.
+    JsonWriter json(os);
+    json.BeginObject().Key("traceEvents").BeginArray();
+    for (const auto & [event, thread] : m_Stages)
+    {
+        json.BeginObject()
+            .Member("name", event.stage)
+            .Member("cat", "stage")
+            .Member("ph", "X")
+            .Member("ts", event.start)
+            .Member("dur", event.duration)
+            .Member("pid", 1)
+            .Member("tid", thread);
+        json.Key("args").BeginObject();
+        WriteStageMembers(json, event);
+        json.EndObject().EndObject();
+    }
+    for (const auto & [event, thread] : m_Iterations)
+    {
+        json.BeginObject()
+            .Member("name", event.stage + " L" + std::to_string(event.level))
+            .Member("cat", "iteration")
+            .Member("ph", "X")
+            .Member("ts", event.start)
+            .Member("dur", event.duration)
+            .Member("pid", 1)
+            .Member("tid", thread);
+        json.Key("args").BeginObject();
+        WriteIterationMembers(json, event);
+        json.EndObject().EndObject();
+    }
+    json.EndArray().Member("displayTimeUnit", "ms").EndObject();
+    os << std::endl;
+}
+
+// =====================================================
+// StageSpan
+// =====================================================
+
+StageSpan::StageSpan(Telemetry * telemetry, std::string caseName, std::string timepoint, std::string stage)
+    : m_Telemetry(telemetry)
+{
+    if (m_Telemetry == nullptr)
+    {
+        return;
+    }
+    m_Event.caseName  = std::move(caseName);
+    m_Event.timepoint = std::move(timepoint);
+    m_Event.stage     = std::move(stage);
+    m_Memory.Start();
+    m_Event.start = m_Telemetry->Now();
+}
+
+StageSpan::~StageSpan()
+{
+    if (m_Telemetry == nullptr)
+    {
+        return;
+    }
+    m_Event.duration = m_Telemetry->Now() - m_Event.start;
+    m_Memory.Stop();
+    m_Event.memoryDelta         = m_Memory.GetTotal();
+    m_Event.peakResidentSetSize = GetPeakResidentSetSize();
+    m_Telemetry->Record(m_Event);
+}
+
+// =====================================================
+// IterationRecorder
+// =====================================================
+
+IterationRecorder::IterationRecorder(Telemetry & telemetry, std::string caseName, std::string timepoint,
+                                     std::string stage)
+    : m_Telemetry(telemetry)
+    , m_CaseName(std::move(caseName))
+    , m_Timepoint(std::move(timepoint))
+    , m_Stage(std::move(stage))
+{
+    m_Last = m_Telemetry.Now();
+}
+
+void IterationRecorder::BeginLevel(unsigned int level, size_t numberOfParameters)
+{
+    m_Level              = level;
+    m_Iteration          = 0;
+    m_NumberOfParameters = numberOfParameters;
+    m_Last               = m_Telemetry.Now();
+}
+
+void IterationRecorder::Iteration(double metricValue)
+{
+    const double now = m_Telemetry.Now();
+
+    Telemetry::IterationEvent event;
+    event.caseName           = m_CaseName;
+    event.timepoint          = m_Timepoint;
+    event.stage              = m_Stage;
+    event.level              = m_Level;
+    event.iteration          = m_Iteration++;
+    event.metric             = metricValue;
+    event.start              = m_Last;
+    event.duration           = now - m_Last;
+    event.numberOfParameters = m_NumberOfParameters;
+    m_Telemetry.Record(event);
+
+    m_Last = now;
+}
+
+} // namespace tt
@@ -0,0 +1,140 @@
+//
+// Profiling telemetry: stage spans and registration iterations
+//
+// Stages record wall time, memory growth and the process peak RSS; the
+// registration stages record every optimizer iteration (metric value,
+// iteration time, level, number of parameters). Everything is written as
+// JSON lines (one event per line, for scripts) or as Chrome trace events
+// (chrome://tracing, Perfetto), chosen by the file extension.
+//
+
+#ifndef TUMOURTRACKER_TELEMETRY_H
+#define TUMOURTRACKER_TELEMETRY_H
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <itkMemoryProbe.h>
+
+namespace tt
+{
+
+// Peak resident set size of the process so far, in kB.
+size_t GetPeakResidentSetSize();
+
+// Thread-safe event sink shared by every case of a run.
+class Telemetry
+{
+public:
+    enum class Format
+    {
+        JsonLines,  // one object per line
+        ChromeTrace // {"traceEvents": [...]}
+    };
+
+    Telemetry();
+
+    // Microseconds since the recorder was created.
+    double Now() const;
+
+    struct StageEvent
+    {
+        std::string caseName;
+        std::string timepoint;
+        std::string stage;
+        double      start               = 0.0; // us
+        double      duration            = 0.0; // us
+        double      memoryDelta         = 0.0; // kB, itk::MemoryProbe over the stage
+        size_t      peakResidentSetSize = 0;   // kB, process-wide at the end of the stage
+    };
+
+    struct IterationEvent
+    {
+        std::string  caseName;
+        std::string  timepoint;
+        std::string  stage;
+        unsigned int level              = 0;
+        unsigned int iteration          = 0; // within the level
+        double       metric             = 0.0;
+        double       start              = 0.0; // us
+        double       duration           = 0.0; // us since the previous iteration (or level start)
+        size_t       numberOfParameters = 0;
+    };
+
+    void Record(const StageEvent & event);
+    void Record(const IterationEvent & event);
+
+    // Snapshot of the stage events recorded so far.
+    std::vector<StageEvent> GetStageEvents() const;
+
+    // ".json" -> Chrome trace, anything else (".jsonl") -> JSON lines.
+    static Format FormatForFile(const std::string & fileName);
+
+    // Throws itk::ExceptionObject if the file cannot be written.
+    void Write(const std::string & fileName) const;
+    void Write(std::ostream & os, Format format) const;
+
+private:
+    unsigned int ThreadIndex(); // small, stable ids for the trace viewer; m_Mutex held
+
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point m_Epoch;
+
+    // Events with the index of the thread that recorded them.
+    mutable std::mutex                                   m_Mutex;
+    std::vector<std::pair<StageEvent, unsigned int>>     m_Stages;
+    std::vector<std::pair<IterationEvent, unsigned int>> m_Iterations;
+    std::map<std::thread::id, unsigned int>              m_ThreadIndices;
+};
+
+// Scoped stage span: wall time, memory growth and peak RSS from construction
+// to destruction. With a null telemetry nothing is measured.
+class StageSpan
+{
+public:
+    StageSpan(Telemetry * telemetry, std::string caseName, std::string timepoint, std::string stage);
+    ~StageSpan();
+
+    StageSpan(const StageSpan &)             = delete;
+    StageSpan & operator=(const StageSpan &) = delete;
+
+private:
+    Telemetry *           m_Telemetry;
+    Telemetry::StageEvent m_Event;
+    itk::MemoryProbe      m_Memory;
+};
+
+// Per-iteration recorder for one registration stage of one timepoint.
+// The stage functions call BeginLevel on MultiResolutionIterationEvent and
+// Iteration on every IterationEvent; BeginLevel restarts the iteration
+// clock so the first iteration does not include level setup.
+class IterationRecorder
+{
+public:
+    IterationRecorder(Telemetry & telemetry, std::string caseName, std::string timepoint,
+                      std::string stage);
+
+    void BeginLevel(unsigned int level, size_t numberOfParameters);
+    void Iteration(double metricValue);
+
+private:
+    Telemetry &  m_Telemetry;
+    std::string  m_CaseName;
+    std::string  m_Timepoint;
+    std::string  m_Stage;
+    unsigned int m_Level              = 0;
+    unsigned int m_Iteration          = 0;
+    size_t       m_NumberOfParameters = 0;
+    double       m_Last               = 0.0;
+};
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_TELEMETRY_H
@@ -0,0 +1,139 @@
+//
+// Carry T0 tumour labels into each follow-up and report lesion volumetrics
+// T0 labels  = segmentation on the fixed image
+// Transforms = T0-to-T(n), as written by the pipeline or deformable_register
+//
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include <itkImageFileReader.h>
+
+#include "command_line.h"
+#include "json_writer.h"
+#include "stage_options.h"
+#include "stages.h"
+#include "tumour_tracking.h"
+
+int main(int argc, char* argv[])
+{
+    tt::TrackingParameters   parameters;
+    std::vector<std::string> files;
+    std::vector<std::string> followUpLabelFiles;
+    std::vector<std::string> propagatedFiles;
+    std::vector<double>      days;
+    std::string              reportFile;
+
+    try
+    {
+        tt::CommandLine cmd(argc, argv);
+        files                        = cmd.Positional();
+        followUpLabelFiles           = cmd.GetList("followup-labels", {});
+        propagatedFiles              = cmd.GetList("propagated", {});
+        days                         = cmd.GetDoubleList("days", {});
+        reportFile                   = cmd.GetString("report", "");
+        parameters.interpolation     = tt::ParseLabelInterpolation(cmd.GetString("interpolation", "nearest"));
+        parameters.padding           = cmd.GetDouble("padding", parameters.padding);
+        parameters.numberOfWorkUnits = cmd.GetUnsigned("threads", parameters.numberOfWorkUnits);
+    }
+    catch (std::exception &err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // One transform / reference pair per follow-up; the per-follow-up lists
+    // are either absent or one entry per pair.
+    const size_t followUps = files.size() > 1 ? (files.size() - 1) / 2 : 0;
+    const auto   matches   = [&](size_t n) { return n == 0 || n == followUps; };
+    if (followUps == 0 || files.size() % 2 == 0 || !matches(followUpLabelFiles.size()) ||
+        !matches(propagatedFiles.size()) || !matches(days.size()))
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " [options] <T0_labels.nii> <T0_to_T1.tfm> <T1.nii> [<T0_to_T2.tfm> <T2.nii> ...]\n";
+        tt::PrintOption(std::cerr, "", "followup-labels <l1,l2,...>", "follow-up segmentations: Dice, Hausdorff, surface distance");
+        tt::PrintOption(std::cerr, "", "days <d1,d2,...>", "days from T0 to each follow-up (growth rate)");
+        tt::PrintOption(std::cerr, "", "propagated <p1,p2,...>", "write the T0 labels on each follow-up grid");
+        tt::PrintOption(std::cerr, "", "interpolation <nearest|gaussian>", "label interpolation (default nearest)");
+        tt::PrintOption(std::cerr, "", "padding <mm>", "margin around each lesion box (default 10)");
+        tt::PrintOption(std::cerr, "", "report <file.json>", "write the per-label metrics as JSON");
+        tt::PrintOption(std::cerr, "", "threads <n>", "work units (default: ITK default)");
+        return EXIT_FAILURE;
+    }
+
+    std::ofstream                   report;
+    std::unique_ptr<tt::JsonWriter> json;
+    if (!reportFile.empty())
+    {
+        report.open(reportFile);
+        json = std::make_unique<tt::JsonWriter>(report);
+        json->BeginObject().Member("labels", files[0]).Key("followups").BeginArray();
+    }
+
+    try
+    {
+        tt::MaskImageType::Pointer fixedLabels = tt::ReadMask(files[0]);
+        for (size_t n = 0; n < followUps; ++n)
+        {
+            const std::string & transformFile = files[1 + 2 * n];
+            const std::string & referenceFile = files[2 + 2 * n];
+
+            // Only the follow-up geometry is needed unless it has labels
+            tt::MaskImageType::Pointer followUpLabels;
+            itk::ImageBase<3>::Pointer grid;
+            if (!followUpLabelFiles.empty())
+            {
+                followUpLabels = tt::ReadMask(followUpLabelFiles[n]);
+                grid           = followUpLabels;
+            }
+            else
+            {
+                auto reader = itk::ImageFileReader<tt::MaskImageType>::New();
+                reader->SetFileName(referenceFile);
+                reader->UpdateOutputInformation();
+                grid = reader->GetOutput();
+            }
+
+            parameters.days = days.empty() ? 0.0 : days[n];
+            const tt::TransformBaseType::Pointer transform = tt::ReadTransform(transformFile);
+            const tt::TrackingResult             result =
+                tt::TrackTumour(fixedLabels, transform, grid, followUpLabels, parameters);
+
+            std::cout << "Follow-up " << referenceFile << std::endl;
+            tt::PrintTrackingResult(result, std::cout);
+            if (!propagatedFiles.empty())
+            {
+                tt::WriteMask(result.propagated, propagatedFiles[n]);
+            }
+            if (json)
+            {
+                json->BeginObject().Member("reference", referenceFile).Member("transform", transformFile);
+                if (!days.empty())
+                {
+                    json->Member("days", days[n]);
+                }
+                json->Key("labels");
+                tt::WriteTrackingJson(result, *json);
+                json->EndObject();
+            }
+        }
+    }
+    catch (itk::ExceptionObject &err)
+    {
+        std::cerr << "Tumour tracking failed:\n" << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception &err)
+    {
+        std::cerr << "Tumour tracking failed: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (json)
+    {
+        json->EndArray().EndObject();
+        report << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,768 @@
+//
+// Registration benchmark on synthetic phantoms (tt_bench)
+//
+// Builds a head-like phantom at each requested size, warps it through a
+// known rigid and rigid + B-spline transform, and times the core routine
+// of every tool (resample, normalize, rigid, deformable, centroid, Jacobian
+// QA) for each thread count; demons and syn run the alternative deformable
+// engines on the same phantoms for an engine comparison. Reports wall time, throughput, scaling efficiency,
+// memory and the target registration error of the recovered transform.
+// resample-opencl and rigid-opencl run the same routines on the OpenCL
+// backend and also report how far the result is from the CPU path.
+//
+// --csv writes the results in the format --baseline reads back, so a
+// stored run can gate a later one: the exit code is nonzero when a
+// routine got slower (or less accurate) than the tolerance allows.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <itkBSplineTransformInitializer.h>
+#include <itkImageDuplicator.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkMemoryProbe.h>
+#include <itkMultiThreaderBase.h>
+
+#include "cohort.h"
+#include "command_line.h"
+#include "deformable_engines.h"
+#include "jacobian.h"
+#include "json_writer.h"
+#include "stage_options.h"
+#include "stages.h"
+
+namespace
+{
+
+using tt::ImageType;
+using tt::PointType;
+
+const double kFieldOfView = 192.0; // mm, phantoms of every size cover the same head
+
+// =====================================================
+// Phantom
+// =====================================================
+
+// Normalized ellipsoid radius of p (1 on the surface).
+double EllipsoidRadius(const PointType & p, double cx, double cy, double cz, double ax, double ay, double az)
+{
+    const double x = (p[0] - cx) / ax;
+    const double y = (p[1] - cy) / ay;
+    const double z = (p[2] - cz) / az;
+    return std::sqrt(x * x + y * y + z * z);
+}
+
+// Skull shell, textured brain, two ventricles and a bright lesion on an
+// isotropic size^3 grid centred on the origin. The texture gives the
+// metric gradients everywhere inside the brain.
+ImageType::Pointer MakePhantom(unsigned int size)
+{
+    ImageType::SizeType imageSize;
+    imageSize.Fill(size);
+    ImageType::SpacingType spacing;
+    spacing.Fill(kFieldOfView / size);
+    ImageType::PointType origin;
+    origin.Fill(-kFieldOfView / 2.0 + spacing[0] / 2.0);
+
+    auto image = ImageType::New();
+    image->SetRegions(ImageType::RegionType(imageSize));
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->Allocate();
+
+    itk::MultiThreaderBase::New()->ParallelizeImageRegion<3>(
+        image->GetLargestPossibleRegion(),
+        [image](const ImageType::RegionType & region)
+        {
+            itk::ImageRegionIteratorWithIndex<ImageType> it(image, region);
+            for (; !it.IsAtEnd(); ++it)
+            {
+                PointType p;
+                image->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+
+                const double head  = EllipsoidRadius(p, 0.0, 0.0, 0.0, 75.0, 85.0, 65.0);
+                float        value = 0.0f;
+                if (head <= 1.0)
+                {
+                    value = 180.0f; // skull
+                }
+                if (head <= 0.9)
+                {
+                    value = static_cast<float>(100.0 + 12.0 * std::sin(p[0] / 7.0) * std::sin(p[1] / 9.0) *
+                                                           std::sin(p[2] / 11.0));
+                    if (EllipsoidRadius(p, -12.0, 5.0, 5.0, 7.0, 20.0, 10.0) <= 1.0 ||
+                        EllipsoidRadius(p, 12.0, 5.0, 5.0, 7.0, 20.0, 10.0) <= 1.0)
+                    {
+                        value = 30.0f;
+                    }
+                    if (EllipsoidRadius(p, 30.0, -20.0, 15.0, 12.0, 12.0, 12.0) <= 1.0)
+                    {
+                        value = 220.0f;
+                    }
+                }
+                it.Set(value);
+            }
+        },
+        nullptr);
+    return image;
+}
+
+tt::RigidTransformType::Pointer MakeKnownRigid()
+{
+    auto transform = tt::RigidTransformType::New();
+    transform->SetRotation(0.06, -0.04, 0.08); // ~3-5 degrees
+    tt::RigidTransformType::OutputVectorType translation;
+    translation[0] = 4.0;
+    translation[1] = -3.0;
+    translation[2] = 2.5;
+    transform->SetTranslation(translation);
+    return transform;
+}
+
+// Smooth deformation: seeded random coefficients on a coarse grid, up to
+// amplitude mm per control point.
+tt::BSplineTransformType::Pointer MakeKnownBSpline(const ImageType * reference, double amplitude)
+{
+    auto transform   = tt::BSplineTransformType::New();
+    auto initializer = itk::BSplineTransformInitializer<tt::BSplineTransformType, ImageType>::New();
+    initializer->SetTransform(transform);
+    initializer->SetImage(reference);
+    tt::BSplineTransformType::MeshSizeType meshSize;
+    meshSize.Fill(4);
+    initializer->SetTransformDomainMeshSize(meshSize);
+    initializer->InitializeTransform();
+
+    std::mt19937                             generator(2024);
+    std::uniform_real_distribution<double>   coefficient(-amplitude, amplitude);
+    tt::BSplineTransformType::ParametersType parameters(transform->GetNumberOfParameters());
+    for (unsigned int i = 0; i < parameters.size(); ++i)
+    {
+        parameters[i] = coefficient(generator);
+    }
+    transform->SetParameters(parameters);
+    return transform;
+}
+
+// Target registration error over a regular grid of brain points: the
+// recovered fixed-to-moving mapping followed by the known moving-to-fixed
+// one (the phantom warp) should be the identity.
+struct TargetRegistrationError
+{
+    double mean    = 0.0;
+    double maximum = 0.0;
+};
+
+TargetRegistrationError MeasureTRE(const tt::TransformBaseType * recovered, const tt::TransformBaseType * known)
+{
+    TargetRegistrationError error;
+    size_t                  points = 0;
+    for (double x = -60.0; x <= 60.0; x += 8.0)
+    {
+        for (double y = -70.0; y <= 70.0; y += 8.0)
+        {
+            for (double z = -50.0; z <= 50.0; z += 8.0)
+            {
+                PointType p;
+                p[0] = x;
+                p[1] = y;
+                p[2] = z;
+                if (EllipsoidRadius(p, 0.0, 0.0, 0.0, 75.0, 85.0, 65.0) > 0.8)
+                {
+                    continue;
+                }
+                const double distance = known->TransformPoint(recovered->TransformPoint(p)).EuclideanDistanceTo(p);
+                error.mean += distance;
+                error.maximum = std::max(error.maximum, distance);
+                ++points;
+            }
+        }
+    }
+    error.mean /= std::max<size_t>(points, 1);
+    return error;
+}
+
+// =====================================================
+// Memory
+// =====================================================
+
+// A field of /proc/self/status in kB ("VmRSS", "VmHWM"); 0 without procfs.
+size_t StatusKB(const std::string & field)
+{
+    std::ifstream status("/proc/self/status");
+    std::string   line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, field.size() + 1, field + ":") == 0)
+        {
+            return std::stoul(line.substr(field.size() + 1));
+        }
+    }
+    return 0;
+}
+
+// Peak RSS growth over one measurement: VmHWM is reset to the current RSS
+// at Start (Linux: /proc/self/clear_refs), so the result covers only what
+// ran in between, unlike ru_maxrss, which keeps the high-water mark of
+// every earlier size and routine. Negative where the mark cannot be reset.
+class PeakProbe
+{
+public:
+    void Start()
+    {
+        std::ofstream clear("/proc/self/clear_refs");
+        clear << "5" << std::flush;
+        m_Reset = static_cast<bool>(clear);
+        m_Start = StatusKB("VmRSS");
+    }
+
+    double GetGrowthMB() const
+    {
+        const size_t peak = StatusKB("VmHWM");
+        if (!m_Reset || peak == 0)
+        {
+            return -1.0;
+        }
+        return (peak > m_Start ? peak - m_Start : 0) / 1024.0;
+    }
+
+private:
+    bool   m_Reset = false;
+    size_t m_Start = 0; // kB
+};
+
+// =====================================================
+// Benchmark
+// =====================================================
+
+struct Result
+{
+    std::string  routine;
+    unsigned int size                  = 0;
+    unsigned int threads               = 0;
+    double       seconds               = 0.0; // fastest of the repeats
+    double       voxelsPerSecond       = 0.0;
+    double       scalingEfficiency     = 1.0; // vs. the smallest thread count
+    double       memoryDeltaMB         = 0.0;  // RSS growth from start to end of the measurement
+    double       peakGrowthMB          = -1.0; // peak RSS over the measurement above its start; negative = n/a
+    double       treMean               = -1.0; // mm; negative = not a registration
+    double       treMaximum            = -1.0;
+    double       maximumDifference     = -1.0; // max |OpenCL - CPU| voxel value; negative = not compared
+    bool         hasJacobian           = false; // registrations: QA of the recovered mapping
+    double       jacobianMinimum       = 0.0;
+    double       foldedFraction        = 0.0;
+};
+
+struct Phantoms
+{
+    ImageType::Pointer                  fixed;
+    ImageType::Pointer                  movingRigid;    // fixed through knownRigid
+    ImageType::Pointer                  movingDeformed; // fixed through knownRigid o knownBSpline
+    tt::TransformBaseType::Pointer      knownRigid;
+    tt::CompositeTransformType::Pointer knownDeformation;
+};
+
+Phantoms MakePhantoms(unsigned int size, double amplitude)
+{
+    Phantoms phantoms;
+    phantoms.fixed = MakePhantom(size);
+
+    auto rigid           = MakeKnownRigid();
+    phantoms.knownRigid  = rigid;
+    phantoms.movingRigid = tt::ResampleToReference(phantoms.fixed, rigid, phantoms.fixed);
+
+    auto bspline              = MakeKnownBSpline(phantoms.fixed, amplitude);
+    phantoms.knownDeformation = tt::ComposeTransforms(rigid, bspline);
+    phantoms.movingDeformed   = tt::ResampleToReference(phantoms.fixed, phantoms.knownDeformation, phantoms.fixed);
+    return phantoms;
+}
+
+ImageType::Pointer Duplicate(const ImageType * image)
+{
+    auto duplicator = itk::ImageDuplicator<ImageType>::New();
+    duplicator->SetInputImage(image);
+    duplicator->Update();
+    return duplicator->GetOutput();
+}
+
+double MaximumDifference(const ImageType * a, const ImageType * b)
+{
+    const size_t  count   = a->GetBufferedRegion().GetNumberOfPixels();
+    const float * aBuffer = a->GetBufferPointer();
+    const float * bBuffer = b->GetBufferPointer();
+    double        maximum = 0.0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        maximum = std::max(maximum, std::fabs(double(aBuffer[i]) - bBuffer[i]));
+    }
+    return maximum;
+}
+
+// TRE and Jacobian QA of a recovered fixed-to-moving mapping.
+void MeasureRegistration(const tt::TransformBaseType * recovered, const Phantoms & phantoms, unsigned int threads,
+                         Result & result)
+{
+    const TargetRegistrationError tre = MeasureTRE(recovered, phantoms.knownDeformation);
+    result.treMean                    = tre.mean;
+    result.treMaximum                 = tre.maximum;
+
+    tt::JacobianParameters parameters;
+    parameters.numberOfWorkUnits          = threads;
+    const tt::JacobianStatistics jacobian = tt::ComputeJacobianStatistics(recovered, phantoms.fixed, parameters);
+    result.hasJacobian                    = true;
+    result.jacobianMinimum                = jacobian.minimum;
+    result.foldedFraction                 = jacobian.FoldedFraction();
+}
+
+// One timed run of routine; returns seconds and fills the TRE when the
+// routine recovers a transform.
+double RunRoutine(const std::string & routine, const Phantoms & phantoms, unsigned int threads,
+                  const tt::RigidParameters & rigidParameters, const tt::DeformableParameters & deformableParameters,
+                  Result & result)
+{
+    using Clock = std::chrono::steady_clock;
+
+    if (routine == "resample" || routine == "resample-opencl")
+    {
+        const tt::ComputeBackend backend =
+            routine == "resample" ? tt::ComputeBackend::CPU : tt::ComputeBackend::OpenCL;
+        const auto         start     = Clock::now();
+        ImageType::Pointer resampled = tt::ResampleIsotropic(phantoms.fixed, 1.0, threads, backend);
+        const double       seconds   = std::chrono::duration<double>(Clock::now() - start).count();
+        if (backend != tt::ComputeBackend::CPU)
+        {
+            result.maximumDifference =
+                MaximumDifference(resampled, tt::ResampleIsotropic(phantoms.fixed, 1.0, threads));
+        }
+        return seconds;
+    }
+    if (routine == "normalize")
+    {
+        ImageType::Pointer          image = Duplicate(phantoms.fixed);
+        tt::NormalizationParameters parameters;
+        parameters.numberOfWorkUnits = threads;
+        const auto start             = Clock::now();
+        tt::NormalizeIntensity(image, parameters);
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    // The "-int16" variants register on int16 pyramid levels; building the
+    // levels is timed with the registration in every variant.
+    const tt::LevelStorage storage = routine.size() > 6 && routine.compare(routine.size() - 6, 6, "-int16") == 0
+                                         ? tt::LevelStorage::Int16
+                                         : tt::LevelStorage::Float;
+    if (routine == "rigid" || routine == "rigid-opencl" || routine == "rigid-int16" || routine == "rigid-multistart")
+    {
+        tt::RigidParameters parameters = rigidParameters;
+        parameters.numberOfWorkUnits   = threads;
+        parameters.backend = routine == "rigid-opencl" ? tt::ComputeBackend::OpenCL : tt::ComputeBackend::CPU;
+        if (routine == "rigid-multistart")
+        {
+            parameters.initialization  = tt::RigidParameters::Initialization::Moments;
+            parameters.startAngleRange = std::max(parameters.startAngleRange, 30.0);
+        }
+        const auto       start = Clock::now();
+        tt::ImagePyramid fixedPyramid(phantoms.fixed, threads, storage);
+        tt::ImagePyramid movingPyramid(phantoms.movingRigid, threads, storage);
+        auto             rigid   = tt::RegisterRigid(fixedPyramid, movingPyramid, parameters);
+        const double     seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        const TargetRegistrationError tre = MeasureTRE(rigid, phantoms.knownRigid);
+        result.treMean    = tre.mean;
+        result.treMaximum = tre.maximum;
+        return seconds;
+    }
+    if (routine == "deformable" || routine == "deformable-int16")
+    {
+        // The rigid part is not timed here; it has its own routine.
+        tt::RigidParameters rigid = rigidParameters;
+        rigid.numberOfWorkUnits   = threads;
+        auto initial              = tt::RegisterRigid(phantoms.fixed, phantoms.movingDeformed, rigid);
+
+        tt::BSplineParameters parameters = deformableParameters.bspline;
+        parameters.numberOfWorkUnits     = threads;
+        parameters.initialTransform      = initial;
+        const auto       start = Clock::now();
+        tt::ImagePyramid fixedPyramid(phantoms.fixed, threads, storage);
+        tt::ImagePyramid movingPyramid(phantoms.movingDeformed, threads, storage);
+        auto             bspline = tt::RegisterBSpline(fixedPyramid, movingPyramid, parameters);
+        const double     seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        MeasureRegistration(tt::ComposeTransforms(initial, bspline), phantoms, threads, result);
+        return seconds;
+    }
+    if (routine == "demons" || routine == "syn")
+    {
+        // The same recovery with the alternative engines, from the same
+        // untimed rigid start.
+        tt::RigidParameters rigid = rigidParameters;
+        rigid.numberOfWorkUnits   = threads;
+        auto initial              = tt::RegisterRigid(phantoms.fixed, phantoms.movingDeformed, rigid);
+
+        tt::DeformableParameters parameters = deformableParameters;
+        parameters.engine = routine == "demons" ? tt::DeformableEngine::Demons : tt::DeformableEngine::SyN;
+        const auto       start   = Clock::now();
+        tt::ImagePyramid fixedPyramid(phantoms.fixed, threads);
+        tt::ImagePyramid movingPyramid(phantoms.movingDeformed, threads);
+        auto             field   = tt::RegisterDeformable(fixedPyramid, movingPyramid, parameters, initial, threads);
+        const double     seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        MeasureRegistration(tt::ComposeTransforms(initial, field), phantoms, threads, result);
+        return seconds;
+    }
+    if (routine == "jacobian")
+    {
+        // The QA path of the pipeline, on a rigid o B-spline composite,
+        // checked against the dense-field filter on the same mapping.
+        tt::JacobianParameters parameters;
+        parameters.numberOfWorkUnits = threads;
+        const auto                   start = Clock::now();
+        const tt::JacobianStatistics qa =
+            tt::ComputeJacobianStatistics(phantoms.knownDeformation, phantoms.fixed, parameters);
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        const tt::JacobianStatistics field = tt::ComputeJacobianStatistics(
+            tt::ComputeDisplacementField(phantoms.knownDeformation, phantoms.fixed, threads), parameters);
+        if (qa.numberOfVoxels != field.numberOfVoxels || std::fabs(qa.mean - field.mean) > 1e-2)
+        {
+            throw std::runtime_error("Jacobian QA mean " + std::to_string(qa.mean) + " differs from the field's " +
+                                     std::to_string(field.mean));
+        }
+        return seconds;
+    }
+    if (routine == "centroid")
+    {
+        const auto start = Clock::now();
+        tt::CentroidCheck(phantoms.fixed, phantoms.movingDeformed, threads);
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    throw std::invalid_argument("unknown routine '" + routine + "'");
+}
+
+// =====================================================
+// Output and baseline
+// =====================================================
+
+std::string ResultKey(const std::string & routine, unsigned int size, unsigned int threads)
+{
+    return routine + "/" + std::to_string(size) + "/" + std::to_string(threads);
+}
+
+void WriteCsv(const std::vector<Result> & results, std::ostream & os)
+{
+    os << "routine,size,threads,seconds,voxels_per_second,scaling_efficiency,memory_delta_mb,peak_growth_mb,"
+          "tre_mean_mm,tre_max_mm,jacobian_min,folded_fraction\n";
+    os << std::setprecision(9);
+    for (const Result & r : results)
+    {
+        os << r.routine << ',' << r.size << ',' << r.threads << ',' << r.seconds << ',' << r.voxelsPerSecond << ','
+           << r.scalingEfficiency << ',' << r.memoryDeltaMB << ',';
+        if (r.peakGrowthMB >= 0.0)
+        {
+            os << r.peakGrowthMB;
+        }
+        os << ',' << r.treMean << ',' << r.treMaximum << ',';
+        if (r.hasJacobian)
+        {
+            os << r.jacobianMinimum << ',' << r.foldedFraction;
+        }
+        else
+        {
+            os << ',';
+        }
+        os << '\n';
+    }
+}
+
+void WriteJson(const std::vector<Result> & results, std::ostream & os)
+{
+    tt::JsonWriter json(os);
+    json.BeginObject().Key("results").BeginArray();
+    for (const Result & r : results)
+    {
+        json.BeginObject()
+            .Member("routine", r.routine)
+            .Member("size", r.size)
+            .Member("threads", r.threads)
+            .Member("seconds", r.seconds)
+            .Member("voxels_per_second", r.voxelsPerSecond)
+            .Member("scaling_efficiency", r.scalingEfficiency)
+            .Member("memory_delta_mb", r.memoryDeltaMB);
+        if (r.peakGrowthMB >= 0.0)
+        {
+            json.Member("peak_growth_mb", r.peakGrowthMB);
+        }
+        if (r.treMean >= 0.0)
+        {
+            json.Member("tre_mean_mm", r.treMean).Member("tre_max_mm", r.treMaximum);
+        }
+        if (r.hasJacobian)
+        {
+            json.Member("jacobian_min", r.jacobianMinimum).Member("folded_fraction", r.foldedFraction);
+        }
+        if (r.maximumDifference >= 0.0)
+        {
+            json.Member("max_difference_vs_cpu", r.maximumDifference);
+        }
+        json.EndObject();
+    }
+    json.EndArray().EndObject();
+    os << std::endl;
+}
+
+// routine/size/threads -> (seconds, mean TRE) from an earlier --csv file.
+std::map<std::string, std::pair<double, double>> ReadBaseline(const std::string & fileName)
+{
+    std::ifstream file(fileName);
+    if (!file)
+    {
+        throw std::runtime_error("cannot read baseline " + fileName);
+    }
+    std::map<std::string, std::pair<double, double>> baseline;
+    std::string                                      line;
+    std::getline(file, line); // header
+    while (std::getline(file, line))
+    {
+        std::vector<std::string> fields;
+        std::stringstream        stream(line);
+        std::string              field;
+        while (std::getline(stream, field, ','))
+        {
+            fields.push_back(field);
+        }
+        if (fields.size() < 9)
+        {
+            continue;
+        }
+        baseline[ResultKey(fields[0], std::stoul(fields[1]), std::stoul(fields[2]))] =
+            std::make_pair(std::stod(fields[3]), std::stod(fields[8]));
+    }
+    return baseline;
+}
+
+} // namespace
+
+int main(int argc, char * argv[])
+{
+    std::vector<unsigned int> sizes;
+    std::vector<unsigned int> threadCounts;
+    std::vector<std::string>  routines;
+    unsigned int              repeats      = 1;
+    double                    amplitude    = 3.0;
+    std::string               csvFile;
+    std::string               jsonFile;
+    std::string               baselineFile;
+    double                    tolerance    = 0.2;
+    double                    treTolerance = 0.5;
+    tt::RigidParameters       rigidParameters;
+    tt::DeformableParameters  deformableParameters;
+
+    try
+    {
+        tt::CommandLine cmd(argc, argv, 1, { "help" });
+        if (cmd.Has("help"))
+        {
+            std::cerr << "Usage: " << argv[0] << " [options]\n";
+            tt::PrintOption(std::cerr, "", "sizes <list>", "phantom edge lengths in voxels (default 128,256)");
+            tt::PrintOption(std::cerr, "", "threads <list>", "thread counts (default 1 and all cores)");
+            tt::PrintOption(std::cerr, "", "routines <list>",
+                            "resample,normalize,rigid,deformable,centroid,jacobian, rigid-int16,deformable-int16, "
+                            "demons,syn (the alternative engines, not in the default suite), "
+                            "rigid-multistart (moments, +-30 deg starts unless --rigid-start-range), "
+                            "resample-opencl,rigid-opencl (default all; the OpenCL ones when a device is found)");
+            tt::PrintOption(std::cerr, "", "repeats <n>", "runs per measurement; the fastest counts (default 1)");
+            tt::PrintOption(std::cerr, "", "amplitude <mm>", "known B-spline coefficient range (default 3)");
+            tt::PrintOption(std::cerr, "", "csv <file>", "results as CSV (readable by --baseline)");
+            tt::PrintOption(std::cerr, "", "json <file>", "results as JSON");
+            tt::PrintOption(std::cerr, "", "baseline <file>", "fail on regressions against an earlier --csv");
+            tt::PrintOption(std::cerr, "", "tolerance <f>", "allowed relative slowdown (default 0.2)");
+            tt::PrintOption(std::cerr, "", "tre-tolerance <mm>", "allowed mean TRE increase (default 0.5)");
+            std::cerr << "Rigid routine:\n";
+            tt::PrintRigidOptionsUsage(std::cerr, "rigid-");
+            std::cerr << "Deformable routine:\n";
+            tt::PrintBSplineOptionsUsage(std::cerr, "bspline-");
+            std::cerr << "Demons routine:\n";
+            tt::PrintDemonsOptionsUsage(std::cerr, "demons-");
+            std::cerr << "SyN routine:\n";
+            tt::PrintSyNOptionsUsage(std::cerr, "syn-");
+            return EXIT_FAILURE;
+        }
+
+        const unsigned int cores = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+        sizes        = cmd.GetUnsignedList("sizes", { 128, 256 });
+        threadCounts = cmd.GetUnsignedList("threads", cores > 1 ? std::vector<unsigned int>{ 1, cores }
+                                                                : std::vector<unsigned int>{ 1 });
+        std::vector<std::string> defaultRoutines = { "resample",    "normalize",        "rigid",    "deformable",
+                                                     "rigid-int16", "deformable-int16", "centroid", "jacobian" };
+        if (tt::IsOpenCLAvailable())
+        {
+            defaultRoutines.insert(defaultRoutines.end(), { "resample-opencl", "rigid-opencl" });
+        }
+        routines     = cmd.GetList("routines", defaultRoutines);
+        repeats      = std::max(1u, cmd.GetUnsigned("repeats", repeats));
+        amplitude    = cmd.GetDouble("amplitude", amplitude);
+        csvFile      = cmd.GetString("csv", "");
+        jsonFile     = cmd.GetString("json", "");
+        baselineFile = cmd.GetString("baseline", "");
+        tolerance    = cmd.GetDouble("tolerance", tolerance);
+        treTolerance = cmd.GetDouble("tre-tolerance", treTolerance);
+        tt::ParseRigidOptions(cmd, "rigid-", rigidParameters);
+        tt::ParseBSplineOptions(cmd, "bspline-", deformableParameters.bspline);
+        tt::ParseDemonsOptions(cmd, "demons-", deformableParameters.demons);
+        tt::ParseSyNOptions(cmd, "syn-", deformableParameters.syn);
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::sort(threadCounts.begin(), threadCounts.end());
+    tt::ConfigureThreadPool(threadCounts.back());
+    if (tt::IsOpenCLAvailable())
+    {
+        std::cout << "OpenCL device: " << tt::OpenCLDeviceName() << std::endl;
+    }
+
+    std::vector<Result> results;
+    try
+    {
+        for (unsigned int size : sizes)
+        {
+            std::cout << "Phantom " << size << "^3 (" << kFieldOfView / size << " mm)" << std::endl;
+            const Phantoms phantoms = MakePhantoms(size, amplitude);
+            const double   voxels   = static_cast<double>(size) * size * size;
+
+            for (const std::string & routine : routines)
+            {
+                double singleThreadSeconds = 0.0;
+                for (unsigned int threads : threadCounts)
+                {
+                    Result result;
+                    result.routine = routine;
+                    result.size    = size;
+                    result.threads = threads;
+
+                    itk::MemoryProbe memory;
+                    PeakProbe        peak;
+                    memory.Start();
+                    peak.Start();
+                    result.seconds =
+                        RunRoutine(routine, phantoms, threads, rigidParameters, deformableParameters, result);
+                    for (unsigned int r = 1; r < repeats; ++r)
+                    {
+                        result.seconds = std::min(result.seconds, RunRoutine(routine, phantoms, threads,
+                                                                             rigidParameters, deformableParameters,
+                                                                             result));
+                    }
+                    memory.Stop();
+
+                    if (threads == threadCounts.front())
+                    {
+                        singleThreadSeconds = result.seconds;
+                    }
+                    result.voxelsPerSecond   = voxels / result.seconds;
+                    result.scalingEfficiency = singleThreadSeconds * threadCounts.front() /
+                                               (result.seconds * threads);
+                    result.memoryDeltaMB = memory.GetTotal() / 1024.0;
+                    result.peakGrowthMB  = peak.GetGrowthMB();
+                    results.push_back(result);
+
+                    std::cout << "  " << std::left << std::setw(16) << routine << std::right << std::setw(3)
+                              << threads << " threads " << std::fixed << std::setprecision(3) << std::setw(9)
+                              << result.seconds << " s " << std::setprecision(1) << std::setw(8)
+                              << result.voxelsPerSecond / 1e6 << " Mvox/s  eff " << std::setprecision(2)
+                              << result.scalingEfficiency << "  memory " << std::setprecision(0)
+                              << (result.peakGrowthMB >= 0.0 ? result.peakGrowthMB : result.memoryDeltaMB)
+                              << " MB";
+                    if (result.treMean >= 0.0)
+                    {
+                        std::cout << "  TRE " << std::setprecision(2) << result.treMean << " / "
+                                  << result.treMaximum << " mm";
+                    }
+                    if (result.hasJacobian)
+                    {
+                        std::cout << "  det min " << std::setprecision(3) << result.jacobianMinimum << ", folded "
+                                  << std::setprecision(4) << 100.0 * result.foldedFraction << " %";
+                    }
+                    if (result.maximumDifference >= 0.0)
+                    {
+                        std::cout << "  max |OpenCL - CPU| " << std::setprecision(5) << result.maximumDifference;
+                    }
+                    std::cout << std::defaultfloat << std::endl;
+                }
+            }
+        }
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "Benchmark failed:\n" << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Benchmark failed: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!csvFile.empty())
+    {
+        std::ofstream csv(csvFile);
+        WriteCsv(results, csv);
+    }
+    if (!jsonFile.empty())
+    {
+        std::ofstream json(jsonFile);
+        WriteJson(results, json);
+    }
+
+    if (baselineFile.empty())
+    {
+        return EXIT_SUCCESS;
+    }
+
+    size_t regressions = 0;
+    try
+    {
+        const auto baseline = ReadBaseline(baselineFile);
+        for (const Result & r : results)
+        {
+            const auto found = baseline.find(ResultKey(r.routine, r.size, r.threads));
+            if (found == baseline.end())
+            {
+                continue;
+            }
+            const double baseSeconds = found->second.first;
+            const double baseTRE     = found->second.second;
+            if (r.seconds > baseSeconds * (1.0 + tolerance))
+            {
+                std::cout << "REGRESSION " << ResultKey(r.routine, r.size, r.threads) << ": " << r.seconds
+                          << " s vs " << baseSeconds << " s" << std::endl;
+                ++regressions;
+            }
+            if (r.treMean >= 0.0 && baseTRE >= 0.0 && r.treMean > baseTRE + treTolerance)
+            {
+                std::cout << "REGRESSION " << ResultKey(r.routine, r.size, r.threads) << ": TRE " << r.treMean
+                          << " mm vs " << baseTRE << " mm" << std::endl;
+                ++regressions;
+            }
+        }
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << regressions << " regression(s) against " << baselineFile << std::endl;
+    return regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,523 @@
+//
+// Tumour mask propagation and volumetrics (track_tumour)
+//
+
+#include "tumour_tracking.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkLabelImageGaussianInterpolateImageFunction.h>
+#include <itkMatrixOffsetTransformBase.h>
+#include <itkMultiThreaderBase.h>
+
+#include "image_helpers.h"
+#include "json_writer.h"
+
+namespace tt
+{
+
+LabelInterpolation ParseLabelInterpolation(const std::string & name)
+{
+    if (name == "nearest")
+    {
+        return LabelInterpolation::NearestNeighbor;
+    }
+    if (name == "gaussian")
+    {
+        return LabelInterpolation::Gaussian;
+    }
+    throw std::invalid_argument("unknown label interpolation '" + name + "' (nearest or gaussian)");
+}
+
+namespace
+{
+
+using RegionType   = MaskImageType::RegionType;
+using IndexType    = MaskImageType::IndexType;
+using DistanceType = DistanceImageType;
+using MatrixType   = itk::Matrix<double, 3, 3>;
+using LinearType   = itk::MatrixOffsetTransformBase<double, 3, 3>;
+
+double VoxelVolume(const itk::ImageBase<3> * image)
+{
+    const auto spacing = image->GetSpacing();
+    return spacing[0] * spacing[1] * spacing[2];
+}
+
+MaskImageType::Pointer AllocateMask(const itk::ImageBase<3> * grid, const RegionType & region)
+{
+    auto mask = MaskImageType::New();
+    mask->SetOrigin(grid->GetOrigin());
+    mask->SetSpacing(grid->GetSpacing());
+    mask->SetDirection(grid->GetDirection());
+    mask->SetRegions(region);
+    mask->Allocate(true);
+    return mask;
+}
+
+// Voxel index has a 6-neighbour outside the set (or outside region).
+template <typename TInside>
+bool IsBoundary(const IndexType & index, const RegionType & region, const TInside & inside)
+{
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+        for (int step : { -1, 1 })
+        {
+            IndexType neighbour = index;
+            neighbour[d] += step;
+            if (!region.IsInside(neighbour) || !inside(neighbour))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// The deformable part of the transform (applied first, in T0 space) and the
+// inverse matrix of its linear part, for the fixed-point inverse.
+struct TransformParts
+{
+    const TransformBaseType * full       = nullptr;
+    const TransformBaseType * deformable = nullptr; // null = purely linear
+    MatrixType                inverseLinear;
+};
+
+TransformParts SplitTransform(const TransformBaseType * transform)
+{
+    TransformParts parts;
+    parts.full = transform;
+    parts.inverseLinear.SetIdentity();
+
+    const TransformBaseType * linear = transform;
+    if (auto composite = dynamic_cast<const CompositeTransformType *>(transform))
+    {
+        if (composite->GetNumberOfTransforms() == 2)
+        {
+            linear           = composite->GetNthTransformConstPointer(0);
+            parts.deformable = composite->GetNthTransformConstPointer(1);
+        }
+        else
+        {
+            parts.deformable = transform;
+            return parts;
+        }
+    }
+    if (auto matrixOffset = dynamic_cast<const LinearType *>(linear))
+    {
+        parts.inverseLinear = matrixOffset->GetInverseMatrix();
+    }
+    else if (parts.deformable == nullptr)
+    {
+        parts.deformable = transform;
+    }
+    return parts;
+}
+
+// T0 point mapped to y by the transform: x <- x + A^-1 (y - T(x)), exact in
+// one step for a linear transform and converging for small deformations.
+PointType InversePoint(const TransformParts & parts, const PointType & y, const TrackingParameters & parameters)
+{
+    PointType x = y;
+    for (unsigned int i = 0; i < std::max(1u, parameters.inverseIterations); ++i)
+    {
+        const itk::Vector<double, 3> residual = y - parts.full->TransformPoint(x);
+        x += parts.inverseLinear * residual;
+        if (residual.GetNorm() < parameters.inverseTolerance)
+        {
+            break;
+        }
+    }
+    return x;
+}
+
+struct LabelInputs
+{
+    const MaskImageType *     fixedLabels;
+    const TransformParts *    parts;
+    const itk::ImageBase<3> * followUpGrid;
+    const MaskImageType *     followUpLabels; // may be null
+    const RegionType *        followUpRegion; // of this label in followUpLabels; null = absent
+    const TrackingParameters * parameters;
+};
+
+// Volumetrics, boundary displacement and overlap of one label. The label
+// carried into the follow-up is returned on its own small region.
+LabelMetrics TrackLabel(unsigned int label, const RegionType & fixedRegion, const LabelInputs & inputs,
+                        unsigned int numberOfWorkUnits, MaskImageType::Pointer & propagated)
+{
+    const MaskImageType *      fixedLabels = inputs.fixedLabels;
+    const TransformParts &     parts       = *inputs.parts;
+    const TrackingParameters & parameters  = *inputs.parameters;
+    auto                       threader    = MakeThreader(numberOfWorkUnits);
+
+    LabelMetrics metrics;
+    metrics.label = label;
+
+    // T0: volume, then boundary voxels with their outward normals from the
+    // signed distance over the padded box.
+    RegionType paddedRegion;
+    RegionCovering(fixedLabels, RegionCorners(fixedLabels, fixedRegion), parameters.padding, paddedRegion);
+    MaskImageType::Pointer fixedMask = AllocateMask(fixedLabels, paddedRegion);
+    size_t                 fixedCount = 0;
+    for (itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(fixedLabels, fixedRegion); !it.IsAtEnd(); ++it)
+    {
+        if (it.Get() == label)
+        {
+            fixedMask->SetPixel(it.GetIndex(), 1);
+            ++fixedCount;
+        }
+    }
+    metrics.fixedVolume = fixedCount * VoxelVolume(fixedLabels);
+
+    const auto insideFixed = [&](const IndexType & index) { return fixedMask->GetPixel(index) != 0; };
+    std::vector<IndexType> boundary;
+    for (itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(fixedMask, fixedRegion); !it.IsAtEnd(); ++it)
+    {
+        if (it.Get() != 0 && IsBoundary(it.GetIndex(), paddedRegion, insideFixed))
+        {
+            boundary.push_back(it.GetIndex());
+        }
+    }
+    metrics.boundaryVoxels = boundary.size();
+
+    if (parts.deformable != nullptr && !boundary.empty())
+    {
+        DistanceType::Pointer fixedDistance = SignedDistance(fixedMask, numberOfWorkUnits);
+        const auto            spacing       = fixedLabels->GetSpacing();
+        const auto            direction     = fixedLabels->GetDirection();
+
+        std::vector<double> displacement(boundary.size());
+        std::vector<double> normal(boundary.size());
+        threader->ParallelizeArray(
+            0,
+            boundary.size(),
+            [&](itk::SizeValueType i)
+            {
+                const IndexType & index = boundary[i];
+                PointType         point;
+                fixedLabels->TransformIndexToPhysicalPoint(index, point);
+                const itk::Vector<double, 3> d = parts.deformable->TransformPoint(point) - point;
+                displacement[i]                = d.GetNorm();
+
+                // Central differences where both neighbours are in the box
+                itk::Vector<double, 3> gradient;
+                for (unsigned int axis = 0; axis < 3; ++axis)
+                {
+                    IndexType below = index;
+                    IndexType above = index;
+                    --below[axis];
+                    ++above[axis];
+                    below = paddedRegion.IsInside(below) ? below : index;
+                    above = paddedRegion.IsInside(above) ? above : index;
+                    const double steps = double(above[axis] - below[axis]);
+                    gradient[axis] = steps > 0.0 ? (fixedDistance->GetPixel(above) - fixedDistance->GetPixel(below)) /
+                                                       (steps * spacing[axis])
+                                                 : 0.0;
+                }
+                gradient              = direction * gradient;
+                const double length   = gradient.GetNorm();
+                normal[i]             = length > 0.0 ? (d * gradient) / length : 0.0;
+            },
+            nullptr);
+
+        for (size_t i = 0; i < boundary.size(); ++i)
+        {
+            metrics.meanBoundaryDisplacement += displacement[i];
+            metrics.maximumBoundaryDisplacement = std::max(metrics.maximumBoundaryDisplacement, displacement[i]);
+            metrics.meanNormalDisplacement += normal[i];
+        }
+        metrics.meanBoundaryDisplacement /= boundary.size();
+        metrics.meanNormalDisplacement /= boundary.size();
+    }
+
+    // Follow-up: every voxel of the box the transformed T0 box lands in is
+    // mapped back to T0 and labelled there.
+    std::vector<PointType> mappedCorners;
+    for (const PointType & corner : RegionCorners(fixedLabels, fixedRegion))
+    {
+        mappedCorners.push_back(parts.full->TransformPoint(corner));
+    }
+    const itk::ImageBase<3> * grid = inputs.followUpGrid;
+    RegionType                propagatedRegion;
+    const bool landed = RegionCovering(grid, mappedCorners, parameters.padding, propagatedRegion);
+
+    using GaussianType = itk::LabelImageGaussianInterpolateImageFunction<MaskImageType, double>;
+    GaussianType::Pointer gaussian;
+    if (parameters.interpolation == LabelInterpolation::Gaussian)
+    {
+        gaussian = GaussianType::New();
+        gaussian->SetInputImage(fixedLabels);
+        gaussian->SetSigma(fixedLabels->GetSpacing().GetDataPointer());
+    }
+
+    const size_t followUpSlice = propagatedRegion.GetSize(0) * propagatedRegion.GetSize(1);
+    propagated                 = AllocateMask(grid, landed ? propagatedRegion : RegionType());
+    std::vector<size_t> counts(landed ? propagatedRegion.GetSize(2) : 0, 0);
+    threader->ParallelizeArray(
+        0,
+        counts.size(),
+        [&](itk::SizeValueType z)
+        {
+            IndexType index = propagatedRegion.GetIndex();
+            index[2] += static_cast<itk::IndexValueType>(z);
+            for (size_t k = 0; k < followUpSlice; ++k)
+            {
+                index[0] = propagatedRegion.GetIndex(0) + static_cast<itk::IndexValueType>(k % propagatedRegion.GetSize(0));
+                index[1] = propagatedRegion.GetIndex(1) + static_cast<itk::IndexValueType>(k / propagatedRegion.GetSize(0));
+
+                PointType y;
+                grid->TransformIndexToPhysicalPoint(index, y);
+                const PointType x = InversePoint(parts, y, parameters);
+
+                bool inside = false;
+                if (gaussian)
+                {
+                    inside = gaussian->IsInsideBuffer(x) && static_cast<unsigned int>(gaussian->Evaluate(x)) == label;
+                }
+                else
+                {
+                    IndexType fixedIndex;
+                    inside = fixedLabels->TransformPhysicalPointToIndex(x, fixedIndex) &&
+                             fixedLabels->GetPixel(fixedIndex) == label;
+                }
+                if (inside)
+                {
+                    propagated->SetPixel(index, 1);
+                    ++counts[z];
+                }
+            }
+        },
+        nullptr);
+    size_t propagatedCount = 0;
+    for (size_t count : counts)
+    {
+        propagatedCount += count;
+    }
+    metrics.propagatedVolume = propagatedCount * VoxelVolume(grid);
+
+    // Overlap with the follow-up's own label over the union of both boxes,
+    // one voxel wider so every surface lies inside it.
+    const MaskImageType * followUpLabels = inputs.followUpLabels;
+    if (followUpLabels != nullptr)
+    {
+        size_t followUpCount = 0;
+        size_t intersection  = 0;
+
+        std::vector<PointType> corners;
+        if (landed)
+        {
+            corners = RegionCorners(grid, propagatedRegion);
+        }
+        if (inputs.followUpRegion != nullptr)
+        {
+            const std::vector<PointType> labelCorners = RegionCorners(grid, *inputs.followUpRegion);
+            corners.insert(corners.end(), labelCorners.begin(), labelCorners.end());
+        }
+
+        RegionType unionRegion;
+        if (!corners.empty() && RegionCovering(grid, corners, grid->GetSpacing().GetVnlVector().max_value(), unionRegion))
+        {
+            MaskImageType::Pointer carried  = AllocateMask(grid, unionRegion);
+            MaskImageType::Pointer followUp = AllocateMask(grid, unionRegion);
+            for (itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(followUpLabels, unionRegion); !it.IsAtEnd();
+                 ++it)
+            {
+                const IndexType & index = it.GetIndex();
+                const bool        s     = it.Get() == label;
+                const bool        p     = landed && propagatedRegion.IsInside(index) && propagated->GetPixel(index) != 0;
+                carried->SetPixel(index, p);
+                followUp->SetPixel(index, s);
+                followUpCount += s;
+                intersection += s && p;
+            }
+            metrics.followUpVolume = followUpCount * VoxelVolume(grid);
+            metrics.dice = propagatedCount + followUpCount > 0
+                               ? 2.0 * intersection / double(propagatedCount + followUpCount)
+                               : 1.0;
+
+            if (propagatedCount > 0 && followUpCount > 0)
+            {
+                // Surface voxel of one mask to the surface of the other
+                DistanceType::Pointer carriedDistance  = SignedDistance(carried, numberOfWorkUnits);
+                DistanceType::Pointer followUpDistance = SignedDistance(followUp, numberOfWorkUnits);
+
+                double maximum = 0.0;
+                double sum     = 0.0;
+                size_t count   = 0;
+                const auto surface = [&](const MaskImageType * mask, const DistanceType * other)
+                {
+                    const auto inside = [&](const IndexType & index) { return mask->GetPixel(index) != 0; };
+                    for (itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(mask, unionRegion); !it.IsAtEnd();
+                         ++it)
+                    {
+                        if (it.Get() != 0 && IsBoundary(it.GetIndex(), unionRegion, inside))
+                        {
+                            const double distance = std::fabs(other->GetPixel(it.GetIndex()));
+                            maximum               = std::max(maximum, distance);
+                            sum += distance;
+                            ++count;
+                        }
+                    }
+                };
+                surface(carried, followUpDistance);
+                surface(followUp, carriedDistance);
+                metrics.hausdorff           = maximum;
+                metrics.meanSurfaceDistance = count > 0 ? sum / count : 0.0;
+            }
+        }
+        else
+        {
+            metrics.followUpVolume = 0.0;
+            metrics.dice           = 1.0;
+        }
+    }
+
+    const double target  = metrics.followUpVolume >= 0.0 ? metrics.followUpVolume : metrics.propagatedVolume;
+    metrics.volumeChange = target - metrics.fixedVolume;
+    metrics.growthRate   = parameters.days > 0.0 ? metrics.volumeChange / parameters.days : 0.0;
+    return metrics;
+}
+
+} // namespace
+
+TrackingResult TrackTumour(const MaskImageType * fixedLabels, const TransformBaseType * transform,
+                           const itk::ImageBase<3> * followUpGrid, const MaskImageType * followUpLabels,
+                           const TrackingParameters & parameters)
+{
+    if (followUpLabels != nullptr &&
+        (followUpLabels->GetLargestPossibleRegion() != followUpGrid->GetLargestPossibleRegion() ||
+         followUpLabels->GetSpacing() != followUpGrid->GetSpacing() ||
+         followUpLabels->GetOrigin() != followUpGrid->GetOrigin()))
+    {
+        itkGenericExceptionMacro(<< "Follow-up labels are not on the follow-up grid");
+    }
+
+    std::vector<unsigned int> labels;
+    const auto                fixedRegions = LabelRegions(fixedLabels, labels);
+    std::vector<unsigned int> followUpPresent;
+    std::array<RegionType, kNumberOfLabels> followUpRegions;
+    std::array<bool, kNumberOfLabels>       inFollowUp{};
+    if (followUpLabels != nullptr)
+    {
+        followUpRegions = LabelRegions(followUpLabels, followUpPresent);
+        for (unsigned int label : followUpPresent)
+        {
+            inFollowUp[label] = true;
+        }
+    }
+
+    const TransformParts parts = SplitTransform(transform);
+
+    // Labels in parallel, each single-threaded; a lone label gets every work
+    // unit for its own loops and distance maps instead.
+    const unsigned int workUnits = parameters.numberOfWorkUnits > 0
+                                       ? parameters.numberOfWorkUnits
+                                       : itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+    const unsigned int perLabel  = labels.size() > 1 ? 1 : workUnits;
+
+    TrackingResult                      result;
+    std::vector<MaskImageType::Pointer> carried(labels.size());
+    result.labels.resize(labels.size());
+    MakeThreader(labels.size() > 1 ? workUnits : 1)
+        ->ParallelizeArray(
+            0,
+            labels.size(),
+            [&](itk::SizeValueType i)
+            {
+                const unsigned int label = labels[i];
+                LabelInputs        inputs{ fixedLabels,
+                                    &parts,
+                                    followUpGrid,
+                                    followUpLabels,
+                                    inFollowUp[label] ? &followUpRegions[label] : nullptr,
+                                    &parameters };
+                result.labels[i] = TrackLabel(label, fixedRegions[label], inputs, perLabel, carried[i]);
+            },
+            nullptr);
+
+    // Labels only present in the follow-up are not tracked; their voxels
+    // are still part of no propagated label.
+    result.propagated = AllocateMask(followUpGrid, followUpGrid->GetLargestPossibleRegion());
+    for (size_t i = 0; i < labels.size(); ++i)
+    {
+        for (itk::ImageRegionConstIteratorWithIndex<MaskImageType> it(carried[i], carried[i]->GetBufferedRegion());
+             !it.IsAtEnd(); ++it)
+        {
+            if (it.Get() != 0)
+            {
+                result.propagated->SetPixel(it.GetIndex(), static_cast<MaskImageType::PixelType>(labels[i]));
+            }
+        }
+    }
+    return result;
+}
+
+void PrintTrackingResult(const TrackingResult & result, std::ostream & os)
+{
+    for (const LabelMetrics & m : result.labels)
+    {
+        os << "Label " << m.label << std::endl;
+        os << "  Volume (mm^3): T0 " << m.fixedVolume << ", propagated " << m.propagatedVolume;
+        if (m.followUpVolume >= 0.0)
+        {
+            os << ", follow-up " << m.followUpVolume;
+        }
+        os << " (change " << m.volumeChange;
+        if (m.growthRate != 0.0)
+        {
+            os << ", " << m.growthRate << " mm^3/day";
+        }
+        os << ")" << std::endl;
+        if (m.dice >= 0.0)
+        {
+            os << "  Dice: " << m.dice;
+            if (m.hausdorff >= 0.0)
+            {
+                os << ", Hausdorff (mm): " << m.hausdorff << ", mean surface distance (mm): "
+                   << m.meanSurfaceDistance;
+            }
+            os << std::endl;
+        }
+        os << "  Boundary displacement (mm) over " << m.boundaryVoxels << " voxels: mean "
+           << m.meanBoundaryDisplacement << ", max " << m.maximumBoundaryDisplacement << ", outward "
+           << m.meanNormalDisplacement << std::endl;
+    }
+}
+
+void WriteTrackingJson(const TrackingResult & result, JsonWriter & json)
+{
+    json.BeginArray();
+    for (const LabelMetrics & m : result.labels)
+    {
+        json.BeginObject()
+            .Member("label", m.label)
+            .Member("fixed_volume_mm3", m.fixedVolume)
+            .Member("propagated_volume_mm3", m.propagatedVolume);
+        if (m.followUpVolume >= 0.0)
+        {
+            json.Member("followup_volume_mm3", m.followUpVolume);
+        }
+        json.Member("volume_change_mm3", m.volumeChange).Member("growth_rate_mm3_per_day", m.growthRate);
+        if (m.dice >= 0.0)
+        {
+            json.Member("dice", m.dice);
+        }
+        if (m.hausdorff >= 0.0)
+        {
+            json.Member("hausdorff_mm", m.hausdorff).Member("mean_surface_distance_mm", m.meanSurfaceDistance);
+        }
+        json.Member("boundary_voxels", m.boundaryVoxels)
+            .Member("mean_boundary_displacement_mm", m.meanBoundaryDisplacement)
+            .Member("max_boundary_displacement_mm", m.maximumBoundaryDisplacement)
+            .Member("mean_normal_displacement_mm", m.meanNormalDisplacement)
+            .EndObject();
+    }
+    json.EndArray();
+}
+
+} // namespace tt
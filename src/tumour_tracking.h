@@ -0,0 +1,89 @@
+//
+// Tumour mask propagation and volumetrics (track_tumour)
+//
+// T0 labels are carried into a follow-up through the stored T0-to-T(n)
+// transform and compared there with the follow-up's own labels, when it
+// has them: volume, change and growth rate, Dice, Hausdorff and mean
+// surface distance (from signed Maurer distance maps) and the displacement
+// of every T0 boundary voxel. Each label is processed in its own bounding
+// box (padded), and labels run in parallel, so no pass covers the volume.
+//
+
+#ifndef TUMOURTRACKER_TUMOUR_TRACKING_H
+#define TUMOURTRACKER_TUMOUR_TRACKING_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+class JsonWriter;
+
+enum class LabelInterpolation
+{
+    NearestNeighbor,
+    Gaussian // label-Gaussian vote; smoother boundaries under strong deformation
+};
+
+// "nearest" or "gaussian"; throws std::invalid_argument otherwise.
+LabelInterpolation ParseLabelInterpolation(const std::string & name);
+
+struct TrackingParameters
+{
+    LabelInterpolation interpolation     = LabelInterpolation::NearestNeighbor;
+    double             padding           = 10.0; // mm around each lesion box
+    unsigned int       inverseIterations = 20;   // fixed-point steps per follow-up voxel
+    double             inverseTolerance  = 0.01; // mm
+    double             days              = 0.0;  // T0 to follow-up; 0 = no growth rate
+    unsigned int       numberOfWorkUnits = 0;
+};
+
+struct LabelMetrics
+{
+    unsigned int label            = 0;
+    double       fixedVolume      = 0.0;  // mm^3, T0 label
+    double       propagatedVolume = 0.0;  // mm^3, T0 label carried into the follow-up
+    double       followUpVolume   = -1.0; // mm^3, follow-up label; negative = none given
+    double       volumeChange     = 0.0;  // follow-up (else propagated) minus T0
+    double       growthRate       = 0.0;  // mm^3/day; 0 without days
+
+    // Propagated vs. follow-up label; negative = no follow-up label
+    double dice                = -1.0;
+    double hausdorff           = -1.0; // mm
+    double meanSurfaceDistance = -1.0; // mm, symmetric
+
+    // Deformable part of the transform at the T0 boundary voxels; the normal
+    // component is positive outwards (growth).
+    size_t boundaryVoxels              = 0;
+    double meanBoundaryDisplacement    = 0.0; // mm
+    double maximumBoundaryDisplacement = 0.0;
+    double meanNormalDisplacement      = 0.0;
+};
+
+struct TrackingResult
+{
+    std::vector<LabelMetrics> labels;     // ascending label values
+    MaskImageType::Pointer    propagated; // T0 labels on the follow-up grid
+};
+
+// fixedLabels: T0 label map (0 = background). transform maps T0 points to
+// the follow-up (as written by the pipeline: rigid + deformable composite,
+// or any transform). followUpGrid gives the follow-up geometry;
+// followUpLabels, when given, must lie on that grid.
+TrackingResult TrackTumour(const MaskImageType * fixedLabels, const TransformBaseType * transform,
+                           const itk::ImageBase<3> * followUpGrid, const MaskImageType * followUpLabels,
+                           const TrackingParameters & parameters = TrackingParameters());
+
+void PrintTrackingResult(const TrackingResult & result, std::ostream & os);
+
+// [{"label":..,"fixed_volume_mm3":..,...}, ...]
+void WriteTrackingJson(const TrackingResult & result, JsonWriter & json);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_TUMOUR_TRACKING_H
@@ -0,0 +1,48 @@
+//
+// libtumourtracker: in-process API
+//
+// Every stage takes and returns ITK images and transforms, so a long-lived
+// process can run many cases without re-reading intermediates or paying
+// process startup (ITK's IO factories are registered once per process):
+//
+//   auto fixed  = tt::ReadImage("T0.nii.gz");
+//   auto moving = tt::ReadImage("T1.nii.gz");
+//   fixed  = tt::ResampleIsotropic(fixed);
+//   moving = tt::ResampleIsotropic(moving);
+//   tt::NormalizeIntensity(fixed);
+//   tt::NormalizeIntensity(moving);
+//
+//   tt::ImagePyramid fixedPyramid(fixed);
+//   tt::ImagePyramid movingPyramid(moving);
+//   auto rigid = tt::RegisterRigid(fixedPyramid, movingPyramid);
+//
+//   tt::BSplineParameters bspline;
+//   bspline.initialTransform = rigid;
+//   auto deformable = tt::RegisterBSpline(fixedPyramid, movingPyramid, bspline);
+//
+//   auto full   = tt::ComposeTransforms(rigid, deformable);
+//   auto warped = tt::ResampleToReference(moving, full, fixed);
+//   auto check  = tt::CentroidCheck(fixed, warped);
+//
+// tt::RunCase (pipeline.h) chains the same stages for a whole case and
+// tt::RunCohort (cohort.h) schedules many cases on one thread pool.
+//
+
+#ifndef TUMOURTRACKER_TUMOURTRACKER_H
+#define TUMOURTRACKER_TUMOURTRACKER_H
+
+#include "image_types.h"
+#include "stages.h"
+#include "deformable_engines.h"
+#include "jacobian.h"
+#include "image_cache.h"
+#include "case_io.h"
+#include "pipeline.h"
+#include "cohort.h"
+#include "piecewise_registration.h"
+#include "tumour_tracking.h"
+#include "service.h"
+#include "telemetry.h"
+#include "volume_cache.h"
+
+#endif // TUMOURTRACKER_TUMOURTRACKER_H
@@ -0,0 +1,307 @@
+//
+// Raw on-disk volumes and a content-keyed cache of preprocessed timepoints
+//
+
+#include "volume_cache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <itkImportImageContainer.h>
+#include <itkMacro.h>
+#include <itksys/SystemTools.hxx>
+
+namespace tt
+{
+
+namespace
+{
+
+constexpr char     kMagic[8]     = { 'T', 'T', 'V', 'O', 'L', '0', '0', '1' };
+constexpr uint32_t kByteOrderTag = 0x01020304;
+constexpr size_t   kHeaderSize   = 4096; // keeps the voxel buffer page aligned for mmap
+
+struct RawVolumeHeader
+{
+    char     magic[8];
+    uint32_t byteOrder;
+    uint32_t bytesPerVoxel;
+    uint64_t size[3];
+    double   origin[3];
+    double   spacing[3];
+    double   direction[9];
+    uint64_t dataOffset;
+};
+static_assert(sizeof(RawVolumeHeader) <= kHeaderSize, "raw volume header must fit its block");
+
+// Pixel container over a private file mapping; unmapped with the image.
+class MappedPixelContainer : public itk::ImportImageContainer<itk::SizeValueType, float>
+{
+public:
+    ITK_DISALLOW_COPY_AND_MOVE(MappedPixelContainer);
+
+    using Self       = MappedPixelContainer;
+    using Superclass = itk::ImportImageContainer<itk::SizeValueType, float>;
+    using Pointer    = itk::SmartPointer<Self>;
+
+    itkNewMacro(Self);
+    itkOverrideGetNameOfClassMacro(MappedPixelContainer);
+
+    void SetMapping(void * base, size_t length)
+    {
+        m_Base   = base;
+        m_Length = length;
+    }
+
+protected:
+    MappedPixelContainer() = default;
+    ~MappedPixelContainer() override
+    {
+        if (m_Base != nullptr)
+        {
+            munmap(m_Base, m_Length);
+        }
+    }
+
+private:
+    void * m_Base   = nullptr;
+    size_t m_Length = 0;
+};
+
+void WriteAll(int fd, const char * data, size_t length, const std::string & fileName)
+{
+    while (length > 0)
+    {
+        const ssize_t written = ::write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            itkGenericExceptionMacro(<< "Cannot write " << fileName << ": " << std::strerror(errno));
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+}
+
+} // namespace
+
+// =====================================================
+// Raw volume files
+// =====================================================
+
+bool IsRawVolumeFile(const std::string & fileName)
+{
+    return itksys::SystemTools::GetFilenameLastExtension(fileName) == ".ttv";
+}
+
+void WriteRawVolume(const ImageType * image, const std::string & fileName)
+{
+    const ImageType::RegionType region = image->GetBufferedRegion();
+    if (region != image->GetLargestPossibleRegion())
+    {
+        itkGenericExceptionMacro(<< "Raw volumes need the whole image in memory");
+    }
+
+    std::vector<char> block(kHeaderSize, 0);
+    RawVolumeHeader   header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.byteOrder     = kByteOrderTag;
+    header.bytesPerVoxel = sizeof(float);
+    header.dataOffset    = kHeaderSize;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        header.size[i]    = region.GetSize(i);
+        header.origin[i]  = image->GetOrigin()[i];
+        header.spacing[i] = image->GetSpacing()[i];
+        for (unsigned int j = 0; j < 3; ++j)
+        {
+            header.direction[3 * i + j] = image->GetDirection()[i][j];
+        }
+    }
+    std::memcpy(block.data(), &header, sizeof(header));
+
+    // Written under a temporary name and renamed, so a half-written file is
+    // never picked up by a concurrent or later reader.
+    const std::string temporary = fileName + ".tmp" + std::to_string(::getpid()) + "." +
+                                  std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    const int         fd        = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        itkGenericExceptionMacro(<< "Cannot create " << temporary << ": " << std::strerror(errno));
+    }
+    try
+    {
+        WriteAll(fd, block.data(), block.size(), fileName);
+        WriteAll(fd, reinterpret_cast<const char *>(image->GetBufferPointer()),
+                 region.GetNumberOfPixels() * sizeof(float), fileName);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    ::close(fd);
+
+    if (std::rename(temporary.c_str(), fileName.c_str()) != 0)
+    {
+        ::unlink(temporary.c_str());
+        itkGenericExceptionMacro(<< "Cannot rename " << temporary << " to " << fileName);
+    }
+}
+
+ImageType::Pointer ReadRawVolume(const std::string & fileName)
+{
+    const int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        itkGenericExceptionMacro(<< "Cannot open " << fileName << ": " << std::strerror(errno));
+    }
+    struct stat status;
+    if (::fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < kHeaderSize)
+    {
+        ::close(fd);
+        itkGenericExceptionMacro(<< fileName << " is not a raw volume");
+    }
+    const size_t length = static_cast<size_t>(status.st_size);
+    void *       base   = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+    {
+        itkGenericExceptionMacro(<< "Cannot map " << fileName << ": " << std::strerror(errno));
+    }
+
+    // The container owns the mapping from here on, also on the error paths.
+    auto container = MappedPixelContainer::New();
+    container->SetMapping(base, length);
+
+    RawVolumeHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    const size_t numberOfPixels = header.size[0] * header.size[1] * header.size[2];
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.byteOrder != kByteOrderTag ||
+        header.bytesPerVoxel != sizeof(float) || header.dataOffset + numberOfPixels * sizeof(float) > length)
+    {
+        itkGenericExceptionMacro(<< fileName << " is not a float raw volume of this byte order");
+    }
+    container->SetImportPointer(reinterpret_cast<float *>(static_cast<char *>(base) + header.dataOffset),
+                                numberOfPixels, false);
+
+    ImageType::SizeType      size;
+    ImageType::PointType     origin;
+    ImageType::SpacingType   spacing;
+    ImageType::DirectionType direction;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        size[i]    = header.size[i];
+        origin[i]  = header.origin[i];
+        spacing[i] = header.spacing[i];
+        for (unsigned int j = 0; j < 3; ++j)
+        {
+            direction[i][j] = header.direction[3 * i + j];
+        }
+    }
+
+    auto image = ImageType::New();
+    image->SetRegions(ImageType::RegionType(size));
+    image->SetOrigin(origin);
+    image->SetSpacing(spacing);
+    image->SetDirection(direction);
+    image->SetPixelContainer(container);
+    return image;
+}
+
+// =====================================================
+// Hashing
+// =====================================================
+
+uint64_t HashString(const std::string & value, uint64_t seed)
+{
+    uint64_t hash = seed;
+    for (const unsigned char c : value)
+    {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t HashFile(const std::string & fileName)
+{
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in)
+    {
+        itkGenericExceptionMacro(<< "Cannot open " << fileName);
+    }
+
+    uint64_t          hash = 14695981039346656037ULL;
+    std::vector<char> buffer(1 << 20);
+    while (in)
+    {
+        in.read(buffer.data(), buffer.size());
+        const std::streamsize count = in.gcount();
+        for (std::streamsize i = 0; i < count; ++i)
+        {
+            hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// =====================================================
+// VolumeCache
+// =====================================================
+
+VolumeCache::VolumeCache(const std::string & directory)
+    : m_Directory(directory)
+{
+    if (this->IsEnabled())
+    {
+        itksys::SystemTools::MakeDirectory(m_Directory);
+    }
+}
+
+std::string VolumeCache::MakeKey(const std::string & stage, uint64_t inputHash, const std::string & parameters)
+{
+    std::ostringstream key;
+    key << stage << "-" << std::hex << std::setw(16) << std::setfill('0')
+        << HashString(parameters, inputHash);
+    return key.str();
+}
+
+std::string VolumeCache::PathFor(const std::string & key) const
+{
+    return m_Directory + "/" + key + ".ttv";
+}
+
+ImageType::Pointer VolumeCache::Find(const std::string & key) const
+{
+    if (!this->IsEnabled() || !itksys::SystemTools::FileExists(this->PathFor(key), true))
+    {
+        return nullptr;
+    }
+    return ReadRawVolume(this->PathFor(key));
+}
+
+void VolumeCache::Store(const std::string & key, const ImageType * image) const
+{
+    if (this->IsEnabled())
+    {
+        WriteRawVolume(image, this->PathFor(key));
+    }
+}
+
+} // namespace tt
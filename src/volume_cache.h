@@ -0,0 +1,58 @@
+//
+// Raw on-disk volumes and a content-keyed cache of preprocessed timepoints.
+//
+// A ".ttv" file is a 4 KiB geometry header (size, origin, spacing,
+// direction) followed by the float voxel buffer, native byte order. It is
+// written with one sequential write and read back by mapping the file
+// straight into the itk::Image buffer, so no decompression or copy is
+// needed. The mapping is private: in-place filters on the returned image
+// never modify the file.
+//
+// VolumeCache stores such files under a hash of their inputs' content and
+// the stage parameters, so a rerun with unchanged inputs skips the stage.
+//
+
+#ifndef TUMOURTRACKER_VOLUME_CACHE_H
+#define TUMOURTRACKER_VOLUME_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "image_types.h"
+
+namespace tt
+{
+
+bool IsRawVolumeFile(const std::string & fileName); // ".ttv" extension
+
+void               WriteRawVolume(const ImageType * image, const std::string & fileName);
+ImageType::Pointer ReadRawVolume(const std::string & fileName);
+
+// 64-bit FNV-1a of a file's bytes / of a string, for cache keys.
+uint64_t HashFile(const std::string & fileName);
+uint64_t HashString(const std::string & value, uint64_t seed = 14695981039346656037ULL);
+
+class VolumeCache
+{
+public:
+    // Empty directory disables the cache (Find always misses, Store is a no-op).
+    explicit VolumeCache(const std::string & directory = std::string());
+
+    bool IsEnabled() const { return !m_Directory.empty(); }
+
+    // Key from a stage name, the hashes of its input files and its parameters.
+    static std::string MakeKey(const std::string & stage, uint64_t inputHash, const std::string & parameters);
+
+    // The cached volume, or null on a miss.
+    ImageType::Pointer Find(const std::string & key) const;
+    void               Store(const std::string & key, const ImageType * image) const;
+
+private:
+    std::string PathFor(const std::string & key) const;
+
+    std::string m_Directory;
+};
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_VOLUME_CACHE_H
@@ -0,0 +1,83 @@
+//
+// Apply a precomputed displacement field (TumourTracker warp)
+//
+
+#include "warp.h"
+
+#include <iostream>
+#include <set>
+
+#include "command_line.h"
+#include "stage_options.h"
+#include "stages.h"
+
+namespace tt
+{
+
+int RunWarpCommand(int argc, char * argv[])
+{
+    std::string              fieldFile;
+    std::vector<std::string> files;
+    std::set<std::string>    labelImages;
+    unsigned int             numberOfWorkUnits = 0;
+    Interpolation            interpolation     = Interpolation::Linear;
+
+    try
+    {
+        CommandLine cmd(argc, argv);
+        files             = cmd.Positional();
+        fieldFile         = cmd.GetString("field", "");
+        numberOfWorkUnits = cmd.GetUnsigned("threads", numberOfWorkUnits);
+        interpolation     = ReadInterpolationOption(cmd);
+        for (const auto & label : cmd.GetList("labels", {}))
+        {
+            labelImages.insert(label);
+        }
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (fieldFile.empty() || files.empty() || files.size() % 2 != 0)
+    {
+        std::cerr << "Usage: TumourTracker warp --field <field.nii.gz> [options] <in.nii> <out.nii> [<in> <out> ...]\n";
+        PrintOption(std::cerr, "", "field <field.nii.gz>", "displacement field from deformable_register / run");
+        PrintOption(std::cerr, "", "labels <in1,in2,...>", "inputs warped as label maps (nearest neighbour, uint8)");
+        PrintOption(std::cerr, "", "interpolation <linear|nearest|bspline|sinc>", "other inputs (default linear)");
+        PrintOption(std::cerr, "", "threads <n>", "work units (default: ITK default)");
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        DisplacementFieldType::Pointer          field     = ReadDisplacementField(fieldFile);
+        DisplacementFieldTransformType::Pointer transform = MakeDisplacementFieldTransform(field);
+
+        for (size_t i = 0; i < files.size(); i += 2)
+        {
+            const std::string & input  = files[i];
+            const std::string & output = files[i + 1];
+            if (labelImages.count(input))
+            {
+                WriteMask(WarpMask(ReadMask(input), transform, numberOfWorkUnits), output);
+            }
+            else
+            {
+                WriteImage(WarpImage(ReadImage(input), transform, interpolation, numberOfWorkUnits),
+                           output);
+            }
+            std::cout << input << " -> " << output << std::endl;
+        }
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "Warp failed:\n" << err << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+} // namespace tt
@@ -0,0 +1,20 @@
+//
+// Apply a precomputed displacement field (TumourTracker warp)
+//
+// The field written by deformable_register / the pipeline already holds the
+// full T1-to-T0 mapping, so every sequence and mask of a timepoint is warped
+// by one field lookup per voxel instead of a B-spline evaluation.
+//
+
+#ifndef TUMOURTRACKER_WARP_H
+#define TUMOURTRACKER_WARP_H
+
+namespace tt
+{
+
+// Entry point for "TumourTracker warp ..." (argv[0] is "warp").
+int RunWarpCommand(int argc, char * argv[]);
+
+} // namespace tt
+
+#endif // TUMOURTRACKER_WARP_H